@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""Merge the HVAC_TRACE files of a job into one Chrome trace.
+
+Each process writes its spans on its own node's steady clock, with the
+offset to wall time in otherData.realtime_offset_ns. The spans of every
+file are moved to wall time and the result is rebased to start at zero,
+so clients and servers on different nodes share one timeline in
+Perfetto (ui.perfetto.dev) or chrome://tracing. Alignment is as good as
+the nodes' wall clocks agree.
+
+Pids are only unique per node, so each file's pids are moved into a range
+of their own (file index << 22 | pid); process names keep the original
+pid.
+
+usage: merge_traces.py -o merged.json trace.*.json
+"""
+import argparse
+import json
+import sys
+
+PID_BITS = 22   # pid_max is at most 2^22 on Linux
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-o", "--output", required=True, help="merged trace to write")
+    parser.add_argument("traces", nargs="+", help="<HVAC_TRACE>.<pid>.json files")
+    args = parser.parse_args()
+
+    loaded = []
+    for path in args.traces:
+        with open(path) as f:
+            trace = json.load(f)
+        other = trace.get("otherData", {})
+        loaded.append((path, trace["traceEvents"], other.get("realtime_offset_ns", 0) / 1000.0))
+        if other.get("dropped_events"):
+            print("%s: %d spans were dropped, raise HVAC_TRACE_EVENTS" % (path, other["dropped_events"]),
+                  file=sys.stderr)
+
+    # Earliest span in wall time becomes zero
+    starts = [e["ts"] + offset for _, events, offset in loaded for e in events if "ts" in e]
+    base = min(starts) if starts else 0.0
+
+    merged = []
+    for index, (path, events, offset) in enumerate(loaded):
+        named = set()
+        pids = set()
+        for e in events:
+            if "ts" in e:
+                e["ts"] = round(e["ts"] + offset - base, 3)
+            if "pid" in e:
+                pid = e["pid"]
+                pids.add(pid)
+                e["pid"] = (index << PID_BITS) | pid
+                if e.get("ph") == "M" and e.get("name") == "process_name":
+                    named.add(pid)
+                    name = e.setdefault("args", {}).get("name", "")
+                    if str(pid) not in name.split():
+                        e["args"]["name"] = ("%s %d" % (name, pid)).strip()
+            merged.append(e)
+        for pid in sorted(pids - named):
+            merged.append({"name": "process_name", "ph": "M", "pid": (index << PID_BITS) | pid, "tid": 0,
+                           "args": {"name": "%s %d" % (path, pid)}})
+
+    with open(args.output, "w") as f:
+        json.dump({"traceEvents": merged, "displayTimeUnit": "ns"}, f)
+    print("%d events from %d files written to %s" % (len(merged), len(loaded), args.output))
+
+
+if __name__ == "__main__":
+    main()
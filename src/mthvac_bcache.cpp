@@ -0,0 +1,303 @@
+/* Per-process block cache for small reads - see mthvac_bcache.h
+ *
+ * The cache is split into shards, each a fixed array of block slots with
+ * its own mutex, index and CLOCK hand. Slot buffers are allocated on
+ * first use and recycled on eviction, so the footprint only grows to the
+ * budget if the workload needs it. The RPC of a miss runs without any
+ * lock held; two threads missing on the same block both fetch it and the
+ * second insert just refreshes the slot.
+ */
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "mthvac_bcache.h"
+#include "mthvac_fdtable.h"
+#include "mthvac_comm.h"
+#include "mthvac_shmcache.h"
+#include "mthvac_timer.h" // ! HVAC TIMING
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+#define HVAC_BCACHE_SHARDS 16
+#define HVAC_BCACHE_MIN_BLOCK 4096
+
+static size_t g_bc_bytes = 64 * 1024 * 1024;
+static size_t g_bc_block = 64 * 1024;
+static size_t g_bc_max_read = 0;       // 0 until init, then defaults to the block size
+
+static std::atomic<uint64_t> g_bc_hits{0};
+static std::atomic<uint64_t> g_bc_misses{0};
+static std::atomic<uint64_t> g_bc_hit_bytes{0};
+static std::atomic<uint64_t> g_bc_evictions{0};
+
+struct hvac_bc_key {
+    uint64_t file;      // path hash of the canonical path
+    uint64_t block;
+
+    bool operator==(const hvac_bc_key &o) const {
+        return file == o.file && block == o.block;
+    }
+};
+
+struct hvac_bc_key_hash {
+    size_t operator()(const hvac_bc_key &k) const {
+        return k.file ^ (k.block * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+struct hvac_bc_slot {
+    hvac_bc_key key;
+    char *data;         // g_bc_block bytes, NULL until the slot is first used
+    size_t len;         // valid bytes, less than a block only at EOF
+    bool ref;           // CLOCK reference bit
+};
+
+struct hvac_bc_shard {
+    pthread_mutex_t mutex;
+    std::vector<hvac_bc_slot> slots;
+    std::unordered_map<hvac_bc_key, uint32_t, hvac_bc_key_hash> index;
+    uint32_t used;
+    uint32_t hand;
+};
+
+static hvac_bc_shard *g_bc_shards = NULL;
+
+void hvac_bcache_init()
+{
+    char *env;
+
+    if ((env = getenv("HVAC_BCACHE_BYTES")) != NULL)
+        g_bc_bytes = strtoull(env, NULL, 10);
+    if ((env = getenv("HVAC_BCACHE_BLOCK")) != NULL)
+        g_bc_block = strtoull(env, NULL, 10);
+    if ((env = getenv("HVAC_BCACHE_MAX_READ")) != NULL)
+        g_bc_max_read = strtoull(env, NULL, 10);
+
+    if (g_bc_block < HVAC_BCACHE_MIN_BLOCK)
+        g_bc_block = HVAC_BCACHE_MIN_BLOCK;
+    if (g_bc_max_read == 0)
+        g_bc_max_read = g_bc_block;
+
+    size_t per_shard = g_bc_bytes / g_bc_block / HVAC_BCACHE_SHARDS;
+    if (g_bc_bytes == 0 || per_shard == 0) {
+        L4C_INFO("Block cache disabled");
+        return;
+    }
+
+    g_bc_shards = new hvac_bc_shard[HVAC_BCACHE_SHARDS];
+    for (int i = 0; i < HVAC_BCACHE_SHARDS; i++) {
+        hvac_bc_shard *s = &g_bc_shards[i];
+        pthread_mutex_init(&s->mutex, NULL);
+        s->slots.resize(per_shard);
+        for (auto &slot : s->slots) {
+            slot.data = NULL;
+            slot.len = 0;
+            slot.ref = false;
+        }
+        s->index.reserve(per_shard);
+        s->used = 0;
+        s->hand = 0;
+    }
+
+    L4C_INFO("Block cache %zu bytes in %zu byte blocks, reads up to %zu bytes",
+             per_shard * HVAC_BCACHE_SHARDS * g_bc_block, g_bc_block, g_bc_max_read);
+}
+
+static inline hvac_bc_shard *hvac_bc_shard_of(const hvac_bc_key &k)
+{
+    return &g_bc_shards[hvac_bc_key_hash()(k) % HVAC_BCACHE_SHARDS];
+}
+
+/* Copy from the cached block what it holds at in-block offset off.
+ * Returns false if the block isn't cached; *eof is set when the block
+ * ends the file and the copy reached that end. */
+static bool hvac_bc_get(const hvac_bc_key &k, size_t off, char *dst, size_t want, size_t *n, bool *eof)
+{
+    hvac_bc_shard *s = hvac_bc_shard_of(k);
+
+    pthread_mutex_lock(&s->mutex);
+    auto it = s->index.find(k);
+    if (it == s->index.end()) {
+        pthread_mutex_unlock(&s->mutex);
+        return false;
+    }
+    hvac_bc_slot *slot = &s->slots[it->second];
+    size_t avail = off < slot->len ? slot->len - off : 0;
+    *n = avail < want ? avail : want;
+    memcpy(dst, slot->data + off, *n);
+    *eof = slot->len < g_bc_block && off + *n >= slot->len;
+    slot->ref = true;
+    pthread_mutex_unlock(&s->mutex);
+    return true;
+}
+
+static void hvac_bc_put(const hvac_bc_key &k, const char *src, size_t len)
+{
+    hvac_bc_shard *s = hvac_bc_shard_of(k);
+    hvac_bc_slot *slot;
+    uint32_t idx;
+
+    pthread_mutex_lock(&s->mutex);
+    auto it = s->index.find(k);
+    if (it != s->index.end()) {
+        idx = it->second;
+    } else if (s->used < s->slots.size()) {
+        idx = s->used++;
+    } else {
+        /* CLOCK: clear reference bits until a slot without one comes up */
+        while (s->slots[s->hand].ref) {
+            s->slots[s->hand].ref = false;
+            s->hand = (s->hand + 1) % s->slots.size();
+        }
+        idx = s->hand;
+        s->hand = (s->hand + 1) % s->slots.size();
+        s->index.erase(s->slots[idx].key);
+        g_bc_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    slot = &s->slots[idx];
+    if (slot->data == NULL) {
+        slot->data = (char *)malloc(g_bc_block);
+        if (slot->data == NULL) {
+            // Only a never used slot lacks a buffer, hand it back
+            s->used--;
+            pthread_mutex_unlock(&s->mutex);
+            return;
+        }
+    }
+    memcpy(slot->data, src, len);
+    slot->len = len;
+    slot->key = k;
+    slot->ref = false;
+    s->index[k] = idx;
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/* Copy the leading part of [offset, offset + count) that is cached.
+ * *eof is set when the copy stopped at the end of the file. */
+static size_t hvac_bc_copy_cached(uint64_t file, char *dst, size_t count, off_t offset, bool *eof)
+{
+    size_t copied = 0;
+
+    *eof = false;
+    while (copied < count) {
+        off_t pos = offset + copied;
+        hvac_bc_key k = { file, (uint64_t)pos / g_bc_block };
+        size_t n;
+
+        if (!hvac_bc_get(k, pos % g_bc_block, dst + copied, count - copied, &n, eof))
+            break;
+        copied += n;
+        if (*eof)
+            break;
+    }
+    return copied;
+}
+
+static inline bool hvac_bc_wants(int fd, size_t count, off_t offset)
+{
+    return g_bc_shards != NULL && count != 0 && count <= g_bc_max_read && offset >= 0 &&
+           hvac_fdtable_entry(fd) != NULL;
+}
+
+ssize_t hvac_bcache_lookup(int fd, void *buf, size_t count, off_t offset)
+{
+    if (!hvac_bc_wants(fd, count, offset))
+        return HVAC_BCACHE_BYPASS;
+
+    bool eof;
+    size_t copied = hvac_bc_copy_cached(g_hvac_fdtable[fd].path_hash, (char *)buf, count, offset, &eof);
+    if (copied < count && !eof)
+        return HVAC_BCACHE_BYPASS;
+    g_bc_hits.fetch_add(1, std::memory_order_relaxed);
+    g_bc_hit_bytes.fetch_add(copied, std::memory_order_relaxed);
+    return copied;
+}
+
+ssize_t hvac_bcache_pread(int fd, uint32_t host, void *buf, size_t count, off_t offset)
+{
+    if (!hvac_bc_wants(fd, count, offset))
+        return HVAC_BCACHE_BYPASS;
+
+    HVAC_TIMING("CLIENT_(hvac_bcache_pread)_total");
+    uint64_t file = g_hvac_fdtable[fd].path_hash;
+    char *dst = (char *)buf;
+    bool eof;
+
+    size_t copied = hvac_bc_copy_cached(file, dst, count, offset, &eof);
+    if (copied == count || eof) {
+        g_bc_hits.fetch_add(1, std::memory_order_relaxed);
+        g_bc_hit_bytes.fetch_add(copied, std::memory_order_relaxed);
+        return copied;
+    }
+    g_bc_misses.fetch_add(1, std::memory_order_relaxed);
+
+    /* One RPC for every block from the first one we lack to the last one
+     * the read touches */
+    off_t pos = offset + copied;
+    off_t start = pos - pos % g_bc_block;
+    off_t end = offset + count;
+    size_t span = (end - start + g_bc_block - 1) / g_bc_block * g_bc_block;
+    char *tmp = (char *)malloc(span);
+    if (tmp == NULL)
+        return HVAC_BCACHE_BYPASS;
+
+    ssize_t got;
+    {
+        HVAC_TIMING("CLIENT_(hvac_bcache_pread)_fill");
+        got = hvac_shm_pread(fd, host, tmp, span, start);
+    }
+    if (got < 0) {
+        free(tmp);
+        return copied ? (ssize_t)copied : -1;
+    }
+
+    /* A short block marks the end of the file, later blocks aren't stored.
+     * It is only kept if the file really ends there: a server that came
+     * back short for any other reason must not leave a truncated block
+     * that every later read would take for EOF. */
+    for (size_t o = 0; o < span; o += g_bc_block) {
+        size_t len = (size_t)got > o ? (size_t)got - o : 0;
+        if (len >= g_bc_block) {
+            hvac_bc_put({ file, (uint64_t)(start + o) / g_bc_block }, tmp + o, g_bc_block);
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == (off_t)(start + o + len))
+            hvac_bc_put({ file, (uint64_t)(start + o) / g_bc_block }, tmp + o, len);
+        break;
+    }
+
+    size_t skip = pos - start;
+    size_t avail = (size_t)got > skip ? (size_t)got - skip : 0;
+    size_t n = avail < count - copied ? avail : count - copied;
+    memcpy(dst + copied, tmp + skip, n);
+    free(tmp);
+    return copied + n;
+}
+
+void hvac_bcache_get_stats(struct hvac_bcache_stats *stats)
+{
+    stats->hits = g_bc_hits.load(std::memory_order_relaxed);
+    stats->misses = g_bc_misses.load(std::memory_order_relaxed);
+    stats->hit_bytes = g_bc_hit_bytes.load(std::memory_order_relaxed);
+    stats->evictions = g_bc_evictions.load(std::memory_order_relaxed);
+}
+
+void hvac_bcache_report()
+{
+    struct hvac_bcache_stats st;
+
+    hvac_bcache_get_stats(&st);
+    if (st.hits + st.misses == 0)
+        return;
+    L4C_INFO("Block cache: %lu hits, %lu misses (%.1f%% hit rate), %lu bytes from memory, %lu evictions",
+             st.hits, st.misses, 100.0 * st.hits / (st.hits + st.misses), st.hit_bytes, st.evictions);
+}
@@ -0,0 +1,41 @@
+/* Per-process block cache for small reads
+ *
+ * HDF5, TFRecord index and npz readers go back to the same headers and
+ * footers many times per sample, each time with a small pread(). Reads of
+ * at most HVAC_BCACHE_MAX_READ bytes are served from HVAC_BCACHE_BLOCK
+ * sized blocks kept in memory, keyed by (file, block) so a file that is
+ * closed and opened again still hits. A miss fetches every block the read
+ * touches in one RPC. HVAC_BCACHE_BYTES caps the cache, full shards evict
+ * with CLOCK. Dataset files are assumed not to change under us.
+ */
+#ifndef __HVAC_BCACHE_H__
+#define __HVAC_BCACHE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Returned when the read is not one for the cache
+#define HVAC_BCACHE_BYPASS (-2)
+
+struct hvac_bcache_stats {
+    uint64_t hits;          // reads served entirely from memory
+    uint64_t misses;        // reads that needed an RPC
+    uint64_t hit_bytes;
+    uint64_t evictions;
+};
+
+void hvac_bcache_init();
+
+// Serve a small positional read on a tracked fd, filling the cache on a
+// miss. -1 if the RPC failed and nothing could be read.
+ssize_t hvac_bcache_pread(int fd, uint32_t host, void *buf, size_t count, off_t offset);
+
+// Same without ever going to the server: the byte count on a full hit,
+// HVAC_BCACHE_BYPASS otherwise. For read() while readahead owns the fd,
+// the caller tells readahead about a hit (hvac_ra_advance).
+ssize_t hvac_bcache_lookup(int fd, void *buf, size_t count, off_t offset);
+
+void hvac_bcache_get_stats(struct hvac_bcache_stats *stats);
+void hvac_bcache_report();
+
+#endif
@@ -1,14 +1,24 @@
 //Starting to use CPP functionality
 #include <map>
 #include <string>
-#include <filesystem>
 #include <iostream>
 #include <assert.h>
 #include <unordered_map>
+#include <atomic>
 
 #include "mthvac_internal.h"
 #include "hvac_logging.h"
 #include "mthvac_comm.h"
+#include "mthvac_readahead.h"
+#include "mthvac_bcache.h"
+#include "mthvac_shmcache.h"
+#include "mthvac_stripe.h"
+#include "mthvac_placement.h"
+#include "mthvac_fdtable.h"
+#include "mthvac_pathfilter.h"
+#include "mthvac_meta.h"
+#include "mthvac_stdio.h"
+#include "mthvac_mmap.h"
 #include "mthvac_timer.h" // ! HVAC TIMING
 
 //* add below
@@ -17,14 +27,70 @@ FILE* (*__real_fopen)(const char *path, const char *mode) = NULL;
 FILE* (*__real_fopen64)(const char *path, const char *mode) = NULL;
 ssize_t (*__real_pread)(int fd, void *buf, size_t count, off_t offset) = NULL;
 ssize_t (*__real_readv)(int fd, const struct iovec *iov, int iovcnt) = NULL;
+ssize_t (*__real_preadv)(int fd, const struct iovec *iov, int iovcnt, off_t offset) = NULL;
+ssize_t (*__real_preadv2)(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags) = NULL;
 ssize_t (*__real_write)(int fd, const void *buf, size_t count) = NULL;
 int (*__real_open)(const char *pathname, int flags, ...) = NULL;
 int (*__real_open64)(const char *pathname, int flags, ...) = NULL;
+int (*__real_openat)(int dirfd, const char *pathname, int flags, ...) = NULL;
+int (*__real_openat64)(int dirfd, const char *pathname, int flags, ...) = NULL;
+int (*__real___open_2)(const char *pathname, int flags) = NULL;
+int (*__real___open64_2)(const char *pathname, int flags) = NULL;
+int (*__real___openat_2)(int dirfd, const char *pathname, int flags) = NULL;
+int (*__real___openat64_2)(int dirfd, const char *pathname, int flags) = NULL;
+int (*__real_fclose)(FILE *fp) = NULL;
+int (*__real_fileno)(FILE *fp) = NULL;
+int (*__real_fileno_unlocked)(FILE *fp) = NULL;
 ssize_t (*__real_read)(int fd, void *buf, size_t count) = NULL;
 ssize_t (*__real_read64)(int fd, void *buf, size_t count) = NULL;
 int (*__real_close)(int fd) = NULL;
+void *(*__real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset) = NULL;
+void *(*__real_mmap64)(void *addr, size_t length, int prot, int flags, int fd, off64_t offset) = NULL;
+int (*__real_munmap)(void *addr, size_t length) = NULL;
 off_t (*__real_lseek)(int fd, off_t offset, int whence) = NULL;
 off64_t (*__real_lseek64)(int fd, off64_t offset, int whence) = NULL;
+int (*__real_dup)(int oldfd) = NULL;
+int (*__real_dup2)(int oldfd, int newfd) = NULL;
+int (*__real_dup3)(int oldfd, int newfd, int flags) = NULL;
+int (*__real_fcntl)(int fd, int cmd, ...) = NULL;
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 28)
+int (*__real_fcntl64)(int fd, int cmd, ...) = NULL;
+#endif
+int (*__real_stat)(const char *path, struct stat *buf) = NULL;
+int (*__real_lstat)(const char *path, struct stat *buf) = NULL;
+int (*__real_fstat)(int fd, struct stat *buf) = NULL;
+int (*__real_fstatat)(int dirfd, const char *path, struct stat *buf, int flags) = NULL;
+int (*__real_stat64)(const char *path, struct stat64 *buf) = NULL;
+int (*__real_lstat64)(const char *path, struct stat64 *buf) = NULL;
+int (*__real_fstat64)(int fd, struct stat64 *buf) = NULL;
+int (*__real_fstatat64)(int dirfd, const char *path, struct stat64 *buf, int flags) = NULL;
+int (*__real___xstat)(int ver, const char *path, struct stat *buf) = NULL;
+int (*__real___lxstat)(int ver, const char *path, struct stat *buf) = NULL;
+int (*__real___fxstat)(int ver, int fd, struct stat *buf) = NULL;
+int (*__real___fxstatat)(int ver, int dirfd, const char *path, struct stat *buf, int flags) = NULL;
+int (*__real___xstat64)(int ver, const char *path, struct stat64 *buf) = NULL;
+int (*__real___lxstat64)(int ver, const char *path, struct stat64 *buf) = NULL;
+int (*__real___fxstat64)(int ver, int fd, struct stat64 *buf) = NULL;
+int (*__real___fxstatat64)(int ver, int dirfd, const char *path, struct stat64 *buf, int flags) = NULL;
+int (*__real_statx)(int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf) = NULL;
+int (*__real_access)(const char *path, int mode) = NULL;
+int (*__real_faccessat)(int dirfd, const char *path, int mode, int flags) = NULL;
+int (*__real_unlink)(const char *path) = NULL;
+int (*__real_unlinkat)(int dirfd, const char *path, int flags) = NULL;
+int (*__real_rmdir)(const char *path) = NULL;
+int (*__real_mkdir)(const char *path, mode_t mode) = NULL;
+int (*__real_rename)(const char *oldpath, const char *newpath) = NULL;
+int (*__real_renameat)(int olddirfd, const char *oldpath, int newdirfd, const char *newpath) = NULL;
+DIR *(*__real_opendir)(const char *name) = NULL;
+struct dirent *(*__real_readdir)(DIR *dirp) = NULL;
+struct dirent64 *(*__real_readdir64)(DIR *dirp) = NULL;
+int (*__real_readdir_r)(DIR *dirp, struct dirent *entry, struct dirent **result) = NULL;
+int (*__real_readdir64_r)(DIR *dirp, struct dirent64 *entry, struct dirent64 **result) = NULL;
+int (*__real_closedir)(DIR *dirp) = NULL;
+int (*__real_dirfd)(DIR *dirp) = NULL;
+void (*__real_rewinddir)(DIR *dirp) = NULL;
+long (*__real_telldir)(DIR *dirp) = NULL;
+void (*__real_seekdir)(DIR *dirp, long loc) = NULL;
 
 // ! HVAC TIMING
 extern "C" void hvac_setup_detailed_logging();
@@ -41,9 +107,23 @@ uint32_t g_hvac_server_count = 0;
 char *hvac_data_dir = NULL;
 
 pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t comm_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-std::unordered_map<int,std::string> fd_map;
-std::unordered_map<int, int > fd_redir_map;
+
+/* Mercury comes up on the first tracked open or metadata lookup, whichever
+ * happens first - both can run on any application thread. */
+void hvac_client_ensure_comm()
+{
+	if (g_mercury_init)
+		return;
+	pthread_mutex_lock(&comm_init_mutex);
+	if (!g_mercury_init){
+		hvac_init_comm(false);
+		hvac_client_comm_register_rpc();
+		g_mercury_init = true;
+	}
+	pthread_mutex_unlock(&comm_init_mutex);
+}
 
 void Initialize_function() {
     L4C_INFO("Executing Initialize_function");
@@ -55,6 +135,18 @@ void Initialize_function() {
     L4C_INFO("Finished Initialize_timer");
 }
 
+/* A child that reads an inherited fd through the kernel, an exec'd tool
+ * say, starts where the parent's reads left off. Only fork() runs this,
+ * posix_spawn() and vfork() children see the position of the last dup
+ * or fork. */
+static void hvac_client_atfork_prepare()
+{
+    int high = g_hvac_fdtable_high.load(std::memory_order_relaxed);
+
+    for (int fd = 0; fd < high; fd++)
+        hvac_sync_kernel_offset(fd);
+}
+
 /* Devise a way to safely call this and initialize early */
 static void __attribute__((constructor)) hvac_client_init()
 {	
@@ -83,6 +175,18 @@ static void __attribute__((constructor)) hvac_client_init()
 		hvac_data_dir = (char *)malloc(strlen(hvac_data_dir_c) + 1);
 		snprintf(hvac_data_dir, strlen(hvac_data_dir_c) + 1, "%s", hvac_data_dir_c);
     }
+
+    hvac_placement_init(g_hvac_server_count);
+    hvac_fdtable_init();
+    pthread_atfork(hvac_client_atfork_prepare, NULL, NULL);
+    hvac_pathfilter_init(hvac_data_dir);
+    hvac_meta_init();
+    hvac_stdio_init();
+    hvac_mmap_init();
+    hvac_ra_init();
+    hvac_bcache_init();
+    hvac_shm_init();
+    hvac_stripe_init();
     
 
     g_hvac_initialized = true;
@@ -95,20 +199,33 @@ static void __attribute__((constructor)) hvac_client_init()
 	Initialize_function();
 }
 
+/* Reads and opens that went to the PFS because a server failed them, missed
+ * an open deadline or sat in the penalty box */
+static std::atomic<uint64_t> g_hvac_fallback_reads{0};
+static std::atomic<uint64_t> g_hvac_fallback_opens{0};
+
 static void __attribute((destructor)) hvac_client_shutdown()
 {
+    if (g_hvac_fallback_reads.load() || g_hvac_fallback_opens.load())
+        L4C_INFO("PFS fallbacks: %lu reads, %lu opens", g_hvac_fallback_reads.load(), g_hvac_fallback_opens.load());
+    hvac_bcache_report();
+    hvac_shm_report();
+    if (g_mercury_init)
+        hvac_comm_report_contexts();
     hvac_shutdown_comm();
 }
 
 bool hvac_track_file(const char *path, int flags, int fd)
 {   
 	HVAC_TIMING("CLIENT_(hvac_track_file)_total");    
+	HVAC_REQUEST("CLIENT_(hvac_track_file)");
 	if (strstr(path, ".ports.cfg.") != NULL)
 	{
 		return false;
 	}
 	//Always back out of RDONLY
 	bool tracked = false;
+	std::string cpath;
 	if ((flags & O_ACCMODE) == O_WRONLY) {
 		return false;
 	}
@@ -116,51 +233,48 @@ bool hvac_track_file(const char *path, int flags, int fd)
 	if ((flags & O_APPEND)) {
 		return false;
 	}    
+	// Directories opened for openat() / fchdir() are not data
+	if (flags & (O_DIRECTORY | O_PATH)) {
+		return false;
+	}
 
-	try {
-		std::string ppath = std::filesystem::canonical(path).parent_path();
-		// Check if current file exists in HVAC_DATA_DIR
-		if (hvac_data_dir != NULL){
-			std::string test = std::filesystem::canonical(hvac_data_dir);
-			
-			if (ppath.find(test) != std::string::npos)
-			{
-				//L4C_FATAL("Got a file want a stack trace");
-				L4C_INFO("Traacking used HV_DD file %s",path);
-				fd_map[fd] = std::filesystem::canonical(path);
-				tracked = true;
-			}		
-		}else if (ppath == std::filesystem::current_path()) {       
-			L4C_INFO("Traacking used CWD file %s",path);
-			fd_map[fd] = std::filesystem::canonical(path);
-			tracked = true;
-		}
-	} catch (...)
 	{
-		//Need to do something here
+		HVAC_TIMING("CLIENT_(hvac_track_file)_filter");
+		tracked = hvac_pathfilter_match(path, &cpath);
 	}
+	if (tracked)
+		L4C_INFO("Tracking file %s", cpath.c_str());
 
 
-	// Send RPC to tell server to open file 
+	// Send RPC to tell server to open file - this does not wait for the
+	// server, the first read or close on the fd does
+	if (tracked && !hvac_fdtable_track(fd, cpath)) {
+		L4C_WARN("fd %d is past the descriptor table, %s stays on the PFS", fd, path);
+		tracked = false;
+	}
 	if (tracked){
-		if (!g_mercury_init){
-			hvac_init_comm(false);	
-			/* I think I only need to do this once */
-			hvac_client_comm_register_rpc();
-			g_mercury_init = true;
-		}
+		hvac_client_ensure_comm();
 		
-		int host = std::hash<std::string>{}(fd_map[fd]) % g_hvac_server_count;	
+		int host = hvac_fdtable_server(fd);	
+		if (!hvac_client_comm_server_available(host)) {
+			L4C_INFO("Host %d is in the penalty box - %s stays on the PFS", host, path);
+			g_hvac_fallback_opens++;
+			hvac_fdtable_untrack(fd);
+			return false;
+		}
 		L4C_INFO("Remote open - Host %d", host);
 		ssize_t open_result;
 		{
 			HVAC_TIMING("CLIENT_(comm_gen_open_rpc)_dispatch");
-			open_result = hvac_client_comm_gen_open_rpc(host, fd_map[fd], fd);
+			open_result = hvac_client_comm_gen_open_rpc(host, cpath, fd);
 		}
 		
 		if (open_result < 0) {
-			L4C_ERR("Remote open failed for file %s", path);
+			L4C_ERR("Remote open dispatch failed for file %s", path);
+			hvac_fdtable_untrack(fd);
 			tracked = false;  // If remote open failed, don't track the file
+		} else {
+			hvac_stripe_track(fd, cpath);
 		}
 	}
 
@@ -168,13 +282,15 @@ bool hvac_track_file(const char *path, int flags, int fd)
 	return tracked;
 }
 
-/* Need to clean this up - in theory the RPC should time out if the request hasn't been serviced we'll go to the file-system?
- * Maybe not - we'll roll to another server.
- * For now we return true to keep the good path happy
+/* read() is a positional read at the client owned file position, which
+ * advances by what came back. Returns -1 when the read failed or the
+ * server is in the penalty box, the wrapper then reads from the PFS at
+ * the same position.
  */
 ssize_t hvac_remote_read(int fd, void *buf, size_t count)
 {
 	HVAC_TIMING("CLIENT_(hvac_remote_read)_total");
+	HVAC_REQUEST("CLIENT_(hvac_remote_read)");
 	/* HVAC Code */
 	/* Check the local fd - if it's tracked we pass it to the RPC function
 	 * The local FD is converted to the remote FD with the buf and count
@@ -182,98 +298,247 @@ ssize_t hvac_remote_read(int fd, void *buf, size_t count)
 	 */
 	ssize_t bytes_read = -1;
 	if (hvac_file_tracked(fd)){
-		int host = std::hash<std::string>{}(fd_map[fd]) % g_hvac_server_count;	
+		off_t offset = hvac_fdtable_offset(fd);
+		// Striped files have no single server to stream from
+		if (hvac_stripe_is_striped(fd)) {
+			bytes_read = hvac_remote_pread(fd, buf, count, offset);
+			if (bytes_read > 0)
+				hvac_fdtable_set_offset(fd, offset + bytes_read);
+			return bytes_read;
+		}
+		int host = hvac_fdtable_server(fd);	
+		if (!hvac_client_comm_server_available(host)) {
+			g_hvac_fallback_reads++;
+			return -1;
+		}
 		L4C_INFO("Remote read - Host %d", host);	
 		{
 			HVAC_TIMING("CLIENT_(hvac_remote_read)_dispatch");
-			bytes_read = hvac_client_comm_gen_read_rpc(host, fd, buf, count, -1);
+			// Readahead owns the stream, the block cache only answers hits
+			if (hvac_ra_enabled()) {
+				bytes_read = hvac_bcache_lookup(fd, buf, count, offset);
+				if (bytes_read == HVAC_BCACHE_BYPASS)
+					bytes_read = hvac_ra_read(fd, host, buf, count, offset);
+				else
+					hvac_ra_advance(fd, offset, bytes_read);
+			} else {
+				bytes_read = hvac_bcache_pread(fd, host, buf, count, offset);
+				if (bytes_read == HVAC_BCACHE_BYPASS)
+					bytes_read = hvac_shm_pread(fd, host, buf, count, offset);
+			}
 		}	
+		if (bytes_read < 0)
+			g_hvac_fallback_reads++;
+		else
+			hvac_fdtable_set_offset(fd, offset + bytes_read);
 		return bytes_read;
 	}
 	/* Non-HVAC Reads come from base */
 	return bytes_read;
 }
 
-/* Need to clean this up - in theory the RPC should time out if the request hasn't been serviced we'll go to the file-system?
- * Maybe not - we'll roll to another server.
- * For now we return true to keep the good path happy
+/* Returns -1 when the read failed or the server is in the penalty box,
+ * the wrapper then falls back to __real_pread against the original path.
  */
 ssize_t hvac_remote_pread(int fd, void *buf, size_t count, off_t offset)
 {
 	HVAC_TIMING("CLIENT_(hvac_remote_pread)_total");
+	HVAC_REQUEST("CLIENT_(hvac_remote_pread)");
 	/* HVAC Code */
 	/* Check the local fd - if it's tracked we pass it to the RPC function
 	 * The local FD is converted to the remote FD with the buf and count
 	 * We must know the remote FD to avoid collision on the remote side
 	 */
 	ssize_t bytes_read = -1;
-	if (hvac_file_tracked(fd) && fd_redir_map[fd] != 0){
-		int host = std::hash<std::string>{}(fd_map[fd]) % g_hvac_server_count;	
+	if (hvac_file_tracked(fd)){
+		// Large striped files fan out to the owners of each block
+		if (hvac_stripe_is_striped(fd)) {
+			HVAC_TIMING("CLIENT_(hvac_remote_pread)_striped");
+			bytes_read = hvac_stripe_pread(fd, buf, count, offset);
+			if (bytes_read < 0)
+				g_hvac_fallback_reads++;
+			return bytes_read;
+		}
+		int host = hvac_fdtable_server(fd);	
+		if (!hvac_client_comm_server_available(host)) {
+			g_hvac_fallback_reads++;
+			return -1;
+		}
 		L4C_INFO("Remote pread - Host %d", host);	
 		{
 			HVAC_TIMING("CLIENT_(hvac_remote_pread)_dispatch");	
-			bytes_read = hvac_client_comm_gen_read_rpc(host, fd, buf, count, offset);
+			bytes_read = hvac_bcache_pread(fd, host, buf, count, offset);
+			if (bytes_read == HVAC_BCACHE_BYPASS)
+				bytes_read = hvac_shm_pread(fd, host, buf, count, offset);
 		}
+		if (bytes_read < 0)
+			g_hvac_fallback_reads++;
 	}
 	/* Non-HVAC Reads come from base */
 	return bytes_read;
 }
 
-ssize_t hvac_remote_lseek(int fd, int offset, int whence)
+/* readv / preadv on a tracked fd. offset -1 is readv(), which reads at
+ * and advances the file position. One RPC carries the whole iovec unless
+ * the fd is striped or reading ahead, then the entries are served one by
+ * one from those paths instead.
+ * Returns -1 to make the wrapper fall back to the PFS.
+ */
+ssize_t hvac_remote_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
 {
-		/* HVAC Code */
-	/* Check the local fd - if it's tracked we pass it to the RPC function
-	 * The local FD is converted to the remote FD with the buf and count
-	 * We must know the remote FD to avoid collision on the remote side
-	 */
+	HVAC_TIMING("CLIENT_(hvac_remote_preadv)_total");
+	HVAC_REQUEST("CLIENT_(hvac_remote_preadv)");
 	ssize_t bytes_read = -1;
-	if (hvac_file_tracked(fd)){
-		int host = std::hash<std::string>{}(fd_map[fd]) % g_hvac_server_count;	
-		L4C_INFO("Remote seek - Host %d", host);		
-		bytes_read = hvac_client_comm_gen_seek_rpc(host, fd, offset, whence);
-		return bytes_read;
+	if (!hvac_file_tracked(fd))
+		return -1;
+
+	bool striped = hvac_stripe_is_striped(fd);
+	if (striped || (offset == -1 && hvac_ra_enabled())) {
+		size_t total = 0;
+		for (int i = 0; i < iovcnt; i++) {
+			ssize_t got = (offset == -1) ? hvac_remote_read(fd, iov[i].iov_base, iov[i].iov_len)
+			                             : hvac_remote_pread(fd, iov[i].iov_base, iov[i].iov_len, offset + total);
+			if (got < 0)
+				return total ? (ssize_t)total : -1;
+			total += got;
+			if ((size_t)got < iov[i].iov_len)
+				break;
+		}
+		return total;
 	}
-	/* Non-HVAC Reads come from base */
+
+	int host = hvac_fdtable_server(fd);
+	if (!hvac_client_comm_server_available(host)) {
+		g_hvac_fallback_reads++;
+		return -1;
+	}
+	L4C_INFO("Remote preadv - Host %d, %d entries", host, iovcnt);
+	off_t pos = (offset == -1) ? hvac_fdtable_offset(fd) : offset;
+	{
+		HVAC_TIMING("CLIENT_(hvac_remote_preadv)_dispatch");
+		bytes_read = hvac_client_comm_gen_readv_rpc(host, fd, iov, iovcnt, pos);
+	}
+	if (bytes_read < 0)
+		g_hvac_fallback_reads++;
+	else if (offset == -1)
+		hvac_fdtable_set_offset(fd, pos + bytes_read);
 	return bytes_read;
 }
 
+/* lseek on a tracked fd never leaves the client. SEEK_END asks fstat(),
+ * which the metadata cache usually answers; SEEK_DATA / SEEK_HOLE need
+ * the file system and go to the local fd. Unlike the kernel's f_pos, and
+ * the server's single progress thread before it, the client position
+ * does not serialize concurrent read() calls on one fd: two threads may
+ * read at the same position. Threads sharing an fd should use pread.
+ * Nor does it move the kernel's f_pos, which is only brought up to date
+ * when the fd is duplicated or the process forks: a dup() copy, which is
+ * not tracked, or a child reading through the kernel starts at the right
+ * place but does not share a cursor with the tracked fd after that.
+ */
+off_t hvac_tracked_lseek(int fd, off_t offset, int whence)
+{
+	off_t pos;
+	struct stat st;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = hvac_fdtable_offset(fd) + offset;
+		break;
+	case SEEK_END:
+		if (fstat(fd, &st) != 0)
+			return -1;
+		pos = st.st_size + offset;
+		break;
+	default:
+		pos = __real_lseek(fd, offset, whence);
+		if (pos < 0)
+			return -1;
+		break;
+	}
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	hvac_fdtable_set_offset(fd, pos);
+	return pos;
+}
+
+off_t hvac_file_offset(int fd)
+{
+	return hvac_fdtable_offset(fd);
+}
+
+void hvac_file_set_offset(int fd, off_t offset)
+{
+	hvac_fdtable_set_offset(fd, offset);
+}
+
 void hvac_remote_close(int fd){
 	if (hvac_file_tracked(fd)){
-		int host = std::hash<std::string>{}(fd_map[fd]) % g_hvac_server_count;	
+		int host = hvac_fdtable_server(fd);	
 		hvac_client_comm_gen_close_rpc(host, fd);             	
 	}
 }
 
+// Hot path for every intercepted call - a single atomic load, no timing scope
 bool hvac_file_tracked(int fd)
 {
-	HVAC_TIMING("CLIENT_(hvac_file_tracked)_total");
-	return (fd_map.find(fd) != fd_map.end());
+	return hvac_fdtable_tracked(fd);
 }
 
+// A copy, valid until the calling thread's next hvac_get_path - the
+// table's own string goes away when another thread closes fd
 const char * hvac_get_path(int fd)
 {	
-	HVAC_TIMING("CLIENT_(hvac_get_path)_total");
-	if (fd_map.find(fd) != fd_map.end())
-	{
-		return fd_map[fd].c_str();
-	}
-	return NULL;
+	static thread_local std::string tl_path;
+
+	if (!hvac_fdtable_copy_path(fd, tl_path))
+		return NULL;
+	return tl_path.c_str();
 }
 
 bool hvac_remove_fd(int fd)
 {
+	if (!hvac_file_tracked(fd))
+		return false;
+	// Any prefetch still in flight targets the remote fd we are about to close
+	hvac_ra_release(fd);
+	hvac_stripe_release(fd);
 	hvac_remote_close(fd);	
-	return fd_map.erase(fd);
+	hvac_fdtable_untrack(fd);
+	return true;
 }
 
 extern "C" {
     void hvac_trigger_print_all_stats(int epoch_num) {
         hvac::print_all_stats(epoch_num);
+        hvac_bcache_report();
+        hvac_shm_report();
+        if (g_mercury_init)
+            hvac_comm_report_contexts();
     }
 
 	void hvac_trigger_reset_all_stats() {
         hvac::reset_all_stats();
     }
+
+	uint64_t hvac_client_get_fallback_count() {
+		return g_hvac_fallback_reads.load() + g_hvac_fallback_opens.load();
+	}
+
+	// Block cache counters of this process, see mthvac_bcache.h
+	void hvac_client_get_bcache_stats(uint64_t *hits, uint64_t *misses, uint64_t *hit_bytes, uint64_t *evictions) {
+		struct hvac_bcache_stats st;
+		hvac_bcache_get_stats(&st);
+		*hits = st.hits;
+		*misses = st.misses;
+		*hit_bytes = st.hit_bytes;
+		*evictions = st.evictions;
+	}
 }
 
 // Used for initiate the detailed logs of a specific tag
@@ -281,6 +546,21 @@ extern "C" void hvac_setup_detailed_logging() {
 	hvac::enable_detailed_call_logging_for_tag("CLIENT_hvac_open_rpc_wait_data");
 }
 
+// Used to export the latency histograms of every tag, see mthvac_timer.h
+extern "C" void hvac_client_export_histograms(const char* output_filename_c_str) {
+    if (output_filename_c_str)
+        hvac::export_histograms_to_file(output_filename_c_str);
+}
+
+// Used to write the HVAC_TRACE file now, for processes that leave through _exit()
+// (DataLoader workers do) and so never reach the dump at exit. Returns 0 on success.
+extern "C" int hvac_client_dump_trace() {
+    std::string name = hvac::trace_file_name();
+    if (name.empty() || !hvac::dump_trace_to_file(name.c_str()))
+        return -1;
+    return 0;
+}
+
 // Used to export detailed call history for a specific tag to a CSV file
 extern "C" void hvac_client_export_tag_details(const char* tag_name_c_str, const char* output_filename_c_str, int epoch_num) {
     if (tag_name_c_str && output_filename_c_str) {
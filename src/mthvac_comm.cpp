@@ -1,4 +1,6 @@
 #include "mthvac_comm.h"
+#include "mthvac_meta.h"
+#include "mthvac_srvstats.h"
 #include "mthvac_data_mover_internal.h"
 #include "mthvac_timer.h" // ! HVAC TIMING
 
@@ -8,29 +10,271 @@ extern "C" {
 #include <cassert>
 //#include <pmi.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
 }
 
 
 #include <string>
+#include <vector>
 #include <iostream>
 #include <map>	
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <set>
+#include <unordered_set>
+#include <unordered_map>
+#include <string.h>
 
 
 static hg_class_t *hg_class = NULL;
 static hg_context_t *hg_context = NULL;
+/* Second class on na+sm for node local traffic, NULL if disabled. Servers
+ * listen on both, clients use it for servers on their own node. */
+static hg_class_t *hg_sm_class = NULL;
+static hg_context_t *hg_sm_context = NULL;
 static int hvac_progress_thread_shutdown_flags = 0;
+
+/* A context and the progress thread that drives it. Every completion
+ * callback runs on the thread of the context its handle was created on,
+ * so clients can spread them over HVAC_CLIENT_CONTEXTS contexts per class.
+ * Servers keep a single one. [0] is hg_context / hg_sm_context. */
+struct hvac_comm_ctx {
+	hg_context_t *context;
+	bool sm;
+	std::atomic<uint64_t> triggered;	// callbacks run on this context
+};
+static std::vector<hvac_comm_ctx *> hvac_contexts;
+static std::vector<hvac_comm_ctx *> hvac_sm_contexts;
+static bool hvac_context_by_server = false;	// else by calling thread
+static struct timespec hvac_comm_start_ts;
+static __thread int tl_context_slot = -1;
+/* When this thread's last HG_Progress returned. Handlers run from the
+ * HG_Trigger loop that follows, so the gap to a handler is the time its
+ * request waited behind the callbacks delivered with it. */
+static __thread uint64_t tl_progress_ns = 0;
 static int hvac_server_rank = -1;
 static int server_rank = -1;
 
-/* struct used to carry state of overall operation across callbacks */
+/* Large reads are served in chunks of at most hvac_bulk_chunk_size bytes
+ * with up to hvac_bulk_pipeline_depth chunks in flight, so the read of the
+ * next chunk overlaps the bulk push of the previous one and a request never
+ * pins more than chunk_size * depth bytes of server memory.
+ */
+static hg_size_t hvac_bulk_chunk_size = 4 * 1024 * 1024;
+static int hvac_bulk_pipeline_depth = 4;
+
+/* Disk reads run on a pool of hvac_io_threads I/O threads, not on the
+ * progress thread: sm and tcp only move bulk data while the progress
+ * thread runs, so a read there would stall every push and every new
+ * request behind it. Workers start the bulk push or respond themselves,
+ * the completion callbacks still come back on the progress thread.
+ * With 0 threads tasks run inline on the calling thread.
+ */
+static int hvac_io_threads = 4;
+// No destructors, so exit never waits on a cond the workers sleep on
+static pthread_mutex_t hvac_io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hvac_io_cond = PTHREAD_COND_INITIALIZER;
+static std::deque<std::function<void()>> hvac_io_queue;
+
+static void *
+hvac_io_fn(void *)
+{
+    for (;;) {
+        pthread_mutex_lock(&hvac_io_mutex);
+        while (hvac_io_queue.empty())
+            pthread_cond_wait(&hvac_io_cond, &hvac_io_mutex);
+        std::function<void()> task = std::move(hvac_io_queue.front());
+        hvac_io_queue.pop_front();
+        pthread_mutex_unlock(&hvac_io_mutex);
+        task();
+    }
+    return NULL;
+}
+
+static void
+hvac_io_submit(std::function<void()> task)
+{
+    if (hvac_io_threads == 0) {
+        task();
+        return;
+    }
+    pthread_mutex_lock(&hvac_io_mutex);
+    hvac_io_queue.push_back(std::move(task));
+    pthread_cond_signal(&hvac_io_cond);
+    pthread_mutex_unlock(&hvac_io_mutex);
+}
+
+/* Directory snapshots served to clients, rebuilt when the directory mtime
+ * moves or once they are older than hvac_meta_ttl seconds (file sizes and
+ * times don't touch the directory mtime), so the PFS sees one listing per
+ * change however many clients ask. Listing runs on the I/O threads; a
+ * directory's build lock makes concurrent requests for it wait for one
+ * listing rather than each make their own. A snapshot is never changed
+ * once built, a rebuild replaces it, so pushes in flight keep their copy.
+ * The least recently used directory is dropped past HVAC_DIR_SNAPSHOT_MAX.
+ */
+#define HVAC_DIR_SNAPSHOT_MAX 1024
+struct hvac_dir_snapshot {
+    time_t taken;
+    struct timespec mtime;  // of the directory when it was listed
+    uint64_t gen;           // changes on every rebuild, clients revalidate with it
+    int ret;                // 0 or -errno from listing the directory
+    std::string data;       // packed hvac_meta_rec records
+};
+struct hvac_dir_slot {
+    std::mutex build_lock;
+    std::shared_ptr<const struct hvac_dir_snapshot> snap;     // under build_lock
+    time_t checked;         // last time the directory mtime was compared, under build_lock
+    time_t last_used;       // under dir_snapshots_mutex
+};
+static std::mutex dir_snapshots_mutex;
+static map<string, std::shared_ptr<struct hvac_dir_slot>> dir_snapshots;
+static int hvac_meta_ttl = 60;
+static int hvac_stripe_idle_secs = 60;      // see hvac_stripe_fd
+
+/* Counters for the stats RPC. Handlers run on the progress thread of
+ * either class, so they are atomics. "cached" is the burst buffer tier,
+ * everything else was read from the PFS. */
+struct hvac_srv_counters {
+    std::atomic<uint64_t> opens{0};
+    std::atomic<uint64_t> opens_cached{0};
+    std::atomic<uint64_t> open_errors{0};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> reads_cached{0};
+    std::atomic<uint64_t> read_errors{0};
+    std::atomic<uint64_t> bytes_cached{0};
+    std::atomic<uint64_t> bytes_pfs{0};
+    std::atomic<uint64_t> active_reads{0};     // requests not answered yet
+    std::atomic<uint64_t> inflight_chunks{0};  // bulk pushes in flight
+};
+static struct hvac_srv_counters srv_counters;
+
+/* Server fds opened on the cached copy, for charging reads to a tier */
+static std::mutex cached_fds_mutex;
+static std::unordered_set<int> cached_fds;
+
+static bool hvac_fd_is_cached(int fd)
+{
+    std::lock_guard<std::mutex> lk(cached_fds_mutex);
+    return cached_fds.count(fd) != 0;
+}
+
+/* Reads still running on a client opened fd. A client that gave up on a
+ * deadline may close while chunks are in pread(); the close is then left
+ * to the last of them, so the fd number can't be reused under them. */
+struct hvac_fd_use {
+    int active;
+    bool close_pending;
+};
+static std::mutex fd_use_mutex;
+static std::unordered_map<int, struct hvac_fd_use> fd_use;
+
+static void hvac_fd_hold(int fd)
+{
+    std::lock_guard<std::mutex> lk(fd_use_mutex);
+    fd_use[fd].active++;
+}
+
+static void hvac_fd_release(int fd)
+{
+    bool close_now = false;
+    {
+        std::lock_guard<std::mutex> lk(fd_use_mutex);
+        auto it = fd_use.find(fd);
+        if (--it->second.active == 0) {
+            close_now = it->second.close_pending;
+            fd_use.erase(it);
+        }
+    }
+    if (close_now)
+        close(fd);
+}
+
+// Close fd now, or once the reads on it are done
+static int hvac_fd_close(int fd)
+{
+    {
+        std::lock_guard<std::mutex> lk(fd_use_mutex);
+        auto it = fd_use.find(fd);
+        if (it != fd_use.end()) {
+            it->second.close_pending = true;
+            return 0;
+        }
+    }
+    return close(fd);
+}
+
+/* struct used to carry state of overall operation across callbacks.
+ * Its chunks are read on I/O threads and pushed from the progress
+ * thread, so everything below the lock is only touched under it. */
 struct hvac_rpc_state {
-    hg_size_t size;
+    pthread_mutex_t lock;
+    hg_size_t size;         // bytes the client asked for
+    hg_size_t next_offset;  // next byte of the request handed to a chunk
+    hg_size_t limit;        // where the data ends: size, or a short / failed read
+    int slots;              // chunks not retired yet, the last one answers
+    int inflight;           // chunks currently being pushed
+    bool done_reading;      // short read, error or request fully read
+    bool read_failed;       // a read returned -1
+    int fd;                 // server side fd to read from
+    uint64_t req_id;        // client request ID, for the logs
+    uint64_t start_ns;      // handler entry
+    uint64_t queue_ns;      // waited before the handler ran
+    uint64_t storage_ns;    // spent in read() / pread()
+    uint64_t push_ns;       // spent in bulk pushes, issue to callback
+    bool cached;            // fd is on the burst buffer copy
+    int64_t offset;         // file offset of the request, -1 for the fd position
+    hg_bulk_t origin_bulk;  // client buffer to push into
+    hg_handle_t handle;
+    hvac_extent_list_t *extents;    // vectored read, NULL for a single range
+    bool fd_held;           // fd is a client's open, released in hvac_rpc_finish
+    struct hvac_stripe_fd *stripe;  // striped block read, released when done
+    uint32_t ext_index;     // extent the next chunk starts in
+    hg_size_t ext_done;     // bytes of that extent already read
+    // Decoded input, kept until we respond. HG_Free_input knows which
+    // proc to use from the handle, so either member can be passed.
+    union {
+        hvac_rpc_in_t in;
+        hvac_stripe_read_in_t stripe_in;
+        hvac_readv_in_t readv_in;
+    };
+};
+
+/* One pipeline slot. The buffer and its bulk handle are reused for every
+ * chunk that passes through the slot.
+ */
+struct hvac_rpc_chunk {
+    struct hvac_rpc_state *rpc_state;
     void *buffer;
+    hg_size_t capacity;
+    hg_size_t len;
+    hg_size_t origin_offset;
     hg_bulk_t bulk_handle;
-    hg_handle_t handle;
-    hvac_rpc_in_t in;
+    uint64_t push_start;    // when the current push was issued
 };
 
+static inline uint64_t hvac_comm_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Queue wait of a request whose handler runs now, also kept in the
+ * server's own timing summary */
+static uint64_t hvac_comm_queue_wait(uint64_t now)
+{
+	static const uint32_t tag = hvac::intern_tag("HvacComm_(request)_queue_wait");
+	uint64_t waited = (tl_progress_ns != 0 && now > tl_progress_ns) ? now - tl_progress_ns : 0;
+
+	hvac::record_duration(tag, waited);
+	return waited;
+}
 
 void hvac_init_comm(hg_bool_t listen)
 {
@@ -53,21 +297,72 @@ void hvac_init_comm(hg_bool_t listen)
     //	L4C_INFO("PMIX_RANK: %s Server Rank: %d \n", rankstr_str.c_str(), server_rank);
 	L4C_INFO("Server Rank: %d \n", server_rank);
 
-	pthread_t hvac_progress_tid;
+	if (listen)
+	{
+		char *env;
+		if ((env = getenv("HVAC_BULK_CHUNK_SIZE")) != NULL && strtoull(env, NULL, 10) > 0)
+			hvac_bulk_chunk_size = strtoull(env, NULL, 10);
+		if ((env = getenv("HVAC_BULK_PIPELINE_DEPTH")) != NULL && atoi(env) > 0)
+			hvac_bulk_pipeline_depth = atoi(env);
+		if ((env = getenv("HVAC_META_TTL")) != NULL)
+			hvac_meta_ttl = atoi(env);
+		if ((env = getenv("HVAC_STRIPE_FD_IDLE")) != NULL && atoi(env) > 0)
+			hvac_stripe_idle_secs = atoi(env);
+		if ((env = getenv("HVAC_SERVER_IO_THREADS")) != NULL && atoi(env) >= 0)
+			hvac_io_threads = atoi(env);
+		L4C_INFO("Bulk chunk size %lu, pipeline depth %d, %d I/O threads", hvac_bulk_chunk_size,
+				 hvac_bulk_pipeline_depth, hvac_io_threads);
+		for (int i = 0; i < hvac_io_threads; i++)
+		{
+			pthread_t hvac_io_tid;
+			if (pthread_create(&hvac_io_tid, NULL, hvac_io_fn, NULL) != 0){
+				L4C_FATAL("Failed to start I/O thread\n");
+			}
+			pthread_detach(hvac_io_tid);
+		}
+	}
+
+	int nr_contexts = 1;
+	if (!listen)
+	{
+		char *env;
+		if ((env = getenv("HVAC_CLIENT_CONTEXTS")) != NULL && atoi(env) > 0)
+			nr_contexts = atoi(env);
+		// NA counts contexts in a uint8_t
+		if (nr_contexts > UINT8_MAX)
+			nr_contexts = UINT8_MAX;
+		if ((env = getenv("HVAC_CLIENT_CONTEXT_MAP")) != NULL && strcmp(env, "server") == 0)
+			hvac_context_by_server = true;
+		L4C_INFO("%d client contexts per class, assigned by %s", nr_contexts,
+				 hvac_context_by_server ? "server" : "thread");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &hvac_comm_start_ts);
 
     HG_Set_log_level("DEBUG");
 
-    /* Initialize Mercury with the desired network abstraction class */
-    hg_class = HG_Init(info_string, listen);
+    /* Initialize Mercury with the desired network abstraction class. NA
+     * only sets up one context per class unless told otherwise, and a
+     * second HG_Context_create on it would share that one underneath. */
+	struct hg_init_info hg_init_info = HG_INIT_INFO_INITIALIZER;
+	hg_init_info.na_init_info.max_contexts = nr_contexts;
+    hg_class = HG_Init_opt(info_string, listen, &hg_init_info);
 	if (hg_class == NULL){
 		L4C_FATAL("Failed to initialize HG_CLASS Listen Mode : %d : PMI_RANK %d \n", listen, server_rank);
 	}
 
-    /* Create HG context */
-    hg_context = HG_Context_create(hg_class);
-	if (hg_context == NULL){
-		L4C_FATAL("Failed to initialize HG_CONTEXT\n");
+    /* Create HG contexts, progress threads start below */
+	for (int i = 0; i < nr_contexts; i++)
+	{
+		hvac_comm_ctx *ctx = new hvac_comm_ctx();
+		ctx->context = HG_Context_create_id(hg_class, i);
+		ctx->sm = false;
+		ctx->triggered = 0;
+		if (ctx->context == NULL){
+			L4C_FATAL("Failed to initialize HG_CONTEXT\n");
+		}
+		hvac_contexts.push_back(ctx);
 	}
+	hg_context = hvac_contexts[0]->context;
 	//Only for server processes
 	if (listen)
 	{
@@ -84,8 +379,40 @@ void hvac_init_comm(hg_bool_t listen)
 	//free(pid_server);
 	//TODO The engine creates a pthread here to do the listening and progress work
 	//I need to understand this better I don't want to create unecessary work for the client
-	if (pthread_create(&hvac_progress_tid, NULL, hvac_progress_fn, NULL) != 0){
-		L4C_FATAL("Failed to initialized mecury progress thread\n");
+	for (hvac_comm_ctx *ctx : hvac_contexts)
+	{
+		pthread_t hvac_progress_tid;
+		if (pthread_create(&hvac_progress_tid, NULL, hvac_progress_fn, ctx) != 0){
+			L4C_FATAL("Failed to initialized mecury progress thread\n");
+		}
+	}
+
+	/* Shared memory transport for co-located client / server pairs.
+	 * Optional - everything still works over the fabric without it. */
+	char *sm_env = getenv("HVAC_NODE_LOCAL_SM");
+	if (sm_env == NULL || atoi(sm_env) != 0)
+	{
+		hg_sm_class = HG_Init_opt("na+sm", listen, &hg_init_info);
+		if (hg_sm_class == NULL){
+			L4C_WARN("Failed to initialize na+sm class, node local traffic stays on the fabric");
+		}else
+		{
+			for (int i = 0; i < nr_contexts; i++)
+			{
+				hvac_comm_ctx *ctx = new hvac_comm_ctx();
+				pthread_t hvac_sm_progress_tid;
+				ctx->context = HG_Context_create_id(hg_sm_class, i);
+				ctx->sm = true;
+				ctx->triggered = 0;
+				if (ctx->context == NULL ||
+					pthread_create(&hvac_sm_progress_tid, NULL, hvac_progress_fn, ctx) != 0){
+					L4C_FATAL("Failed to initialize na+sm context / progress thread\n");
+				}
+				hvac_sm_contexts.push_back(ctx);
+			}
+			hg_sm_context = hvac_sm_contexts[0]->context;
+			L4C_INFO("na+sm initialized");
+		}
 	}
 
 }
@@ -99,22 +426,50 @@ void hvac_shutdown_comm()
 	return;
 }
 
+/* One of these runs per context, args is the hvac_comm_ctx to drive */
 void *hvac_progress_fn(void *args)
 {
 	hg_return_t ret;
 	unsigned int actual_count = 0;
+	hvac_comm_ctx *ctx = args ? (hvac_comm_ctx *)args : hvac_contexts[0];
+	hg_context_t *context = ctx->context;
 	while (!hvac_progress_thread_shutdown_flags){
 		do{
-			ret = HG_Trigger(hg_context, 0, 1, &actual_count);
+			ret = HG_Trigger(context, 0, 1, &actual_count);
+			if (ret == HG_SUCCESS && actual_count)
+				ctx->triggered.fetch_add(actual_count, std::memory_order_relaxed);
 		} while (
 			(ret == HG_SUCCESS) && actual_count && !hvac_progress_thread_shutdown_flags);
 		if (!hvac_progress_thread_shutdown_flags)
-			HG_Progress(hg_context, 100);
+		{
+			HG_Progress(context, 100);
+			tl_progress_ns = hvac_comm_now_ns();
+		}
 	}
 	
 	return NULL;
 }
 
+/* Identifies the node for the na+sm decision - clients compare this with
+ * the node_id a server posted in .ports.cfg */
+void hvac_comm_node_id(char *buf, size_t len)
+{
+	if (gethostname(buf, len) != 0)
+		snprintf(buf, len, "unknown");
+	buf[len - 1] = '\0';
+}
+
+/* Every live class an RPC has to be registered on. Mercury derives the
+ * id from the name so the id is the same on all of them. */
+static std::vector<hg_class_t *> hvac_comm_classes()
+{
+	std::vector<hg_class_t *> classes;
+	classes.push_back(hg_class);
+	if (hg_sm_class != NULL)
+		classes.push_back(hg_sm_class);
+	return classes;
+}
+
 /* I think only servers need to post their addresses. */
 /* There is an expectation that the server will be started in 
  * advance of the clients. Should the servers be started with an
@@ -135,6 +490,18 @@ void hvac_comm_list_addr()
     	HG_Addr_to_string(
         hg_class, self_addr_string, &self_addr_string_size, self_addr);
     	HG_Addr_free(hg_class, self_addr);
+
+	/* Clients on the same node switch to this address */
+	char sm_addr_string[PATH_MAX] = "-";
+	if (hg_sm_class != NULL){
+		hg_size_t sm_addr_string_size = PATH_MAX;
+		HG_Addr_self(hg_sm_class, &self_addr);
+		HG_Addr_to_string(hg_sm_class, sm_addr_string, &sm_addr_string_size, self_addr);
+		HG_Addr_free(hg_sm_class, self_addr);
+	}
+
+	char node_id[256];
+	hvac_comm_node_id(node_id, sizeof(node_id));
     
 
     /* Write addr to a file */
@@ -144,89 +511,685 @@ void hvac_comm_list_addr()
             filename);
         exit(0);
     }
-    fprintf(na_config, "%d %s\n", hvac_server_rank, self_addr_string);
+    /* rank fabric_addr node_id sm_addr - sm_addr is "-" without na+sm */
+    fprintf(na_config, "%d %s %s %s\n", hvac_server_rank, self_addr_string, node_id, sm_addr_string);
     fclose(na_config);
 }
 
 
 
-/* callback triggered upon completion of bulk transfer */
-static hg_return_t
-hvac_rpc_handler_bulk_cb(const struct hg_cb_info *info)
+static hg_return_t hvac_rpc_handler_bulk_cb(const struct hg_cb_info *info);
+struct hvac_stripe_fd;
+static void hvac_stripe_put(struct hvac_stripe_fd *sfd);
+
+/* Reply to the client once nothing is left in flight and free everything */
+static void
+hvac_rpc_finish(struct hvac_rpc_state *hvac_rpc_state_p)
 {
-    HVAC_TIMING("HvacComm_(hvac_rpc_handler_bulk_cb)_total");
-    struct hvac_rpc_state *hvac_rpc_state_p = (struct hvac_rpc_state*)info->arg;
     int ret;
     hvac_rpc_out_t out;
-    out.ret = hvac_rpc_state_p->size;
 
-    assert(info->ret == 0);
+    if (hvac_rpc_state_p->fd_held)
+        hvac_fd_release(hvac_rpc_state_p->fd);
+
+    /* Chunks cover the request in order up to next_offset and every one
+     * below limit was read in full and pushed. Partial data wins over a
+     * late error, the client sees a short read. */
+    hg_size_t end = hvac_rpc_state_p->limit < hvac_rpc_state_p->next_offset ? hvac_rpc_state_p->limit
+                                                                             : hvac_rpc_state_p->next_offset;
+    if (end == 0 && hvac_rpc_state_p->read_failed)
+        out.ret = -1;
+    else
+        out.ret = end;
+    /* Time spent neither reading nor pushing - chunks waiting for an I/O
+     * thread - is queueing too. Chunks overlap, so storage and push may
+     * add up to more than the request took. */
+    uint64_t wall = hvac_comm_now_ns() - hvac_rpc_state_p->start_ns;
+    uint64_t busy = hvac_rpc_state_p->storage_ns + hvac_rpc_state_p->push_ns;
+    out.queue_ns = hvac_rpc_state_p->queue_ns + (wall > busy ? wall - busy : 0);
+    out.storage_ns = hvac_rpc_state_p->storage_ns;
+    out.push_ns = hvac_rpc_state_p->push_ns;
+    srv_counters.reads++;
+    if (hvac_rpc_state_p->cached) {
+        srv_counters.reads_cached++;
+        srv_counters.bytes_cached += end;
+    } else {
+        srv_counters.bytes_pfs += end;
+    }
+    if (out.ret < 0)
+        srv_counters.read_errors++;
+    srv_counters.active_reads--;
+    {
+        static const uint32_t tag = hvac::intern_tag("HvacComm_(request)_service");
+        hvac::record_duration(tag, hvac_comm_now_ns() - hvac_rpc_state_p->start_ns);
+    }
+    L4C_DEBUG("Server Rank %d : req %016lx done, %d bytes, queue %lu ns, storage %lu ns, push %lu ns", server_rank,
+              hvac_rpc_state_p->req_id, out.ret, out.queue_ns, out.storage_ns, out.push_ns);
 
     ret = HG_Respond(hvac_rpc_state_p->handle, NULL, NULL, &out);
-    assert(ret == HG_SUCCESS);        
+    assert(ret == HG_SUCCESS);
+    (void) ret;
 
-    HG_Bulk_free(hvac_rpc_state_p->bulk_handle);
-    L4C_INFO("Info Server: Freeing Bulk Handle\n");
+    if (hvac_rpc_state_p->stripe != NULL)
+        hvac_stripe_put(hvac_rpc_state_p->stripe);
+    HG_Free_input(hvac_rpc_state_p->handle, &hvac_rpc_state_p->in);  // same address as stripe_in
     HG_Destroy(hvac_rpc_state_p->handle);
-    free(hvac_rpc_state_p->buffer);
+    pthread_mutex_destroy(&hvac_rpc_state_p->lock);
     free(hvac_rpc_state_p);
+}
+
+static void
+hvac_rpc_chunk_free(struct hvac_rpc_chunk *chunk)
+{
+    HG_Bulk_free(chunk->bulk_handle);
+    L4C_INFO("Info Server: Freeing Bulk Handle\n");
+    free(chunk->buffer);
+    free(chunk);
+}
+
+/* Fill buf with the next want bytes of a vectored read. Small extents
+ * share a chunk so they go out in one bulk push. A short read ends the
+ * whole request, the client only gets the contiguous prefix. */
+static ssize_t
+hvac_rpc_extents_read(struct hvac_rpc_state *hvac_rpc_state_p, char *buf, hg_size_t want)
+{
+    hvac_extent_list_t *ext = hvac_rpc_state_p->extents;
+    hg_size_t got = 0;
+
+    while (got < want && hvac_rpc_state_p->ext_index < ext->count) {
+        uint32_t i = hvac_rpc_state_p->ext_index;
+        hg_size_t left = ext->lengths[i] - hvac_rpc_state_p->ext_done;
+        hg_size_t n = left < want - got ? left : want - got;
+        ssize_t r;
+
+        if (ext->offsets[i] == -1)
+            r = read(hvac_rpc_state_p->fd, buf + got, n);
+        else
+            r = pread(hvac_rpc_state_p->fd, buf + got, n, ext->offsets[i] + hvac_rpc_state_p->ext_done);
+        if (r < 0)
+            return got ? (ssize_t)got : -1;
+
+        got += r;
+        hvac_rpc_state_p->ext_done += r;
+        if ((hg_size_t)r < n) {
+            hvac_rpc_state_p->ext_index = ext->count;
+            break;
+        }
+        if (hvac_rpc_state_p->ext_done == (hg_size_t)ext->lengths[i]) {
+            hvac_rpc_state_p->ext_index++;
+            hvac_rpc_state_p->ext_done = 0;
+        }
+    }
+    return got;
+}
+
+/* Drop a chunk the request has no more use for. The last one answers. */
+static void
+hvac_rpc_chunk_retire(struct hvac_rpc_chunk *chunk)
+{
+    struct hvac_rpc_state *hvac_rpc_state_p = chunk->rpc_state;
+
+    hvac_rpc_chunk_free(chunk);
+    pthread_mutex_lock(&hvac_rpc_state_p->lock);
+    bool last = (--hvac_rpc_state_p->slots == 0);
+    pthread_mutex_unlock(&hvac_rpc_state_p->lock);
+    if (last)
+        hvac_rpc_finish(hvac_rpc_state_p);
+}
+
+/* A push failed: the client cancelled it or went away. Nothing from this
+ * chunk on reaches the client, the reply covers what came before it. */
+static void
+hvac_rpc_chunk_failed(struct hvac_rpc_chunk *chunk, hg_return_t ret)
+{
+    struct hvac_rpc_state *hvac_rpc_state_p = chunk->rpc_state;
+
+    L4C_WARN("Server Rank %d : req %016lx push at %lu failed: %d", server_rank, hvac_rpc_state_p->req_id,
+             (unsigned long)chunk->origin_offset, (int)ret);
+    pthread_mutex_lock(&hvac_rpc_state_p->lock);
+    hvac_rpc_state_p->read_failed = true;
+    if (chunk->origin_offset < hvac_rpc_state_p->limit)
+        hvac_rpc_state_p->limit = chunk->origin_offset;
+    hvac_rpc_state_p->done_reading = true;
+    hvac_rpc_state_p->inflight--;
+    srv_counters.inflight_chunks--;
+    pthread_mutex_unlock(&hvac_rpc_state_p->lock);
+    hvac_rpc_chunk_retire(chunk);
+}
+
+/* Read the next piece of the request into chunk and start pushing it,
+ * or retire the chunk if there is nothing left to read. Runs on an I/O
+ * thread; chunks of one request may be read concurrently.
+ */
+static void
+hvac_rpc_chunk_issue(struct hvac_rpc_chunk *chunk)
+{
+    HVAC_TIMING("HvacComm_(hvac_rpc_chunk_issue)_total");
+    struct hvac_rpc_state *hvac_rpc_state_p = chunk->rpc_state;
+    const struct hg_info *hgi = HG_Get_info(hvac_rpc_state_p->handle);
+    hg_size_t want, at;
+    ssize_t readbytes;
+    int ret;
+
+    pthread_mutex_lock(&hvac_rpc_state_p->lock);
+    if (hvac_rpc_state_p->done_reading) {
+        pthread_mutex_unlock(&hvac_rpc_state_p->lock);
+        hvac_rpc_chunk_retire(chunk);
+        return;
+    }
+
+    want = hvac_rpc_state_p->size - hvac_rpc_state_p->next_offset;
+    if (want > chunk->capacity)
+        want = chunk->capacity;
+    at = hvac_rpc_state_p->next_offset;
+    hvac_rpc_state_p->next_offset += want;
+    if (hvac_rpc_state_p->next_offset >= hvac_rpc_state_p->size)
+        hvac_rpc_state_p->done_reading = true;
+
+    /* offset -1 continues from the server side file position and extents
+     * are walked in order, so those reads stay under the lock; positional
+     * reads of separate chunks go to disk in parallel */
+    uint64_t read_start = hvac_comm_now_ns();
+    if (hvac_rpc_state_p->extents != NULL){
+        readbytes = hvac_rpc_extents_read(hvac_rpc_state_p, (char *)chunk->buffer, want);
+        L4C_DEBUG("Server Rank %d : Gathered %ld bytes from fd %d", server_rank, readbytes, hvac_rpc_state_p->fd);
+    }else if (hvac_rpc_state_p->offset == -1){
+        readbytes = read(hvac_rpc_state_p->fd, chunk->buffer, want);
+        L4C_DEBUG("Server Rank %d : Read %ld bytes from fd %d", server_rank,readbytes, hvac_rpc_state_p->fd);
+    }else
+    {
+        off_t offset = hvac_rpc_state_p->offset + at;
+        pthread_mutex_unlock(&hvac_rpc_state_p->lock);
+        readbytes = pread(hvac_rpc_state_p->fd, chunk->buffer, want, offset);
+        L4C_DEBUG("Server Rank %d : PRead %ld bytes from fd %d at offset %ld", server_rank,readbytes, hvac_rpc_state_p->fd, offset);
+        pthread_mutex_lock(&hvac_rpc_state_p->lock);
+    }
+    hvac_rpc_state_p->storage_ns += hvac_comm_now_ns() - read_start;
+
+    if (readbytes < 0) {
+        hvac_rpc_state_p->read_failed = true;
+        readbytes = 0;
+    }
+    if ((hg_size_t)readbytes < want) {
+        if (at + readbytes < hvac_rpc_state_p->limit)
+            hvac_rpc_state_p->limit = at + readbytes;
+        hvac_rpc_state_p->done_reading = true;
+    }
+    // An earlier chunk may have hit the end of the file meanwhile
+    chunk->len = at < hvac_rpc_state_p->limit ? hvac_rpc_state_p->limit - at : 0;
+    if (chunk->len > (hg_size_t)readbytes)
+        chunk->len = readbytes;
+    chunk->origin_offset = at;
+    if (chunk->len == 0) {
+        pthread_mutex_unlock(&hvac_rpc_state_p->lock);
+        hvac_rpc_chunk_retire(chunk);
+        return;
+    }
+    hvac_rpc_state_p->inflight++;
+    srv_counters.inflight_chunks++;
+    pthread_mutex_unlock(&hvac_rpc_state_p->lock);
+
+    /* initiate bulk transfer from server to client */
+    chunk->push_start = hvac_comm_now_ns();
+    ret = HG_Bulk_transfer(hgi->context, hvac_rpc_handler_bulk_cb, chunk,
+        HG_BULK_PUSH, hgi->addr, hvac_rpc_state_p->origin_bulk, chunk->origin_offset,
+        chunk->bulk_handle, 0, chunk->len, HG_OP_ID_IGNORE);
+    if (ret != HG_SUCCESS)
+        hvac_rpc_chunk_failed(chunk, (hg_return_t)ret);
+}
+
+/* callback triggered upon completion of bulk transfer */
+static hg_return_t
+hvac_rpc_handler_bulk_cb(const struct hg_cb_info *info)
+{
+    HVAC_TIMING("HvacComm_(hvac_rpc_handler_bulk_cb)_total");
+    struct hvac_rpc_chunk *chunk = (struct hvac_rpc_chunk*)info->arg;
+    struct hvac_rpc_state *hvac_rpc_state_p = chunk->rpc_state;
+
+    if (info->ret != HG_SUCCESS) {
+        hvac_rpc_chunk_failed(chunk, info->ret);
+        return HG_SUCCESS;
+    }
+
+    pthread_mutex_lock(&hvac_rpc_state_p->lock);
+    hvac_rpc_state_p->push_ns += hvac_comm_now_ns() - chunk->push_start;
+    hvac_rpc_state_p->inflight--;
+    srv_counters.inflight_chunks--;
+    pthread_mutex_unlock(&hvac_rpc_state_p->lock);
+
+    /* Recycle the slot for the next chunk, or retire it */
+    hvac_io_submit([chunk] { hvac_rpc_chunk_issue(chunk); });
+
     return (hg_return_t)0;
 }
 
 
 
+/* Prime the chunk pipeline for a decoded request. Either answers right
+ * away or leaves the reply to whichever chunk retires last.
+ */
+static void
+hvac_rpc_start_pipeline(struct hvac_rpc_state *hvac_rpc_state_p)
+{
+    int ret;
+    const struct hg_info *hgi;
+    hg_size_t chunk_size;
+    int depth;
+
+    hgi = HG_Get_info(hvac_rpc_state_p->handle);
+    assert(hgi);
+    srv_counters.active_reads++;
+    pthread_mutex_init(&hvac_rpc_state_p->lock, NULL);
+    hvac_rpc_state_p->limit = hvac_rpc_state_p->size;
+
+    chunk_size = hvac_rpc_state_p->size < hvac_bulk_chunk_size ? hvac_rpc_state_p->size : hvac_bulk_chunk_size;
+    depth = chunk_size ? (hvac_rpc_state_p->size + chunk_size - 1) / chunk_size : 0;
+    if (depth > hvac_bulk_pipeline_depth)
+        depth = hvac_bulk_pipeline_depth;
+    if (hvac_rpc_state_p->fd < 0) {
+        hvac_rpc_state_p->read_failed = true;
+        depth = 0;
+    }
+
+    /* Nothing to push (EOF or read error) - answer right away */
+    if (depth == 0) {
+        hvac_rpc_finish(hvac_rpc_state_p);
+        return;
+    }
+
+    /* Each slot owns a buffer registered for bulk access */
+    hvac_rpc_state_p->slots = depth;
+    for (int i = 0; i < depth; i++) {
+        struct hvac_rpc_chunk *chunk = (struct hvac_rpc_chunk*)malloc(sizeof(*chunk));
+        chunk->rpc_state = hvac_rpc_state_p;
+        chunk->capacity = chunk_size;
+        chunk->buffer = malloc(chunk_size);
+        assert(chunk->buffer);
+
+        ret = HG_Bulk_create(hgi->hg_class, 1, &chunk->buffer,
+            &chunk->capacity, HG_BULK_READ_ONLY, &chunk->bulk_handle);
+        assert(ret == 0);
+        (void) ret;
+
+        hvac_io_submit([chunk] { hvac_rpc_chunk_issue(chunk); });
+    }
+}
+
 static hg_return_t
 hvac_rpc_handler(hg_handle_t handle)
 {
     HVAC_TIMING("HvacComm_(hvac_rpc_handler)_total");
-    int ret;
     struct hvac_rpc_state *hvac_rpc_state_p;
-    const struct hg_info *hgi;
-    ssize_t readbytes;
 
-    hvac_rpc_state_p = (struct hvac_rpc_state*)malloc(sizeof(*hvac_rpc_state_p));
+    hvac_rpc_state_p = (struct hvac_rpc_state*)calloc(1, sizeof(*hvac_rpc_state_p));
+    hvac_rpc_state_p->start_ns = hvac_comm_now_ns();
+    hvac_rpc_state_p->queue_ns = hvac_comm_queue_wait(hvac_rpc_state_p->start_ns);
 
     /* decode input */
     HG_Get_input(handle, &hvac_rpc_state_p->in);   
-    
-    /* This includes allocating a target buffer for bulk transfer */
-    hvac_rpc_state_p->buffer = calloc(1, hvac_rpc_state_p->in.input_val);
-    assert(hvac_rpc_state_p->buffer);
 
     hvac_rpc_state_p->size = hvac_rpc_state_p->in.input_val;
+    hvac_rpc_state_p->fd = hvac_rpc_state_p->in.accessfd;
+    hvac_rpc_state_p->offset = hvac_rpc_state_p->in.offset;
+    hvac_rpc_state_p->origin_bulk = hvac_rpc_state_p->in.bulk_handle;
+    hvac_rpc_state_p->req_id = hvac_rpc_state_p->in.req_id;
+    hvac_rpc_state_p->cached = hvac_fd_is_cached(hvac_rpc_state_p->fd);
     hvac_rpc_state_p->handle = handle;
+    if (hvac_rpc_state_p->fd >= 0) {
+        hvac_fd_hold(hvac_rpc_state_p->fd);
+        hvac_rpc_state_p->fd_held = true;
+    }
 
-    /* register local target buffer for bulk access */
+    hvac_rpc_start_pipeline(hvac_rpc_state_p);
 
-    hgi = HG_Get_info(handle);
-    assert(hgi);
-    ret = HG_Bulk_create(hgi->hg_class, 1, &hvac_rpc_state_p->buffer,
-        &hvac_rpc_state_p->size, HG_BULK_READ_ONLY,
-        &hvac_rpc_state_p->bulk_handle);
-    assert(ret == 0);
+    return HG_SUCCESS;
+}
+
+static hg_return_t
+hvac_readv_rpc_handler(hg_handle_t handle)
+{
+    HVAC_TIMING("HvacComm_(hvac_readv_rpc_handler)_total");
+    struct hvac_rpc_state *hvac_rpc_state_p;
+
+    hvac_rpc_state_p = (struct hvac_rpc_state*)calloc(1, sizeof(*hvac_rpc_state_p));
+    hvac_rpc_state_p->start_ns = hvac_comm_now_ns();
+    hvac_rpc_state_p->queue_ns = hvac_comm_queue_wait(hvac_rpc_state_p->start_ns);
+
+    /* decode input - fails for more extents than the proc accepts */
+    if (HG_Get_input(handle, &hvac_rpc_state_p->readv_in) != HG_SUCCESS) {
+        hvac_rpc_out_t out;
+        L4C_ERR("Server Rank %d : Failed to decode readv request", server_rank);
+        memset(&out, 0, sizeof(out));
+        out.ret = -1;
+        HG_Respond(handle, NULL, NULL, &out);
+        HG_Destroy(handle);
+        free(hvac_rpc_state_p);
+        return HG_SUCCESS;
+    }
+
+    hvac_rpc_state_p->extents = &hvac_rpc_state_p->readv_in.extents;
+    for (uint32_t i = 0; i < hvac_rpc_state_p->extents->count; i++) {
+        if (hvac_rpc_state_p->extents->lengths[i] < 0)
+            hvac_rpc_state_p->extents->lengths[i] = 0;
+        hvac_rpc_state_p->size += hvac_rpc_state_p->extents->lengths[i];
+    }
+    hvac_rpc_state_p->fd = hvac_rpc_state_p->readv_in.accessfd;
+    hvac_rpc_state_p->origin_bulk = hvac_rpc_state_p->readv_in.bulk_handle;
+    hvac_rpc_state_p->req_id = hvac_rpc_state_p->readv_in.req_id;
+    hvac_rpc_state_p->cached = hvac_fd_is_cached(hvac_rpc_state_p->fd);
+    hvac_rpc_state_p->handle = handle;
+    if (hvac_rpc_state_p->fd >= 0) {
+        hvac_fd_hold(hvac_rpc_state_p->fd);
+        hvac_rpc_state_p->fd_held = true;
+    }
+
+    hvac_rpc_start_pipeline(hvac_rpc_state_p);
+
+    return HG_SUCCESS;
+}
+
+static void
+hvac_meta_append(std::string &data, const struct stat *st, const char *name, uint8_t d_type)
+{
+    struct hvac_meta_rec rec;
+    size_t name_len = strlen(name);
+    size_t at = data.size();
+
+    hvac_meta_rec_from_stat(&rec, st);
+    rec.name_len = name_len;
+    rec.d_type = d_type;
+    data.resize(at + HVAC_META_REC_SIZE(name_len), '\0');
+    memcpy(&data[at], &rec, sizeof(rec));
+    memcpy(&data[at + sizeof(rec)], name, name_len);
+}
+
+static std::shared_ptr<const struct hvac_dir_snapshot>
+hvac_meta_build_snapshot(const string &path)
+{
+    HVAC_TIMING("HvacComm_(hvac_meta_build_snapshot)_total");
+    auto snap = std::make_shared<struct hvac_dir_snapshot>();
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    snap->taken = now.tv_sec;
+    snap->gen = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    memset(&snap->mtime, 0, sizeof(snap->mtime));
+    dir = opendir(path.c_str());
+    if (dir == NULL) {
+        snap->ret = -errno;
+        return snap;
+    }
+    snap->ret = 0;
+    if (fstat(dirfd(dir), &st) == 0) {
+        snap->mtime = st.st_mtim;
+        hvac_meta_append(snap->data, &st, ".", DT_DIR);
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        // Some file systems leave d_type unknown, the lstat knows better
+        hvac_meta_append(snap->data, &st, de->d_name, IFTODT(st.st_mode));
+    }
+    closedir(dir);
+    L4C_INFO("Server Rank %d : Snapshot of %s, %zu bytes", server_rank, path.c_str(), snap->data.size());
+    return snap;
+}
+
+/* Current snapshot of path, listing the directory again if it is stale */
+static std::shared_ptr<const struct hvac_dir_snapshot>
+hvac_meta_get_snapshot(const string &path)
+{
+    std::shared_ptr<struct hvac_dir_slot> slot;
+    time_t now = time(NULL);
 
-    if (hvac_rpc_state_p->in.offset == -1){
-        readbytes = read(hvac_rpc_state_p->in.accessfd, hvac_rpc_state_p->buffer, hvac_rpc_state_p->size);
-        L4C_DEBUG("Server Rank %d : Read %ld bytes from file %s", server_rank,readbytes, fd_to_path[hvac_rpc_state_p->in.accessfd].c_str());
-    }else
     {
-        readbytes = pread(hvac_rpc_state_p->in.accessfd, hvac_rpc_state_p->buffer, hvac_rpc_state_p->size, hvac_rpc_state_p->in.offset);
-        L4C_DEBUG("Server Rank %d : PRead %ld bytes from file %s at offset %ld", server_rank,readbytes, fd_to_path[hvac_rpc_state_p->in.accessfd].c_str(),hvac_rpc_state_p->in.offset );
+        std::lock_guard<std::mutex> guard(dir_snapshots_mutex);
+        auto it = dir_snapshots.find(path);
+        if (it == dir_snapshots.end()) {
+            if (dir_snapshots.size() >= HVAC_DIR_SNAPSHOT_MAX) {
+                auto lru = dir_snapshots.begin();
+                for (auto i = dir_snapshots.begin(); i != dir_snapshots.end(); ++i)
+                    if (i->second->last_used < lru->second->last_used)
+                        lru = i;
+                dir_snapshots.erase(lru);
+            }
+            it = dir_snapshots.emplace(path, std::make_shared<struct hvac_dir_slot>()).first;
+            it->second->checked = 0;
+        }
+        slot = it->second;
+        slot->last_used = now;
     }
 
-    //Reduce size of transfer to what was actually read 
-    //We may need to revisit this.
-    hvac_rpc_state_p->size = readbytes;
+    std::lock_guard<std::mutex> guard(slot->build_lock);
+    if (!slot->snap || now - slot->snap->taken >= hvac_meta_ttl) {
+        slot->snap = hvac_meta_build_snapshot(path);
+        slot->checked = now;
+    } else if (now != slot->checked) {
+        /* Entries added, removed or renamed since the listing - look at
+         * the directory at most once a second however many ranks ask */
+        struct stat st;
+        slot->checked = now;
+        if (stat(path.c_str(), &st) != 0 || st.st_mtim.tv_sec != slot->snap->mtime.tv_sec ||
+            st.st_mtim.tv_nsec != slot->snap->mtime.tv_nsec)
+            slot->snap = hvac_meta_build_snapshot(path);
+    }
+    return slot->snap;
+}
 
-    /* initiate bulk transfer from client to server */
-    ret = HG_Bulk_transfer(hgi->context, hvac_rpc_handler_bulk_cb, hvac_rpc_state_p,
-        HG_BULK_PUSH, hgi->addr, hvac_rpc_state_p->in.bulk_handle, 0,
-        hvac_rpc_state_p->bulk_handle, 0, hvac_rpc_state_p->size, HG_OP_ID_IGNORE);
-    
-    assert(ret == 0);
+struct hvac_dir_snapshot_state {
+    hg_handle_t handle;
+    hvac_dir_snapshot_in_t in;      // holds the client bulk handle until we respond
+    std::shared_ptr<const struct hvac_dir_snapshot> snap;  // pinned until the push is done
+    hg_bulk_t bulk_handle;
+    hvac_dir_snapshot_out_t out;
+};
+
+static void
+hvac_dir_snapshot_done(struct hvac_dir_snapshot_state *state)
+{
+    HG_Respond(state->handle, NULL, NULL, &state->out);
+    HG_Free_input(state->handle, &state->in);
+    HG_Destroy(state->handle);
+    delete state;
+}
+
+static hg_return_t
+hvac_dir_snapshot_bulk_cb(const struct hg_cb_info *info)
+{
+    struct hvac_dir_snapshot_state *state = (struct hvac_dir_snapshot_state *)info->arg;
+
+    if (info->ret != HG_SUCCESS) {
+        state->out.ret = -EIO;
+        state->out.used = 0;
+    }
+    HG_Bulk_free(state->bulk_handle);
+    hvac_dir_snapshot_done(state);
+    return HG_SUCCESS;
+}
+
+// On an I/O thread: list the directory if needed, then push or reply
+static void
+hvac_dir_snapshot_serve(struct hvac_dir_snapshot_state *state)
+{
+    const struct hg_info *hgi = HG_Get_info(state->handle);
+    hvac_dir_snapshot_out_t &out = state->out;
+
+    state->snap = hvac_meta_get_snapshot(state->in.path);
+    const struct hvac_dir_snapshot &snap = *state->snap;
+    out.ret = snap.ret;
+    out.gen = snap.gen;
+    out.needed = snap.data.size();
+    out.used = 0;
+    if (snap.ret == 0 && state->in.have_gen == snap.gen)
+        out.needed = 0;     // the client's copy is current
+    if (snap.ret != 0 || snap.data.empty() || out.needed == 0 || out.needed > state->in.capacity) {
+        hvac_dir_snapshot_done(state);
+        return;
+    }
+
+    void *buffer = (void *)snap.data.data();
+    hg_size_t size = snap.data.size();
+    out.used = size;
+    int ret = HG_Bulk_create(hgi->hg_class, 1, &buffer, &size, HG_BULK_READ_ONLY, &state->bulk_handle);
+    assert(ret == HG_SUCCESS);
+    ret = HG_Bulk_transfer(hgi->context, hvac_dir_snapshot_bulk_cb, state, HG_BULK_PUSH, hgi->addr,
+                           state->in.bulk_handle, 0, state->bulk_handle, 0, size, HG_OP_ID_IGNORE);
+    assert(ret == HG_SUCCESS);
     (void) ret;
+}
 
-    return (hg_return_t)ret;
+static hg_return_t
+hvac_dir_snapshot_rpc_handler(hg_handle_t handle)
+{
+    HVAC_TIMING("HvacComm_(hvac_dir_snapshot_rpc_handler)_total");
+    struct hvac_dir_snapshot_state *state = new hvac_dir_snapshot_state();
+    int ret = HG_Get_input(handle, &state->in);
+    assert(ret == HG_SUCCESS);
+    (void) ret;
+
+    state->handle = handle;
+    hvac_io_submit([state] { hvac_dir_snapshot_serve(state); });
+    return HG_SUCCESS;
+}
+
+/* Block reads of striped files are addressed by path since the client
+ * never opened the file on this server. One entry per path keeps the PFS
+ * fd and, once anything is staged, an fd on the local copy. A block owner
+ * only stages the ranges it is asked for (hvac_stage_range); a whole-file
+ * copy made by the file's home server wins when there is one. Entries
+ * nobody has read from for hvac_stripe_idle_secs are closed.
+ */
+struct hvac_stripe_fd {
+    int fd;                 // on the PFS
+    int copy_fd;            // on the staged copy, -1 until there is one
+    bool whole;             // copy_fd is a full copy, not a sparse one
+    int users;              // requests reading through this entry
+    time_t last_used;
+    std::set<std::pair<uint64_t, uint64_t>> requested;     // ranges sent to the mover
+};
+static std::mutex stripe_fd_mutex;
+static map<string, struct hvac_stripe_fd> stripe_fd_map;
+
+static void
+hvac_stripe_close_idle(time_t now)
+{
+    static time_t last_sweep = 0;
+
+    if (now - last_sweep < hvac_stripe_idle_secs / 4 + 1)
+        return;
+    last_sweep = now;
+    for (auto it = stripe_fd_map.begin(); it != stripe_fd_map.end(); ) {
+        if (it->second.users == 0 && now - it->second.last_used >= hvac_stripe_idle_secs) {
+            close(it->second.fd);
+            if (it->second.copy_fd >= 0)
+                close(it->second.copy_fd);
+            it = stripe_fd_map.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/* The fd to serve [offset, offset + length) of path from. The entry is
+ * held until hvac_stripe_put. Returns -1 if the file can't be opened. */
+static int
+hvac_stripe_get_fd(const string &path, uint64_t offset, uint64_t length, bool *cached,
+                   struct hvac_stripe_fd **held)
+{
+    std::lock_guard<std::mutex> lk(stripe_fd_mutex);
+    time_t now = time(NULL);
+    string copy;
+
+    hvac_stripe_close_idle(now);
+    *held = NULL;
+    auto it = stripe_fd_map.find(path);
+    if (it == stripe_fd_map.end()) {
+        struct hvac_stripe_fd sfd;
+        sfd.fd = open(path.c_str(), O_RDONLY);
+        if (sfd.fd < 0) {
+            L4C_ERR("Server Rank %d : Failed to open striped file %s", server_rank, path.c_str());
+            return -1;
+        }
+        sfd.copy_fd = -1;
+        sfd.whole = false;
+        sfd.users = 0;
+        it = stripe_fd_map.emplace(path, sfd).first;
+    }
+    struct hvac_stripe_fd &sfd = it->second;
+    sfd.users++;
+    sfd.last_used = now;
+    *held = &sfd;
+
+    // The home server's full copy, or a sparse copy that has this range
+    if (!sfd.whole && hvac_cached_copy(path, &copy)) {
+        int fd = open(copy.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            if (sfd.copy_fd >= 0)
+                close(sfd.copy_fd);
+            sfd.copy_fd = fd;
+            sfd.whole = true;
+            sfd.requested.clear();
+        }
+    }
+    if (sfd.whole) {
+        *cached = true;
+        return sfd.copy_fd;
+    }
+    if (hvac_cached_range(path, offset, length, &copy)) {
+        if (sfd.copy_fd < 0)
+            sfd.copy_fd = open(copy.c_str(), O_RDONLY);
+        if (sfd.copy_fd >= 0) {
+            *cached = true;
+            return sfd.copy_fd;
+        }
+    }
+
+    // Not staged yet - serve from the PFS and stage just this range
+    *cached = false;
+    if (sfd.requested.insert(std::make_pair(offset, length)).second) {
+        L4C_INFO("Caching %s at %lu+%lu", path.c_str(), offset, length);
+        hvac_stage_range(path, offset, length);
+    }
+    return sfd.fd;
+}
+
+static void
+hvac_stripe_put(struct hvac_stripe_fd *sfd)
+{
+    std::lock_guard<std::mutex> lk(stripe_fd_mutex);
+    sfd->users--;
+}
+
+static hg_return_t
+hvac_stripe_read_rpc_handler(hg_handle_t handle)
+{
+    HVAC_TIMING("HvacComm_(hvac_stripe_read_rpc_handler)_total");
+    struct hvac_rpc_state *hvac_rpc_state_p;
+
+    hvac_rpc_state_p = (struct hvac_rpc_state*)calloc(1, sizeof(*hvac_rpc_state_p));
+    hvac_rpc_state_p->start_ns = hvac_comm_now_ns();
+    hvac_rpc_state_p->queue_ns = hvac_comm_queue_wait(hvac_rpc_state_p->start_ns);
+
+    /* decode input */
+    HG_Get_input(handle, &hvac_rpc_state_p->stripe_in);
+
+    hvac_rpc_state_p->size = hvac_rpc_state_p->stripe_in.length;
+    hvac_rpc_state_p->fd = hvac_stripe_get_fd(hvac_rpc_state_p->stripe_in.path, hvac_rpc_state_p->stripe_in.offset,
+                                              hvac_rpc_state_p->stripe_in.length, &hvac_rpc_state_p->cached,
+                                              &hvac_rpc_state_p->stripe);
+    hvac_rpc_state_p->offset = hvac_rpc_state_p->stripe_in.offset;
+    hvac_rpc_state_p->origin_bulk = hvac_rpc_state_p->stripe_in.bulk_handle;
+    hvac_rpc_state_p->req_id = hvac_rpc_state_p->stripe_in.req_id;
+    hvac_rpc_state_p->handle = handle;
+
+    hvac_rpc_start_pipeline(hvac_rpc_state_p);
+
+    return HG_SUCCESS;
 }
 
 
@@ -238,17 +1201,36 @@ hvac_open_rpc_handler(hg_handle_t handle)
     HVAC_TIMING("HvacComm_(hvac_open_rpc_handler)_total");
     hvac_open_in_t in;
     hvac_open_out_t out;    
+    uint64_t start = hvac_comm_now_ns();
+    out.queue_ns = hvac_comm_queue_wait(start);
     int ret = HG_Get_input(handle, &in);
     assert(ret == 0);
     string redir_path = in.path;
-    if (path_cache_map.find(redir_path) != path_cache_map.end())
+    string copy;
+    bool cached = false;
+    if (hvac_cached_copy(redir_path, &copy))
     {
-        L4C_INFO("Server Rank %d : Successful Redirection %s to %s", server_rank, redir_path.c_str(), path_cache_map[redir_path].c_str());
-        redir_path = path_cache_map[redir_path];
+        cached = true;
+        L4C_INFO("Server Rank %d : Successful Redirection %s to %s", server_rank, redir_path.c_str(), copy.c_str());
+        redir_path = copy;
     }
-    L4C_INFO("Server Rank %d : Successful Open %s", server_rank, in.path);    
+    L4C_INFO("Server Rank %d : Successful Open %s (req %016lx)", server_rank, in.path, in.req_id);
+    uint64_t open_start = hvac_comm_now_ns();
     out.ret_status = open(redir_path.c_str(),O_RDONLY);  
-    fd_to_path[out.ret_status] = in.path;  
+    out.storage_ns = hvac_comm_now_ns() - open_start;
+    srv_counters.opens++;
+    if (out.ret_status < 0) {
+        srv_counters.open_errors++;
+    } else if (cached) {
+        srv_counters.opens_cached++;
+        std::lock_guard<std::mutex> lk(cached_fds_mutex);
+        cached_fds.insert(out.ret_status);
+    }
+    if (out.ret_status >= 0) {
+        pthread_mutex_lock(&fd_to_path_mutex);
+        fd_to_path[out.ret_status] = in.path;
+        pthread_mutex_unlock(&fd_to_path_mutex);
+    }
     HG_Respond(handle,NULL,NULL,&out);
 
     return (hg_return_t)ret;
@@ -264,86 +1246,114 @@ hvac_close_rpc_handler(hg_handle_t handle)
     assert(ret == HG_SUCCESS);
 
     L4C_INFO("Closing File %d\n",in.fd);
-    ret = close(in.fd);
+    {
+        std::lock_guard<std::mutex> lk(cached_fds_mutex);
+        cached_fds.erase(in.fd);
+    }
+
+    /* Take the path out before the fd number can be reused by an open on
+     * the other progress thread */
+    string path;
+    bool known = false;
+    pthread_mutex_lock(&fd_to_path_mutex);
+    auto it = fd_to_path.find(in.fd);
+    if (it != fd_to_path.end()) {
+        path = it->second;
+        known = true;
+        fd_to_path.erase(it);
+    }
+    pthread_mutex_unlock(&fd_to_path_mutex);
+
+    ret = hvac_fd_close(in.fd);
     assert(ret == 0);
 
     //Signal to the data mover to copy the file
-    if (path_cache_map.find(fd_to_path[in.fd]) == path_cache_map.end())
+    string copy;
+    if (known && !hvac_cached_copy(path, &copy))
     {
-        L4C_INFO("Caching %s",fd_to_path[in.fd].c_str());
-        pthread_mutex_lock(&data_mutex);
-        data_queue.push(fd_to_path[in.fd]);
-        pthread_cond_signal(&data_cond);
-        pthread_mutex_unlock(&data_mutex);
-    }   
-
-	fd_to_path.erase(in.fd);
+        L4C_INFO("Caching %s",path.c_str());
+        hvac_stage_file(path);
+    }
+
     return (hg_return_t)ret;
 }
 
-static hg_return_t
-hvac_seek_rpc_handler(hg_handle_t handle)
+/* register this particular rpc type with Mercury */
+hg_id_t
+hvac_rpc_register(void)
 {
-    hvac_seek_in_t in;
-    hvac_seek_out_t out;    
-    int ret = HG_Get_input(handle, &in);
-    assert(ret == 0);
-
-    out.ret = lseek64(in.fd, in.offset, in.whence);
+    hg_id_t tmp = 0;
 
-    HG_Respond(handle,NULL,NULL,&out);
+    for (hg_class_t *cls : hvac_comm_classes())
+        tmp = MERCURY_REGISTER(
+            cls, "hvac_base_rpc", hvac_rpc_in_t, hvac_rpc_out_t, hvac_rpc_handler);
 
-    return (hg_return_t)ret;
+    return tmp;
 }
 
-
-/* register this particular rpc type with Mercury */
 hg_id_t
-hvac_rpc_register(void)
+hvac_dir_snapshot_rpc_register(void)
 {
-    hg_id_t tmp;
+    hg_id_t tmp = 0;
 
-    tmp = MERCURY_REGISTER(
-        hg_class, "hvac_base_rpc", hvac_rpc_in_t, hvac_rpc_out_t, hvac_rpc_handler);
+    for (hg_class_t *cls : hvac_comm_classes())
+        tmp = MERCURY_REGISTER(
+            cls, "hvac_dir_snapshot_rpc", hvac_dir_snapshot_in_t, hvac_dir_snapshot_out_t, hvac_dir_snapshot_rpc_handler);
 
     return tmp;
 }
 
 hg_id_t
-hvac_open_rpc_register(void)
+hvac_readv_rpc_register(void)
 {
-    hg_id_t tmp;
+    hg_id_t tmp = 0;
 
-    tmp = MERCURY_REGISTER(
-        hg_class, "hvac_open_rpc", hvac_open_in_t, hvac_open_out_t, hvac_open_rpc_handler);
+    for (hg_class_t *cls : hvac_comm_classes())
+        tmp = MERCURY_REGISTER(
+            cls, "hvac_readv_rpc", hvac_readv_in_t, hvac_rpc_out_t, hvac_readv_rpc_handler);
 
     return tmp;
 }
 
 hg_id_t
-hvac_close_rpc_register(void)
+hvac_stripe_read_rpc_register(void)
 {
-    hg_id_t tmp;
+    hg_id_t tmp = 0;
 
-    tmp = MERCURY_REGISTER(
-        hg_class, "hvac_close_rpc", hvac_close_in_t, void, hvac_close_rpc_handler);
-    
+    for (hg_class_t *cls : hvac_comm_classes())
+        tmp = MERCURY_REGISTER(
+            cls, "hvac_stripe_read_rpc", hvac_stripe_read_in_t, hvac_rpc_out_t, hvac_stripe_read_rpc_handler);
 
-    int ret =  HG_Registered_disable_response(hg_class, tmp,
-                                           HG_TRUE);                        
-    assert(ret == HG_SUCCESS);
+    return tmp;
+}
+
+hg_id_t
+hvac_open_rpc_register(void)
+{
+    hg_id_t tmp = 0;
+
+    for (hg_class_t *cls : hvac_comm_classes())
+        tmp = MERCURY_REGISTER(
+            cls, "hvac_open_rpc", hvac_open_in_t, hvac_open_out_t, hvac_open_rpc_handler);
 
     return tmp;
 }
 
-/* register this particular rpc type with Mercury */
 hg_id_t
-hvac_seek_rpc_register(void)
+hvac_close_rpc_register(void)
 {
-    hg_id_t tmp;
+    hg_id_t tmp = 0;
+
+    for (hg_class_t *cls : hvac_comm_classes()) {
+        tmp = MERCURY_REGISTER(
+            cls, "hvac_close_rpc", hvac_close_in_t, void, hvac_close_rpc_handler);
+    
 
-    tmp = MERCURY_REGISTER(
-        hg_class, "hvac_seek_rpc", hvac_seek_in_t, hvac_seek_out_t, hvac_seek_rpc_handler);
+        int ret =  HG_Registered_disable_response(cls, tmp,
+                                               HG_TRUE);                        
+        assert(ret == HG_SUCCESS);
+        (void) ret;
+    }
 
     return tmp;
 }
@@ -375,6 +1385,65 @@ hg_context_t *hvac_comm_get_context()
     return hg_context;
 }
 
+/* Context a new handle to server should be created on. By thread keeps
+ * one caller's callbacks on one progress thread; by server keeps each
+ * server's traffic together. */
+hg_context_t *hvac_comm_pick_context(bool sm, uint32_t server)
+{
+	std::vector<hvac_comm_ctx *> &ctxs = sm ? hvac_sm_contexts : hvac_contexts;
+	static std::atomic<uint32_t> next_slot{0};
+
+	if (ctxs.size() <= 1)
+		return sm ? hg_sm_context : hg_context;
+	if (hvac_context_by_server)
+		return ctxs[server % ctxs.size()]->context;
+	if (tl_context_slot < 0)
+		tl_context_slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+	return ctxs[tl_context_slot % ctxs.size()]->context;
+}
+
+/* Callbacks triggered per context, fabric contexts first then na+sm.
+ * Returns the number of contexts, at most max are written. */
+extern "C" size_t hvac_comm_context_triggers(uint64_t *counts, size_t max)
+{
+	size_t n = 0;
+	for (auto *ctxs : {&hvac_contexts, &hvac_sm_contexts})
+		for (hvac_comm_ctx *ctx : *ctxs) {
+			if (n < max)
+				counts[n] = ctx->triggered.load(std::memory_order_relaxed);
+			n++;
+		}
+	return n;
+}
+
+void hvac_comm_report_contexts()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double secs = (now.tv_sec - hvac_comm_start_ts.tv_sec) +
+				  (now.tv_nsec - hvac_comm_start_ts.tv_nsec) / 1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	int i = 0;
+	for (auto *ctxs : {&hvac_contexts, &hvac_sm_contexts})
+		for (hvac_comm_ctx *ctx : *ctxs) {
+			uint64_t triggered = ctx->triggered.load(std::memory_order_relaxed);
+			L4C_INFO("Context %d (%s): %lu callbacks, %.1f/s", i++, ctx->sm ? "na+sm" : "fabric",
+					 triggered, triggered / secs);
+		}
+}
+
+hg_class_t *hvac_comm_get_sm_class()
+{
+    return hg_sm_class;
+}
+
+hg_context_t *hvac_comm_get_sm_context()
+{
+    return hg_sm_context;
+}
+
 
 // --- RPC Handler for Server-side Print Stats ---
 static hg_return_t
@@ -415,14 +1484,147 @@ hvac_trigger_srv_print_stats_handler(hg_handle_t handle) {
 hg_id_t
 hvac_trigger_srv_print_stats_rpc_register(void) {
     // This function registers the RPC that allows clients to tell the server to print its stats.
-    hg_id_t rpc_id;
-    rpc_id = MERCURY_REGISTER(
-        hg_class,                                 // Mercury class (should be initialized and accessible)
-        "hvac_rpc_trigger_srv_print_stats",       // Unique RPC name string
-        hvac_rpc_trigger_srv_print_stats_in_t,    // Input struct type
-        hvac_rpc_trigger_srv_print_stats_out_t,   // Output struct type
-        hvac_trigger_srv_print_stats_handler      // Handler function for this RPC
-    );
+    hg_id_t rpc_id = 0;
+    for (hg_class_t *cls : hvac_comm_classes()) {
+        rpc_id = MERCURY_REGISTER(
+            cls,                                      // Mercury class (fabric and, if enabled, na+sm)
+            "hvac_rpc_trigger_srv_print_stats",       // Unique RPC name string
+            hvac_rpc_trigger_srv_print_stats_in_t,    // Input struct type
+            hvac_rpc_trigger_srv_print_stats_out_t,   // Output struct type
+            hvac_trigger_srv_print_stats_handler      // Handler function for this RPC
+        );
+    }
     L4C_INFO("HvacComm: Registered RPC 'hvac_rpc_trigger_srv_print_stats' with ID: %u", rpc_id);
     return rpc_id;
-}
\ No newline at end of file
+}
+// --- Server stats snapshot (mthvac_srvstats.h) ---
+struct hvac_srv_stats_state {
+    hg_handle_t handle;
+    hvac_srv_stats_in_t in;         // holds the client bulk handle until we respond
+    void *buffer;
+    hg_bulk_t bulk_handle;
+    hvac_srv_stats_out_t out;
+};
+
+static void
+hvac_srv_stats_collect(struct hvac_srv_stats *stats)
+{
+    char node[256];
+    struct timespec now;
+    size_t queued;
+
+    hvac_comm_node_id(node, sizeof(node));
+    stats->node = node;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&data_mutex);
+    queued = data_queue.size();
+    pthread_mutex_unlock(&data_mutex);
+
+    uint64_t callbacks = 0;
+    for (auto *ctxs : {&hvac_contexts, &hvac_sm_contexts})
+        for (hvac_comm_ctx *ctx : *ctxs)
+            callbacks += ctx->triggered.load(std::memory_order_relaxed);
+
+    std::map<std::string, uint64_t> &c = stats->counters;
+    c["rank"] = hvac_server_rank;
+    c["pid"] = getpid();
+    c["uptime_ms"] = (now.tv_sec - hvac_comm_start_ts.tv_sec) * 1000 +
+                     (now.tv_nsec - hvac_comm_start_ts.tv_nsec) / 1000000;
+    c["opens"] = srv_counters.opens;
+    c["opens_cached"] = srv_counters.opens_cached;
+    c["open_errors"] = srv_counters.open_errors;
+    c["reads"] = srv_counters.reads;
+    c["reads_cached"] = srv_counters.reads_cached;
+    c["read_errors"] = srv_counters.read_errors;
+    c["bytes_cached"] = srv_counters.bytes_cached;
+    c["bytes_pfs"] = srv_counters.bytes_pfs;
+    c["staging_backlog"] = queued + data_staging;
+    c["staged_files"] = data_staged;
+    c["staging_failures"] = data_stage_failures;
+    {
+        pthread_mutex_lock(&fd_to_path_mutex);
+        uint64_t open_fds = fd_to_path.size();
+        pthread_mutex_unlock(&fd_to_path_mutex);
+        std::lock_guard<std::mutex> lk(stripe_fd_mutex);
+        c["open_fds"] = open_fds + stripe_fd_map.size();
+    }
+    c["active_reads"] = srv_counters.active_reads;
+    c["inflight_chunks"] = srv_counters.inflight_chunks;
+    c["callbacks"] = callbacks;
+
+    std::lock_guard<std::mutex> lk(hvac::get_mutex());
+    stats->tags = hvac::collect_stats_locked();
+}
+
+static hg_return_t
+hvac_srv_stats_bulk_cb(const struct hg_cb_info *info)
+{
+    struct hvac_srv_stats_state *state = (struct hvac_srv_stats_state *)info->arg;
+
+    if (info->ret != HG_SUCCESS) {
+        state->out.ret = -EIO;
+        state->out.used = 0;
+    }
+    HG_Respond(state->handle, NULL, NULL, &state->out);
+    HG_Bulk_free(state->bulk_handle);
+    HG_Free_input(state->handle, &state->in);
+    HG_Destroy(state->handle);
+    free(state->buffer);
+    free(state);
+    return HG_SUCCESS;
+}
+
+static hg_return_t
+hvac_srv_stats_rpc_handler(hg_handle_t handle)
+{
+    HVAC_TIMING("HvacComm_(hvac_srv_stats_rpc_handler)_total");
+    hvac_srv_stats_in_t in;
+    hvac_srv_stats_out_t out;
+    struct hvac_srv_stats stats;
+    const struct hg_info *hgi = HG_Get_info(handle);
+    int ret = HG_Get_input(handle, &in);
+    assert(ret == HG_SUCCESS);
+
+    hvac_srv_stats_collect(&stats);
+    std::string data = hvac_srv_stats_pack(stats);
+
+    out.ret = 0;
+    out.used = 0;
+    out.needed = data.size();
+    if (out.needed > in.capacity) {
+        HG_Respond(handle, NULL, NULL, &out);
+        HG_Free_input(handle, &in);
+        HG_Destroy(handle);
+        return HG_SUCCESS;
+    }
+
+    struct hvac_srv_stats_state *state = (struct hvac_srv_stats_state *)malloc(sizeof(*state));
+    hg_size_t size = data.size();
+    state->handle = handle;
+    state->in = in;
+    state->buffer = malloc(size);
+    memcpy(state->buffer, data.data(), size);
+    out.used = size;
+    state->out = out;
+
+    ret = HG_Bulk_create(hgi->hg_class, 1, &state->buffer, &size, HG_BULK_READ_ONLY, &state->bulk_handle);
+    assert(ret == HG_SUCCESS);
+    ret = HG_Bulk_transfer(hgi->context, hvac_srv_stats_bulk_cb, state, HG_BULK_PUSH, hgi->addr,
+                           in.bulk_handle, 0, state->bulk_handle, 0, size, HG_OP_ID_IGNORE);
+    assert(ret == HG_SUCCESS);
+    (void) ret;
+    return HG_SUCCESS;
+}
+
+hg_id_t
+hvac_srv_stats_rpc_register(void)
+{
+    hg_id_t tmp = 0;
+
+    for (hg_class_t *cls : hvac_comm_classes())
+        tmp = MERCURY_REGISTER(
+            cls, "hvac_srv_stats_rpc", hvac_srv_stats_in_t, hvac_srv_stats_out_t, hvac_srv_stats_rpc_handler);
+
+    return tmp;
+}
@@ -11,21 +11,91 @@ MERCURY_GEN_PROC(hvac_rpc_trigger_srv_print_stats_in_t, ((int32_t)(dummy_arg)))
 // Output: simple status
 MERCURY_GEN_PROC(hvac_rpc_trigger_srv_print_stats_out_t, ((int32_t)(status)))
 
+//Server stats snapshot (mthvac_srvstats.h) pushed into the caller's
+//buffer. Like a directory snapshot, needed > capacity means nothing was
+//sent, retry bigger.
+MERCURY_GEN_PROC(hvac_srv_stats_in_t, ((hg_bulk_t)(bulk_handle))((int64_t)(capacity)))
+MERCURY_GEN_PROC(hvac_srv_stats_out_t, ((int32_t)(ret))((int64_t)(used))((int64_t)(needed)))
+
 #include <string>
+#include <stdlib.h>
+#include <sys/uio.h>
 using namespace std;
 /* visible API for example RPC operation */
 
+// req_id: request ID the client generated for the intercepted call, so a
+// client read and its server side work can be matched in the logs.
+// Outputs carry the server's own timings in ns:
+//  queue_ns   - from the progress call that delivered the request to its handler,
+//               plus the time a read spent neither reading nor pushing
+//  storage_ns - in open() or in reads from the cache tier / PFS
+//  push_ns    - bulk pushes, from issue to their completion callback
+// A read's chunks overlap, so its storage and push times are sums that can
+// add up to more than the request took.
+
 //RPC Open Handler
-MERCURY_GEN_PROC(hvac_open_out_t, ((int32_t)(ret_status)))
-MERCURY_GEN_PROC(hvac_open_in_t, ((hg_string_t)(path)))
+MERCURY_GEN_PROC(hvac_open_out_t, ((int32_t)(ret_status))((uint64_t)(queue_ns))((uint64_t)(storage_ns)))
+MERCURY_GEN_PROC(hvac_open_in_t, ((hg_string_t)(path))((uint64_t)(req_id)))
 
 //BULK Read Handler
-MERCURY_GEN_PROC(hvac_rpc_out_t, ((int32_t)(ret)))
-MERCURY_GEN_PROC(hvac_rpc_in_t, ((int32_t)(input_val))((hg_bulk_t)(bulk_handle))((int32_t)(accessfd))((int64_t)(offset)))
+MERCURY_GEN_PROC(hvac_rpc_out_t, ((int32_t)(ret))((uint64_t)(queue_ns))((uint64_t)(storage_ns))((uint64_t)(push_ns)))
+MERCURY_GEN_PROC(hvac_rpc_in_t, ((int32_t)(input_val))((hg_bulk_t)(bulk_handle))((int32_t)(accessfd))((int64_t)(offset))((uint64_t)(req_id)))
+
+//Striped block read - addressed by path, the block owner never saw the open
+MERCURY_GEN_PROC(hvac_stripe_read_in_t, ((hg_string_t)(path))((hg_bulk_t)(bulk_handle))((int64_t)(offset))((int64_t)(length))((uint64_t)(req_id)))
+
+//Vectored read - a list of (offset, length) extents gathered into the
+//caller's iovec in one round trip. An offset of -1 continues from the
+//server side file position, like read().
+#define HVAC_READV_MAX_EXTENTS 1024
+typedef struct {
+    uint32_t count;
+    int64_t *offsets;
+    int64_t *lengths;
+} hvac_extent_list_t;
+
+static inline hg_return_t
+hg_proc_hvac_extent_list_t(hg_proc_t proc, void *data)
+{
+    hvac_extent_list_t *list = (hvac_extent_list_t *)data;
+    hg_return_t ret = hg_proc_uint32_t(proc, &list->count);
+
+    if (ret != HG_SUCCESS)
+        return ret;
+    switch (hg_proc_get_op(proc)) {
+    case HG_DECODE:
+        if (list->count > HVAC_READV_MAX_EXTENTS)
+            return HG_INVALID_ARG;
+        list->offsets = (int64_t *)malloc((list->count + 1) * sizeof(int64_t));
+        list->lengths = (int64_t *)malloc((list->count + 1) * sizeof(int64_t));
+        if (list->offsets == NULL || list->lengths == NULL)
+            return HG_NOMEM;
+        /* fall through */
+    case HG_ENCODE:
+        for (uint32_t i = 0; i < list->count && ret == HG_SUCCESS; i++) {
+            ret = hg_proc_int64_t(proc, &list->offsets[i]);
+            if (ret == HG_SUCCESS)
+                ret = hg_proc_int64_t(proc, &list->lengths[i]);
+        }
+        break;
+    case HG_FREE:
+        free(list->offsets);
+        free(list->lengths);
+        break;
+    }
+    return ret;
+}
+
+MERCURY_GEN_PROC(hvac_readv_in_t, ((int32_t)(accessfd))((hg_bulk_t)(bulk_handle))((hvac_extent_list_t)(extents))((uint64_t)(req_id)))
+
+//Directory snapshot - the server lists and stats a directory once and
+//pushes packed hvac_meta_rec records (mthvac_meta.h) into the client
+//buffer. needed > capacity means nothing was sent, retry bigger.
+// have_gen: generation the client already holds (0 for none). If it is
+// still current the reply carries no data, just the same gen back
+MERCURY_GEN_PROC(hvac_dir_snapshot_in_t, ((hg_string_t)(path))((hg_bulk_t)(bulk_handle))((int64_t)(capacity))((uint64_t)(have_gen)))
+MERCURY_GEN_PROC(hvac_dir_snapshot_out_t, ((int32_t)(ret))((int64_t)(used))((int64_t)(needed))((uint64_t)(gen)))
 
-//RPC Seek Handler
-MERCURY_GEN_PROC(hvac_seek_out_t, ((int32_t)(ret)))
-MERCURY_GEN_PROC(hvac_seek_in_t, ((int32_t)(fd))((int32_t)(offset))((int32_t)(whence)))
 
 
 //Close Handler input arg
@@ -39,18 +109,68 @@ void hvac_comm_list_addr();
 void hvac_comm_create_handle(hg_addr_t addr, hg_id_t id, hg_handle_t *handle);
 void hvac_shutdown_comm();
 void hvac_comm_free_addr(hg_addr_t addr);
+void hvac_comm_node_id(char *buf, size_t len);
 
 //Retrieve the static variables
 hg_class_t *hvac_comm_get_class();
 hg_context_t *hvac_comm_get_context();
+// na+sm class / context, NULL when node local shared memory is disabled
+hg_class_t *hvac_comm_get_sm_class();
+hg_context_t *hvac_comm_get_sm_context();
+// Client side context for a new handle to server (HVAC_CLIENT_CONTEXTS)
+hg_context_t *hvac_comm_pick_context(bool sm, uint32_t server);
+void hvac_comm_report_contexts();
 
 
 //Client
-ssize_t hvac_client_comm_gen_seek_rpc(uint32_t svr_hash, int fd, int offset, int whence);
+/* Request IDs. Every intercepted call that may go to a server opens a
+ * request scope; the RPCs it sends carry the scope's ID and, when they
+ * complete, split their latency into network, server queue, storage and
+ * bulk push time under the scope's tag (base + "_rpc", "_network",
+ * "_server_queue", "_server_storage", "_server_push"). A scope opened
+ * inside another one joins it. RPCs sent outside any scope get their own
+ * ID and are charged to "HvacCommClient_(request)". */
+struct hvac_request_tags {
+    uint32_t rpc, network, queue, storage, push;
+};
+struct hvac_request_tags hvac_request_tags_for(const char *base);
+
+class hvac_request_scope {
+    public:
+        explicit hvac_request_scope(const struct hvac_request_tags *tags);
+        ~hvac_request_scope();
+    private:
+        bool owner_;
+};
+
+// ID of the calling thread's current request
+uint64_t hvac_request_id();
+
+#define HVAC_REQUEST_CAT2(a, b) a##b
+#define HVAC_REQUEST_CAT(a, b) HVAC_REQUEST_CAT2(a, b)
+// Tags are interned once per call site
+#define HVAC_REQUEST(base) \
+    static const struct hvac_request_tags HVAC_REQUEST_CAT(__hvac_rq_, __LINE__) = hvac_request_tags_for(base); \
+    hvac_request_scope HVAC_REQUEST_CAT(__hvac_rs_, __LINE__)(&HVAC_REQUEST_CAT(__hvac_rq_, __LINE__))
+
 ssize_t hvac_client_comm_gen_read_rpc(uint32_t svr_hash, int localfd, void* buffer, ssize_t count, off_t offset);
+// Split-phase read: start returns NULL if the RPC could not be sent,
+// wait blocks until the data has landed in buffer and frees the op
+struct hvac_read_op;
+struct hvac_read_op *hvac_client_comm_start_read_rpc(uint32_t svr_hash, int localfd, void* buffer, ssize_t count, off_t offset);
+struct hvac_read_op *hvac_client_comm_start_stripe_read_rpc(uint32_t svr_hash, const string &path, void* buffer, ssize_t count, off_t offset);
+ssize_t hvac_client_comm_wait_read_rpc(struct hvac_read_op *read_op);
+// Fetch the snapshot of dir into buf. 0 or -errno, *needed is the full size
+int hvac_client_comm_gen_dir_snapshot_rpc(uint32_t svr_hash, const string &dir, void *buf, size_t capacity,
+                                          uint64_t have_gen, size_t *used, size_t *needed, uint64_t *gen);
+// One RPC for the whole iovec, offset -1 reads from the file position
+ssize_t hvac_client_comm_gen_readv_rpc(uint32_t svr_hash, int localfd, const struct iovec *iov, int iovcnt, off_t offset);
 ssize_t hvac_client_comm_gen_open_rpc(uint32_t svr_hash, string path, int fd);
 void hvac_client_comm_gen_close_rpc(uint32_t svr_hash, int fd);
 hg_addr_t hvac_client_comm_lookup_addr(int rank);
+void hvac_client_comm_create_handle(int rank, hg_id_t id, hg_handle_t *handle);
+// False while a server sits in the penalty box for missing deadlines
+bool hvac_client_comm_server_available(uint32_t server);
 void hvac_client_comm_register_rpc();
 // Legacy functions - now deprecated
 void hvac_client_block();
@@ -63,11 +183,15 @@ ssize_t hvac_seek_block();
 hg_id_t hvac_rpc_register(void);
 hg_id_t hvac_open_rpc_register(void);
 hg_id_t hvac_close_rpc_register(void);
-hg_id_t hvac_seek_rpc_register(void);
+hg_id_t hvac_stripe_read_rpc_register(void);
+hg_id_t hvac_readv_rpc_register(void);
+hg_id_t hvac_dir_snapshot_rpc_register(void);
 
 
 // used to register the RPC on Server side for printing stats
 hg_id_t hvac_trigger_srv_print_stats_rpc_register(void);
+// Snapshot of the server's counters and histograms, queried by hvac_stats
+hg_id_t hvac_srv_stats_rpc_register(void);
 
 #ifdef __cplusplus
 extern "C" {
@@ -78,6 +202,9 @@ extern "C" {
 // Returns 0 on successful RPC send and server ACK, non-zero otherwise.
 int hvac_client_request_server_to_print_stats(const char* server_rank_identifier);
 void hvac_client_export_tag_details(const char* tag_name_c_str, const char* output_filename_c_str, int epoch_num);
+// Callbacks triggered per client context, fabric contexts first then
+// na+sm. Returns the number of contexts, at most max are written.
+size_t hvac_comm_context_triggers(uint64_t *counts, size_t max);
 
 
 #ifdef __cplusplus
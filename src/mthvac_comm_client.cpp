@@ -3,12 +3,16 @@
 #include <map>	
 #include <unordered_map>
 #include <memory>
+#include <vector>
 #include <pthread.h>
 #include <time.h>
 #include <errno.h>
+#include <atomic>
 
 #include "mthvac_timer.h"  // ! HVAC TIMING
 #include "mthvac_comm.h"
+#include "mthvac_completion.h"
+#include "mthvac_fdtable.h"
 #include "mthvac_data_mover_internal.h"
 
 extern "C" {
@@ -18,21 +22,19 @@ extern "C" {
 #include <unistd.h>
 }
 
-/* RPC Block Constructs - Now using individual sync mechanisms */
+/* RPC Block Constructs - one completion per operation (mthvac_completion.h) */
 struct hvac_sync_context {
-    hg_bool_t done;
-    ssize_t result;
-    pthread_cond_t done_cond;
-    pthread_mutex_t done_mutex;
+    struct hvac_completion *completion;
+    hg_handle_t handle;     // owned by the waiter
+    uint32_t server;        // charged with the miss
+    uint64_t req_id;        // of the RPC, for the logs
+    int timeout_ms;         // 0 waits forever
     
-    hvac_sync_context() : done(HG_FALSE), result(-1) {
-        pthread_cond_init(&done_cond, NULL);
-        pthread_mutex_init(&done_mutex, NULL);
+    hvac_sync_context() : completion(hvac_completion_get()), handle(HG_HANDLE_NULL), server(0), req_id(0), timeout_ms(0) {
     }
     
     ~hvac_sync_context() {
-        pthread_cond_destroy(&done_cond);
-        pthread_mutex_destroy(&done_mutex);
+        hvac_completion_put(completion);
     }
 };
 
@@ -45,10 +47,12 @@ enum hvac_fd_state {
 
 struct hvac_fd_status {
     enum hvac_fd_state state;
+    uint32_t server;        // target of the open, charged if it is late
+    uint32_t gen;           // fd table generation the open was sent under
     pthread_mutex_t state_mutex;
     pthread_cond_t ready_cond;
     
-    hvac_fd_status() : state(HVAC_FD_OPENING) {
+    hvac_fd_status() : state(HVAC_FD_OPENING), server(0), gen(0) {
         pthread_mutex_init(&state_mutex, NULL);
         pthread_cond_init(&ready_cond, NULL);
     }
@@ -59,6 +63,86 @@ struct hvac_fd_status {
     }
 };
 
+/* Per operation deadlines. An open that runs past its deadline reports
+ * failure so the wrapper falls back to the PFS. A read past its deadline
+ * is charged to the server but still waits for the reply, since the bulk
+ * push may land in the caller's buffer until then. A server that misses
+ * g_penalty_misses deadlines in a row is put in the penalty box for
+ * g_penalty_ms and its files go straight to the PFS meanwhile.
+ */
+static int g_open_timeout_ms = 5000;
+static int g_read_timeout_ms = 10000;
+static uint32_t g_penalty_misses = 3;
+static uint64_t g_penalty_ms = 30000;
+
+struct hvac_server_health {
+    std::atomic<uint32_t> misses{0};
+    std::atomic<uint64_t> penalized_until_ms{0};
+};
+static struct hvac_server_health *server_health = NULL;
+static uint32_t server_health_count = 0;
+extern uint32_t g_hvac_server_count;
+
+static uint64_t hvac_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void hvac_deadline_from_now(int timeout_ms, struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void hvac_client_comm_load_deadlines()
+{
+    char *env;
+    if ((env = getenv("HVAC_OPEN_TIMEOUT_MS")) != NULL) g_open_timeout_ms = atoi(env);
+    if ((env = getenv("HVAC_READ_TIMEOUT_MS")) != NULL) g_read_timeout_ms = atoi(env);
+    if ((env = getenv("HVAC_PENALTY_MISSES")) != NULL && atoi(env) > 0) g_penalty_misses = atoi(env);
+    if ((env = getenv("HVAC_PENALTY_MS")) != NULL) g_penalty_ms = strtoull(env, NULL, 10);
+
+    server_health_count = g_hvac_server_count;
+    server_health = new hvac_server_health[server_health_count ? server_health_count : 1];
+    L4C_INFO("Deadlines open %d ms read %d ms, penalty after %u misses for %lu ms",
+             g_open_timeout_ms, g_read_timeout_ms, g_penalty_misses, g_penalty_ms);
+}
+
+static void hvac_server_note_miss(uint32_t server)
+{
+    if (server_health == NULL || server >= server_health_count)
+        return;
+    uint32_t misses = server_health[server].misses.fetch_add(1) + 1;
+    if (misses >= g_penalty_misses) {
+        server_health[server].penalized_until_ms.store(hvac_now_ms() + g_penalty_ms);
+        server_health[server].misses.store(0);
+        L4C_WARN("Server %u missed %u deadlines - routing its files to the PFS for %lu ms", server, misses, g_penalty_ms);
+    }
+}
+
+static void hvac_server_note_ok(uint32_t server)
+{
+    if (server_health == NULL || server >= server_health_count)
+        return;
+    if (server_health[server].misses.load(std::memory_order_relaxed))
+        server_health[server].misses.store(0);
+}
+
+bool hvac_client_comm_server_available(uint32_t server)
+{
+    if (server_health == NULL || server >= server_health_count)
+        return true;
+    uint64_t until = server_health[server].penalized_until_ms.load(std::memory_order_relaxed);
+    return until == 0 || hvac_now_ms() >= until;
+}
+
 // Global file descriptor state management with sharding to reduce lock contention
 #define FD_STATE_SHARDS 64
 static std::unordered_map<int, std::shared_ptr<hvac_fd_status>> fd_state_map;
@@ -93,20 +177,23 @@ std::shared_ptr<hvac_fd_status> hvac_get_fd_status(int fd) {
     return status;
 }
 
-void hvac_set_fd_opening(int fd) {
+void hvac_set_fd_opening(int fd, uint32_t server, uint32_t gen) {
     HVAC_TIMING("HvacCommClient_(hvac_set_fd_opening)_total");
     pthread_rwlock_t* rwlock = get_fd_rwlock(fd);
     pthread_rwlock_wrlock(rwlock);  // Write lock for modification
     auto status = std::make_shared<hvac_fd_status>();
     status->state = HVAC_FD_OPENING;
+    status->server = server;
+    status->gen = gen;
     fd_state_map[fd] = status;
     pthread_rwlock_unlock(rwlock);
 }
 
-void hvac_set_fd_ready(int fd) {
+// Both ignore an open whose fd has since been closed and tracked again
+void hvac_set_fd_ready(int fd, uint32_t gen) {
     HVAC_TIMING("HvacCommClient_(hvac_set_fd_ready)_total");
     auto status = hvac_get_fd_status(fd);
-    if (status) {
+    if (status && status->gen == gen) {
         pthread_mutex_lock(&status->state_mutex);
         status->state = HVAC_FD_READY;
         pthread_cond_broadcast(&status->ready_cond);  // Wake up all waiting threads
@@ -114,9 +201,9 @@ void hvac_set_fd_ready(int fd) {
     }
 }
 
-void hvac_set_fd_error(int fd) {
+void hvac_set_fd_error(int fd, uint32_t gen) {
     auto status = hvac_get_fd_status(fd);
-    if (status) {
+    if (status && status->gen == gen) {
         pthread_mutex_lock(&status->state_mutex);
         status->state = HVAC_FD_ERROR;
         pthread_cond_broadcast(&status->ready_cond);  // Wake up all waiting threads
@@ -124,10 +211,17 @@ void hvac_set_fd_error(int fd) {
     }
 }
 
-bool hvac_wait_fd_ready(int fd, int timeout_ms = 5000) {
+// timeout_ms < 0 uses the configured open deadline, 0 waits forever
+bool hvac_wait_fd_ready(int fd, int timeout_ms = -1) {
+    // Once the open has landed the remote fd is in the table - skip the
+    // shard lock and the status mutex on every subsequent I/O
+    if (hvac_fdtable_remote(fd) != 0)
+        return true;
     HVAC_TIMING("HvacCommClient_(hvac_wait_fd_ready)_total");
     auto status = hvac_get_fd_status(fd);
     if (!status) return false;
+    if (timeout_ms < 0)
+        timeout_ms = g_open_timeout_ms;
     
     pthread_mutex_lock(&status->state_mutex);
     
@@ -140,25 +234,24 @@ bool hvac_wait_fd_ready(int fd, int timeout_ms = 5000) {
     
     // Wait for the state to change with timeout
     struct timespec timeout_ts;
-    clock_gettime(CLOCK_REALTIME, &timeout_ts);
-    timeout_ts.tv_sec += timeout_ms / 1000;
-    timeout_ts.tv_nsec += (timeout_ms % 1000) * 1000000;
-    if (timeout_ts.tv_nsec >= 1000000000) {
-        timeout_ts.tv_sec++;
-        timeout_ts.tv_nsec -= 1000000000;
-    }
+    hvac_deadline_from_now(timeout_ms, &timeout_ts);
     
     while (status->state == HVAC_FD_OPENING) {
-        int ret = pthread_cond_timedwait(&status->ready_cond, &status->state_mutex, &timeout_ts);
+        int ret = timeout_ms ? pthread_cond_timedwait(&status->ready_cond, &status->state_mutex, &timeout_ts)
+                             : pthread_cond_wait(&status->ready_cond, &status->state_mutex);
         if (ret == ETIMEDOUT) {
+            // The open stays in flight and may still land for later I/O
             L4C_ERR("Timeout waiting for fd %d to be ready", fd);
             pthread_mutex_unlock(&status->state_mutex);
+            hvac_server_note_miss(status->server);
             return false;
         }
     }
     
     bool ready = (status->state == HVAC_FD_READY);
     pthread_mutex_unlock(&status->state_mutex);
+    if (ready)
+        hvac_server_note_ok(status->server);
     return ready;
 }
 
@@ -173,17 +266,121 @@ void hvac_cleanup_fd_state(int fd) {
 static hg_id_t hvac_client_rpc_id;
 static hg_id_t hvac_client_open_id;
 static hg_id_t hvac_client_close_id;
-static hg_id_t hvac_client_seek_id;
+static hg_id_t hvac_client_stripe_read_id;
+static hg_id_t hvac_client_readv_id;
+static hg_id_t hvac_client_dir_snapshot_id;
 static hg_id_t hvac_client_trigger_srv_print_stats_rpc_id;
 
-/* Mercury Data Caching */
-std::unordered_map<int, std::string> address_cache;
-extern std::unordered_map<int, int > fd_redir_map;
-
-extern std::unordered_map<int, std::string > fd_map;
+/* Mercury Data Caching - each server rank is looked up once and the
+ * address kept for the life of the process, along with whether it lives
+ * on the na+sm class (same node) or the fabric class */
+struct hvac_server_addr {
+    hg_addr_t addr;
+    bool sm;
+};
+static std::unordered_map<int, struct hvac_server_addr> address_cache;
+static pthread_mutex_t address_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool hvac_client_comm_resolve(int rank, struct hvac_server_addr *server);
 extern "C" bool hvac_file_tracked(int fd);
 extern "C" bool hvac_track_file(const char* path, int flags, int fd);
 
+/* Request IDs: the high half names the process, the low half counts */
+static uint64_t g_request_prefix = 0;
+static std::atomic<uint32_t> g_request_seq{0};
+static __thread uint64_t tl_request_id = 0;
+static __thread const struct hvac_request_tags *tl_request_tags = NULL;
+
+// At registration and again in forked children, which need their own prefix
+static void hvac_request_set_prefix()
+{
+    char host[256];
+    uint64_t h = 14695981039346656037ULL;    // FNV-1a of the host name
+    hvac_comm_node_id(host, sizeof(host));
+    for (const char *c = host; *c; c++)
+        h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    g_request_prefix = (h ^ ((uint64_t)getpid() * 0x9e3779b97f4a7c15ULL)) & 0xffffffff00000000ULL;
+    g_request_seq.store(0, std::memory_order_relaxed);
+}
+
+static uint64_t hvac_request_new_id()
+{
+    return g_request_prefix | g_request_seq.fetch_add(1, std::memory_order_relaxed);
+}
+
+struct hvac_request_tags hvac_request_tags_for(const char *base)
+{
+    std::string b(base);
+    struct hvac_request_tags tags;
+
+    tags.rpc = hvac::intern_tag((b + "_rpc").c_str());
+    tags.network = hvac::intern_tag((b + "_network").c_str());
+    tags.queue = hvac::intern_tag((b + "_server_queue").c_str());
+    tags.storage = hvac::intern_tag((b + "_server_storage").c_str());
+    tags.push = hvac::intern_tag((b + "_server_push").c_str());
+    return tags;
+}
+
+hvac_request_scope::hvac_request_scope(const struct hvac_request_tags *tags)
+    : owner_(tl_request_id == 0)
+{
+    if (owner_) {
+        tl_request_id = hvac_request_new_id();
+        tl_request_tags = tags;
+    }
+}
+
+hvac_request_scope::~hvac_request_scope()
+{
+    if (owner_) {
+        tl_request_id = 0;
+        tl_request_tags = NULL;
+    }
+}
+
+uint64_t hvac_request_id()
+{
+    return tl_request_id;
+}
+
+/* What an RPC needs to charge its latency to the request that sent it */
+struct hvac_request_ctx {
+    uint64_t id;
+    const struct hvac_request_tags *tags;
+    uint64_t sent_ns;
+};
+
+static inline uint64_t hvac_request_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void hvac_request_begin(struct hvac_request_ctx *req)
+{
+    static const struct hvac_request_tags unscoped = hvac_request_tags_for("HvacCommClient_(request)");
+
+    req->id = tl_request_id ? tl_request_id : hvac_request_new_id();
+    req->tags = tl_request_tags ? tl_request_tags : &unscoped;
+    req->sent_ns = hvac_request_now_ns();
+}
+
+/* Split a completed RPC's latency with the server's timings. Whatever the
+ * server didn't account for is network: the wire both ways, Mercury on
+ * either side and the wait for this process's progress thread. */
+static void hvac_request_complete(const struct hvac_request_ctx *req, uint64_t queue_ns,
+                                  uint64_t storage_ns, uint64_t push_ns)
+{
+    uint64_t total = hvac_request_now_ns() - req->sent_ns;
+    uint64_t server = queue_ns + storage_ns + push_ns;
+
+    hvac::record_duration(req->tags->rpc, total);
+    hvac::record_duration(req->tags->network, total > server ? total - server : 0);
+    hvac::record_duration(req->tags->queue, queue_ns);
+    hvac::record_duration(req->tags->storage, storage_ns);
+    hvac::record_duration(req->tags->push, push_ns);
+}
+
 /* struct used to carry state of overall operation across callbacks */
 struct hvac_rpc_state {
     uint32_t value;
@@ -192,43 +389,19 @@ struct hvac_rpc_state {
     hg_bulk_t bulk_handle;
     hg_handle_t handle;
     struct hvac_sync_context *sync_ctx;  // Individual sync context
+    struct hvac_request_ctx req;
 };
 
 // Carry CB Information for CB
+// Opens are asynchronous: the callback owns and frees this state
 struct hvac_open_state{
     uint32_t local_fd;
-    struct hvac_sync_context *sync_ctx;  // Individual sync context
-};
-
-// Seek state structure
-struct hvac_seek_state{
-    int fd;
-    struct hvac_sync_context *sync_ctx;  // Individual sync context
+    uint32_t gen;           // of the fd table slot when the open was sent
+    uint32_t server;
+    struct hvac_request_ctx req;
 };
 
-static hg_return_t
-hvac_seek_cb(const struct hg_cb_info *info)
-{
-    hvac_seek_out_t out;
-    ssize_t bytes_read = -1;
-    struct hvac_seek_state *seek_state = (struct hvac_seek_state *)info->arg;
-
-    HG_Get_output(info->info.forward.handle, &out);    
-    //Set the SEEK OUTPUT
-    bytes_read = out.ret;
-    HG_Free_output(info->info.forward.handle, &out);
-    HG_Destroy(info->info.forward.handle);
-
-    /* signal to waiting thread that we are done - using individual sync context */
-    pthread_mutex_lock(&seek_state->sync_ctx->done_mutex);
-    seek_state->sync_ctx->done = HG_TRUE;
-    seek_state->sync_ctx->result = bytes_read;
-    pthread_cond_broadcast(&seek_state->sync_ctx->done_cond);
-    pthread_mutex_unlock(&seek_state->sync_ctx->done_mutex);
-    
-    // Don't free seek_state here - it will be freed by the waiting thread
-    return HG_SUCCESS;    
-}
+static void hvac_client_comm_send_close(uint32_t svr_hash, int32_t remote_fd);
 
 static hg_return_t
 hvac_open_cb(const struct hg_cb_info *info)
@@ -236,30 +409,36 @@ hvac_open_cb(const struct hg_cb_info *info)
     HVAC_TIMING("HvacCommClient_(hvac_open_cb)_total");
     hvac_open_out_t out;
     struct hvac_open_state *open_state = (struct hvac_open_state *)info->arg;    
-    assert(info->ret == HG_SUCCESS);
+    if (info->ret != HG_SUCCESS) {
+        L4C_ERR("Open RPC for fd %d did not complete (%d)", open_state->local_fd, info->ret);
+        hvac_set_fd_error(open_state->local_fd, open_state->gen);
+        HG_Destroy(info->info.forward.handle);
+        free(open_state);
+        return HG_SUCCESS;
+    }
     HG_Get_output(info->info.forward.handle, &out);    
     
-    // Update file descriptor mapping and state
-    if (out.ret_status > 0) {
-        fd_redir_map[open_state->local_fd] = out.ret_status;
-        hvac_set_fd_ready(open_state->local_fd);  // Mark FD as ready for I/O
+    // Update file descriptor mapping and state - this wakes any read/close
+    // that is already parked in hvac_wait_fd_ready on this fd
+    hvac_request_complete(&open_state->req, out.queue_ns, out.storage_ns, 0);
+    if (out.ret_status > 0 && !hvac_fdtable_set_remote(open_state->local_fd, open_state->gen, out.ret_status)) {
+        // The local fd was closed while the open was in flight - nobody
+        // else knows about this remote fd, so close it here
+        L4C_INFO("Open RPC for closed fd %d returned FD %d - closing it", open_state->local_fd, out.ret_status);
+        hvac_client_comm_send_close(open_state->server, out.ret_status);
+    } else if (out.ret_status > 0) {
+        hvac_set_fd_ready(open_state->local_fd, open_state->gen);  // Mark FD as ready for I/O
         L4C_INFO("Open RPC Returned FD %d - marked as ready\n", out.ret_status);
     } else {
-        hvac_set_fd_error(open_state->local_fd);  // Mark FD as error
+        hvac_set_fd_error(open_state->local_fd, open_state->gen);  // Mark FD as error
         L4C_ERR("Open RPC failed with status %d\n", out.ret_status);
     }
     
     HG_Free_output(info->info.forward.handle, &out);
     HG_Destroy(info->info.forward.handle);
 
-    /* signal to waiting thread that we are done - using individual sync context */
-    pthread_mutex_lock(&open_state->sync_ctx->done_mutex);
-    open_state->sync_ctx->done = HG_TRUE;
-    open_state->sync_ctx->result = out.ret_status;
-    pthread_cond_broadcast(&open_state->sync_ctx->done_cond);
-    pthread_mutex_unlock(&open_state->sync_ctx->done_mutex);
-    
-    // Don't free open_state here - it will be freed by the waiting thread
+    // Nobody waits on the open itself anymore, so the state is ours to free
+    free(open_state);
     return HG_SUCCESS;
 }
 
@@ -273,31 +452,30 @@ hvac_read_cb(const struct hg_cb_info *info)
     hvac_rpc_out_t out;
     ssize_t bytes_read = -1;
     struct hvac_rpc_state *hvac_rpc_state_p = (hvac_rpc_state *)info->arg;
-    assert(info->ret == HG_SUCCESS);
+    struct hvac_sync_context *sync_ctx = hvac_rpc_state_p->sync_ctx;
+    hg_handle_t handle = info->info.forward.handle;
+
+    /* decode response - a read that did not complete reports -1 */
+    if (info->ret == HG_SUCCESS) {
+        HG_Get_output(handle, &out);
+        bytes_read = out.ret;
+        hvac_request_complete(&hvac_rpc_state_p->req, out.queue_ns, out.storage_ns, out.push_ns);
+        ret = HG_Free_output(handle, &out);
+        assert(ret == HG_SUCCESS);
+    }
 
-    /* decode response */
-    HG_Get_output(info->info.forward.handle, &out);
-    bytes_read = out.ret;
-    /* clean up resources consumed by this rpc */
+    /* clean up resources consumed by this rpc - the server has replied,
+     * so its push into the caller's buffer is over */
     ret = HG_Bulk_free(hvac_rpc_state_p->bulk_handle);
 	assert(ret == HG_SUCCESS);
+	(void) ret;
 	L4C_INFO("INFO: Freeing Bulk Handle"); //Does this deregister memory?
 
-	ret = HG_Free_output(info->info.forward.handle, &out);
-	assert(ret == HG_SUCCESS);
-    
-	ret = HG_Destroy(info->info.forward.handle);
-	assert(ret == HG_SUCCESS);
-
-    /* signal to waiting thread that we are done - using individual sync context */
-    pthread_mutex_lock(&hvac_rpc_state_p->sync_ctx->done_mutex);
-    hvac_rpc_state_p->sync_ctx->done = HG_TRUE;
-    hvac_rpc_state_p->sync_ctx->result = bytes_read;
-    pthread_cond_broadcast(&hvac_rpc_state_p->sync_ctx->done_cond);
-    pthread_mutex_unlock(&hvac_rpc_state_p->sync_ctx->done_mutex);
-    
-    // Free the RPC state but not the sync context (caller will handle that)
+    // Free the RPC state before signalling - the waiter owns the handle
+    // and the sync context and may drop both as soon as it wakes
     free(hvac_rpc_state_p);
+
+    hvac_completion_complete(sync_ctx->completion, bytes_read);
     return HG_SUCCESS;
 }
 
@@ -306,10 +484,17 @@ void hvac_client_comm_register_rpc()
     hvac_client_open_id = hvac_open_rpc_register();
     hvac_client_rpc_id = hvac_rpc_register();    
     hvac_client_close_id = hvac_close_rpc_register();
-    hvac_client_seek_id = hvac_seek_rpc_register();
+    hvac_client_stripe_read_id = hvac_stripe_read_rpc_register();
+    hvac_client_readv_id = hvac_readv_rpc_register();
+    hvac_client_dir_snapshot_id = hvac_dir_snapshot_rpc_register();
 
     // ! TIMING for RPC in server
     hvac_client_trigger_srv_print_stats_rpc_id = hvac_trigger_srv_print_stats_rpc_register();
+
+    hvac_client_comm_load_deadlines();
+
+    hvac_request_set_prefix();
+    pthread_atfork(NULL, NULL, hvac_request_set_prefix);
 }
 
 // Updated to use individual sync context
@@ -318,16 +503,29 @@ ssize_t hvac_wait_for_operation(struct hvac_sync_context *sync_ctx, const char*
     HVAC_TIMING("HvacCommClient_(hvac_wait_for_operation)_total");
     ssize_t result;
     
-    /* wait for callbacks to finish using individual sync context */
-        pthread_mutex_lock(&sync_ctx->done_mutex); 
+    bool timed_out = false;
+
     {
         HVAC_TIMING("HvacCommClient_(hvac_wait_for_operation)_wait_for_done");
-        while (sync_ctx->done != HG_TRUE) {
-            pthread_cond_wait(&sync_ctx->done_cond, &sync_ctx->done_mutex);
+        if (!hvac_completion_wait(sync_ctx->completion, sync_ctx->timeout_ms)) {
+            /* Don't cancel: a bulk push over na+sm is a one-sided write
+             * from the server process that freeing the handle does not
+             * stop, so the buffer is only ours again once the reply is
+             * in. Charge the server now so later files avoid it. */
+            timed_out = true;
+            L4C_WARN("%s to server %u (req %016lx) missed its %d ms deadline", operation_name, sync_ctx->server,
+                     sync_ctx->req_id, sync_ctx->timeout_ms);
+            hvac_server_note_miss(sync_ctx->server);
+            hvac_completion_wait(sync_ctx->completion, 0);
         }
     }
-    result = sync_ctx->result;
-    pthread_mutex_unlock(&sync_ctx->done_mutex);
+    result = sync_ctx->completion->result;
+    HG_Destroy(sync_ctx->handle);
+    sync_ctx->handle = HG_HANDLE_NULL;
+
+    // A late reply still carries good data, but it doesn't clear the miss
+    if (!timed_out)
+        hvac_server_note_ok(sync_ctx->server);
 
     // L4C_INFO("Operation %s completed with result: %zd", operation_name, result);
     return result;
@@ -356,133 +554,131 @@ ssize_t hvac_seek_block()
     return -1;
 }
 
+static void hvac_client_comm_send_close(uint32_t svr_hash, int32_t remote_fd)
+{
+    hvac_close_in_t in;
+    hg_handle_t handle;
+
+    hvac_client_comm_create_handle(svr_hash, hvac_client_close_id, &handle);
+    in.fd = remote_fd;
+    if (HG_Forward(handle, NULL, NULL, &in) != HG_SUCCESS)
+        L4C_ERR("Failed to send close RPC for remote fd %d", remote_fd);
+    HG_Destroy(handle);
+}
+
 void hvac_client_comm_gen_close_rpc(uint32_t svr_hash, int fd)
 {   
     HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_close_rpc)_total");
-    hg_addr_t svr_addr; 
-    hvac_close_in_t in;
-    hg_handle_t handle; 
-    int ret;
 
-    /* Get address */
-    svr_addr = hvac_client_comm_lookup_addr(svr_hash);        
+    // The open may still be in flight - let it land so the remote FD is known
+    {
+        HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_close_rpc)_wait_fd_ready");
+        hvac_wait_fd_ready(fd);
+    }
 
-    /* create create handle to represent this rpc operation */
-    hvac_comm_create_handle(svr_addr, hvac_client_close_id, &handle);
-
-    // Check if we have a valid remote FD to close
-    if (fd_redir_map.find(fd) != fd_redir_map.end() && fd_redir_map[fd] != 0) {
-        in.fd = fd_redir_map[fd];
-        
-        ret = HG_Forward(handle, NULL, NULL, &in);
-        if (ret != 0) {
-            L4C_ERR("Failed to send close RPC for fd %d", fd);
-        }
-        
-        // Clean up mapping regardless of RPC success
-        fd_redir_map.erase(fd);
-    } else {
+    // Taking the remote FD moves the slot to a new generation, so an open
+    // that is still in flight after the wait closes its own remote FD
+    int32_t remote_fd = hvac_fdtable_take_remote(fd);
+    if (remote_fd != 0)
+        hvac_client_comm_send_close(svr_hash, remote_fd);
+    else
         L4C_WARN("No remote FD mapping found for fd %d during close", fd);
-    }
 
     // Clean up FD state tracking
     hvac_cleanup_fd_state(fd);
-
-    HG_Destroy(handle);
-    hvac_comm_free_addr(svr_addr);
-
-    return;
 }
 
+/* Fire the open RPC and return without waiting for the server.
+ * The fd stays in HVAC_FD_OPENING until hvac_open_cb runs; the first
+ * read/pread/close on it parks in hvac_wait_fd_ready. This lets a loader
+ * open a batch of files and have all of the opens in flight at once.
+ * Returns 0 once the RPC is dispatched, -1 if it could not be sent.
+ */
 ssize_t hvac_client_comm_gen_open_rpc(uint32_t svr_hash, string path, int fd)
 {
     // HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_open_rpc)_total");
-    hg_addr_t svr_addr;
     hvac_open_in_t in;
     hg_handle_t handle;
     struct hvac_open_state *hvac_open_state_p;
-    struct hvac_sync_context sync_ctx;  // Individual sync context
     int ret;
-    ssize_t result = -1;
 
     // Initialize FD state as opening before starting RPC
-    hvac_set_fd_opening(fd);
-
-    /* Get address */
-    {
-        HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_open_rpc)_addr_lookup");
-        svr_addr = hvac_client_comm_lookup_addr(svr_hash);
-    } 
+    uint32_t gen = hvac_fdtable_generation(fd);
+    hvac_set_fd_opening(fd, svr_hash, gen);
 
-    /* Allocate args for callback pass through */
+    /* Allocate args for callback pass through - freed by hvac_open_cb */
     hvac_open_state_p = (struct hvac_open_state *)malloc(sizeof(*hvac_open_state_p));
     hvac_open_state_p->local_fd = fd;
-    hvac_open_state_p->sync_ctx = &sync_ctx;  // Link to our sync context
+    hvac_open_state_p->gen = gen;
+    hvac_open_state_p->server = svr_hash;
 
     /* create create handle to represent this rpc operation */    
-    hvac_comm_create_handle(svr_addr, hvac_client_open_id, &handle);  
+    {
+        HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_open_rpc)_addr_lookup");
+        hvac_client_comm_create_handle(svr_hash, hvac_client_open_id, &handle);
+    }
 
     in.path = (hg_string_t)malloc(strlen(path.c_str()) + 1 );
     sprintf(in.path,"%s",path.c_str());
+    hvac_request_begin(&hvac_open_state_p->req);
+    in.req_id = hvac_open_state_p->req.id;
     
     ret = HG_Forward(handle, hvac_open_cb, hvac_open_state_p, &in);
     if (ret != 0) {
         // If RPC dispatch failed, mark as error
-        hvac_set_fd_error(fd);
+        hvac_set_fd_error(fd, gen);
         free(hvac_open_state_p);
         free(in.path);
-        hvac_comm_free_addr(svr_addr);
+        HG_Destroy(handle);
         return -1;
     }
 
-    hvac_comm_free_addr(svr_addr);
-
-    // Wait for the operation to complete using individual sync context
-    {
-        HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_open_rpc)_wait_for_operation");
-        result = hvac_wait_for_operation(&sync_ctx, "OPEN");
-    }
-    
-    // Clean up resources
-    free(hvac_open_state_p);
+    // The input has been serialized by HG_Forward so the path can go now
     free(in.path);
-    
-    return result;
+
+    return 0;
 }
 
-ssize_t hvac_client_comm_gen_read_rpc(uint32_t svr_hash, int localfd, void *buffer, ssize_t count, off_t offset)
+/* An in-flight read started by hvac_client_comm_start_read_rpc.
+ * Heap allocated so the caller can go do something else and collect the
+ * result later with hvac_client_comm_wait_read_rpc.
+ */
+struct hvac_read_op {
+    struct hvac_sync_context sync_ctx;
+};
+
+struct hvac_read_op *hvac_client_comm_start_read_rpc(uint32_t svr_hash, int localfd, void *buffer, ssize_t count, off_t offset)
 {
-    HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_read_rpc)_total");
-    hg_addr_t svr_addr;
+    HVAC_TIMING("HvacCommClient_(hvac_client_comm_start_read_rpc)_total");
     hvac_rpc_in_t in;
     const struct hg_info *hgi;
     int ret;
     struct hvac_rpc_state *hvac_rpc_state_p;
-    struct hvac_sync_context sync_ctx;  // Individual sync context
-    ssize_t result = -1;
+    struct hvac_read_op *read_op;
 
     // Wait for FD to be ready before proceeding with read
     {
         HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_read_rpc)_wait_fd_ready");
         if (!hvac_wait_fd_ready(localfd)) {
         L4C_ERR("File descriptor %d not ready for read operation", localfd);
-        return -1;
+        return NULL;
     }
     }
 
     // Double-check that we have a valid remote FD mapping
-    if (fd_redir_map.find(localfd) == fd_redir_map.end() || fd_redir_map[localfd] == 0) {
+    if (hvac_fdtable_remote(localfd) == 0) {
         L4C_ERR("No valid remote FD mapping for local fd %d", localfd);
-        return -1;
+        return NULL;
     }
 
-    /* Get address */
-    svr_addr = hvac_client_comm_lookup_addr(svr_hash);
+    read_op = new hvac_read_op();
 
     /* set up state structure */
     hvac_rpc_state_p = (struct hvac_rpc_state *)malloc(sizeof(*hvac_rpc_state_p));
     hvac_rpc_state_p->size = count;
-    hvac_rpc_state_p->sync_ctx = &sync_ctx;  // Link to our sync context
+    hvac_rpc_state_p->sync_ctx = &read_op->sync_ctx;  // Link to the op's sync context
+    read_op->sync_ctx.server = svr_hash;
+    read_op->sync_ctx.timeout_ms = g_read_timeout_ms;
 
     /* This includes allocating a src buffer for bulk transfer */
     hvac_rpc_state_p->buffer = buffer;
@@ -490,7 +686,8 @@ ssize_t hvac_client_comm_gen_read_rpc(uint32_t svr_hash, int localfd, void *buff
     //hvac_rpc_state_p->value = 5;
 
     /* create create handle to represent this rpc operation */
-    hvac_comm_create_handle(svr_addr, hvac_client_rpc_id, &(hvac_rpc_state_p->handle));
+    hvac_client_comm_create_handle(svr_hash, hvac_client_rpc_id, &(hvac_rpc_state_p->handle));
+    read_op->sync_ctx.handle = hvac_rpc_state_p->handle;
 
     /* register buffer for rdma/bulk access by server */
     hgi = HG_Get_info(hvac_rpc_state_p->handle);
@@ -506,8 +703,11 @@ ssize_t hvac_client_comm_gen_read_rpc(uint32_t svr_hash, int localfd, void *buff
      */
     in.input_val = count;
     //Convert FD to remote FD - now safe since we verified it exists
-    in.accessfd = fd_redir_map[localfd];
+    in.accessfd = hvac_fdtable_remote(localfd);
     in.offset = offset;
+    hvac_request_begin(&hvac_rpc_state_p->req);
+    in.req_id = hvac_rpc_state_p->req.id;
+    read_op->sync_ctx.req_id = in.req_id;
     
     ret = HG_Forward(hvac_rpc_state_p->handle, hvac_read_cb, hvac_rpc_state_p, &in);
     if (ret != 0) {
@@ -515,102 +715,355 @@ ssize_t hvac_client_comm_gen_read_rpc(uint32_t svr_hash, int localfd, void *buff
         HG_Bulk_free(hvac_rpc_state_p->bulk_handle);
         HG_Destroy(hvac_rpc_state_p->handle);
         free(hvac_rpc_state_p);
-        hvac_comm_free_addr(svr_addr);
-        return -1;
+        delete read_op;
+        return NULL;
     }
 
-    hvac_comm_free_addr(svr_addr);
 
-    // Wait for the operation to complete using individual sync context
+    // Note: hvac_rpc_state_p is freed in the callback, read_op by the waiter
+    return read_op;
+}
+
+/* Read one block of a striped file from the server that owns the block.
+ * No fd state to wait on - the block owner opens the file by path.
+ */
+struct hvac_read_op *hvac_client_comm_start_stripe_read_rpc(uint32_t svr_hash, const string &path, void *buffer, ssize_t count, off_t offset)
+{
+    HVAC_TIMING("HvacCommClient_(hvac_client_comm_start_stripe_read_rpc)_total");
+    hvac_stripe_read_in_t in;
+    const struct hg_info *hgi;
+    int ret;
+    struct hvac_rpc_state *hvac_rpc_state_p;
+    struct hvac_read_op *read_op;
+
+    read_op = new hvac_read_op();
+
+    /* set up state structure */
+    hvac_rpc_state_p = (struct hvac_rpc_state *)malloc(sizeof(*hvac_rpc_state_p));
+    hvac_rpc_state_p->size = count;
+    hvac_rpc_state_p->sync_ctx = &read_op->sync_ctx;
+    read_op->sync_ctx.server = svr_hash;
+    read_op->sync_ctx.timeout_ms = g_read_timeout_ms;
+    hvac_rpc_state_p->buffer = buffer;
+    assert(hvac_rpc_state_p->buffer);
+
+    hvac_client_comm_create_handle(svr_hash, hvac_client_stripe_read_id, &(hvac_rpc_state_p->handle));
+    read_op->sync_ctx.handle = hvac_rpc_state_p->handle;
+
+    /* register buffer for rdma/bulk access by server */
+    hgi = HG_Get_info(hvac_rpc_state_p->handle);
+    assert(hgi);
+    ret = HG_Bulk_create(hgi->hg_class, 1, (void**) &(buffer),
+       &(hvac_rpc_state_p->size), HG_BULK_WRITE_ONLY, &(in.bulk_handle));
+
+    hvac_rpc_state_p->bulk_handle = in.bulk_handle;
+    assert(ret == HG_SUCCESS);
+
+    in.path = (hg_string_t)path.c_str();
+    in.offset = offset;
+    in.length = count;
+    hvac_request_begin(&hvac_rpc_state_p->req);
+    in.req_id = hvac_rpc_state_p->req.id;
+    read_op->sync_ctx.req_id = in.req_id;
+
+    // Same output as a plain read, so the plain read callback completes it
+    ret = HG_Forward(hvac_rpc_state_p->handle, hvac_read_cb, hvac_rpc_state_p, &in);
+    if (ret != 0) {
+        HG_Bulk_free(hvac_rpc_state_p->bulk_handle);
+        HG_Destroy(hvac_rpc_state_p->handle);
+        free(hvac_rpc_state_p);
+        delete read_op;
+        return NULL;
+    }
+
+    return read_op;
+}
+
+ssize_t hvac_client_comm_wait_read_rpc(struct hvac_read_op *read_op)
+{
+    ssize_t result;
+
+    if (read_op == NULL)
+        return -1;
+
     {
         HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_read_rpc)_wait_for_operation");
-        result = hvac_wait_for_operation(&sync_ctx, "READ");
-    }    
-    // Note: hvac_rpc_state_p is freed in the callback, sync_ctx is stack-allocated
+        result = hvac_wait_for_operation(&read_op->sync_ctx, "READ");
+    }
+    delete read_op;
     return result;
 }
 
-ssize_t hvac_client_comm_gen_seek_rpc(uint32_t svr_hash, int fd, int offset, int whence)
+ssize_t hvac_client_comm_gen_read_rpc(uint32_t svr_hash, int localfd, void *buffer, ssize_t count, off_t offset)
 {
-    hg_addr_t svr_addr;
-    hvac_seek_in_t in;
-    hg_handle_t handle;
-    struct hvac_seek_state *seek_state_p;
-    struct hvac_sync_context sync_ctx;  // Individual sync context
+    HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_read_rpc)_total");
+    struct hvac_read_op *read_op = hvac_client_comm_start_read_rpc(svr_hash, localfd, buffer, count, offset);
+
+    return hvac_client_comm_wait_read_rpc(read_op);
+}
+
+/* Vectored read: every iovec entry becomes one extent and one segment of
+ * a single bulk handle, so the server answers the whole gather with one
+ * RPC. Returns the contiguous prefix like preadv(), -1 to fall back.
+ */
+ssize_t hvac_client_comm_gen_readv_rpc(uint32_t svr_hash, int localfd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_readv_rpc)_total");
+    hvac_readv_in_t in;
+    const struct hg_info *hgi;
     int ret;
-    ssize_t result = -1;
+    struct hvac_rpc_state *hvac_rpc_state_p;
+    struct hvac_read_op *read_op;
+    std::vector<void *> segments;
+    std::vector<hg_size_t> sizes;
+    std::vector<int64_t> offsets, lengths;
+    hg_size_t total = 0;
+    ssize_t result;
 
-    /* Get address */
-    svr_addr = hvac_client_comm_lookup_addr(svr_hash);    
+    if (iovcnt <= 0 || iovcnt > HVAC_READV_MAX_EXTENTS)
+        return -1;
 
-    /* Allocate args for callback pass through */    
-    seek_state_p = (struct hvac_seek_state *)malloc(sizeof(*seek_state_p));
-    seek_state_p->fd = fd;
-    seek_state_p->sync_ctx = &sync_ctx;  // Link to our sync context
-    
-    /* create create handle to represent this rpc operation */    
-    hvac_comm_create_handle(svr_addr, hvac_client_seek_id, &handle);  
+    {
+        HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_readv_rpc)_wait_fd_ready");
+        if (!hvac_wait_fd_ready(localfd)) {
+            L4C_ERR("File descriptor %d not ready for readv operation", localfd);
+            return -1;
+        }
+    }
+    if (hvac_fdtable_remote(localfd) == 0) {
+        L4C_ERR("No valid remote FD mapping for local fd %d", localfd);
+        return -1;
+    }
 
-    in.fd = fd_redir_map[fd];
-    in.offset = offset;
-    in.whence = whence;
-    
-    ret = HG_Forward(handle, hvac_seek_cb, seek_state_p, &in);
-    assert(ret == 0);
+    // Empty entries carry no data, leave them out of both lists
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0)
+            continue;
+        segments.push_back(iov[i].iov_base);
+        sizes.push_back(iov[i].iov_len);
+        offsets.push_back(offset == -1 ? -1 : (int64_t)(offset + total));
+        lengths.push_back(iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    if (total == 0)
+        return 0;
 
-    hvac_comm_free_addr(svr_addr);
+    read_op = new hvac_read_op();
+    hvac_rpc_state_p = (struct hvac_rpc_state *)malloc(sizeof(*hvac_rpc_state_p));
+    hvac_rpc_state_p->size = total;
+    hvac_rpc_state_p->sync_ctx = &read_op->sync_ctx;
+    read_op->sync_ctx.server = svr_hash;
+    read_op->sync_ctx.timeout_ms = g_read_timeout_ms;
+    hvac_rpc_state_p->buffer = segments[0];
 
-    // Wait for the operation to complete using individual sync context
-    result = hvac_wait_for_operation(&sync_ctx, "SEEK");
-    
-    // Clean up resources
-    free(seek_state_p);
-    
+    hvac_client_comm_create_handle(svr_hash, hvac_client_readv_id, &(hvac_rpc_state_p->handle));
+    read_op->sync_ctx.handle = hvac_rpc_state_p->handle;
+
+    /* one bulk segment per iovec entry */
+    hgi = HG_Get_info(hvac_rpc_state_p->handle);
+    assert(hgi);
+    ret = HG_Bulk_create(hgi->hg_class, segments.size(), segments.data(),
+       sizes.data(), HG_BULK_WRITE_ONLY, &(in.bulk_handle));
+    assert(ret == HG_SUCCESS);
+    hvac_rpc_state_p->bulk_handle = in.bulk_handle;
+
+    in.accessfd = hvac_fdtable_remote(localfd);
+    in.extents.count = offsets.size();
+    in.extents.offsets = offsets.data();
+    in.extents.lengths = lengths.data();
+    hvac_request_begin(&hvac_rpc_state_p->req);
+    in.req_id = hvac_rpc_state_p->req.id;
+    read_op->sync_ctx.req_id = in.req_id;
+
+    // Same output as a plain read, so the plain read callback completes it
+    ret = HG_Forward(hvac_rpc_state_p->handle, hvac_read_cb, hvac_rpc_state_p, &in);
+    if (ret != 0) {
+        HG_Bulk_free(hvac_rpc_state_p->bulk_handle);
+        HG_Destroy(hvac_rpc_state_p->handle);
+        free(hvac_rpc_state_p);
+        delete read_op;
+        return -1;
+    }
+
+    result = hvac_client_comm_wait_read_rpc(read_op);
     return result;
 }
 
+struct hvac_dir_snapshot_client_state {
+    struct hvac_sync_context *sync_ctx;
+    hg_bulk_t bulk_handle;
+    int64_t used;
+    int64_t needed;
+    uint64_t gen;
+};
 
-//We've converted the filename to a rank
-//Using standard c++ hashing modulo servers
-//Find the address
-hg_addr_t hvac_client_comm_lookup_addr(int rank)
+static hg_return_t
+hvac_dir_snapshot_cb(const struct hg_cb_info *info)
+{
+    struct hvac_dir_snapshot_client_state *state = (struct hvac_dir_snapshot_client_state *)info->arg;
+    hvac_dir_snapshot_out_t out;
+    ssize_t ret = -EIO;
+
+    if (info->ret == HG_SUCCESS) {
+        HG_Get_output(info->info.forward.handle, &out);
+        ret = out.ret;
+        state->used = out.used;
+        state->needed = out.needed;
+        state->gen = out.gen;
+        HG_Free_output(info->info.forward.handle, &out);
+    }
+    HG_Bulk_free(state->bulk_handle);
+    hvac_completion_complete(state->sync_ctx->completion, ret);
+    return HG_SUCCESS;
+}
+
+int hvac_client_comm_gen_dir_snapshot_rpc(uint32_t svr_hash, const string &dir, void *buf, size_t capacity,
+                                          uint64_t have_gen, size_t *used, size_t *needed, uint64_t *gen)
+{
+    HVAC_TIMING("HvacCommClient_(hvac_client_comm_gen_dir_snapshot_rpc)_total");
+    hvac_dir_snapshot_in_t in;
+    struct hvac_dir_snapshot_client_state state;
+    struct hvac_sync_context sync_ctx;
+    const struct hg_info *hgi;
+    hg_size_t size = capacity;
+    hg_handle_t handle;
+    ssize_t result;
+    int ret;
+
+    state.sync_ctx = &sync_ctx;
+    state.used = 0;
+    state.needed = 0;
+    state.gen = 0;
+
+    hvac_client_comm_create_handle(svr_hash, hvac_client_dir_snapshot_id, &handle);
+    sync_ctx.handle = handle;
+    sync_ctx.server = svr_hash;
+    sync_ctx.timeout_ms = g_read_timeout_ms;
+
+    hgi = HG_Get_info(handle);
+    assert(hgi);
+    ret = HG_Bulk_create(hgi->hg_class, 1, &buf, &size, HG_BULK_WRITE_ONLY, &state.bulk_handle);
+    assert(ret == HG_SUCCESS);
+
+    in.path = (hg_string_t)dir.c_str();
+    in.bulk_handle = state.bulk_handle;
+    in.capacity = capacity;
+    in.have_gen = have_gen;
+
+    ret = HG_Forward(handle, hvac_dir_snapshot_cb, &state, &in);
+    if (ret != 0) {
+        HG_Bulk_free(state.bulk_handle);
+        HG_Destroy(handle);
+        return -EIO;
+    }
+
+    result = hvac_wait_for_operation(&sync_ctx, "DIR_SNAPSHOT");
+    *used = state.used;
+    *needed = state.needed;
+    *gen = state.gen;
+    return result < 0 ? (int)result : 0;
+}
+
+/* Find rank in .ports.cfg and look it up on the right class. Servers on
+ * our own node that posted an na+sm address are reached over shared
+ * memory, everything else over the fabric. */
+static bool hvac_client_comm_resolve(int rank, struct hvac_server_addr *server)
 {
-	L4C_INFO("AWAIS RANK %d", rank);
-	if (address_cache.find(rank) != address_cache.end())
+	pthread_mutex_lock(&address_cache_mutex);
+	auto it = address_cache.find(rank);
+	if (it != address_cache.end())
 	{
-        hg_addr_t target_server;
-        HG_Addr_lookup2(hvac_comm_get_class(), address_cache[rank].c_str(), &target_server);
-		return target_server;
+		*server = it->second;
+		pthread_mutex_unlock(&address_cache_mutex);
+		return true;
 	}
 
 	/* The hardway */
 	char filename[PATH_MAX];
+	char line[3 * PATH_MAX];
 	char svr_str[PATH_MAX];
+	char node_str[PATH_MAX];
+	char sm_str[PATH_MAX];
+	char my_node[256];
 	int svr_rank = -1;
+	int fields = 0;
 	char *jobid = getenv("SLURM_JOBID");
-	hg_addr_t target_server = nullptr;
 	bool svr_found = false;
 	FILE *na_config = NULL;
 	sprintf(filename, "./.ports.cfg.%s", jobid);
-	na_config = fopen(filename,"r+");
-    
+	na_config = fopen(filename,"r");
+	if (na_config == NULL)
+	{
+		L4C_ERR("Could not open config file %s", filename);
+		pthread_mutex_unlock(&address_cache_mutex);
+		return false;
+	}
 
-	while (fscanf(na_config, "%d %s\n",&svr_rank, svr_str) == 2)
+	while (fgets(line, sizeof(line), na_config) != NULL)
 	{
-		if (svr_rank == rank){
-			L4C_INFO("Connecting to %s %d\n", svr_str, svr_rank);            
+		fields = sscanf(line, "%d %s %s %s", &svr_rank, svr_str, node_str, sm_str);
+		if (fields >= 2 && svr_rank == rank){
 			svr_found = true;
             break;
 		}
 	}
+	fclose(na_config);
+
+	if (!svr_found){
+		pthread_mutex_unlock(&address_cache_mutex);
+		return false;
+	}
+
+	struct hvac_server_addr found;
+	found.addr = HG_ADDR_NULL;
+	found.sm = false;
 
-	if (svr_found){
-		//Do something
-        address_cache[rank] = svr_str;
-        HG_Addr_lookup2(hvac_comm_get_class(),svr_str,&target_server);		
+	hvac_comm_node_id(my_node, sizeof(my_node));
+	if (fields == 4 && hvac_comm_get_sm_class() != NULL &&
+		strcmp(sm_str, "-") != 0 && strcmp(node_str, my_node) == 0)
+	{
+		L4C_INFO("Connecting to %s %d over na+sm\n", sm_str, svr_rank);
+		if (HG_Addr_lookup2(hvac_comm_get_sm_class(), sm_str, &found.addr) == HG_SUCCESS)
+			found.sm = true;
+	}
+	if (!found.sm)
+	{
+		L4C_INFO("Connecting to %s %d\n", svr_str, svr_rank);
+		HG_Addr_lookup2(hvac_comm_get_class(), svr_str, &found.addr);
 	}
 
-	return target_server;
+	if (found.addr != HG_ADDR_NULL)
+		address_cache[rank] = found;
+	pthread_mutex_unlock(&address_cache_mutex);
+
+	*server = found;
+	return found.addr != HG_ADDR_NULL;
+}
+
+//We've converted the filename to a rank
+//Find the address - owned by the address cache, do not free it
+hg_addr_t hvac_client_comm_lookup_addr(int rank)
+{
+	struct hvac_server_addr server;
+
+	if (!hvac_client_comm_resolve(rank, &server))
+		return HG_ADDR_NULL;
+	return server.addr;
+}
+
+/* Create a handle for an RPC to rank on whichever context can reach it */
+void hvac_client_comm_create_handle(int rank, hg_id_t id, hg_handle_t *handle)
+{
+	struct hvac_server_addr server;
+	hg_return_t ret;
+
+	bool found = hvac_client_comm_resolve(rank, &server);
+	assert(found);
+	(void) found;
+
+	ret = HG_Create(hvac_comm_pick_context(server.sm, rank), server.addr, id, handle);
+	assert(ret == HG_SUCCESS);
+	(void) ret;
 }
 
 // Callback for the client after the server responds to the print stats request
@@ -670,10 +1123,7 @@ extern "C" int hvac_client_request_server_to_print_stats(const char* server_rank
     int operation_status = -10; // Default status: uninitialized/failed to complete
 
     // Create an RPC handle
-    hvac_comm_create_handle(server_address, hvac_client_trigger_srv_print_stats_rpc_id, &rpc_handle);
-
-    // Create individual sync context for this operation
-    struct hvac_sync_context sync_ctx;
+    hvac_client_comm_create_handle(server_rank_int, hvac_client_trigger_srv_print_stats_rpc_id, &rpc_handle);
 
     // Send the RPC request (HG_Forward) - using simplified approach for stats RPC
     hg_status = HG_Forward(rpc_handle,                        // RPC handle
@@ -684,7 +1134,6 @@ extern "C" int hvac_client_request_server_to_print_stats(const char* server_rank
     if (hg_status != HG_SUCCESS) {
         L4C_ERR("hvac_client_request_server_to_print_stats: HG_Forward() failed with error %d.", hg_status);
         HG_Destroy(rpc_handle);         // Clean up handle on failure
-        hvac_comm_free_addr(server_address); // Free looked-up address
         return -5; // HG_Forward call failed
     }
     
@@ -692,7 +1141,7 @@ extern "C" int hvac_client_request_server_to_print_stats(const char* server_rank
     HG_Destroy(rpc_handle);
     operation_status = 0; // Assume success for fire-and-forget
 
-    hvac_comm_free_addr(server_address); // Free the server address resource
+    // server_address belongs to the address cache, nothing to free
 
     return operation_status; // Return the status set by the callback (0 for success)
 }
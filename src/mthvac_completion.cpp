@@ -0,0 +1,128 @@
+/* Futex based RPC completion - see mthvac_completion.h */
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include "mthvac_completion.h"
+
+// Polls before parking, roughly a few microseconds on current cores.
+// Spinning only pays if the progress thread can run meanwhile, so a
+// single CPU process parks straight away.
+#define HVAC_COMPLETION_SPINS 2000
+// Completions kept per thread, the rest go back to the heap
+#define HVAC_COMPLETION_FREE_MAX 64
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits");
+
+static __thread struct hvac_completion *tl_completion_free = NULL;
+static __thread int tl_completion_free_count = 0;
+
+static int hvac_completion_spins()
+{
+    static int spins = -1;
+    if (spins < 0)
+        spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? HVAC_COMPLETION_SPINS : 0;
+    return spins;
+}
+
+static inline void hvac_cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+static long hvac_futex(std::atomic<uint32_t> *word, int op, uint32_t val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), op, val, timeout, NULL, 0);
+}
+
+struct hvac_completion *hvac_completion_get()
+{
+    struct hvac_completion *c = tl_completion_free;
+
+    if (c != NULL) {
+        tl_completion_free = c->next_free;
+        tl_completion_free_count--;
+    } else {
+        c = new hvac_completion();
+    }
+    c->state.store(HVAC_COMPLETION_PENDING, std::memory_order_relaxed);
+    c->result = -1;
+    c->next_free = NULL;
+    return c;
+}
+
+void hvac_completion_put(struct hvac_completion *c)
+{
+    if (c == NULL)
+        return;
+    if (tl_completion_free_count >= HVAC_COMPLETION_FREE_MAX) {
+        delete c;
+        return;
+    }
+    c->next_free = tl_completion_free;
+    tl_completion_free = c;
+    tl_completion_free_count++;
+}
+
+void hvac_completion_complete(struct hvac_completion *c, ssize_t result)
+{
+    c->result = result;
+    // The waiter may reuse c as soon as it sees DONE - a wake that lands on
+    // a recycled word is just a spurious wakeup for its next owner
+    if (c->state.exchange(HVAC_COMPLETION_DONE, std::memory_order_acq_rel) == HVAC_COMPLETION_WAITING)
+        hvac_futex(&c->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+}
+
+bool hvac_completion_wait(struct hvac_completion *c, int timeout_ms)
+{
+    struct timespec deadline, now, left;
+
+    for (int i = 0, spins = hvac_completion_spins(); i < spins; i++) {
+        if (c->state.load(std::memory_order_acquire) == HVAC_COMPLETION_DONE)
+            return true;
+        hvac_cpu_relax();
+    }
+
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    for (;;) {
+        uint32_t state = HVAC_COMPLETION_PENDING;
+        if (!c->state.compare_exchange_strong(state, HVAC_COMPLETION_WAITING, std::memory_order_acq_rel,
+                                              std::memory_order_acquire) &&
+            state == HVAC_COMPLETION_DONE)
+            return true;
+
+        // FUTEX_WAIT takes a relative timeout measured on CLOCK_MONOTONIC
+        const struct timespec *timeout = NULL;
+        if (timeout_ms > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left.tv_sec = deadline.tv_sec - now.tv_sec;
+            left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (left.tv_nsec < 0) {
+                left.tv_sec--;
+                left.tv_nsec += 1000000000L;
+            }
+            if (left.tv_sec < 0)
+                return c->state.load(std::memory_order_acquire) == HVAC_COMPLETION_DONE;
+            timeout = &left;
+        }
+
+        hvac_futex(&c->state, FUTEX_WAIT_PRIVATE, HVAC_COMPLETION_WAITING, timeout);
+        if (c->state.load(std::memory_order_acquire) == HVAC_COMPLETION_DONE)
+            return true;
+    }
+}
@@ -8,6 +8,8 @@
 
 #include <pthread.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "hvac_logging.h"
 #include "mthvac_data_mover_internal.h"
@@ -17,13 +19,148 @@ namespace fs = std::filesystem;
 pthread_cond_t data_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Open and close handlers run on the fabric and na+sm progress threads alike
+pthread_mutex_t fd_to_path_mutex = PTHREAD_MUTEX_INITIALIZER;
 map<int,string> fd_to_path;
 map<string, string> path_cache_map;
 queue<string> data_queue;
+queue<struct hvac_stage_range> range_queue;
+map<string, struct hvac_range_copy> range_copy_map;
+std::atomic<uint64_t> data_staging{0};
+std::atomic<uint64_t> data_staged{0};
+std::atomic<uint64_t> data_stage_failures{0};
+
+bool hvac_cached_copy(const string &path, string *copy)
+{
+    pthread_mutex_lock(&data_mutex);
+    auto it = path_cache_map.find(path);
+    bool found = (it != path_cache_map.end());
+    if (found)
+        *copy = it->second;
+    pthread_mutex_unlock(&data_mutex);
+    return found;
+}
+
+static bool hvac_range_covered_locked(const struct hvac_range_copy &rc, uint64_t offset, uint64_t length)
+{
+    auto it = rc.ranges.upper_bound(offset);
+    if (it == rc.ranges.begin())
+        return false;
+    --it;
+    return it->first <= offset && it->second >= offset + length;
+}
+
+bool hvac_cached_range(const string &path, uint64_t offset, uint64_t length, string *copy)
+{
+    pthread_mutex_lock(&data_mutex);
+    auto it = range_copy_map.find(path);
+    bool found = (it != range_copy_map.end() && hvac_range_covered_locked(it->second, offset, length));
+    if (found)
+        *copy = it->second.file;
+    pthread_mutex_unlock(&data_mutex);
+    return found;
+}
+
+void hvac_stage_file(const string &path)
+{
+    pthread_mutex_lock(&data_mutex);
+    data_queue.push(path);
+    pthread_cond_signal(&data_cond);
+    pthread_mutex_unlock(&data_mutex);
+}
+
+void hvac_stage_range(const string &path, uint64_t offset, uint64_t length)
+{
+    pthread_mutex_lock(&data_mutex);
+    range_queue.push({path, offset, length});
+    pthread_cond_signal(&data_cond);
+    pthread_mutex_unlock(&data_mutex);
+}
+
+// Fresh directory on the burst buffer for the copy of path
+static string hvac_stage_target(const string &nvmepath, const string &path)
+{
+    char *newdir = (char *)malloc(strlen(nvmepath.c_str())+1);
+    strcpy(newdir,nvmepath.c_str());
+    char *dir_name = mkdtemp(newdir);
+    if(dir_name == NULL)
+        fprintf(stderr, "%s dir creation failed\n", newdir);
+    string dirpath = newdir;
+    free(newdir);
+    return dirpath + string("/") + fs::path(path.c_str()).filename().string();
+}
+
+// Copy one range of a striped file into its sparse copy and mark it staged
+static void hvac_copy_range(const string &nvmepath, const struct hvac_stage_range &r)
+{
+    string file;
+    bool fresh = false;
+
+    pthread_mutex_lock(&data_mutex);
+    auto it = range_copy_map.find(r.path);
+    if (it != range_copy_map.end()) {
+        file = it->second.file;
+        if (hvac_range_covered_locked(it->second, r.offset, r.length)) {
+            pthread_mutex_unlock(&data_mutex);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&data_mutex);
+    if (file.empty()) {
+        file = hvac_stage_target(nvmepath, r.path);
+        fresh = true;
+    }
+
+    int src = open(r.path.c_str(), O_RDONLY);
+    int dst = open(file.c_str(), O_WRONLY | O_CREAT, 0600);
+    char *buf = (char *)malloc(1 << 20);
+    uint64_t done = 0;
+    bool eof = false;
+    while (src >= 0 && dst >= 0 && done < r.length) {
+        size_t want = r.length - done < (1 << 20) ? r.length - done : (1 << 20);
+        ssize_t got = pread(src, buf, want, r.offset + done);
+        if (got < 0 || (got > 0 && pwrite(dst, buf, got, r.offset + done) != got))
+            break;
+        done += got;
+        if ((size_t)got < want) {
+            eof = true;     // the copy ends where the file does, reads past it come back short
+            break;
+        }
+    }
+    free(buf);
+    if (src >= 0)
+        close(src);
+    if (dst >= 0)
+        close(dst);
+    if (done == 0) {
+        L4C_INFO("Failed to stage %s at %lu+%lu", r.path.c_str(), r.offset, r.length);
+        data_stage_failures++;
+        return;
+    }
+
+    // Merge with the ranges already in, they stay disjoint
+    pthread_mutex_lock(&data_mutex);
+    struct hvac_range_copy &rc = range_copy_map[r.path];
+    if (fresh && rc.file.empty())
+        rc.file = file;
+    uint64_t start = r.offset, end = r.offset + (eof ? r.length : done);
+    auto next = rc.ranges.upper_bound(start);
+    if (next != rc.ranges.begin() && prev(next)->second >= start)
+        next = prev(next);
+    while (next != rc.ranges.end() && next->first <= end) {
+        start = min(start, next->first);
+        end = max(end, next->second);
+        next = rc.ranges.erase(next);
+    }
+    rc.ranges[start] = end;
+    pthread_mutex_unlock(&data_mutex);
+    data_staged++;
+}
 
 void *hvac_data_mover_fn(void *args)
 {
     queue<string> local_list;
+    queue<struct hvac_stage_range> local_ranges;
 
     if (getenv("BBPATH") == NULL){
         L4C_ERR("Set BBPATH Prior to using HVAC");        
@@ -33,12 +170,19 @@ void *hvac_data_mover_fn(void *args)
 
     while (1) {
         pthread_mutex_lock(&data_mutex);
-        pthread_cond_wait(&data_cond, &data_mutex);
+        while (data_queue.empty() && range_queue.empty())
+            pthread_cond_wait(&data_cond, &data_mutex);
         
         /* We can do stuff here when signaled */
         while (!data_queue.empty()){
             local_list.push(data_queue.front());
             data_queue.pop();
+            data_staging++;
+        }
+        while (!range_queue.empty()){
+            local_ranges.push(range_queue.front());
+            range_queue.pop();
+            data_staging++;
         }
 
         pthread_mutex_unlock(&data_mutex);
@@ -46,23 +190,28 @@ void *hvac_data_mover_fn(void *args)
         /* Now we copy the local list to the NVMes*/
         while (!local_list.empty())
         {
-            char *newdir = (char *)malloc(strlen(nvmepath.c_str())+1);
-            strcpy(newdir,nvmepath.c_str());
-            char *dir_name = mkdtemp(newdir);
-	    if(dir_name == NULL)
-		    fprintf(stderr, "%s dir creation failed\n", newdir);
-            string dirpath = newdir;
-            string filename = dirpath + string("/") + fs::path(local_list.front().c_str()).filename().string();
+            string filename = hvac_stage_target(nvmepath, local_list.front());
 
             try{
             fs::copy(local_list.front(), filename);
+            pthread_mutex_lock(&data_mutex);
 	    path_cache_map[local_list.front()] = filename;
+            pthread_mutex_unlock(&data_mutex);
+            data_staged++;
             } catch (const fs::filesystem_error& e)
             {
-		fprintf(stderr, "Error : %s copying from %s to %s\n", e.what(), e.path1(), e.path2());
+		fprintf(stderr, "Error : %s copying from %s to %s\n", e.what(), e.path1().c_str(), e.path2().c_str());
                 L4C_INFO("Failed to copy %s to %s\n",local_list.front().c_str(), filename.c_str());
+                data_stage_failures++;
             }        
             local_list.pop();
+            data_staging--;
+        }
+        while (!local_ranges.empty())
+        {
+            hvac_copy_range(nvmepath, local_ranges.front());
+            local_ranges.pop();
+            data_staging--;
         }
     }
     return NULL;
@@ -3,6 +3,8 @@
 
 #include <queue>
 #include <map>
+#include <atomic>
+#include <stdint.h>
 
 using namespace std;
 /*Data Mover */
@@ -10,8 +12,37 @@ using namespace std;
 extern pthread_cond_t data_cond;
 extern pthread_mutex_t data_mutex;
 extern queue<string> data_queue;
-extern map<int, string> fd_to_path;
-extern map<string, string> path_cache_map;
+extern pthread_mutex_t fd_to_path_mutex;
+extern map<int, string> fd_to_path;           // under fd_to_path_mutex
+extern map<string, string> path_cache_map;     // under data_mutex
+
+/* Byte ranges of striped files. A block owner never sees the whole file,
+ * so it stages just the ranges it serves into a sparse local copy and
+ * reads them from there once they are in. Queue and map are under
+ * data_mutex. */
+struct hvac_stage_range {
+    string path;
+    uint64_t offset;
+    uint64_t length;
+};
+struct hvac_range_copy {
+    string file;                        // sparse copy on the burst buffer
+    map<uint64_t, uint64_t> ranges;     // start -> end of the staged ranges, disjoint
+};
+extern queue<struct hvac_stage_range> range_queue;
+extern map<string, struct hvac_range_copy> range_copy_map;
+
+// The cached copy of a whole file, false if there is none yet
+bool hvac_cached_copy(const string &path, string *copy);
+// The staged copy holding [offset, offset + length) of path, false if not all of it is in
+bool hvac_cached_range(const string &path, uint64_t offset, uint64_t length, string *copy);
+void hvac_stage_file(const string &path);
+void hvac_stage_range(const string &path, uint64_t offset, uint64_t length);
+// Staging progress for the stats RPC. data_staging counts files taken off
+// data_queue whose copy hasn't finished, so the backlog is both together.
+extern std::atomic<uint64_t> data_staging;
+extern std::atomic<uint64_t> data_staged;
+extern std::atomic<uint64_t> data_stage_failures;
 
 
 void *hvac_data_mover_fn(void *args);
@@ -0,0 +1,108 @@
+/* fd indexed table of tracked descriptors - see mthvac_fdtable.h */
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "mthvac_fdtable.h"
+#include "mthvac_placement.h"
+
+// Upper bound on the table, fds past it are simply never tracked
+#define HVAC_FDTABLE_MAX (1 << 20)
+
+struct hvac_fd_entry *g_hvac_fdtable = NULL;
+int g_hvac_fdtable_size = 0;
+std::atomic<int> g_hvac_fdtable_high{0};
+
+void hvac_fdtable_init()
+{
+    struct rlimit rl;
+    size_t size = 65536;
+    void *table;
+
+    if (g_hvac_fdtable != NULL)
+        return;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY)
+        size = rl.rlim_max;
+    if (size > HVAC_FDTABLE_MAX)
+        size = HVAC_FDTABLE_MAX;
+
+    // Anonymous pages arrive zeroed and only get backed once touched
+    table = mmap(NULL, size * sizeof(struct hvac_fd_entry), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED)
+        return;
+    g_hvac_fdtable = (struct hvac_fd_entry *)table;
+    g_hvac_fdtable_size = size;
+}
+
+// Bump the generation and clear the remote fd, returning the old word
+static uint64_t hvac_fdtable_next_generation(struct hvac_fd_entry *e)
+{
+    uint64_t old = e->remote.load(std::memory_order_relaxed);
+    while (!e->remote.compare_exchange_weak(old, ((old >> 32) + 1) << 32, std::memory_order_acq_rel))
+        ;
+    return old;
+}
+
+bool hvac_fdtable_track(int fd, const std::string &path)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+
+    if (e == NULL)
+        return false;
+    e->path_hash = hvac_hash64(path.data(), path.size());
+    e->server = hvac_place_hash(e->path_hash);
+    hvac_fdtable_next_generation(e);
+    e->offset.store(0, std::memory_order_relaxed);
+    e->striped.store(false, std::memory_order_relaxed);
+    e->path.store(strdup(path.c_str()), std::memory_order_release);
+
+    int high = g_hvac_fdtable_high.load(std::memory_order_relaxed);
+    while (fd >= high && !g_hvac_fdtable_high.compare_exchange_weak(high, fd + 1, std::memory_order_relaxed))
+        ;
+    return true;
+}
+
+void hvac_fdtable_untrack(int fd)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+
+    if (e == NULL)
+        return;
+    // seq_cst pairs with hvac_fdtable_copy_path: a reader that got the old
+    // path registered before this exchange and is seen below
+    const char *path = e->path.exchange(NULL);
+    e->striped.store(false, std::memory_order_relaxed);
+    hvac_fdtable_next_generation(e);
+    while (e->readers.load() != 0)
+        sched_yield();
+    free((void *)path);
+}
+
+bool hvac_fdtable_copy_path(int fd, std::string &out)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+    bool tracked = false;
+
+    if (e == NULL)
+        return false;
+    e->readers.fetch_add(1);
+    const char *path = e->path.load();
+    if (path != NULL) {
+        out = path;
+        tracked = true;
+    }
+    e->readers.fetch_sub(1, std::memory_order_release);
+    return tracked;
+}
+
+int32_t hvac_fdtable_take_remote(int fd)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+
+    if (e == NULL)
+        return 0;
+    return (int32_t)(uint32_t)hvac_fdtable_next_generation(e);
+}
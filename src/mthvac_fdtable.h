@@ -0,0 +1,130 @@
+/* fd indexed table of tracked descriptors
+ *
+ * Every intercepted read / pread / close asks "is this fd ours?". The
+ * answer used to come from std::unordered_maps that the loader threads
+ * and the progress thread both mutate without a lock. Instead there is
+ * one flat array indexed by fd, sized from RLIMIT_NOFILE and left to the
+ * kernel to zero fill lazily, so an untracked fd costs one atomic load.
+ * Each entry caches what the I/O path needs: the canonical path, its
+ * hash, the server it is placed on and the remote fd once the open RPC
+ * lands, so no request hashes the path again. The file position of a
+ * tracked fd lives here too: every read the client sends is positional,
+ * the server never keeps a position for us.
+ *
+ * Entries are published by storing the path last (release) and cleared by
+ * storing NULL first, so a reader that sees a path sees the rest too.
+ * The path itself is only ever handed out as a copy: readers announce
+ * themselves in the slot while copying and untrack waits for them before
+ * freeing, so a close racing a fault or a log line can't free it under
+ * them.
+ *
+ * The remote fd shares a word with a generation that moves on whenever
+ * the slot is tracked, untracked or its remote fd taken for closing. An
+ * open RPC remembers the generation it was sent under and only installs
+ * its result if the slot is still in it, so a reply that lands after the
+ * local fd was closed (and maybe reused) can't attach to the new file.
+ */
+#ifndef __HVAC_FDTABLE_H__
+#define __HVAC_FDTABLE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+struct hvac_fd_entry {
+    std::atomic<const char *> path;     // NULL when the fd isn't tracked
+    std::atomic<uint64_t> remote;       // generation << 32 | remote fd, 0 until the open RPC lands
+    std::atomic<int64_t> offset;        // read() / lseek() position
+    std::atomic<uint32_t> readers;      // threads copying path right now
+    std::atomic<bool> striped;          // blocks placed one by one, see mthvac_stripe.h
+    uint32_t server;
+    uint64_t path_hash;
+};
+
+extern struct hvac_fd_entry *g_hvac_fdtable;
+extern int g_hvac_fdtable_size;
+// One past the highest fd ever tracked, walks over the table stop there
+extern std::atomic<int> g_hvac_fdtable_high;
+
+void hvac_fdtable_init();
+
+// Start tracking fd in a new generation. Returns false if fd is beyond the table.
+bool hvac_fdtable_track(int fd, const std::string &path);
+void hvac_fdtable_untrack(int fd);
+
+static inline struct hvac_fd_entry *hvac_fdtable_entry(int fd)
+{
+    if (fd < 0 || fd >= g_hvac_fdtable_size)
+        return NULL;
+    return &g_hvac_fdtable[fd];
+}
+
+static inline bool hvac_fdtable_tracked(int fd)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+    return e && e->path.load(std::memory_order_acquire) != NULL;
+}
+
+// Copy the path of fd into out. False (out untouched) if it isn't tracked.
+bool hvac_fdtable_copy_path(int fd, std::string &out);
+
+static inline uint32_t hvac_fdtable_server(int fd)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+    return e ? e->server : 0;
+}
+
+static inline int32_t hvac_fdtable_remote(int fd)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+    return e ? (int32_t)(uint32_t)e->remote.load(std::memory_order_acquire) : 0;
+}
+
+static inline uint32_t hvac_fdtable_generation(int fd)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+    return e ? (uint32_t)(e->remote.load(std::memory_order_acquire) >> 32) : 0;
+}
+
+static inline bool hvac_fdtable_striped(int fd)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+    return e && e->striped.load(std::memory_order_relaxed);
+}
+
+static inline void hvac_fdtable_set_striped(int fd, bool striped)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+    if (e)
+        e->striped.store(striped, std::memory_order_relaxed);
+}
+
+static inline int64_t hvac_fdtable_offset(int fd)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+    return e ? e->offset.load(std::memory_order_relaxed) : 0;
+}
+
+static inline void hvac_fdtable_set_offset(int fd, int64_t offset)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+    if (e)
+        e->offset.store(offset, std::memory_order_relaxed);
+}
+
+// Install the remote fd of an open sent under generation gen. False if the
+// fd was closed or reused since, the remote fd is then the caller's to close.
+static inline bool hvac_fdtable_set_remote(int fd, uint32_t gen, int32_t remote_fd)
+{
+    struct hvac_fd_entry *e = hvac_fdtable_entry(fd);
+    uint64_t expected = (uint64_t)gen << 32;
+
+    return e && e->remote.compare_exchange_strong(expected, expected | (uint32_t)remote_fd,
+                                                  std::memory_order_acq_rel);
+}
+
+// Move the slot to a new generation and hand back its remote fd, if any.
+// An open still in flight for the old generation will close its own.
+int32_t hvac_fdtable_take_remote(int fd);
+
+#endif
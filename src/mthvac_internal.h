@@ -18,6 +18,8 @@
 #include <fcntl.h>
 #include <sys/uio.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
 
 // A version string.  Currently, it just gets written to the log file.
 #define MT-HVAC_VERSION "0.0.1"
@@ -29,14 +31,17 @@
 
 #define WRAP_DECL(__name) __name
 
+/* Threads may race to map the same symbol. They all store the same
+ * address, the atomics just keep that store and the loads whole. */
 #define MAP_OR_FAIL(func) \
-    if (!(__real_ ## func)) \
+    if (!__atomic_load_n(&__real_ ## func, __ATOMIC_ACQUIRE)) \
     { \
-        __real_ ## func = dlsym(RTLD_NEXT, #func); \
-        if(!(__real_ ## func)) { \
+        void *__sym = dlsym(RTLD_NEXT, #func); \
+        if(!__sym) { \
             fprintf(stderr, "hvac failed to map symbol: %s\n", #func); \
             exit(1); \
         } \
+        __atomic_store_n((void **)&__real_ ## func, __sym, __ATOMIC_RELEASE); \
     }
 
 #else
@@ -49,18 +54,85 @@
 #define MAP_OR_FAIL(func)
 #endif
 
-// REAL_DECL(fopen, FILE *, (const char *path, const char *mode))
-// REAL_DECL(fopen64, FILE *, (const char *path, const char *mode))
+REAL_DECL(fopen, FILE *, (const char *path, const char *mode))
+REAL_DECL(fopen64, FILE *, (const char *path, const char *mode))
+REAL_DECL(fclose, int, (FILE *fp))
+REAL_DECL(fileno, int, (FILE *fp))
+REAL_DECL(fileno_unlocked, int, (FILE *fp))
 REAL_DECL(pread, ssize_t, (int fd, void *buf, size_t count, off_t offset))
-// REAL_DECL(readv, ssize_t, (int fd, const struct iovec *iov, int iovcnt))
+REAL_DECL(readv, ssize_t, (int fd, const struct iovec *iov, int iovcnt))
+REAL_DECL(preadv, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset))
+REAL_DECL(preadv2, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags))
 // REAL_DECL(write, ssize_t, (int fd, const void *buf, size_t count))
 REAL_DECL(open, int, (const char *pathname, int flags, ...))
-// REAL_DECL(open64, int, (const char *pathname, int flags, ...))
+REAL_DECL(open64, int, (const char *pathname, int flags, ...))
+REAL_DECL(openat, int, (int dirfd, const char *pathname, int flags, ...))
+REAL_DECL(openat64, int, (int dirfd, const char *pathname, int flags, ...))
+REAL_DECL(__open_2, int, (const char *pathname, int flags))
+REAL_DECL(__open64_2, int, (const char *pathname, int flags))
+REAL_DECL(__openat_2, int, (int dirfd, const char *pathname, int flags))
+REAL_DECL(__openat64_2, int, (int dirfd, const char *pathname, int flags))
 REAL_DECL(read, ssize_t, (int fd, void *buf, size_t count))
 // REAL_DECL(read64, ssize_t, (int fd, void *buf, size_t count))
 REAL_DECL(close, int, (int fd))
-// REAL_DECL(lseek, off_t, (int fd, off_t offset, int whence))
-// REAL_DECL(lseek64, off64_t, (int fd, off64_t offset, int whence))
+REAL_DECL(mmap, void *, (void *addr, size_t length, int prot, int flags, int fd, off_t offset))
+#ifdef _LARGEFILE64_SOURCE
+REAL_DECL(mmap64, void *, (void *addr, size_t length, int prot, int flags, int fd, off64_t offset))
+#endif
+REAL_DECL(munmap, int, (void *addr, size_t length))
+REAL_DECL(lseek, off_t, (int fd, off_t offset, int whence))
+#ifdef _LARGEFILE64_SOURCE
+REAL_DECL(lseek64, off64_t, (int fd, off64_t offset, int whence))
+#endif
+REAL_DECL(dup, int, (int oldfd))
+REAL_DECL(dup2, int, (int oldfd, int newfd))
+REAL_DECL(dup3, int, (int oldfd, int newfd, int flags))
+REAL_DECL(fcntl, int, (int fd, int cmd, ...))
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 28)
+REAL_DECL(fcntl64, int, (int fd, int cmd, ...))
+#endif
+struct stat64;
+struct statx;
+struct dirent64;
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 33)
+// Before 2.33 the stat calls are inlines over the versioned __xstat family
+REAL_DECL(__xstat, int, (int ver, const char *path, struct stat *buf))
+REAL_DECL(__lxstat, int, (int ver, const char *path, struct stat *buf))
+REAL_DECL(__fxstat, int, (int ver, int fd, struct stat *buf))
+REAL_DECL(__fxstatat, int, (int ver, int dirfd, const char *path, struct stat *buf, int flags))
+REAL_DECL(__xstat64, int, (int ver, const char *path, struct stat64 *buf))
+REAL_DECL(__lxstat64, int, (int ver, const char *path, struct stat64 *buf))
+REAL_DECL(__fxstat64, int, (int ver, int fd, struct stat64 *buf))
+REAL_DECL(__fxstatat64, int, (int ver, int dirfd, const char *path, struct stat64 *buf, int flags))
+#else
+REAL_DECL(stat, int, (const char *path, struct stat *buf))
+REAL_DECL(lstat, int, (const char *path, struct stat *buf))
+REAL_DECL(fstat, int, (int fd, struct stat *buf))
+REAL_DECL(fstatat, int, (int dirfd, const char *path, struct stat *buf, int flags))
+REAL_DECL(stat64, int, (const char *path, struct stat64 *buf))
+REAL_DECL(lstat64, int, (const char *path, struct stat64 *buf))
+REAL_DECL(fstat64, int, (int fd, struct stat64 *buf))
+REAL_DECL(fstatat64, int, (int dirfd, const char *path, struct stat64 *buf, int flags))
+#endif
+REAL_DECL(statx, int, (int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf))
+REAL_DECL(access, int, (const char *path, int mode))
+REAL_DECL(faccessat, int, (int dirfd, const char *path, int mode, int flags))
+REAL_DECL(unlink, int, (const char *path))
+REAL_DECL(unlinkat, int, (int dirfd, const char *path, int flags))
+REAL_DECL(rmdir, int, (const char *path))
+REAL_DECL(mkdir, int, (const char *path, mode_t mode))
+REAL_DECL(rename, int, (const char *oldpath, const char *newpath))
+REAL_DECL(renameat, int, (int olddirfd, const char *oldpath, int newdirfd, const char *newpath))
+REAL_DECL(opendir, DIR *, (const char *name))
+REAL_DECL(readdir, struct dirent *, (DIR *dirp))
+REAL_DECL(readdir64, struct dirent64 *, (DIR *dirp))
+REAL_DECL(readdir_r, int, (DIR *dirp, struct dirent *entry, struct dirent **result))
+REAL_DECL(readdir64_r, int, (DIR *dirp, struct dirent64 *entry, struct dirent64 **result))
+REAL_DECL(closedir, int, (DIR *dirp))
+REAL_DECL(dirfd, int, (DIR *dirp))
+REAL_DECL(rewinddir, void, (DIR *dirp))
+REAL_DECL(telldir, long, (DIR *dirp))
+REAL_DECL(seekdir, void, (DIR *dirp, long loc))
 
 #ifdef __cplusplus
 extern "C" {
@@ -71,7 +143,13 @@ const char* hvac_get_path(int fd);
 bool hvac_remove_fd(int fd);
 ssize_t hvac_remote_read(int fd, void *buf, size_t count);
 ssize_t hvac_remote_pread(int fd, void *buf, size_t count, off_t offset);
-ssize_t hvac_remote_lseek(int fd, int offset, int whence);
+ssize_t hvac_remote_preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+off_t hvac_tracked_lseek(int fd, off_t offset, int whence);
+// Move the kernel position of a tracked fd to the client side one
+void hvac_sync_kernel_offset(int fd);
+// Client side position of a tracked fd, for wrappers that fall back
+off_t hvac_file_offset(int fd);
+void hvac_file_set_offset(int fd, off_t offset);
 void hvac_remote_close(int fd);
 bool hvac_file_tracked(int fd);
 
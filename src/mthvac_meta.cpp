@@ -0,0 +1,388 @@
+/* Client side metadata cache - see mthvac_meta.h */
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "mthvac_meta.h"
+#include "mthvac_comm.h"
+#include "mthvac_fdtable.h"
+#include "mthvac_pathfilter.h"
+#include "mthvac_placement.h"
+#include "mthvac_timer.h" // ! HVAC TIMING
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+// First guess at a snapshot's size, grown to what the server asks for
+#define HVAC_META_INITIAL_BUF (256 * 1024)
+// Directories kept before the cache is dropped and rebuilt
+#define HVAC_META_MAX_DIRS 1024
+
+void hvac_client_ensure_comm();
+
+typedef std::unordered_map<std::string, struct hvac_meta_rec> hvac_meta_entries;
+
+/* Read only once published, except fetched which a revalidation bumps */
+struct hvac_meta_dir {
+    std::atomic<time_t> fetched;
+    bool ok;        // false: the server couldn't list it, use the PFS
+    uint64_t gen;   // server generation this copy came from
+    hvac_meta_entries entries;
+    std::vector<const hvac_meta_entries::value_type *> order;  // listing order, without "."
+};
+
+/* What opendir() hands the application in place of a DIR */
+struct hvac_meta_dirstream {
+    std::shared_ptr<hvac_meta_dir> snap;
+    std::string path;
+    size_t pos;
+    int fd;                 // opened by dirfd() only
+    struct dirent64 ent;
+};
+
+static std::atomic<bool> g_meta_enabled{true};
+static int g_meta_ttl = 60;
+static size_t g_meta_max_bytes = 64 * 1024 * 1024;
+
+static std::unordered_map<std::string, std::shared_ptr<hvac_meta_dir>> meta_dirs;
+// Directories this process wrote to, stat()s in them go to the PFS
+static std::unordered_set<std::string> meta_dirty_dirs;
+static pthread_rwlock_t meta_dirs_lock = PTHREAD_RWLOCK_INITIALIZER;
+// Set while we fetch, any stat Mercury makes on the way goes to the PFS
+static __thread bool tl_in_meta = false;
+
+static std::unordered_set<void *> meta_streams;
+static pthread_mutex_t meta_streams_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Lets readdir() on ordinary DIRs skip the lookup while we have none open
+static std::atomic<int> meta_stream_count{0};
+
+void hvac_meta_init()
+{
+    char *env;
+
+    if ((env = getenv("HVAC_META_CACHE")) != NULL)
+        g_meta_enabled = atoi(env) != 0;
+    if ((env = getenv("HVAC_META_TTL")) != NULL)
+        g_meta_ttl = atoi(env);
+    if ((env = getenv("HVAC_META_MAX_BYTES")) != NULL)
+        g_meta_max_bytes = strtoull(env, NULL, 10);
+    L4C_INFO("Metadata cache %s, ttl %d s", g_meta_enabled ? "on" : "off", g_meta_ttl);
+}
+
+/* Fetch dir from the server that owns it. When old is a good copy the
+ * server only sends data if its listing changed since. */
+static std::shared_ptr<hvac_meta_dir> hvac_meta_fetch(const std::string &dir,
+                                                      const std::shared_ptr<hvac_meta_dir> &old)
+{
+    HVAC_TIMING("CLIENT_(hvac_meta_fetch)_total");
+    auto snap = std::make_shared<hvac_meta_dir>();
+    uint64_t have_gen = (old && old->ok) ? old->gen : 0;
+    size_t capacity = HVAC_META_INITIAL_BUF;
+    size_t used = 0, needed = 0;
+    uint64_t gen = 0;
+    char *buf = NULL;
+    int ret = -1;
+
+    snap->fetched = time(NULL);
+    snap->ok = false;
+    snap->gen = 0;
+
+    hvac_client_ensure_comm();
+    uint32_t server = hvac_place_path(dir);
+    if (!hvac_client_comm_server_available(server))
+        return snap;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        buf = (char *)malloc(capacity);
+        if (buf == NULL)
+            return snap;
+        ret = hvac_client_comm_gen_dir_snapshot_rpc(server, dir, buf, capacity, have_gen, &used, &needed, &gen);
+        if (ret != 0 || needed <= capacity || needed > g_meta_max_bytes)
+            break;
+        // Too small - the server told us how much it has
+        free(buf);
+        buf = NULL;
+        capacity = needed;
+    }
+
+    if (ret == 0 && have_gen != 0 && gen == have_gen) {
+        free(buf);
+        old->fetched = snap->fetched.load();
+        return old;
+    }
+
+    if (ret == 0 && used > 0) {
+        size_t off = 0;
+        while (off + sizeof(struct hvac_meta_rec) <= used) {
+            struct hvac_meta_rec rec;
+            memcpy(&rec, buf + off, sizeof(rec));
+            if (off + HVAC_META_REC_SIZE(rec.name_len) > used)
+                break;
+            auto ins = snap->entries.emplace(std::string(buf + off + sizeof(rec), rec.name_len), rec);
+            if (ins.second && ins.first->first != ".")
+                snap->order.push_back(&*ins.first);
+            off += HVAC_META_REC_SIZE(rec.name_len);
+        }
+        snap->ok = true;
+        snap->gen = gen;
+        L4C_INFO("Metadata snapshot of %s: %zu entries", dir.c_str(), snap->entries.size());
+    } else {
+        L4C_INFO("No metadata snapshot for %s (%d), using the PFS", dir.c_str(), ret);
+    }
+    free(buf);
+    return snap;
+}
+
+/* revalidate: ask the server even if our copy is inside the TTL, for
+ * listings where a stale name list would be wrong rather than late */
+static std::shared_ptr<hvac_meta_dir> hvac_meta_get_dir(const std::string &dir, bool revalidate)
+{
+    std::shared_ptr<hvac_meta_dir> snap;
+    time_t now = time(NULL);
+
+    pthread_rwlock_rdlock(&meta_dirs_lock);
+    auto it = meta_dirs.find(dir);
+    if (it != meta_dirs.end())
+        snap = it->second;
+    pthread_rwlock_unlock(&meta_dirs_lock);
+    if (snap && !revalidate && now - snap->fetched < g_meta_ttl)
+        return snap;
+
+    // Fetched without the lock, two threads may race on a cold directory
+    tl_in_meta = true;
+    auto fresh = hvac_meta_fetch(dir, snap);
+    tl_in_meta = false;
+    if (fresh == snap)
+        return snap;
+
+    pthread_rwlock_wrlock(&meta_dirs_lock);
+    if (meta_dirs.size() >= HVAC_META_MAX_DIRS)
+        meta_dirs.clear();
+    meta_dirs[dir] = fresh;
+    pthread_rwlock_unlock(&meta_dirs_lock);
+    return fresh;
+}
+
+static int hvac_meta_lookup(const std::string &dir, const std::string &name, struct stat *st, int follow)
+{
+    pthread_rwlock_rdlock(&meta_dirs_lock);
+    bool dirty = meta_dirty_dirs.count(dir) != 0;
+    pthread_rwlock_unlock(&meta_dirs_lock);
+    if (dirty)
+        return HVAC_META_MISS;
+
+    auto snap = hvac_meta_get_dir(dir, false);
+    if (!snap->ok)
+        return HVAC_META_MISS;
+
+    // Not in the snapshot doesn't mean it doesn't exist now
+    auto it = snap->entries.find(name);
+    if (it == snap->entries.end())
+        return HVAC_META_MISS;
+    if (follow && S_ISLNK(it->second.mode))
+        return HVAC_META_MISS;
+    hvac_meta_rec_to_stat(&it->second, st);
+    return 0;
+}
+
+int hvac_meta_stat(const char *path, struct stat *st, int follow)
+{
+    std::string dir, name;
+
+    if (!g_meta_enabled || tl_in_meta)
+        return HVAC_META_MISS;
+    if (!hvac_pathfilter_match_dir(path, &dir, &name))
+        return HVAC_META_MISS;
+    return hvac_meta_lookup(dir, name, st, follow);
+}
+
+int hvac_meta_fstat(int fd, struct stat *st)
+{
+    std::string full;
+
+    if (!g_meta_enabled || tl_in_meta || !hvac_fdtable_copy_path(fd, full))
+        return HVAC_META_MISS;
+    // Tracked paths are already canonical
+    size_t slash = full.rfind('/');
+    if (slash == std::string::npos)
+        return HVAC_META_MISS;
+    return hvac_meta_lookup(slash == 0 ? "/" : full.substr(0, slash), full.substr(slash + 1), st, 1);
+}
+
+/* Drops the snapshot of the directory holding path, and of path itself in
+ * case it is a directory, and marks the directory dirty. Called before
+ * the change is made, so no lookup racing it can repopulate the cache
+ * with the old state. Too many dirty directories and the cache is simply
+ * switched off for this process. */
+void hvac_meta_invalidate(const char *path)
+{
+    std::string dir, name;
+
+    if (!g_meta_enabled || tl_in_meta || path == NULL)
+        return;
+    if (!hvac_pathfilter_match_dir(path, &dir, &name))
+        return;
+
+    pthread_rwlock_wrlock(&meta_dirs_lock);
+    meta_dirs.erase(dir);
+    meta_dirs.erase(dir == "/" ? dir + name : dir + "/" + name);
+    if (meta_dirty_dirs.size() >= HVAC_META_MAX_DIRS) {
+        g_meta_enabled = false;
+        L4C_INFO("More than %d directories written, metadata cache off", HVAC_META_MAX_DIRS);
+    }
+    meta_dirty_dirs.insert(dir);
+    pthread_rwlock_unlock(&meta_dirs_lock);
+}
+
+/* Existence and read / execute checks. Anything that needs supplementary
+ * groups, ACLs or write permission goes to the real call. */
+int hvac_meta_access(const char *path, int mode)
+{
+    struct stat st;
+    int ret = hvac_meta_stat(path, &st, 1);
+
+    if (ret != 0 || mode == F_OK)
+        return ret;
+    if (mode & W_OK)
+        return HVAC_META_MISS;
+
+    uid_t uid = getuid();
+    mode_t need = 0;
+    if (uid == 0) {
+        // root reads anything, executes if any x bit is set
+        if (!(mode & X_OK) || (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
+            return 0;
+        return HVAC_META_MISS;
+    }
+    if (st.st_uid == uid)
+        need = ((mode & R_OK) ? S_IRUSR : 0) | ((mode & X_OK) ? S_IXUSR : 0);
+    else if (st.st_gid == getgid())
+        need = ((mode & R_OK) ? S_IRGRP : 0) | ((mode & X_OK) ? S_IXGRP : 0);
+    else
+        need = ((mode & R_OK) ? S_IROTH : 0) | ((mode & X_OK) ? S_IXOTH : 0);
+    return (st.st_mode & need) == need ? 0 : HVAC_META_MISS;
+}
+
+DIR *hvac_meta_opendir(const char *path)
+{
+    std::string dir;
+
+    if (!g_meta_enabled || tl_in_meta)
+        return NULL;
+    if (!hvac_pathfilter_match_tree(path, &dir))
+        return NULL;
+
+    auto snap = hvac_meta_get_dir(dir, true);
+    if (!snap->ok)
+        return NULL;
+
+    auto *ds = new hvac_meta_dirstream();
+    ds->snap = snap;
+    ds->path = dir;
+    ds->pos = 0;
+    ds->fd = -1;
+    pthread_mutex_lock(&meta_streams_mutex);
+    meta_streams.insert(ds);
+    meta_stream_count++;
+    pthread_mutex_unlock(&meta_streams_mutex);
+    L4C_INFO("Listing %s from its snapshot, %zu entries", dir.c_str(), snap->order.size());
+    return (DIR *)ds;
+}
+
+int hvac_meta_owns_dir(DIR *dirp)
+{
+    if (meta_stream_count.load(std::memory_order_relaxed) == 0)
+        return 0;
+    pthread_mutex_lock(&meta_streams_mutex);
+    bool owned = meta_streams.count(dirp) != 0;
+    pthread_mutex_unlock(&meta_streams_mutex);
+    return owned;
+}
+
+/* "." and ".." first, like the real thing, then the snapshot in server
+ * order. d_off is the position telldir() reports. */
+struct dirent64 *hvac_meta_readdir64(DIR *dirp)
+{
+    auto *ds = (hvac_meta_dirstream *)dirp;
+    struct dirent64 *ent = &ds->ent;
+    size_t n = ds->snap->order.size() + 2;
+    const char *name;
+
+    if (ds->pos >= n)
+        return NULL;
+
+    memset(ent, 0, offsetof(struct dirent64, d_name));
+    if (ds->pos < 2) {
+        auto dot = ds->snap->entries.find(".");
+        name = ds->pos == 0 ? "." : "..";
+        ent->d_ino = (ds->pos == 0 && dot != ds->snap->entries.end()) ? dot->second.ino : 0;
+        ent->d_type = DT_DIR;
+    } else {
+        auto *e = ds->snap->order[ds->pos - 2];
+        name = e->first.c_str();
+        ent->d_ino = e->second.ino;
+        ent->d_type = e->second.d_type;
+    }
+    ds->pos++;
+    ent->d_off = ds->pos;
+    ent->d_reclen = sizeof(*ent);
+    strncpy(ent->d_name, name, sizeof(ent->d_name) - 1);
+    ent->d_name[sizeof(ent->d_name) - 1] = '\0';
+    return ent;
+}
+
+struct dirent *hvac_meta_readdir(DIR *dirp)
+{
+    static_assert(sizeof(struct dirent) == sizeof(struct dirent64), "dirent64 differs from dirent");
+    return (struct dirent *)hvac_meta_readdir64(dirp);
+}
+
+int hvac_meta_closedir(DIR *dirp)
+{
+    auto *ds = (hvac_meta_dirstream *)dirp;
+
+    pthread_mutex_lock(&meta_streams_mutex);
+    meta_streams.erase(ds);
+    meta_stream_count--;
+    pthread_mutex_unlock(&meta_streams_mutex);
+    if (ds->fd >= 0)
+        close(ds->fd);
+    delete ds;
+    return 0;
+}
+
+/* Callers want a real descriptor for fstatat() / openat() on the entries */
+int hvac_meta_dirfd(DIR *dirp)
+{
+    auto *ds = (hvac_meta_dirstream *)dirp;
+
+    if (ds->fd < 0)
+        ds->fd = open(ds->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return ds->fd;
+}
+
+void hvac_meta_rewinddir(DIR *dirp)
+{
+    ((hvac_meta_dirstream *)dirp)->pos = 0;
+}
+
+long hvac_meta_telldir(DIR *dirp)
+{
+    return ((hvac_meta_dirstream *)dirp)->pos;
+}
+
+void hvac_meta_seekdir(DIR *dirp, long loc)
+{
+    ((hvac_meta_dirstream *)dirp)->pos = loc < 0 ? 0 : loc;
+}
@@ -0,0 +1,129 @@
+/* Metadata cache for dataset files
+ *
+ * DL loaders stat / fstat / access every sample. Rather than have every
+ * rank ask the Lustre MDS, the server that owns a directory (placed by
+ * the directory path) lists and stats it once and ships the result in
+ * one bulk transfer. Clients keep the snapshot for HVAC_META_TTL seconds
+ * and answer the stat family from it. A name the snapshot doesn't have
+ * goes to the real call, it may have been created since. Once this
+ * process creates, renames, unlinks or opens for writing a file in a
+ * directory, that directory's snapshot is dropped and its stats go to the
+ * PFS from then on - the sizes in it are no longer ours to trust.
+ *
+ * Snapshot wire format, shared by both sides: a sequence of records, each
+ * a struct hvac_meta_rec followed by name_len bytes of name, padded to 8.
+ * The first record is "." - the directory itself. Entries are lstat()ed,
+ * symlinks are left to the real call.
+ *
+ * opendir / readdir on a cached directory iterate the snapshot. opendir
+ * always asks the server, which rebuilds its listing when the directory
+ * mtime moved and otherwise answers "unchanged" without any data.
+ */
+#ifndef __HVAC_META_H__
+#define __HVAC_META_H__
+
+#include <dirent.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+struct hvac_meta_rec {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t blocks;
+    uint64_t dev;
+    uint64_t rdev;
+    int64_t atime_sec;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t atime_nsec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t blksize;
+    uint16_t name_len;
+    uint8_t d_type;
+    uint8_t pad[5];
+};
+
+#define HVAC_META_REC_SIZE(name_len) \
+    ((sizeof(struct hvac_meta_rec) + (name_len) + 7) & ~(size_t)7)
+
+static inline void hvac_meta_rec_from_stat(struct hvac_meta_rec *r, const struct stat *st)
+{
+    memset(r, 0, sizeof(*r));
+    r->ino = st->st_ino;
+    r->size = st->st_size;
+    r->blocks = st->st_blocks;
+    r->dev = st->st_dev;
+    r->rdev = st->st_rdev;
+    r->atime_sec = st->st_atim.tv_sec;
+    r->atime_nsec = st->st_atim.tv_nsec;
+    r->mtime_sec = st->st_mtim.tv_sec;
+    r->mtime_nsec = st->st_mtim.tv_nsec;
+    r->ctime_sec = st->st_ctim.tv_sec;
+    r->ctime_nsec = st->st_ctim.tv_nsec;
+    r->mode = st->st_mode;
+    r->nlink = st->st_nlink;
+    r->uid = st->st_uid;
+    r->gid = st->st_gid;
+    r->blksize = st->st_blksize;
+}
+
+static inline void hvac_meta_rec_to_stat(const struct hvac_meta_rec *r, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_ino = r->ino;
+    st->st_size = r->size;
+    st->st_blocks = r->blocks;
+    st->st_dev = r->dev;
+    st->st_rdev = r->rdev;
+    st->st_atim.tv_sec = r->atime_sec;
+    st->st_atim.tv_nsec = r->atime_nsec;
+    st->st_mtim.tv_sec = r->mtime_sec;
+    st->st_mtim.tv_nsec = r->mtime_nsec;
+    st->st_ctim.tv_sec = r->ctime_sec;
+    st->st_ctim.tv_nsec = r->ctime_nsec;
+    st->st_mode = r->mode;
+    st->st_nlink = r->nlink;
+    st->st_uid = r->uid;
+    st->st_gid = r->gid;
+    st->st_blksize = r->blksize;
+}
+
+// Client side cache. Results for the wrappers:
+#define HVAC_META_MISS 1    // not answered, make the real call
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void hvac_meta_init();
+// 0 with *st filled, -1 with errno set, or HVAC_META_MISS
+int hvac_meta_stat(const char *path, struct stat *st, int follow);
+int hvac_meta_fstat(int fd, struct stat *st);
+int hvac_meta_access(const char *path, int mode);
+// path is being changed by this process, stop answering from its directory
+void hvac_meta_invalidate(const char *path);
+
+/* Directory listings from the same snapshots. opendir returns NULL when
+ * the directory isn't ours to list; the rest only take what it returned,
+ * hvac_meta_owns_dir tells them apart from real DIRs. */
+DIR *hvac_meta_opendir(const char *path);
+int hvac_meta_owns_dir(DIR *dirp);
+struct dirent *hvac_meta_readdir(DIR *dirp);
+struct dirent64 *hvac_meta_readdir64(DIR *dirp);
+int hvac_meta_closedir(DIR *dirp);
+int hvac_meta_dirfd(DIR *dirp);
+void hvac_meta_rewinddir(DIR *dirp);
+long hvac_meta_telldir(DIR *dirp);
+void hvac_meta_seekdir(DIR *dirp, long loc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
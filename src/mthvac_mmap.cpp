@@ -0,0 +1,466 @@
+/* mmap of cached files - see mthvac_mmap.h */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/userfaultfd.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "mthvac_mmap.h"
+#include "mthvac_internal.h"
+#include "mthvac_fdtable.h"
+#include "mthvac_timer.h" // ! HVAC TIMING
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+// Largest single pread() while materializing a mapping
+#define HVAC_MMAP_COPY_CHUNK (16 * 1024 * 1024)
+
+enum hvac_mmap_mode {
+    HVAC_MMAP_OFF,
+    HVAC_MMAP_COPY,
+    HVAC_MMAP_FAULT,
+};
+
+static int g_mmap_mode = HVAC_MMAP_COPY;
+static size_t g_mmap_copy_max = 1024UL * 1024 * 1024;
+static size_t g_mmap_fault_chunk = 1024 * 1024;
+static size_t g_page_size = 4096;
+
+/* Our own descriptor on a mapped file, the application is free to close
+ * the one it mapped. Shared by the pieces of a partly unmapped region and
+ * held by a fault while it reads, closed when the last of them lets go. */
+struct hvac_mmap_file {
+    int fd;
+    ~hvac_mmap_file() { close(fd); }
+};
+
+/* A lazily filled mapping */
+struct hvac_mmap_region {
+    size_t len;
+    std::shared_ptr<struct hvac_mmap_file> file;
+    off_t offset;       // file offset of the first byte
+    off_t file_size;
+    int prot;
+};
+
+static std::map<uintptr_t, struct hvac_mmap_region> mmap_regions;
+static pthread_mutex_t mmap_regions_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Lets munmap() of everything else skip the lookup
+static std::atomic<int> mmap_region_count{0};
+
+// Per process: a fork() child gets its own on its first fault mode mmap
+static std::atomic<int> g_uffd{-1};
+static pthread_mutex_t g_uffd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *g_fault_staging = NULL;
+
+/* Fills a mapping, up front in copy mode or a page run at a time from
+ * the fault handler, by re-entering the pread() wrapper in chunk sized
+ * calls so each one is a normal cached read. Bytes past the end of the
+ * file are left zero. */
+static bool hvac_mmap_fill(int fd, char *dst, size_t len, off_t offset, off_t file_size, size_t chunk)
+{
+    size_t want = offset >= file_size ? 0 : (size_t)(file_size - offset);
+    size_t done = 0;
+
+    if (want > len)
+        want = len;
+    while (done < want) {
+        size_t n = want - done < chunk ? want - done : chunk;
+        ssize_t got = pread(fd, dst + done, n, offset + done);
+        if (got < 0)
+            return false;
+        if (got == 0)
+            break;      // file shrank under us
+        done += got;
+    }
+    return true;
+}
+
+static const struct hvac_mmap_region *hvac_mmap_find(uintptr_t addr, uintptr_t *start)
+{
+    auto it = mmap_regions.upper_bound(addr);
+    if (it == mmap_regions.begin())
+        return NULL;
+    --it;
+    if (addr >= it->first + it->second.len)
+        return NULL;
+    *start = it->first;
+    return &it->second;
+}
+
+/* A read error has to reach the faulting thread the way it would on a
+ * file mapping, as SIGBUS rather than a page of zeros. Any access to a
+ * page of an empty file raises it, so put one over the faulting page;
+ * it replaces the registered page, the woken thread faults again and
+ * gets the signal. */
+static void hvac_mmap_fail_fault(uintptr_t addr)
+{
+    int fd = memfd_create("hvac_mmap_sigbus", MFD_CLOEXEC);
+    struct uffdio_range range = { addr, g_page_size };
+
+    if (fd < 0 || mmap((void *)addr, g_page_size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+        L4C_ERR("mmap fault: can't fail the fault at %p (%s)", (void *)addr, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+    ioctl(g_uffd, UFFDIO_WAKE, &range);
+}
+
+/* Resolve one missing page: fill the chunk around it in one read and
+ * hand it to the kernel. Another thread may have faulted part of the
+ * chunk in already, then just the page itself is copied. */
+static void hvac_mmap_handle_fault(uintptr_t addr, char *staging)
+{
+    HVAC_TIMING("CLIENT_(hvac_mmap_fault)_total");
+    struct hvac_mmap_region region;
+    uintptr_t start;
+    bool found;
+
+    addr &= ~(uintptr_t)(g_page_size - 1);
+    pthread_mutex_lock(&mmap_regions_mutex);
+    const struct hvac_mmap_region *r = hvac_mmap_find(addr, &start);
+    found = (r != NULL);
+    if (found)
+        region = *r;
+    pthread_mutex_unlock(&mmap_regions_mutex);
+
+    if (!found) {
+        // Unmapped while the fault was queued, let the thread go
+        struct uffdio_range range = { addr, g_page_size };
+        ioctl(g_uffd, UFFDIO_WAKE, &range);
+        return;
+    }
+
+    uintptr_t cstart = addr & ~(uintptr_t)(g_mmap_fault_chunk - 1);
+    if (cstart < start)
+        cstart = start;
+    uintptr_t cend = cstart + g_mmap_fault_chunk;
+    if (cend > start + region.len)
+        cend = start + region.len;
+
+    memset(staging, 0, cend - cstart);
+    if (!hvac_mmap_fill(region.file->fd, staging, cend - cstart, region.offset + (cstart - start),
+                        region.file_size, g_mmap_fault_chunk)) {
+        L4C_ERR("mmap fault: read of fd %d at %ld failed", region.file->fd,
+                (long)(region.offset + (cstart - start)));
+        hvac_mmap_fail_fault(addr);
+        return;
+    }
+
+    struct uffdio_copy copy;
+    copy.dst = cstart;
+    copy.src = (uintptr_t)staging;
+    copy.len = cend - cstart;
+    copy.mode = 0;
+    if (ioctl(g_uffd, UFFDIO_COPY, &copy) == 0 || errno != EEXIST)
+        return;
+
+    copy.dst = addr;
+    copy.src = (uintptr_t)staging + (addr - cstart);
+    copy.len = g_page_size;
+    copy.mode = 0;
+    if (ioctl(g_uffd, UFFDIO_COPY, &copy) != 0 && errno == EEXIST) {
+        struct uffdio_range range = { addr, g_page_size };
+        ioctl(g_uffd, UFFDIO_WAKE, &range);
+    }
+}
+
+static void *hvac_mmap_fault_fn(void *arg)
+{
+    char *staging = (char *)arg;
+    struct pollfd pfd;
+    struct uffd_msg msg;
+
+    pfd.fd = g_uffd;
+    pfd.events = POLLIN;
+    while (true) {
+        if (poll(&pfd, 1, -1) <= 0)
+            continue;
+        if (read(g_uffd, &msg, sizeof(msg)) != sizeof(msg))
+            continue;
+        if (msg.event == UFFD_EVENT_PAGEFAULT)
+            hvac_mmap_handle_fault(msg.arg.pagefault.address, staging);
+    }
+    return NULL;
+}
+
+static bool hvac_mmap_uffd_start()
+{
+    struct uffdio_api api;
+    pthread_t fault_thread;
+    int uffd;
+
+    // User mode only is allowed unprivileged on kernels that restrict
+    // userfaultfd, the flag is unknown before 5.11
+    uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+    if (uffd < 0 && errno == EINVAL)
+        uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) {
+        L4C_WARN("userfaultfd unavailable (%s)", strerror(errno));
+        return false;
+    }
+
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    if (ioctl(uffd, UFFDIO_API, &api) != 0) {
+        L4C_WARN("userfaultfd API handshake failed (%s)", strerror(errno));
+        close(uffd);
+        return false;
+    }
+
+    // Inherited by fork() children, who no longer have our fault thread
+    if (g_fault_staging == NULL) {
+        void *staging = mmap(NULL, g_mmap_fault_chunk, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (staging == MAP_FAILED) {
+            close(uffd);
+            return false;
+        }
+        g_fault_staging = (char *)staging;
+    }
+    g_uffd = uffd;
+    if (pthread_create(&fault_thread, NULL, hvac_mmap_fault_fn, g_fault_staging) != 0) {
+        g_uffd = -1;
+        close(uffd);
+        return false;
+    }
+    pthread_detach(fault_thread);
+    return true;
+}
+
+// The process's userfaultfd, started on first use
+static bool hvac_mmap_uffd_ready()
+{
+    if (g_uffd >= 0)
+        return true;
+    pthread_mutex_lock(&g_uffd_mutex);
+    if (g_uffd < 0)
+        hvac_mmap_uffd_start();
+    pthread_mutex_unlock(&g_uffd_mutex);
+    return g_uffd >= 0;
+}
+
+static bool hvac_mmap_register(uintptr_t start, size_t len)
+{
+    struct uffdio_register reg;
+
+    reg.range.start = start;
+    reg.range.len = len;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    return ioctl(g_uffd, UFFDIO_REGISTER, &reg) == 0;
+}
+
+/* Last resort for a child that can't fault its regions in: read every
+ * page it doesn't have yet. Present pages may hold the application's own
+ * writes to a private mapping, they are left alone. */
+static void hvac_mmap_fill_missing(uintptr_t start, const struct hvac_mmap_region &r)
+{
+    size_t pages = r.len / g_page_size;
+    std::vector<unsigned char> present(pages);
+
+    if (mincore((void *)start, r.len, present.data()) != 0)
+        return;
+    if (r.prot != (PROT_READ | PROT_WRITE))
+        mprotect((void *)start, r.len, PROT_READ | PROT_WRITE);
+    for (size_t i = 0; i < pages; i++)
+        if (!(present[i] & 1))
+            hvac_mmap_fill(r.file->fd, (char *)start + i * g_page_size, g_page_size,
+                           r.offset + i * g_page_size, r.file_size, g_page_size);
+    if (r.prot != (PROT_READ | PROT_WRITE))
+        mprotect((void *)start, r.len, r.prot);
+}
+
+/* fork() children lose the userfaultfd registration: their missing pages
+ * would read as zeros and nobody would be there to fill them. The child
+ * registers what it inherited with a userfaultfd and fault thread of its
+ * own, so nothing is read before anyone touches it. The regions lock is
+ * held across fork() so the child's copy of the map is consistent. */
+static void hvac_mmap_atfork_prepare()
+{
+    pthread_mutex_lock(&mmap_regions_mutex);
+}
+
+static void hvac_mmap_atfork_parent()
+{
+    pthread_mutex_unlock(&mmap_regions_mutex);
+}
+
+static void hvac_mmap_atfork_child()
+{
+    pthread_mutex_init(&mmap_regions_mutex, NULL);
+    pthread_mutex_init(&g_uffd_mutex, NULL);
+    if (g_uffd >= 0)
+        close(g_uffd);
+    g_uffd = -1;
+    if (mmap_regions.empty())
+        return;
+
+    bool armed = hvac_mmap_uffd_ready();
+    for (auto &r : mmap_regions) {
+        if (armed && hvac_mmap_register(r.first, r.second.len))
+            continue;
+        L4C_ERR("mmap: can't fault in %zu bytes at %p after fork, reading what's missing now",
+                r.second.len, (void *)r.first);
+        hvac_mmap_fill_missing(r.first, r.second);
+    }
+}
+
+void hvac_mmap_init()
+{
+    char *env;
+
+    g_page_size = sysconf(_SC_PAGESIZE);
+    if ((env = getenv("HVAC_MMAP")) != NULL) {
+        if (strcmp(env, "off") == 0 || strcmp(env, "0") == 0)
+            g_mmap_mode = HVAC_MMAP_OFF;
+        else if (strcmp(env, "fault") == 0)
+            g_mmap_mode = HVAC_MMAP_FAULT;
+        else if (strcmp(env, "copy") == 0)
+            g_mmap_mode = HVAC_MMAP_COPY;
+        else
+            L4C_WARN("Unknown HVAC_MMAP mode %s, using copy", env);
+    }
+    if ((env = getenv("HVAC_MMAP_COPY_MAX")) != NULL)
+        g_mmap_copy_max = strtoull(env, NULL, 10);
+    if ((env = getenv("HVAC_MMAP_FAULT_CHUNK")) != NULL) {
+        size_t chunk = strtoull(env, NULL, 10);
+        // A power of two number of pages, so chunks align
+        g_mmap_fault_chunk = g_page_size;
+        while (g_mmap_fault_chunk < chunk)
+            g_mmap_fault_chunk <<= 1;
+    }
+
+    if (g_mmap_mode == HVAC_MMAP_FAULT && !hvac_mmap_uffd_ready()) {
+        L4C_WARN("mmap fault mode unavailable, materializing mappings instead");
+        g_mmap_mode = HVAC_MMAP_COPY;
+    }
+    if (g_mmap_mode == HVAC_MMAP_FAULT)
+        pthread_atfork(hvac_mmap_atfork_prepare, hvac_mmap_atfork_parent, hvac_mmap_atfork_child);
+    L4C_INFO("mmap of cached files: %s", g_mmap_mode == HVAC_MMAP_OFF ? "off" :
+             g_mmap_mode == HVAC_MMAP_COPY ? "copy" : "fault");
+}
+
+void *hvac_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset, int *handled)
+{
+    HVAC_TIMING("CLIENT_(hvac_mmap)_total");
+    struct stat st;
+
+    *handled = 0;
+    if (g_mmap_mode == HVAC_MMAP_OFF || length == 0 || prot == PROT_NONE)
+        return MAP_FAILED;
+    if ((flags & MAP_ANONYMOUS) || offset < 0 || (offset & (g_page_size - 1)))
+        return MAP_FAILED;
+    if ((flags & MAP_SHARED) && (prot & PROT_WRITE))
+        return MAP_FAILED;
+    if (!hvac_file_tracked(fd))
+        return MAP_FAILED;
+    if (g_mmap_mode == HVAC_MMAP_COPY && length > g_mmap_copy_max)
+        return MAP_FAILED;
+    if (fstat(fd, &st) != 0)
+        return MAP_FAILED;
+
+    int anon_flags = MAP_PRIVATE | MAP_ANONYMOUS | (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE | MAP_NORESERVE));
+    char *p = (char *)mmap(addr, length, PROT_READ | PROT_WRITE, anon_flags, -1, 0);
+    *handled = 1;
+    if (p == MAP_FAILED)
+        return MAP_FAILED;
+
+    if (g_mmap_mode == HVAC_MMAP_COPY) {
+        if (!hvac_mmap_fill(fd, p, length, offset, st.st_size, HVAC_MMAP_COPY_CHUNK)) {
+            munmap(p, length);
+            errno = EIO;
+            return MAP_FAILED;
+        }
+        if (prot != (PROT_READ | PROT_WRITE))
+            mprotect(p, length, prot);
+        L4C_INFO("mmap: materialized %zu bytes of fd %d", length, fd);
+        return p;
+    }
+
+    /* Fault mode: keep our own descriptor, open() tracks it as well */
+    std::string path;
+    int region_fd = hvac_fdtable_copy_path(fd, path) ? open(path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    if (region_fd < 0) {
+        munmap(p, length);
+        *handled = 0;
+        return MAP_FAILED;
+    }
+
+    size_t len = (length + g_page_size - 1) & ~(g_page_size - 1);
+    if (!hvac_mmap_uffd_ready() || !hvac_mmap_register((uintptr_t)p, len)) {
+        L4C_WARN("userfaultfd register failed (%s), mapping fd %d from the PFS", strerror(errno), fd);
+        close(region_fd);
+        munmap(p, length);
+        *handled = 0;
+        return MAP_FAILED;
+    }
+
+    struct hvac_mmap_region region;
+    region.len = len;
+    region.file = std::make_shared<struct hvac_mmap_file>();
+    region.file->fd = region_fd;
+    region.offset = offset;
+    region.file_size = st.st_size;
+    region.prot = prot;
+    pthread_mutex_lock(&mmap_regions_mutex);
+    mmap_regions[(uintptr_t)p] = region;
+    mmap_region_count++;
+    pthread_mutex_unlock(&mmap_regions_mutex);
+
+    if (prot != (PROT_READ | PROT_WRITE))
+        mprotect(p, length, prot);
+    L4C_INFO("mmap: %zu bytes of fd %d filled on fault", length, fd);
+    return p;
+}
+
+/* Regions are looked up by overlap: one that starts below addr or runs
+ * past the end is cut down to what stays mapped, split in two if the
+ * hole is in its middle. Descriptors are closed outside the lock once no
+ * piece or fault uses them. */
+void hvac_munmap_notify(void *addr, size_t length)
+{
+    std::vector<std::shared_ptr<struct hvac_mmap_file>> dropped;
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + ((length + g_page_size - 1) & ~(g_page_size - 1));
+
+    if (mmap_region_count.load(std::memory_order_relaxed) == 0)
+        return;
+    pthread_mutex_lock(&mmap_regions_mutex);
+    auto it = mmap_regions.upper_bound(start);
+    if (it != mmap_regions.begin() && std::prev(it)->first + std::prev(it)->second.len > start)
+        --it;
+    while (it != mmap_regions.end() && it->first < end) {
+        uintptr_t rstart = it->first;
+        uintptr_t rend = rstart + it->second.len;
+        struct hvac_mmap_region r = it->second;
+
+        it = mmap_regions.erase(it);
+        mmap_region_count--;
+        if (rstart < start) {
+            struct hvac_mmap_region left = r;
+            left.len = start - rstart;
+            mmap_regions[rstart] = left;
+            mmap_region_count++;
+        }
+        if (rend > end) {
+            struct hvac_mmap_region right = r;
+            right.offset += end - rstart;
+            right.len = rend - end;
+            mmap_regions[end] = right;
+            mmap_region_count++;
+        }
+        dropped.push_back(std::move(r.file));
+    }
+    pthread_mutex_unlock(&mmap_regions_mutex);
+}
@@ -0,0 +1,43 @@
+/* mmap of cached files
+ *
+ * A file mapping reads straight from the PFS page cache, none of it goes
+ * through the read wrappers. For tracked fds, read-only or private
+ * mappings are instead backed by anonymous memory filled from HVAC:
+ *
+ *   HVAC_MMAP=copy   (default) the whole range is read into the mapping
+ *                    before mmap() returns. Mappings over HVAC_MMAP_COPY_MAX
+ *                    bytes are left to the real mmap().
+ *   HVAC_MMAP=fault  pages are filled on first touch by a userfaultfd
+ *                    handler thread, HVAC_MMAP_FAULT_CHUNK bytes per fault.
+ *                    Falls back to copy when userfaultfd isn't available.
+ *                    fork() children fault in what they inherited through a
+ *                    handler of their own. A failed read raises SIGBUS in
+ *                    the faulting thread, as it would on a file mapping.
+ *   HVAC_MMAP=off    every mmap() goes to the PFS.
+ *
+ * The contents are a snapshot: writes through another mapping or fd are
+ * not seen. Shared writable mappings are never taken over.
+ */
+#ifndef __HVAC_MMAP_H__
+#define __HVAC_MMAP_H__
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void hvac_mmap_init();
+
+// The mapping, MAP_FAILED with errno and *handled set, or *handled clear
+// when the real mmap() should run
+void *hvac_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset, int *handled);
+
+// Before the real munmap(): drop lazily filled regions inside the range
+void hvac_munmap_notify(void *addr, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
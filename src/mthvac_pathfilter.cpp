@@ -0,0 +1,240 @@
+/* Open path filtering - see mthvac_pathfilter.h */
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "mthvac_pathfilter.h"
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+// Directories remembered before the cache is dropped and rebuilt
+#define HVAC_PATHFILTER_CACHE_MAX 4096
+
+struct hvac_path_rule {
+    std::string pattern;
+    bool glob;
+};
+
+struct hvac_dir_verdict {
+    std::string canonical;  // resolved directory
+    bool rejected;          // no include rule can match a file in it
+};
+
+static std::vector<struct hvac_path_rule> g_include;
+static std::vector<struct hvac_path_rule> g_exclude;
+static bool g_include_globs = false;
+static bool g_cwd_mode = false;     // no include rules: cache files in the cwd
+
+static std::unordered_map<std::string, struct hvac_dir_verdict> g_dir_cache;
+static pthread_rwlock_t g_dir_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static bool hvac_is_glob(const std::string &s)
+{
+    return s.find_first_of("*?[") != std::string::npos;
+}
+
+static void hvac_add_rules(const char *spec, std::vector<struct hvac_path_rule> &rules)
+{
+    std::string list = spec;
+    size_t start = 0;
+
+    while (start <= list.size()) {
+        size_t end = list.find(':', start);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string entry = list.substr(start, end - start);
+        start = end + 1;
+        if (entry.empty())
+            continue;
+
+        struct hvac_path_rule rule;
+        rule.glob = hvac_is_glob(entry);
+        rule.pattern = entry;
+        if (!rule.glob) {
+            char resolved[PATH_MAX];
+            // Resolve prefixes now so symlinked mounts still match
+            if (realpath(entry.c_str(), resolved) != NULL)
+                rule.pattern = resolved;
+            while (rule.pattern.size() > 1 && rule.pattern.back() == '/')
+                rule.pattern.pop_back();
+        }
+        rules.push_back(rule);
+    }
+}
+
+// dir is dir itself or below prefix
+static bool hvac_under_prefix(const std::string &dir, const std::string &prefix)
+{
+    if (prefix == "/")
+        return true;
+    return dir.compare(0, prefix.size(), prefix) == 0 &&
+           (dir.size() == prefix.size() || dir[prefix.size()] == '/');
+}
+
+static bool hvac_rule_matches(const struct hvac_path_rule &rule, const std::string &dir, const std::string &file)
+{
+    if (rule.glob)
+        return fnmatch(rule.pattern.c_str(), file.c_str(), 0) == 0;
+    return hvac_under_prefix(dir, rule.pattern);
+}
+
+void hvac_pathfilter_init(const char *data_dir)
+{
+    char *env;
+
+    if (data_dir != NULL)
+        hvac_add_rules(data_dir, g_include);
+    if ((env = getenv("HVAC_INCLUDE")) != NULL)
+        hvac_add_rules(env, g_include);
+    if ((env = getenv("HVAC_EXCLUDE")) != NULL)
+        hvac_add_rules(env, g_exclude);
+
+    for (auto &rule : g_include)
+        g_include_globs |= rule.glob;
+    g_cwd_mode = g_include.empty();
+
+    L4C_INFO("Path filter: %zu include, %zu exclude rules%s", g_include.size(), g_exclude.size(),
+             g_cwd_mode ? ", caching the working directory" : "");
+}
+
+/* Canonical form of the directory holding path, from the cache if we have
+ * seen it. dir is the lexical directory, used as the cache key. */
+static bool hvac_lookup_dir(const std::string &dir, struct hvac_dir_verdict *verdict)
+{
+    pthread_rwlock_rdlock(&g_dir_cache_lock);
+    auto it = g_dir_cache.find(dir);
+    bool found = (it != g_dir_cache.end());
+    if (found)
+        *verdict = it->second;
+    pthread_rwlock_unlock(&g_dir_cache_lock);
+    if (found)
+        return true;
+
+    char resolved[PATH_MAX];
+    if (realpath(dir.c_str(), resolved) == NULL)
+        return false;   // not cached - the directory may appear later
+
+    verdict->canonical = resolved;
+    verdict->rejected = false;
+    if (!g_cwd_mode && !g_include_globs) {
+        verdict->rejected = true;
+        for (auto &rule : g_include)
+            if (hvac_under_prefix(verdict->canonical, rule.pattern))
+                verdict->rejected = false;
+    }
+
+    pthread_rwlock_wrlock(&g_dir_cache_lock);
+    if (g_dir_cache.size() >= HVAC_PATHFILTER_CACHE_MAX)
+        g_dir_cache.clear();
+    g_dir_cache[dir] = *verdict;
+    pthread_rwlock_unlock(&g_dir_cache_lock);
+    return true;
+}
+
+/* file is in dir, both canonical */
+static bool hvac_rules_allow(const std::string &dir, const std::string &file)
+{
+    if (g_cwd_mode) {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == NULL || dir != cwd)
+            return false;
+    } else {
+        bool included = false;
+        for (auto &rule : g_include)
+            if (hvac_rule_matches(rule, dir, file)) {
+                included = true;
+                break;
+            }
+        if (!included)
+            return false;
+    }
+    for (auto &rule : g_exclude)
+        if (hvac_rule_matches(rule, dir, file))
+            return false;
+    return true;
+}
+
+static bool hvac_lexical_path(const char *path, std::string *lexical)
+{
+    if (path == NULL || *path == '\0')
+        return false;
+
+    lexical->clear();
+    if (path[0] != '/') {
+        char cwd[PATH_MAX];
+        if (getcwd(cwd, sizeof(cwd)) == NULL)
+            return false;
+        *lexical = cwd;
+        *lexical += '/';
+    }
+    *lexical += path;
+    return true;
+}
+
+bool hvac_pathfilter_match_dir(const char *path, std::string *dir_out, std::string *name_out)
+{
+    std::string lexical;
+    struct hvac_dir_verdict verdict;
+
+    if (!hvac_lexical_path(path, &lexical))
+        return false;
+
+    size_t slash = lexical.rfind('/');
+    std::string dir = slash == 0 ? "/" : lexical.substr(0, slash);
+    std::string name = lexical.substr(slash + 1);
+    if (name.empty() || name == "." || name == "..")
+        return false;
+
+    if (!hvac_lookup_dir(dir, &verdict) || verdict.rejected)
+        return false;
+
+    std::string file = verdict.canonical == "/" ? "/" + name : verdict.canonical + "/" + name;
+    if (!hvac_rules_allow(verdict.canonical, file))
+        return false;
+
+    *dir_out = verdict.canonical;
+    *name_out = name;
+    return true;
+}
+
+bool hvac_pathfilter_match(const char *path, std::string *canonical)
+{
+    std::string dir, name;
+
+    if (!hvac_pathfilter_match_dir(path, &dir, &name))
+        return false;
+    std::string file = dir == "/" ? "/" + name : dir + "/" + name;
+
+    // The file itself may be a link into another tree, resolve it for the
+    // server side open and for placement
+    char resolved[PATH_MAX];
+    if (realpath(file.c_str(), resolved) == NULL)
+        return false;
+    *canonical = resolved;
+    return true;
+}
+
+bool hvac_pathfilter_match_tree(const char *path, std::string *canonical)
+{
+    std::string lexical;
+    struct hvac_dir_verdict verdict;
+
+    if (!hvac_lexical_path(path, &lexical))
+        return false;
+    while (lexical.size() > 1 && lexical.back() == '/')
+        lexical.pop_back();
+
+    if (!hvac_lookup_dir(lexical, &verdict) || verdict.rejected)
+        return false;
+    if (!hvac_rules_allow(verdict.canonical, verdict.canonical))
+        return false;
+    *canonical = verdict.canonical;
+    return true;
+}
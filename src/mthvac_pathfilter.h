@@ -0,0 +1,33 @@
+/* Which open() calls get cached
+ *
+ * Rules are compiled once at init: HVAC_DATA_DIR (canonicalized here,
+ * not on every open) plus optional colon separated HVAC_INCLUDE and
+ * HVAC_EXCLUDE lists. An entry containing *, ? or [ is a glob (fnmatch),
+ * anything else a directory prefix that matches itself and everything
+ * below it. Without HVAC_DATA_DIR / HVAC_INCLUDE files in the current
+ * working directory are cached, as before.
+ *
+ * Each directory is canonicalized once and remembered. Directories no
+ * include rule can match are remembered as rejected, so opens of shared
+ * libraries, Python modules and the like cost a string lookup and no
+ * realpath at all.
+ */
+#ifndef __HVAC_PATHFILTER_H__
+#define __HVAC_PATHFILTER_H__
+
+#include <string>
+
+void hvac_pathfilter_init(const char *data_dir);
+
+// True if path should be cached, canonical receives its resolved path
+bool hvac_pathfilter_match(const char *path, std::string *canonical);
+
+// Same rules without resolving the file itself: the canonical directory
+// and the entry name, for metadata lookups that must not touch the PFS
+bool hvac_pathfilter_match_dir(const char *path, std::string *dir, std::string *name);
+
+// A directory inside the cached tree, for listings. canonical receives
+// the resolved directory
+bool hvac_pathfilter_match_tree(const char *path, std::string *canonical);
+
+#endif
@@ -0,0 +1,142 @@
+/* File to server placement - see mthvac_placement.h */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mthvac_placement.h"
+
+static uint32_t g_place_server_count = 1;
+static std::vector<double> g_place_weights;
+
+static inline uint64_t hvac_rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* Final avalanche from MurmurHash3 */
+static inline uint64_t hvac_fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* 8 bytes per round with a multiply / rotate mix, tail folded in byte by
+ * byte. Loads go through memcpy so the result does not depend on
+ * alignment; bytes are assembled little endian so it does not depend on
+ * the host either.
+ */
+uint64_t hvac_hash64(const void *data, size_t len, uint64_t seed)
+{
+    const uint64_t m1 = 0x87c37b91114253d5ULL;
+    const uint64_t m2 = 0x4cf5ad432745937fULL;
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = seed ^ (len * m1);
+
+    while (len >= 8) {
+        uint64_t k = 0;
+        for (int i = 7; i >= 0; i--)
+            k = (k << 8) | p[i];
+        k *= m1;
+        k = hvac_rotl64(k, 31);
+        k *= m2;
+        h ^= k;
+        h = hvac_rotl64(h, 27) * 5 + 0x52dce729;
+        p += 8;
+        len -= 8;
+    }
+
+    uint64_t tail = 0;
+    for (size_t i = len; i > 0; i--)
+        tail = (tail << 8) | p[i - 1];
+    if (len) {
+        tail *= m2;
+        tail = hvac_rotl64(tail, 33);
+        tail *= m1;
+        h ^= tail;
+    }
+
+    return hvac_fmix64(h);
+}
+
+uint32_t hvac_jump_hash(uint64_t key, uint32_t buckets)
+{
+    int64_t b = -1, j = 0;
+
+    while (j < (int64_t)buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+    return (uint32_t)b;
+}
+
+uint32_t hvac_rendezvous_hash(uint64_t key, const std::vector<double> &weights)
+{
+    uint32_t best = 0;
+    double best_score = -HUGE_VAL;
+
+    for (uint32_t i = 0; i < weights.size(); i++) {
+        /* Map (key, server) to a uniform in (0,1) and score it -w/ln(u) */
+        uint64_t h = hvac_fmix64(key ^ hvac_fmix64(i + 0x9e3779b97f4a7c15ULL));
+        double u = ((h >> 11) + 0.5) / 9007199254740992.0;
+        double score = -weights[i] / log(u);
+        if (score > best_score) {
+            best_score = score;
+            best = i;
+        }
+    }
+    return best;
+}
+
+std::vector<double> hvac_parse_weights(const char *spec, uint32_t server_count)
+{
+    std::vector<double> weights;
+    const char *p = spec;
+
+    while (p != NULL && *p != '\0') {
+        char *end;
+        double w = strtod(p, &end);
+        if (end == p || w <= 0.0)
+            return std::vector<double>();
+        weights.push_back(w);
+        p = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0')
+            return std::vector<double>();
+    }
+
+    if (weights.size() != server_count)
+        return std::vector<double>();
+    return weights;
+}
+
+void hvac_placement_init(uint32_t server_count)
+{
+    g_place_server_count = server_count ? server_count : 1;
+    g_place_weights.clear();
+
+    const char *spec = getenv("HVAC_SERVER_WEIGHTS");
+    if (spec != NULL)
+        g_place_weights = hvac_parse_weights(spec, g_place_server_count);
+}
+
+uint32_t hvac_place_hash(uint64_t path_hash)
+{
+    if (!g_place_weights.empty())
+        return hvac_rendezvous_hash(path_hash, g_place_weights);
+    return hvac_jump_hash(path_hash, g_place_server_count);
+}
+
+uint32_t hvac_place_path(const std::string &path)
+{
+    return hvac_place_hash(hvac_hash64(path.data(), path.size()));
+}
+
+uint32_t hvac_place_block(const std::string &path, uint64_t block)
+{
+    // Seed with the block so blocks of one file scatter independently
+    return hvac_place_hash(hvac_hash64(path.data(), path.size(), hvac_fmix64(block + 1)));
+}
@@ -0,0 +1,39 @@
+/* File to server placement
+ *
+ * std::hash is neither stable across libstdc++ builds nor friendly to a
+ * changing HVAC_SERVER_COUNT (modulo remaps nearly every file). Paths are
+ * hashed with a fixed in-tree 64-bit hash and mapped with jump consistent
+ * hashing, so growing from n to n+1 servers only moves ~1/(n+1) of the
+ * files. If HVAC_SERVER_WEIGHTS is set (comma separated, one per server)
+ * weighted rendezvous hashing is used instead to follow uneven capacity.
+ *
+ * Kept free of Mercury / log4c so it can be tested on its own.
+ */
+#ifndef __HVAC_PLACEMENT_H__
+#define __HVAC_PLACEMENT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Fixed 64-bit hash, identical on every build and platform
+uint64_t hvac_hash64(const void *data, size_t len, uint64_t seed = 0);
+
+// Jump consistent hash (Lamping & Veach) - no state, no weights
+uint32_t hvac_jump_hash(uint64_t key, uint32_t buckets);
+
+// Weighted rendezvous (highest random weight) hashing
+uint32_t hvac_rendezvous_hash(uint64_t key, const std::vector<double> &weights);
+
+// Parse "w0,w1,..." - returns an empty vector if spec doesn't describe
+// exactly server_count positive weights
+std::vector<double> hvac_parse_weights(const char *spec, uint32_t server_count);
+
+/* Process wide placement, set up once from the server count and env */
+void hvac_placement_init(uint32_t server_count);
+uint32_t hvac_place_hash(uint64_t path_hash);
+uint32_t hvac_place_path(const std::string &path);
+uint32_t hvac_place_block(const std::string &path, uint64_t block);
+
+#endif
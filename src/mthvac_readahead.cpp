@@ -0,0 +1,291 @@
+/* Client side readahead for sequential read() - see mthvac_readahead.h
+ *
+ * Each fd keeps at most two windows: the one we are serving read() from
+ * and one prefetch in flight behind it. Both are plain malloc buffers
+ * registered for bulk by the read RPC.
+ */
+#include <unordered_map>
+#include <atomic>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "mthvac_readahead.h"
+#include "mthvac_comm.h"
+#include "mthvac_shmcache.h"
+#include "mthvac_timer.h" // ! HVAC TIMING
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+#define HVAC_RA_MIN_WINDOW (128 * 1024)
+// Number of back-to-back read() calls before we start prefetching. Keeps
+// the open / read whole file / close pattern from paying for a window.
+#define HVAC_RA_SEQ_TRIGGER 2
+
+static size_t g_ra_max_window = 4 * 1024 * 1024;
+static size_t g_ra_budget = 256 * 1024 * 1024;
+static std::atomic<size_t> g_ra_in_use{0};
+
+struct hvac_ra_buf {
+    char *data;
+    size_t cap;     // bytes requested from the server / reserved in the budget
+    off_t off;      // file offset of data[0]
+    size_t len;     // valid bytes in data
+};
+
+struct hvac_ra_state {
+    pthread_mutex_t mutex;
+    struct hvac_ra_buf ready;           // data already delivered by the server
+    struct hvac_ra_buf pending;         // target of the in-flight prefetch
+    struct hvac_read_op *pending_op;
+    size_t window;
+    off_t next;         // where the last read() ended
+    uint32_t seq_reads;
+    bool eof;
+
+    hvac_ra_state() : pending_op(NULL), window(HVAC_RA_MIN_WINDOW), next(0), seq_reads(0), eof(false) {
+        memset(&ready, 0, sizeof(ready));
+        memset(&pending, 0, sizeof(pending));
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    ~hvac_ra_state() {
+        pthread_mutex_destroy(&mutex);
+    }
+};
+
+static std::unordered_map<int, hvac_ra_state *> ra_map;
+static pthread_mutex_t ra_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void hvac_ra_init()
+{
+    char *env;
+
+    if ((env = getenv("HVAC_READAHEAD_MAX")) != NULL)
+        g_ra_max_window = strtoull(env, NULL, 10);
+    if ((env = getenv("HVAC_READAHEAD_BUDGET")) != NULL)
+        g_ra_budget = strtoull(env, NULL, 10);
+
+    if (g_ra_max_window != 0 && g_ra_max_window < HVAC_RA_MIN_WINDOW)
+        g_ra_max_window = HVAC_RA_MIN_WINDOW;
+
+    L4C_INFO("Readahead max window %zu bytes, budget %zu bytes", g_ra_max_window, g_ra_budget);
+}
+
+bool hvac_ra_enabled()
+{
+    return g_ra_max_window != 0 && g_ra_budget != 0;
+}
+
+/* Take bytes out of the per-process budget, fails instead of blocking */
+static bool hvac_ra_reserve(size_t bytes)
+{
+    size_t cur = g_ra_in_use.load(std::memory_order_relaxed);
+    do {
+        if (cur + bytes > g_ra_budget)
+            return false;
+    } while (!g_ra_in_use.compare_exchange_weak(cur, cur + bytes, std::memory_order_relaxed));
+    return true;
+}
+
+static void hvac_ra_buf_free(struct hvac_ra_buf *b)
+{
+    if (b->data) {
+        free(b->data);
+        g_ra_in_use.fetch_sub(b->cap, std::memory_order_relaxed);
+    }
+    memset(b, 0, sizeof(*b));
+}
+
+static bool hvac_ra_buf_alloc(struct hvac_ra_buf *b, size_t size)
+{
+    hvac_ra_buf_free(b);
+    if (!hvac_ra_reserve(size))
+        return false;
+    b->data = (char *)malloc(size);
+    if (b->data == NULL) {
+        g_ra_in_use.fetch_sub(size, std::memory_order_relaxed);
+        return false;
+    }
+    b->cap = size;
+    return true;
+}
+
+/* Copy what buf holds of [pos, pos + count) */
+static size_t hvac_ra_copy_out(struct hvac_ra_buf *b, off_t pos, char *dst, size_t count)
+{
+    if (b->data == NULL || pos < b->off || pos >= b->off + (off_t)b->len)
+        return 0;
+    size_t n = b->off + b->len - pos;
+    if (n > count)
+        n = count;
+    memcpy(dst, b->data + (pos - b->off), n);
+    return n;
+}
+
+/* The application moved: whatever we buffered is for the old stream */
+static void hvac_ra_reset(struct hvac_ra_state *st)
+{
+    if (st->pending_op != NULL) {
+        hvac_client_comm_wait_read_rpc(st->pending_op);
+        st->pending_op = NULL;
+    }
+    hvac_ra_buf_free(&st->ready);
+    hvac_ra_buf_free(&st->pending);
+    st->window = HVAC_RA_MIN_WINDOW;
+    st->seq_reads = 0;
+    st->eof = false;
+}
+
+static hvac_ra_state *hvac_ra_get_state(int fd)
+{
+    hvac_ra_state *st;
+
+    pthread_mutex_lock(&ra_map_mutex);
+    auto it = ra_map.find(fd);
+    if (it == ra_map.end()) {
+        st = new hvac_ra_state();
+        ra_map[fd] = st;
+    } else {
+        st = it->second;
+    }
+    pthread_mutex_unlock(&ra_map_mutex);
+    return st;
+}
+
+ssize_t hvac_ra_read(int fd, uint32_t host, void *buf, size_t count, off_t offset)
+{
+    HVAC_TIMING("CLIENT_(hvac_ra_read)_total");
+    hvac_ra_state *st = hvac_ra_get_state(fd);
+    char *dst = (char *)buf;
+    size_t copied;
+    ssize_t got;
+
+    pthread_mutex_lock(&st->mutex);
+
+    if (offset != st->next)
+        hvac_ra_reset(st);
+
+    copied = hvac_ra_copy_out(&st->ready, offset, dst, count);
+
+    /* The prefetch is the next piece of the stream - collect it */
+    if (copied < count && st->pending_op != NULL) {
+        {
+            HVAC_TIMING("CLIENT_(hvac_ra_read)_wait_prefetch");
+            got = hvac_client_comm_wait_read_rpc(st->pending_op);
+        }
+        st->pending_op = NULL;
+        hvac_ra_buf_free(&st->ready);
+        st->ready = st->pending;
+        memset(&st->pending, 0, sizeof(st->pending));
+
+        if (got < 0) {
+            // Start over on the next read, this one falls back for the rest
+            L4C_ERR("Readahead prefetch failed on fd %d", fd);
+            hvac_ra_reset(st);
+            st->next = offset + copied;
+            pthread_mutex_unlock(&st->mutex);
+            return copied ? (ssize_t)copied : -1;
+        }
+        if ((size_t)got < st->ready.cap)
+            st->eof = true;
+        st->ready.len = got;
+        copied += hvac_ra_copy_out(&st->ready, offset + copied, dst + copied, count - copied);
+    }
+
+    if (copied < count && !st->eof) {
+        size_t need = count - copied;
+        off_t pos = offset + copied;
+
+        if (st->seq_reads >= HVAC_RA_SEQ_TRIGGER && need < st->window &&
+            hvac_ra_buf_alloc(&st->ready, st->window)) {
+            /* Refill a whole window and serve from it */
+            HVAC_TIMING("CLIENT_(hvac_ra_read)_refill");
+            st->ready.off = pos;
+            got = hvac_shm_pread(fd, host, st->ready.data, st->ready.cap, pos);
+            if (got >= 0) {
+                if ((size_t)got < st->ready.cap)
+                    st->eof = true;
+                st->ready.len = got;
+                copied += hvac_ra_copy_out(&st->ready, pos, dst + copied, need);
+            }
+        } else {
+            /* Not streaming yet, or the request outruns the window */
+            got = hvac_shm_pread(fd, host, dst + copied, need, pos);
+            if (got >= 0) {
+                if ((size_t)got < need)
+                    st->eof = true;
+                copied += got;
+            }
+        }
+
+        if (got < 0) {
+            st->next = offset + copied;
+            pthread_mutex_unlock(&st->mutex);
+            return copied ? (ssize_t)copied : -1;
+        }
+    }
+    st->next = offset + copied;
+    st->seq_reads++;
+
+    /* Keep one window in flight ahead of the application, starting where
+     * the buffered data ends */
+    if (st->seq_reads >= HVAC_RA_SEQ_TRIGGER && !st->eof && st->pending_op == NULL &&
+        hvac_ra_buf_alloc(&st->pending, st->window)) {
+        off_t ahead = st->next;
+        if (st->ready.data && st->ready.off + (off_t)st->ready.len > ahead)
+            ahead = st->ready.off + st->ready.len;
+        st->pending.off = ahead;
+        st->pending_op = hvac_client_comm_start_read_rpc(host, fd, st->pending.data, st->pending.cap, ahead);
+        if (st->pending_op == NULL) {
+            hvac_ra_buf_free(&st->pending);
+        } else if (st->window < g_ra_max_window) {
+            st->window *= 2;
+            if (st->window > g_ra_max_window)
+                st->window = g_ra_max_window;
+        }
+    }
+
+    pthread_mutex_unlock(&st->mutex);
+    return copied;
+}
+
+void hvac_ra_advance(int fd, off_t offset, size_t count)
+{
+    hvac_ra_state *st = hvac_ra_get_state(fd);
+
+    pthread_mutex_lock(&st->mutex);
+    if (offset != st->next)
+        hvac_ra_reset(st);
+    st->next = offset + count;
+    st->seq_reads++;
+    pthread_mutex_unlock(&st->mutex);
+}
+
+void hvac_ra_release(int fd)
+{
+    hvac_ra_state *st = NULL;
+
+    pthread_mutex_lock(&ra_map_mutex);
+    auto it = ra_map.find(fd);
+    if (it != ra_map.end()) {
+        st = it->second;
+        ra_map.erase(it);
+    }
+    pthread_mutex_unlock(&ra_map_mutex);
+
+    if (st == NULL)
+        return;
+
+    pthread_mutex_lock(&st->mutex);
+    if (st->pending_op != NULL) {
+        hvac_client_comm_wait_read_rpc(st->pending_op);
+        st->pending_op = NULL;
+    }
+    hvac_ra_buf_free(&st->ready);
+    hvac_ra_buf_free(&st->pending);
+    pthread_mutex_unlock(&st->mutex);
+    delete st;
+}
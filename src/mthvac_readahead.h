@@ -0,0 +1,33 @@
+/* Client side readahead for sequential read()
+ *
+ * read() on a tracked fd continues at the client side file position. Once
+ * an fd has shown a few back-to-back read() calls we start asking the
+ * server for a window ahead of the application and serve later read()
+ * calls from memory. A read() anywhere else (after an lseek) drops the
+ * buffered windows and starts the detection over. The window doubles on
+ * every refill up to HVAC_READAHEAD_MAX and all windows together are
+ * capped by HVAC_READAHEAD_BUDGET.
+ */
+#ifndef __HVAC_READAHEAD_H__
+#define __HVAC_READAHEAD_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+void hvac_ra_init();
+bool hvac_ra_enabled();
+
+// Serve a read() of count bytes at offset on a tracked fd, refilling /
+// prefetching as needed. Returns -1 if nothing could be read so the
+// caller can fall back.
+ssize_t hvac_ra_read(int fd, uint32_t host, void *buf, size_t count, off_t offset);
+
+// A read() of count bytes at offset served without readahead, a block
+// cache hit. Moves the stream on like one of ours would.
+void hvac_ra_advance(int fd, off_t offset, size_t count);
+
+// Drop any buffered data for fd. Waits for an in-flight prefetch since
+// the server may still be writing into its buffer.
+void hvac_ra_release(int fd);
+
+#endif
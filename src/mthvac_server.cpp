@@ -73,10 +73,13 @@ int hvac_start_comm_server(void)
     hvac_rpc_register();
     hvac_open_rpc_register();
     hvac_close_rpc_register();
-    hvac_seek_rpc_register();
+    hvac_stripe_read_rpc_register();
+    hvac_readv_rpc_register();
+    hvac_dir_snapshot_rpc_register();
 
     // ! HVAC TIMING
     hvac_trigger_srv_print_stats_rpc_register(); 
+    hvac_srv_stats_rpc_register();
 
     while (1)
         sleep(1);
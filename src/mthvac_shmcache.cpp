@@ -0,0 +1,676 @@
+/* Node-wide sample cache in shared memory - see mthvac_shmcache.h
+ *
+ * Segment layout: header, index, slab descriptors, slab data. Only
+ * std::atomic fields that are lock free (and therefore address free) are
+ * shared between processes.
+ *
+ * Index entries are one 64-bit word: a 40-bit tag of the key hash and
+ * the slab number. They are only hints - the slab descriptor holds the
+ * full key and is checked on every lookup, so an entry whose slab has
+ * since been recycled is just a miss and may be overwritten. Lookups probe
+ * a short window from the home position and never block.
+ *
+ * A slab's seq word is the version in the low 32 bits and, while the
+ * version is odd, the pid of the process filling the slab in the high 32.
+ * One CAS takes the slab and names its owner, so there is never an odd
+ * slab without a filler to check on, and the word goes back to an even
+ * version with no pid once the data is in place or the claim is given up.
+ * A pid of 0 is never reclaimed. Readers copy between two loads of the
+ * word and throw the copy away if it moved.
+ *
+ * Lifetime is kept with open file description locks on the segment, which
+ * the kernel drops however a process ends: every attached process holds a
+ * read lock on byte HVAC_SHM_LOCK_USERS, and attaching or detaching holds
+ * a write lock on byte HVAC_SHM_LOCK_ATTACH. Whoever gets a write lock on
+ * the users byte is alone with the segment - on attach it starts the
+ * segment over, on detach it removes it.
+ */
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mthvac_shmcache.h"
+#include "mthvac_fdtable.h"
+#include "mthvac_comm.h"
+#include "mthvac_timer.h" // ! HVAC TIMING
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+#define HVAC_SHM_MAGIC 0x4856414353484d32ULL   // "HVACSHM2"
+#define HVAC_SHM_PROBE 8
+#define HVAC_SHM_MAX_RUN 64                     // slabs filled by one RPC
+#define HVAC_SHM_SLAB_BITS 24
+#define HVAC_SHM_SLAB_MASK ((1ULL << HVAC_SHM_SLAB_BITS) - 1)
+#define HVAC_SHM_ALIGN 4096
+#define HVAC_SHM_VERSION_MASK 0xffffffffULL
+#define HVAC_SHM_LOCK_ATTACH 0
+#define HVAC_SHM_LOCK_USERS 1
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock free");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared atomics must be lock free");
+
+struct hvac_shm_header {
+    std::atomic<uint64_t> magic;        // stored last by the creator
+    uint64_t size;
+    uint64_t block;
+    uint64_t nslabs;
+    uint64_t nentries;                  // power of two
+    uint64_t index_off, slabs_off, data_off;
+    std::atomic<uint64_t> hand;         // CLOCK hand, taken modulo nslabs
+    // Node-wide counters
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> fills;
+    std::atomic<uint64_t> waits;
+};
+
+struct hvac_shm_slab {
+    std::atomic<uint64_t> seq;          // filler pid << 32 | version, odd while being filled
+    std::atomic<uint64_t> file;         // 0 when the slab holds nothing
+    std::atomic<uint64_t> block;
+    std::atomic<uint32_t> len;          // valid bytes, less than a block only at EOF
+    std::atomic<uint32_t> ref;          // CLOCK reference bit
+};
+
+static struct hvac_shm_header *g_shm = NULL;
+static std::atomic<uint64_t> *g_shm_index;
+static struct hvac_shm_slab *g_shm_slabs;
+static char *g_shm_data;
+static uint64_t g_shm_block;
+static size_t g_shm_max_read;
+static int g_shm_wait_ms = 10000;
+static char g_shm_name[256];
+static int g_shm_fd = -1;               // holds our locks, open for the life of the process
+static bool g_shm_own_lock = true;      // false in a child still sharing the parent's locks
+
+// This process's share of the node counters
+static std::atomic<uint64_t> g_shm_my_hits{0};
+static std::atomic<uint64_t> g_shm_my_misses{0};
+
+static int hvac_shm_lock(int fd, off_t byte, short type, bool wait)
+{
+    struct flock fl;
+    int rc;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+    do {
+        rc = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+    } while (rc != 0 && errno == EINTR);
+    return rc;
+}
+
+static void hvac_shm_atfork_child()
+{
+    /* The inherited fd shares the parent's open file description, locks
+     * and all, so our exit would look like the parent's. Attach through a
+     * description of our own. The parent's read lock keeps the name on
+     * the same segment. */
+    struct stat mine, inherited;
+    int fd = shm_open(g_shm_name, O_RDWR, 0600);
+
+    if (fd >= 0 && fstat(fd, &mine) == 0 && fstat(g_shm_fd, &inherited) == 0 &&
+        mine.st_dev == inherited.st_dev && mine.st_ino == inherited.st_ino &&
+        hvac_shm_lock(fd, HVAC_SHM_LOCK_USERS, F_RDLCK, true) == 0) {
+        close(g_shm_fd);
+        g_shm_fd = fd;
+        return;
+    }
+    if (fd >= 0)
+        close(fd);
+    // Stay attached on the parent's lock and leave removal to others
+    g_shm_own_lock = false;
+}
+
+static void __attribute((destructor)) hvac_shm_detach()
+{
+    struct stat st;
+
+    if (g_shm == NULL || !g_shm_own_lock)
+        return;
+    // Last one out removes the name, nobody can attach in between
+    if (hvac_shm_lock(g_shm_fd, HVAC_SHM_LOCK_ATTACH, F_WRLCK, true) == 0 &&
+        hvac_shm_lock(g_shm_fd, HVAC_SHM_LOCK_USERS, F_WRLCK, false) == 0 &&
+        fstat(g_shm_fd, &st) == 0 && st.st_nlink > 0)
+        shm_unlink(g_shm_name);
+    close(g_shm_fd);
+}
+
+static inline uint64_t hvac_shm_hash(uint64_t file, uint64_t block)
+{
+    // splitmix64 finalizer over both halves of the key
+    uint64_t x = file ^ (block * 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static inline uint64_t hvac_shm_tag(uint64_t h)
+{
+    return (h >> HVAC_SHM_SLAB_BITS) | 1;
+}
+
+static inline uint64_t hvac_shm_entry(uint64_t h, uint32_t slab)
+{
+    return (hvac_shm_tag(h) << HVAC_SHM_SLAB_BITS) | slab;
+}
+
+static inline bool hvac_shm_slab_is(struct hvac_shm_slab *s, uint64_t file, uint64_t block)
+{
+    return s->file.load(std::memory_order_relaxed) == file &&
+           s->block.load(std::memory_order_relaxed) == block;
+}
+
+static inline char *hvac_shm_slab_data(uint32_t slab)
+{
+    return g_shm_data + (uint64_t)slab * g_shm_block;
+}
+
+static bool hvac_shm_attach(size_t bytes, size_t block)
+{
+    uint64_t nslabs = bytes / block;
+    uint64_t nentries = 1;
+    bool creator = false;
+    struct stat st;
+    int fd;
+
+    if (nslabs > HVAC_SHM_SLAB_MASK)
+        nslabs = HVAC_SHM_SLAB_MASK;
+    while (nentries < 2 * nslabs)
+        nentries <<= 1;
+
+    uint64_t index_off = (sizeof(struct hvac_shm_header) + HVAC_SHM_ALIGN - 1) & ~(uint64_t)(HVAC_SHM_ALIGN - 1);
+    uint64_t slabs_off = index_off + nentries * sizeof(uint64_t);
+    uint64_t data_off = (slabs_off + nslabs * sizeof(struct hvac_shm_slab) + HVAC_SHM_ALIGN - 1) &
+                        ~(uint64_t)(HVAC_SHM_ALIGN - 1);
+    uint64_t size = data_off + nslabs * block;
+
+    for (int attempt = 0;; attempt++) {
+        fd = shm_open(g_shm_name, O_RDWR | O_CREAT, 0600);
+        if (fd < 0) {
+            L4C_ERR("Cannot open shared cache %s: %s", g_shm_name, strerror(errno));
+            return false;
+        }
+        if (hvac_shm_lock(fd, HVAC_SHM_LOCK_ATTACH, F_WRLCK, true) != 0 || fstat(fd, &st) != 0) {
+            L4C_ERR("Cannot lock shared cache %s: %s", g_shm_name, strerror(errno));
+            close(fd);
+            return false;
+        }
+        if (st.st_nlink > 0)
+            break;
+        // The last user removed it while we waited for the lock
+        close(fd);
+        if (attempt == 4)
+            return false;
+    }
+
+    /* Nobody attached: what is there was left by processes that are gone,
+     * possibly of an earlier job. Start over from zeroes. */
+    creator = hvac_shm_lock(fd, HVAC_SHM_LOCK_USERS, F_WRLCK, false) == 0;
+    if (creator) {
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+            L4C_ERR("Cannot size shared cache %s to %lu bytes: %s", g_shm_name, size, strerror(errno));
+            close(fd);
+            return false;
+        }
+    } else {
+        // Its users set it up under the attach lock, their geometry wins over ours
+        if ((uint64_t)st.st_size < sizeof(struct hvac_shm_header)) {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+    }
+
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    struct hvac_shm_header *hdr = (struct hvac_shm_header *)base;
+
+    if (creator) {
+        // ftruncate handed us zeroes: every slab is empty with seq 0
+        hdr->size = size;
+        hdr->block = block;
+        hdr->nslabs = nslabs;
+        hdr->nentries = nentries;
+        hdr->index_off = index_off;
+        hdr->slabs_off = slabs_off;
+        hdr->data_off = data_off;
+        hdr->magic.store(HVAC_SHM_MAGIC, std::memory_order_release);
+    } else if (hdr->magic.load(std::memory_order_acquire) != HVAC_SHM_MAGIC || hdr->size != size) {
+        L4C_ERR("Shared cache %s is not usable", g_shm_name);
+        munmap(base, size);
+        close(fd);
+        return false;
+    }
+
+    // Join the users (a creator trades its write lock for a read lock) and let the next one in
+    if (hvac_shm_lock(fd, HVAC_SHM_LOCK_USERS, F_RDLCK, true) != 0) {
+        munmap(base, size);
+        close(fd);
+        return false;
+    }
+    hvac_shm_lock(fd, HVAC_SHM_LOCK_ATTACH, F_UNLCK, false);
+
+    g_shm_fd = fd;
+    g_shm_index = (std::atomic<uint64_t> *)((char *)base + hdr->index_off);
+    g_shm_slabs = (struct hvac_shm_slab *)((char *)base + hdr->slabs_off);
+    g_shm_data = (char *)base + hdr->data_off;
+    g_shm_block = hdr->block;
+    g_shm = hdr;
+    pthread_atfork(NULL, NULL, hvac_shm_atfork_child);
+
+    L4C_INFO("Shared cache %s: %s %lu slabs of %lu bytes", g_shm_name, creator ? "created" : "attached to",
+             hdr->nslabs, hdr->block);
+    return true;
+}
+
+void hvac_shm_init()
+{
+    size_t bytes = 0;
+    size_t block = 256 * 1024;
+    char *env;
+
+    if ((env = getenv("HVAC_SHM_CACHE_BYTES")) != NULL)
+        bytes = strtoull(env, NULL, 10);
+    if ((env = getenv("HVAC_SHM_CACHE_BLOCK")) != NULL && strtoull(env, NULL, 10) >= 4096)
+        block = strtoull(env, NULL, 10);
+    if ((env = getenv("HVAC_READ_TIMEOUT_MS")) != NULL)
+        g_shm_wait_ms = atoi(env);
+
+    if (bytes < block)
+        return;
+    // Reads that would flush a good part of the cache go around it
+    g_shm_max_read = bytes / 8;
+
+    if ((env = getenv("HVAC_SHM_CACHE_NAME")) != NULL)
+        snprintf(g_shm_name, sizeof(g_shm_name), "/%s", env);
+    else if ((env = getenv("SLURM_JOBID")) != NULL)
+        snprintf(g_shm_name, sizeof(g_shm_name), "/hvac.%s.%u", env, (unsigned)getuid());
+    else
+        snprintf(g_shm_name, sizeof(g_shm_name), "/hvac.%u", (unsigned)getuid());
+
+    if (!hvac_shm_attach(bytes, block))
+        L4C_WARN("Shared cache disabled");
+}
+
+bool hvac_shm_enabled()
+{
+    return g_shm != NULL;
+}
+
+/* Slab number the index maps (file, block) to, in whatever state it is,
+ * or -1 */
+static int64_t hvac_shm_find(uint64_t h, uint64_t file, uint64_t block)
+{
+    uint64_t mask = g_shm->nentries - 1;
+    uint64_t tag = hvac_shm_tag(h);
+
+    for (int i = 0; i < HVAC_SHM_PROBE; i++) {
+        uint64_t e = g_shm_index[(h + i) & mask].load(std::memory_order_acquire);
+        if (e == 0 || (e >> HVAC_SHM_SLAB_BITS) != tag)
+            continue;
+        uint32_t slab = e & HVAC_SHM_SLAB_MASK;
+        if (slab < g_shm->nslabs && hvac_shm_slab_is(&g_shm_slabs[slab], file, block))
+            return slab;
+    }
+    return -1;
+}
+
+enum { HVAC_SHM_HIT, HVAC_SHM_MISS, HVAC_SHM_PENDING };
+
+/* Copy what the cached block holds at in-block offset off. *eof is set
+ * when the block ends the file and the copy reached that end. On
+ * HVAC_SHM_PENDING *slab and *seq say what to wait for. */
+static int hvac_shm_get(uint64_t h, uint64_t file, uint64_t block, size_t off, char *dst, size_t want,
+                        size_t *n, bool *eof, int64_t *slab, uint64_t *seq)
+{
+    int64_t idx = hvac_shm_find(h, file, block);
+    if (idx < 0)
+        return HVAC_SHM_MISS;
+
+    struct hvac_shm_slab *s = &g_shm_slabs[idx];
+    uint64_t v = s->seq.load(std::memory_order_acquire);
+    if (v & 1) {
+        *slab = idx;
+        *seq = v;
+        return HVAC_SHM_PENDING;
+    }
+    if (!hvac_shm_slab_is(s, file, block))
+        return HVAC_SHM_MISS;
+    size_t len = s->len.load(std::memory_order_relaxed);
+    size_t avail = off < len ? len - off : 0;
+    *n = avail < want ? avail : want;
+    memcpy(dst, hvac_shm_slab_data(idx) + off, *n);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s->seq.load(std::memory_order_relaxed) != v)
+        return HVAC_SHM_MISS;     // recycled under us, the copy is garbage
+    *eof = len < g_shm_block && off + *n >= len;
+    if (s->ref.load(std::memory_order_relaxed) == 0)
+        s->ref.store(1, std::memory_order_relaxed);
+    return HVAC_SHM_HIT;
+}
+
+/* The seq word of a slab claimed by this process, steps versions on */
+static inline uint64_t hvac_shm_seq_claimed(uint64_t v, uint64_t steps)
+{
+    return ((uint64_t)(uint32_t)getpid() << 32) | ((v + steps) & HVAC_SHM_VERSION_MASK);
+}
+
+/* The seq word once the owner of claimed word v lets go of the slab */
+static inline uint64_t hvac_shm_seq_done(uint64_t v)
+{
+    return (v + 1) & HVAC_SHM_VERSION_MASK;
+}
+
+/* Whether the process that claimed word v (odd) has exited. A recycled
+ * pid just keeps the slab stuck until that process exits too. */
+static bool hvac_shm_filler_gone(uint64_t v)
+{
+    pid_t pid = (pid_t)(v >> 32);
+
+    return pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/* Give a slab claimed with word seq back empty */
+static void hvac_shm_release(int64_t slab, uint64_t seq)
+{
+    struct hvac_shm_slab *s = &g_shm_slabs[slab];
+
+    s->file.store(0, std::memory_order_relaxed);
+    s->len.store(0, std::memory_order_relaxed);
+    s->seq.store(hvac_shm_seq_done(seq), std::memory_order_release);
+}
+
+/* Empty a slab whose filler died with it claimed as seq. The CAS fails
+ * if the word moved since, so only one process takes over. */
+static void hvac_shm_reap(int64_t slab, uint64_t seq)
+{
+    uint64_t mine = hvac_shm_seq_claimed(seq, 2);
+
+    if (g_shm_slabs[slab].seq.compare_exchange_strong(seq, mine, std::memory_order_acquire))
+        hvac_shm_release(slab, mine);
+}
+
+/* Wait for another process to finish filling a slab, or empty the slab
+ * if that process died. Returns false if it took longer than a read
+ * deadline. */
+static bool hvac_shm_wait(int64_t slab, uint64_t seq)
+{
+    HVAC_TIMING("CLIENT_(hvac_shm_wait)_total");
+    struct hvac_shm_slab *s = &g_shm_slabs[slab];
+    struct timespec start, now;
+    useconds_t pause = 0;
+
+    g_shm->waits.fetch_add(1, std::memory_order_relaxed);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (s->seq.load(std::memory_order_acquire) == seq) {
+        if (pause == 0) {
+            sched_yield();
+            pause = 16;
+        } else {
+            usleep(pause);
+            if (pause < 1000)
+                pause *= 2;
+            else if (hvac_shm_filler_gone(seq)) {
+                hvac_shm_reap(slab, seq);
+                return true;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (g_shm_wait_ms > 0 &&
+            (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 > g_shm_wait_ms)
+            return false;
+    }
+    return true;
+}
+
+/* Take a slab for (file, block) with CLOCK. On success the slab is odd,
+ * carries the key and *seq is the word that claimed it. */
+static int64_t hvac_shm_claim(uint64_t file, uint64_t block, uint64_t *seq)
+{
+    uint64_t nslabs = g_shm->nslabs;
+
+    for (uint64_t tries = 0; tries < 2 * nslabs + 1; tries++) {
+        uint64_t idx = g_shm->hand.fetch_add(1, std::memory_order_relaxed) % nslabs;
+        struct hvac_shm_slab *s = &g_shm_slabs[idx];
+        uint64_t v = s->seq.load(std::memory_order_relaxed);
+        uint64_t next;
+
+        if (v & 1) {
+            /* Somebody is filling it - unless that somebody is gone. The CAS
+             * fails if the word moved since, so only one process takes over
+             * from a dead filler. */
+            if (!hvac_shm_filler_gone(v))
+                continue;
+            next = hvac_shm_seq_claimed(v, 2);
+        } else {
+            if (s->ref.load(std::memory_order_relaxed)) {
+                s->ref.store(0, std::memory_order_relaxed);
+                continue;
+            }
+            next = hvac_shm_seq_claimed(v, 1);
+        }
+        if (!s->seq.compare_exchange_strong(v, next, std::memory_order_acquire))
+            continue;
+        s->file.store(file, std::memory_order_relaxed);
+        s->block.store(block, std::memory_order_relaxed);
+        s->len.store(0, std::memory_order_relaxed);
+        *seq = next;
+        return idx;
+    }
+    return -1;
+}
+
+/* Make a filled slab visible to readers */
+static void hvac_shm_complete(int64_t slab, uint64_t seq, size_t len)
+{
+    struct hvac_shm_slab *s = &g_shm_slabs[slab];
+
+    s->len.store(len, std::memory_order_relaxed);
+    s->ref.store(1, std::memory_order_relaxed);
+    s->seq.store(hvac_shm_seq_done(seq), std::memory_order_release);
+}
+
+/* Point the index at a claimed slab. Fails if another process already
+ * has (file, block) indexed, filled or in flight. */
+static bool hvac_shm_publish(uint64_t h, uint64_t file, uint64_t block, int64_t slab)
+{
+    uint64_t mask = g_shm->nentries - 1;
+    uint64_t want = hvac_shm_entry(h, slab);
+
+    for (int attempt = 0; attempt < 4; attempt++) {
+        int64_t other = hvac_shm_find(h, file, block);
+        if (other >= 0 && other != slab)
+            return false;
+
+        /* An empty entry, or one whose slab moved on to another key */
+        for (int i = 0; i < HVAC_SHM_PROBE; i++) {
+            std::atomic<uint64_t> *pos = &g_shm_index[(h + i) & mask];
+            uint64_t e = pos->load(std::memory_order_acquire);
+            if (e != 0) {
+                struct hvac_shm_slab *s = &g_shm_slabs[e & HVAC_SHM_SLAB_MASK];
+                uint64_t sh = hvac_shm_hash(s->file.load(std::memory_order_relaxed),
+                                            s->block.load(std::memory_order_relaxed));
+                if (hvac_shm_tag(sh) == (e >> HVAC_SHM_SLAB_BITS))
+                    continue;
+            }
+            if (pos->compare_exchange_strong(e, want, std::memory_order_acq_rel))
+                return true;
+            break;      // lost the entry, look again
+        }
+    }
+    // Window full of live entries: push one out, its slab ages out by CLOCK
+    std::atomic<uint64_t> *pos = &g_shm_index[(h + slab % HVAC_SHM_PROBE) & mask];
+    pos->store(want, std::memory_order_release);
+    return true;
+}
+
+ssize_t hvac_shm_pread(int fd, uint32_t host, void *buf, size_t count, off_t offset)
+{
+    struct hvac_fd_entry *fe = hvac_fdtable_entry(fd);
+
+    if (g_shm == NULL || fe == NULL || count == 0 || count > g_shm_max_read || offset < 0)
+        return hvac_client_comm_gen_read_rpc(host, fd, buf, count, offset);
+
+    HVAC_TIMING("CLIENT_(hvac_shm_pread)_total");
+    uint64_t file = fe->path_hash;
+    char *dst = (char *)buf;
+    size_t copied = 0;
+    bool hit = true;
+    int retries = 0;
+
+    while (copied < count) {
+        off_t pos = offset + copied;
+        uint64_t b = pos / g_shm_block;
+        size_t in = pos % g_shm_block;
+        uint64_t h = hvac_shm_hash(file, b);
+        size_t n = 0;
+        bool eof = false;
+        int64_t slab;
+        uint64_t seq;
+
+        int r = hvac_shm_get(h, file, b, in, dst + copied, count - copied, &n, &eof, &slab, &seq);
+        if (r == HVAC_SHM_PENDING && hvac_shm_wait(slab, seq))
+            r = hvac_shm_get(h, file, b, in, dst + copied, count - copied, &n, &eof, &slab, &seq);
+        if (r == HVAC_SHM_HIT) {
+            copied += n;
+            if (eof)
+                break;
+            continue;
+        }
+        hit = false;
+
+        /* Claim the run of missing blocks up to the end of the read */
+        uint64_t last = (offset + count - 1) / g_shm_block;
+        int64_t slabs[HVAC_SHM_MAX_RUN];
+        uint64_t seqs[HVAC_SHM_MAX_RUN];
+        int nrun = 0;
+        if (r == HVAC_SHM_MISS && retries < 3) {
+            for (uint64_t k = b; k <= last && nrun < HVAC_SHM_MAX_RUN; k++) {
+                uint64_t kh = hvac_shm_hash(file, k);
+                if (k != b && hvac_shm_find(kh, file, k) >= 0)
+                    break;
+                int64_t s = hvac_shm_claim(file, k, &seq);
+                if (s < 0)
+                    break;
+                if (!hvac_shm_publish(kh, file, k, s)) {
+                    hvac_shm_release(s, seq);
+                    break;
+                }
+                slabs[nrun] = s;
+                seqs[nrun++] = seq;
+            }
+            if (nrun == 0) {
+                // Somebody beat us to the first block, go and read it
+                retries++;
+                continue;
+            }
+        }
+
+        if (nrun == 0) {
+            /* The fetch we waited on failed or the cache is jammed: read
+             * this block straight into the caller's buffer */
+            size_t want = (b + 1) * g_shm_block - pos;
+            if (want > count - copied)
+                want = count - copied;
+            ssize_t got = hvac_client_comm_gen_read_rpc(host, fd, dst + copied, want, pos);
+            if (got < 0)
+                return copied ? (ssize_t)copied : -1;
+            copied += got;
+            if ((size_t)got < want)
+                break;
+            continue;
+        }
+
+        struct iovec iov[HVAC_SHM_MAX_RUN];
+        for (int i = 0; i < nrun; i++) {
+            iov[i].iov_base = hvac_shm_slab_data(slabs[i]);
+            iov[i].iov_len = g_shm_block;
+        }
+        ssize_t got;
+        {
+            HVAC_TIMING("CLIENT_(hvac_shm_pread)_fill");
+            got = hvac_client_comm_gen_readv_rpc(host, fd, iov, nrun, b * g_shm_block);
+        }
+        if (got < 0) {
+            for (int i = 0; i < nrun; i++)
+                hvac_shm_release(slabs[i], seqs[i]);
+            return copied ? (ssize_t)copied : -1;
+        }
+        g_shm->fills.fetch_add(1, std::memory_order_relaxed);
+
+        /* Copy out while the slabs are still ours, then let them go. A
+         * short slab marks the end of the file for every process on the
+         * node, so it is only completed if the file really ends there; a
+         * server that came back short for any other reason gets the slab
+         * emptied and the caller only what did arrive. */
+        bool at_eof = false;
+        for (int i = 0; i < nrun; i++) {
+            size_t start = (size_t)i * g_shm_block;
+            size_t len = (size_t)got > start ? (size_t)got - start : 0;
+            if (len > g_shm_block)
+                len = g_shm_block;
+            if (at_eof) {
+                hvac_shm_release(slabs[i], seqs[i]);
+                continue;
+            }
+            size_t skip = (i == 0) ? in : 0;
+            if (len > skip && copied < count) {
+                size_t c = len - skip < count - copied ? len - skip : count - copied;
+                memcpy(dst + copied, (char *)iov[i].iov_base + skip, c);
+                copied += c;
+            }
+            if (len < g_shm_block) {
+                struct stat st;
+                if (fstat(fd, &st) == 0 && st.st_size == (off_t)((b + i) * g_shm_block + len))
+                    hvac_shm_complete(slabs[i], seqs[i], len);
+                else
+                    hvac_shm_release(slabs[i], seqs[i]);
+                at_eof = true;
+                continue;
+            }
+            hvac_shm_complete(slabs[i], seqs[i], len);
+        }
+        if (at_eof)
+            break;
+    }
+
+    if (hit) {
+        g_shm->hits.fetch_add(1, std::memory_order_relaxed);
+        g_shm_my_hits.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        g_shm->misses.fetch_add(1, std::memory_order_relaxed);
+        g_shm_my_misses.fetch_add(1, std::memory_order_relaxed);
+    }
+    return copied;
+}
+
+void hvac_shm_report()
+{
+    if (g_shm == NULL)
+        return;
+    uint64_t hits = g_shm_my_hits.load(), misses = g_shm_my_misses.load();
+    if (hits + misses == 0)
+        return;
+    L4C_INFO("Shared cache: %lu hits, %lu misses in this process; node wide %lu hits, %lu misses, %lu fills, %lu waits",
+             hits, misses, g_shm->hits.load(), g_shm->misses.load(), g_shm->fills.load(), g_shm->waits.load());
+}
@@ -0,0 +1,41 @@
+/* Node-wide sample cache in shared memory
+ *
+ * Several training ranks and their DataLoader workers on one node often
+ * read the same samples. With HVAC_SHM_CACHE_BYTES set, every process of
+ * the job that loads the client library maps one segment in /dev/shm
+ * (named after SLURM_JOBID, or HVAC_SHM_CACHE_NAME) holding
+ * HVAC_SHM_CACHE_BLOCK sized slabs of file data and a lock-free
+ * open-addressing index over them, keyed by (path hash, block).
+ *
+ * A hit copies straight out of the segment. On a miss the process claims
+ * slabs for the missing blocks and publishes them in the index before it
+ * sends a single readv RPC into them, so a process that misses on a block
+ * already in flight waits for that fetch instead of issuing its own.
+ * Looking a block up and claiming it are separate steps, though: two
+ * processes missing on it at nearly the same moment can both fetch it,
+ * which costs a read but never serves wrong data. Slabs are versioned like
+ * a seqlock and recycled with CLOCK; a slab left half filled by a process
+ * that died is reclaimed.
+ *
+ * The segment lives as long as some process holds it open. Whoever
+ * attaches to a segment nobody holds - one left behind by a job that was
+ * killed, say - wipes it first, so nothing cached by an earlier job is
+ * ever served. The last process to detach normally removes it.
+ */
+#ifndef __HVAC_SHMCACHE_H__
+#define __HVAC_SHMCACHE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+void hvac_shm_init();
+bool hvac_shm_enabled();
+
+// Positional read on a tracked fd through the node cache. Behaves like
+// hvac_client_comm_gen_read_rpc and is one when the cache is off or the
+// read is too large for it. -1 if the RPC failed and nothing was read.
+ssize_t hvac_shm_pread(int fd, uint32_t host, void *buf, size_t count, off_t offset);
+
+void hvac_shm_report();
+
+#endif
@@ -0,0 +1,75 @@
+/* Server stats snapshots - see mthvac_srvstats.h */
+#include <sstream>
+#include <stdlib.h>
+
+#include "mthvac_srvstats.h"
+
+std::string hvac_srv_stats_pack(const struct hvac_srv_stats &stats)
+{
+    std::ostringstream os;
+
+    os << "version " << HVAC_SRV_STATS_VERSION << "\n";
+    os << "node " << (stats.node.empty() ? "unknown" : stats.node) << "\n";
+    for (auto const &c : stats.counters)
+        os << c.first << " " << c.second << "\n";
+    for (auto const &t : stats.tags) {
+        // Tags are single words on the wire
+        std::string name = t.name;
+        for (char &ch : name)
+            if (ch == ' ' || ch == '\t' || ch == '\n')
+                ch = '_';
+        os << "hist " << name << " " << t.calls << " " << t.total_ns << " " << t.hist.max_ns;
+        for (int i = 0; i < hvac::kHistBuckets; i++)
+            if (t.hist.counts[i])
+                os << " " << i << ":" << t.hist.counts[i];
+        os << "\n";
+    }
+    return os.str();
+}
+
+bool hvac_srv_stats_unpack(const char *data, size_t len, struct hvac_srv_stats *stats)
+{
+    std::istringstream is(std::string(data, len));
+    std::string line;
+    bool versioned = false;
+
+    stats->node.clear();
+    stats->counters.clear();
+    stats->tags.clear();
+    while (std::getline(is, line)) {
+        std::istringstream ls(line);
+        std::string key;
+        if (!(ls >> key))
+            continue;
+        if (key == "version") {
+            int version = 0;
+            ls >> version;
+            // Later versions may only add lines, which are kept or skipped
+            if (version < 1)
+                return false;
+            versioned = true;
+        } else if (key == "node") {
+            ls >> stats->node;
+        } else if (key == "hist") {
+            stats->tags.emplace_back();
+            hvac::TagTotals &t = stats->tags.back();
+            if (!(ls >> t.name >> t.calls >> t.total_ns >> t.hist.max_ns))
+                return false;
+            std::string bucket;
+            while (ls >> bucket) {
+                size_t colon = bucket.find(':');
+                if (colon == std::string::npos)
+                    return false;
+                unsigned long idx = strtoul(bucket.c_str(), NULL, 10);
+                if (idx >= (unsigned long)hvac::kHistBuckets)
+                    return false;
+                t.hist.counts[idx] = strtoull(bucket.c_str() + colon + 1, NULL, 10);
+            }
+        } else {
+            uint64_t value = 0;
+            ls >> value;
+            stats->counters[key] = value;
+        }
+    }
+    return versioned;
+}
@@ -0,0 +1,42 @@
+/* Server stats snapshots
+ *
+ * A server answers the stats RPC with a snapshot of its counters and of
+ * every timing tag with its latency histogram (mthvac_timer.h), packed
+ * as text: one "name value" line per counter and one line per tag,
+ *
+ *   hist <tag> <calls> <total_ns> <max_ns> <bucket>:<count> ...
+ *
+ * with only non-empty buckets listed. Unknown counters are kept and
+ * missing ones read as 0, so servers and tools of different versions
+ * still understand each other: a newer version may add lines but never
+ * change the meaning of existing ones, and any version from 1 up is read. hvac_stats (mthvac_stats.cpp) queries
+ * every server of a job and aggregates the snapshots.
+ */
+#ifndef __HVAC_SRVSTATS_H__
+#define __HVAC_SRVSTATS_H__
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mthvac_timer.h"
+
+#define HVAC_SRV_STATS_VERSION 1
+
+struct hvac_srv_stats {
+    std::string node;
+    std::map<std::string, uint64_t> counters;
+    std::vector<hvac::TagTotals> tags;
+
+    uint64_t get(const char *name) const {
+        auto it = counters.find(name);
+        return it == counters.end() ? 0 : it->second;
+    }
+};
+
+std::string hvac_srv_stats_pack(const struct hvac_srv_stats &stats);
+// False if data isn't a snapshot this code understands
+bool hvac_srv_stats_unpack(const char *data, size_t len, struct hvac_srv_stats *stats);
+
+#endif
@@ -0,0 +1,390 @@
+/* hvac_stats - cluster view of the HVAC servers of a job
+ *
+ * Reads .ports.cfg.<jobid>, sends the stats RPC to every server in it at
+ * once and prints one line per server and a cluster summary: totals, how
+ * unevenly the load is spread over the servers (max / mean) and service
+ * time percentiles over the merged histograms. Servers that don't answer
+ * within the timeout are listed and make the exit status 1.
+ *
+ * usage: hvac_stats [-j jobid] [-f ports file] [-t timeout s] [-a]
+ *   -j  job whose servers to query (default: SLURM_JOBID)
+ *   -f  ports file (default: ./.ports.cfg.<jobid>)
+ *   -t  seconds to wait for the slowest server (default: 10)
+ *   -a  also print every timing tag merged over all servers
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mthvac_comm.h"
+#include "mthvac_srvstats.h"
+
+#define HVAC_STATS_INITIAL_CAPACITY (256 * 1024)
+
+struct hvac_stats_server {
+    int rank;
+    std::string addr_str;
+    hg_addr_t addr;
+    std::vector<char> buf;
+    hg_bulk_t bulk_handle;
+    hg_handle_t handle;
+    bool forwarded;         // handle and bulk handle to free after the round
+    bool done;
+    bool answered;
+    int32_t ret;
+    int64_t used;
+    int64_t needed;
+    std::string error;      // why there are no stats, empty if there are
+    struct hvac_srv_stats stats;
+};
+
+static int g_pending = 0;
+
+static uint64_t hvac_stats_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static hg_return_t
+hvac_stats_cb(const struct hg_cb_info *info)
+{
+    struct hvac_stats_server *s = (struct hvac_stats_server *)info->arg;
+    hvac_srv_stats_out_t out;
+
+    if (info->ret == HG_SUCCESS && HG_Get_output(info->info.forward.handle, &out) == HG_SUCCESS) {
+        s->answered = true;
+        s->ret = out.ret;
+        s->used = out.used;
+        s->needed = out.needed;
+        HG_Free_output(info->info.forward.handle, &out);
+    } else {
+        s->error = info->ret == HG_CANCELED ? "no answer before the timeout" : "RPC failed";
+    }
+    s->done = true;
+    g_pending--;
+    return HG_SUCCESS;
+}
+
+/* One RPC to each of todo, all in flight together, with capacity bytes
+ * for the snapshot. Fills in stats or error, or leaves needed > capacity
+ * for another round. */
+static void
+hvac_stats_query(hg_class_t *cls, hg_context_t *context, hg_id_t id,
+                 std::vector<hvac_stats_server *> &todo, int timeout_ms)
+{
+    for (hvac_stats_server *s : todo) {
+        hvac_srv_stats_in_t in;
+        hg_size_t size = s->buf.size();
+        void *ptr = s->buf.data();
+
+        s->forwarded = false;
+        s->done = false;
+        s->answered = false;
+        if (HG_Bulk_create(cls, 1, &ptr, &size, HG_BULK_WRITE_ONLY, &s->bulk_handle) != HG_SUCCESS) {
+            s->error = "bulk registration failed";
+            s->done = true;
+            continue;
+        }
+        HG_Create(context, s->addr, id, &s->handle);
+        in.bulk_handle = s->bulk_handle;
+        in.capacity = size;
+        if (HG_Forward(s->handle, hvac_stats_cb, s, &in) != HG_SUCCESS) {
+            s->error = "RPC could not be sent";
+            s->done = true;
+            HG_Destroy(s->handle);
+            HG_Bulk_free(s->bulk_handle);
+            continue;
+        }
+        s->forwarded = true;
+        g_pending++;
+    }
+
+    uint64_t deadline = hvac_stats_now_ms() + timeout_ms;
+    bool cancelled = false;
+    while (g_pending > 0) {
+        unsigned int count = 0;
+        hg_return_t ret;
+        do {
+            ret = HG_Trigger(context, 0, 1, &count);
+        } while (ret == HG_SUCCESS && count && g_pending > 0);
+        if (g_pending == 0)
+            break;
+        // Cancelled RPCs still complete through the callback
+        if (!cancelled && hvac_stats_now_ms() >= deadline) {
+            for (hvac_stats_server *s : todo)
+                if (!s->done)
+                    HG_Cancel(s->handle);
+            cancelled = true;
+        }
+        HG_Progress(context, 100);
+    }
+
+    for (hvac_stats_server *s : todo) {
+        if (s->forwarded) {
+            HG_Destroy(s->handle);
+            HG_Bulk_free(s->bulk_handle);
+        }
+        if (!s->answered)
+            continue;
+        if (s->ret != 0) {
+            s->error = "server error " + std::to_string(s->ret);
+        } else if (s->needed <= (int64_t)s->buf.size() &&
+                   !hvac_srv_stats_unpack(s->buf.data(), s->used, &s->stats)) {
+            s->error = "snapshot in an unknown format";
+        }
+    }
+}
+
+static const hvac::TagTotals *
+hvac_stats_find_tag(const struct hvac_srv_stats &stats, const char *name)
+{
+    for (auto const &t : stats.tags)
+        if (t.name == name)
+            return &t;
+    return NULL;
+}
+
+static int hvac_stats_print(const std::string &ports_file, std::vector<hvac_stats_server> &servers,
+                            bool all_tags);
+
+static void
+hvac_stats_usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-j jobid] [-f ports file] [-t timeout s] [-a]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *jobid = getenv("SLURM_JOBID");
+    std::string ports_file;
+    int timeout_s = 10;
+    bool all_tags = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:f:t:ah")) != -1) {
+        switch (opt) {
+        case 'j': jobid = optarg; break;
+        case 'f': ports_file = optarg; break;
+        case 't': timeout_s = atoi(optarg); break;
+        case 'a': all_tags = true; break;
+        default:
+            hvac_stats_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (ports_file.empty()) {
+        if (jobid == NULL) {
+            fprintf(stderr, "No job: set SLURM_JOBID or pass -j or -f\n");
+            return 2;
+        }
+        ports_file = std::string("./.ports.cfg.") + jobid;
+    }
+
+    /* rank fabric_addr [node_id sm_addr]. The file is appended to, so a
+     * restarted server's later line wins. */
+    FILE *f = fopen(ports_file.c_str(), "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s\n", ports_file.c_str());
+        return 2;
+    }
+    std::map<int, std::string> addrs;
+    char line[3 * PATH_MAX];
+    char addr[PATH_MAX];
+    int rank;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "%d %s", &rank, addr) == 2)
+            addrs[rank] = addr;
+    fclose(f);
+    if (addrs.empty()) {
+        fprintf(stderr, "No servers in %s\n", ports_file.c_str());
+        return 2;
+    }
+
+    // Same transport as the servers, taken from their addresses
+    std::string proto = addrs.begin()->second;
+    size_t sep = proto.find("://");
+    if (sep != std::string::npos)
+        proto = proto.substr(0, sep + 3);
+    hg_class_t *cls = HG_Init(proto.c_str(), HG_FALSE);
+    if (cls == NULL) {
+        fprintf(stderr, "Could not initialize Mercury for %s\n", proto.c_str());
+        return 2;
+    }
+    hg_context_t *context = HG_Context_create(cls);
+    hg_id_t id = MERCURY_REGISTER(cls, "hvac_srv_stats_rpc", hvac_srv_stats_in_t, hvac_srv_stats_out_t, NULL);
+
+    std::vector<hvac_stats_server> servers(addrs.size());
+    std::vector<hvac_stats_server *> todo;
+    size_t i = 0;
+    for (auto const &a : addrs) {
+        hvac_stats_server *s = &servers[i++];
+        s->rank = a.first;
+        s->addr_str = a.second;
+        s->addr = HG_ADDR_NULL;
+        s->handle = HG_HANDLE_NULL;
+        s->forwarded = false;
+        s->done = false;
+        s->answered = false;
+        s->buf.resize(HVAC_STATS_INITIAL_CAPACITY);
+        if (HG_Addr_lookup2(cls, s->addr_str.c_str(), &s->addr) != HG_SUCCESS) {
+            s->error = "address lookup failed";
+            continue;
+        }
+        todo.push_back(s);
+    }
+
+    // A second round for snapshots that didn't fit
+    for (int round = 0; round < 2 && !todo.empty(); round++) {
+        hvac_stats_query(cls, context, id, todo, timeout_s * 1000);
+        std::vector<hvac_stats_server *> retry;
+        for (hvac_stats_server *s : todo) {
+            if (s->answered && s->error.empty() && s->needed > (int64_t)s->buf.size()) {
+                s->buf.resize(s->needed + s->needed / 4);
+                retry.push_back(s);
+            }
+        }
+        todo.swap(retry);
+    }
+    for (hvac_stats_server *s : todo)
+        s->error = "snapshot kept outgrowing the buffer";
+
+    int status = hvac_stats_print(ports_file, servers, all_tags);
+
+    for (auto &s : servers)
+        if (s.addr != HG_ADDR_NULL)
+            HG_Addr_free(cls, s.addr);
+    HG_Context_destroy(context);
+    HG_Finalize(cls);
+    return status;
+}
+
+/* Prints the table and summary; 0 if every server answered */
+static int
+hvac_stats_print(const std::string &ports_file, std::vector<hvac_stats_server> &servers, bool all_tags)
+{
+    /* Per server lines */
+    std::vector<hvac_stats_server *> ok;
+    for (auto &s : servers)
+        if (s.error.empty())
+            ok.push_back(&s);
+
+    printf("\n=== HVAC cluster stats (%s): %zu of %zu servers answered ===\n", ports_file.c_str(), ok.size(),
+           servers.size());
+    printf("%6s %-20s %10s %10s %12s %12s %8s %8s %8s %8s %8s %12s %12s %7s\n", "Rank", "Node", "Uptime(s)",
+           "Opens", "Reads", "MiB_served", "Cached%", "Backlog", "Open_fds", "Active", "Chunks", "Svc_p50(us)",
+           "Svc_p99(us)", "Load");
+
+    double total_bytes = 0, total_reads = 0;
+    for (hvac_stats_server *s : ok) {
+        total_bytes += s->stats.get("bytes_cached") + s->stats.get("bytes_pfs");
+        total_reads += s->stats.get("reads");
+    }
+    double mean_bytes = ok.empty() ? 0 : total_bytes / ok.size();
+    double mean_reads = ok.empty() ? 0 : total_reads / ok.size();
+
+    hvac::LatencyHistogram service, queue;
+    std::map<std::string, hvac::TagTotals> merged;
+    for (hvac_stats_server *s : ok) {
+        const struct hvac_srv_stats &st = s->stats;
+        uint64_t bytes = st.get("bytes_cached") + st.get("bytes_pfs");
+        uint64_t reads = st.get("reads");
+        const hvac::TagTotals *svc = hvac_stats_find_tag(st, "HvacComm_(request)_service");
+        const hvac::TagTotals *q = hvac_stats_find_tag(st, "HvacComm_(request)_queue_wait");
+        if (svc != NULL)
+            service.merge(svc->hist);
+        if (q != NULL)
+            queue.merge(q->hist);
+        for (auto const &t : st.tags) {
+            hvac::TagTotals &m = merged[t.name];
+            m.name = t.name;
+            m.calls += t.calls;
+            m.total_ns += t.total_ns;
+            m.hist.merge(t.hist);
+        }
+
+        printf("%6d %-20.20s %10.0f %10lu %12lu %12.1f %8.1f %8lu %8lu %8lu %8lu %12.1f %12.1f %7.2f\n", s->rank,
+               st.node.c_str(), st.get("uptime_ms") / 1000.0, (unsigned long)st.get("opens"), (unsigned long)reads,
+               bytes / 1048576.0, reads ? 100.0 * st.get("reads_cached") / reads : 0.0,
+               (unsigned long)st.get("staging_backlog"), (unsigned long)st.get("open_fds"),
+               (unsigned long)st.get("active_reads"), (unsigned long)st.get("inflight_chunks"),
+               svc ? svc->hist.percentile(0.50) / 1000.0 : 0.0, svc ? svc->hist.percentile(0.99) / 1000.0 : 0.0,
+               mean_bytes > 0 ? bytes / mean_bytes : 0.0);
+    }
+    for (auto &s : servers)
+        if (!s.error.empty())
+            printf("%6d %-20s %s (%s)\n", s.rank, "-", s.error.c_str(), s.addr_str.c_str());
+
+    if (ok.empty())
+        return 1;
+
+    /* Cluster summary */
+    uint64_t opens = 0, opens_cached = 0, reads_cached = 0, read_errors = 0, bytes_cached = 0, backlog = 0,
+             staged = 0, stage_failures = 0;
+    hvac_stats_server *max_bytes = ok[0], *min_bytes = ok[0], *max_reads = ok[0];
+    double var = 0;
+    for (hvac_stats_server *s : ok) {
+        const struct hvac_srv_stats &st = s->stats;
+        double bytes = st.get("bytes_cached") + st.get("bytes_pfs");
+        opens += st.get("opens");
+        opens_cached += st.get("opens_cached");
+        reads_cached += st.get("reads_cached");
+        read_errors += st.get("read_errors");
+        bytes_cached += st.get("bytes_cached");
+        backlog += st.get("staging_backlog");
+        staged += st.get("staged_files");
+        stage_failures += st.get("staging_failures");
+        var += (bytes - mean_bytes) * (bytes - mean_bytes);
+        if (bytes > max_bytes->stats.get("bytes_cached") + max_bytes->stats.get("bytes_pfs"))
+            max_bytes = s;
+        if (bytes < min_bytes->stats.get("bytes_cached") + min_bytes->stats.get("bytes_pfs"))
+            min_bytes = s;
+        if (st.get("reads") > max_reads->stats.get("reads"))
+            max_reads = s;
+    }
+    auto bytes_of = [](hvac_stats_server *s) {
+        return (double)(s->stats.get("bytes_cached") + s->stats.get("bytes_pfs"));
+    };
+
+    printf("\nTotals: %lu opens (%.1f%% of the cached copy), %.0f reads (%.1f%% cached, %lu errors), %.1f MiB served "
+           "(%.1f MiB cached)\n", (unsigned long)opens, opens ? 100.0 * opens_cached / opens : 0.0, total_reads,
+           total_reads ? 100.0 * reads_cached / total_reads : 0.0, (unsigned long)read_errors,
+           total_bytes / 1048576.0, bytes_cached / 1048576.0);
+    printf("Staging: %lu files waiting, %lu staged, %lu failed\n", (unsigned long)backlog, (unsigned long)staged,
+           (unsigned long)stage_failures);
+    if (mean_bytes > 0)
+        printf("Load skew: bytes max/mean %.2f (rank %d), min/mean %.2f (rank %d), CoV %.2f; reads max/mean %.2f "
+               "(rank %d)\n", bytes_of(max_bytes) / mean_bytes, max_bytes->rank, bytes_of(min_bytes) / mean_bytes,
+               min_bytes->rank, sqrt(var / ok.size()) / mean_bytes,
+               mean_reads > 0 ? max_reads->stats.get("reads") / mean_reads : 0.0, max_reads->rank);
+    printf("Read service (us):  p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           service.percentile(0.50) / 1000.0, service.percentile(0.90) / 1000.0, service.percentile(0.99) / 1000.0,
+           service.percentile(0.999) / 1000.0, service.max_ns / 1000.0);
+    printf("Queue wait (us):    p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           queue.percentile(0.50) / 1000.0, queue.percentile(0.90) / 1000.0, queue.percentile(0.99) / 1000.0,
+           queue.percentile(0.999) / 1000.0, queue.max_ns / 1000.0);
+
+    if (all_tags) {
+        printf("\n%-60s %12s %16s %12s", "Section (all servers)", "Calls", "Total(us)", "Avg(us)");
+        for (int c = 0; c < hvac::kPercentileColumns; c++)
+            printf(" %12s", hvac::kPercentileNames[c]);
+        printf("\n");
+        for (auto const &m : merged) {
+            const hvac::TagTotals &t = m.second;
+            printf("%-60s %12lu %16.2f %12.2f", t.name.c_str(), (unsigned long)t.calls, t.total_ns / 1000.0,
+                   t.calls ? t.total_ns / 1000.0 / t.calls : 0.0);
+            for (int c = 0; c < hvac::kPercentileColumns; c++)
+                printf(" %12.2f", hvac::percentile_column_us(t.hist, c));
+            printf("\n");
+        }
+    }
+
+    return ok.size() == servers.size() ? 0 : 1;
+}
@@ -0,0 +1,212 @@
+/* stdio streams on cached files - see mthvac_stdio.h */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
+#include "mthvac_stdio.h"
+#include "mthvac_internal.h"
+#include "mthvac_pathfilter.h"
+#include "mthvac_timer.h" // ! HVAC TIMING
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+struct hvac_stdio_file {
+    int fd;
+    off64_t pos;    // stream position, reads are pread()s from here
+};
+
+struct hvac_stdio_stream {
+    int fd;
+    void *buffer;
+};
+
+static size_t g_stdio_buffer = 1024 * 1024;
+
+static std::unordered_map<FILE *, struct hvac_stdio_stream> stdio_streams;
+static pthread_mutex_t stdio_streams_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Lets fileno() / fclose() on ordinary streams skip the lookup
+static std::atomic<int> stdio_stream_count{0};
+
+void hvac_stdio_init()
+{
+    char *env;
+
+    if ((env = getenv("HVAC_STDIO_BUFFER")) != NULL)
+        g_stdio_buffer = strtoull(env, NULL, 10);
+    L4C_INFO("stdio buffer for cached files %zu bytes", g_stdio_buffer);
+}
+
+/* pread() is our wrapper: HVAC for tracked fds, the PFS otherwise */
+static ssize_t hvac_stdio_read(void *cookie, char *buf, size_t size)
+{
+    HVAC_TIMING("CLIENT_(hvac_stdio_read)_total");
+    struct hvac_stdio_file *f = (struct hvac_stdio_file *)cookie;
+    ssize_t n = pread(f->fd, buf, size, f->pos);
+
+    if (n > 0)
+        f->pos += n;
+    return n;
+}
+
+static int hvac_stdio_seek(void *cookie, off64_t *offset, int whence)
+{
+    struct hvac_stdio_file *f = (struct hvac_stdio_file *)cookie;
+    off64_t pos;
+
+    switch (whence) {
+    case SEEK_SET:
+        pos = *offset;
+        break;
+    case SEEK_CUR:
+        pos = f->pos + *offset;
+        break;
+    case SEEK_END: {
+        struct stat st;
+        if (fstat(f->fd, &st) != 0)
+            return -1;
+        pos = st.st_size + *offset;
+        break;
+    }
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    if (pos < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    f->pos = pos;
+    *offset = pos;
+    return 0;
+}
+
+/* close() is our wrapper too, it drops the tracking */
+static int hvac_stdio_close(void *cookie)
+{
+    struct hvac_stdio_file *f = (struct hvac_stdio_file *)cookie;
+    int ret = close(f->fd);
+
+    free(f);
+    return ret;
+}
+
+/* Plain read modes only - "r", "rb", "re" and friends. Anything that can
+ * write, mmap (m) or convert (,ccs=) stays a normal stream. */
+static bool hvac_stdio_mode_ok(const char *mode, int *flags)
+{
+    if (mode == NULL || mode[0] != 'r')
+        return false;
+    *flags = O_RDONLY;
+    for (const char *c = mode + 1; *c; c++) {
+        switch (*c) {
+        case 'b':
+        case 't':
+            break;
+        case 'e':
+            *flags |= O_CLOEXEC;
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+FILE *hvac_stdio_fopen(const char *path, const char *mode, int *handled)
+{
+    std::string dir, name;
+    int flags;
+
+    *handled = 0;
+    if (!hvac_stdio_mode_ok(mode, &flags))
+        return NULL;
+    // Cheap check first, most fopen()s are config files and libraries
+    if (!hvac_pathfilter_match_dir(path, &dir, &name))
+        return NULL;
+
+    *handled = 1;
+    // open() is our wrapper - it starts tracking if the file qualifies
+    int fd = open(path, flags);
+    if (fd < 0)
+        return NULL;
+    if (!hvac_file_tracked(fd)) {
+        FILE *fp = fdopen(fd, mode);
+        if (fp == NULL)
+            close(fd);
+        return fp;
+    }
+
+    struct hvac_stdio_file *f = (struct hvac_stdio_file *)malloc(sizeof(*f));
+    if (f == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    f->fd = fd;
+    f->pos = 0;
+
+    cookie_io_functions_t io;
+    io.read = hvac_stdio_read;
+    io.write = NULL;
+    io.seek = hvac_stdio_seek;
+    io.close = hvac_stdio_close;
+    FILE *fp = fopencookie(f, "r", io);
+    if (fp == NULL) {
+        close(fd);
+        free(f);
+        return NULL;
+    }
+
+    struct hvac_stdio_stream stream;
+    stream.fd = fd;
+    stream.buffer = NULL;
+    if (g_stdio_buffer > 0 && (stream.buffer = malloc(g_stdio_buffer)) != NULL)
+        setvbuf(fp, (char *)stream.buffer, _IOFBF, g_stdio_buffer);
+
+    pthread_mutex_lock(&stdio_streams_mutex);
+    stdio_streams[fp] = stream;
+    stdio_stream_count++;
+    pthread_mutex_unlock(&stdio_streams_mutex);
+    L4C_INFO("FOpen: Tracking file %s on fd %d", path, fd);
+    return fp;
+}
+
+int hvac_stdio_fileno(FILE *fp)
+{
+    int fd = -1;
+
+    if (stdio_stream_count.load(std::memory_order_relaxed) == 0)
+        return -1;
+    pthread_mutex_lock(&stdio_streams_mutex);
+    auto it = stdio_streams.find(fp);
+    if (it != stdio_streams.end())
+        fd = it->second.fd;
+    pthread_mutex_unlock(&stdio_streams_mutex);
+    return fd;
+}
+
+void *hvac_stdio_forget(FILE *fp)
+{
+    void *buffer = NULL;
+
+    if (stdio_stream_count.load(std::memory_order_relaxed) == 0)
+        return NULL;
+    pthread_mutex_lock(&stdio_streams_mutex);
+    auto it = stdio_streams.find(fp);
+    if (it != stdio_streams.end()) {
+        buffer = it->second.buffer;
+        stdio_streams.erase(it);
+        stdio_stream_count--;
+    }
+    pthread_mutex_unlock(&stdio_streams_mutex);
+    return buffer;
+}
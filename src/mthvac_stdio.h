@@ -0,0 +1,38 @@
+/* stdio streams on cached files
+ *
+ * glibc's FILE reads go straight to the kernel, never through our read()
+ * wrapper, so a plain fopen()ed dataset file would always come from the
+ * PFS. Read-only fopen() of a tracked file instead returns a
+ * fopencookie() stream whose reads are positional reads on the tracked
+ * fd, served by HVAC with the usual PFS fallback. The stream buffer is
+ * HVAC_STDIO_BUFFER bytes so each refill is one sizeable RPC.
+ *
+ * Cookie streams have no descriptor of their own, fileno() on them is
+ * answered from here.
+ */
+#ifndef __HVAC_STDIO_H__
+#define __HVAC_STDIO_H__
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void hvac_stdio_init();
+
+// The stream for path, or NULL with *handled set if the open failed, or
+// NULL with *handled clear if this isn't ours and fopen() should run
+FILE *hvac_stdio_fopen(const char *path, const char *mode, int *handled);
+
+// Descriptor behind one of our streams, -1 if fp isn't one
+int hvac_stdio_fileno(FILE *fp);
+
+// Call before fclose(fp). Returns the buffer to free once it returned
+void *hvac_stdio_forget(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,124 @@
+/* Block striped placement of large files - see mthvac_stripe.h */
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "mthvac_stripe.h"
+#include "mthvac_comm.h"
+#include "mthvac_fdtable.h"
+#include "mthvac_placement.h"
+#include "mthvac_timer.h" // ! HVAC TIMING
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+// Upper bound on block reads one pread keeps in flight
+#define HVAC_STRIPE_MAX_INFLIGHT 64
+
+extern uint32_t g_hvac_server_count;
+
+static uint64_t g_stripe_size = 0;
+static uint64_t g_stripe_threshold = 64 * 1024 * 1024;
+
+void hvac_stripe_init()
+{
+    char *env;
+
+    if ((env = getenv("HVAC_STRIPE_SIZE")) != NULL)
+        g_stripe_size = strtoull(env, NULL, 10);
+    if ((env = getenv("HVAC_STRIPE_THRESHOLD")) != NULL)
+        g_stripe_threshold = strtoull(env, NULL, 10);
+
+    if (g_stripe_size)
+        L4C_INFO("Striping files >= %lu bytes in %lu byte blocks", g_stripe_threshold, g_stripe_size);
+}
+
+bool hvac_stripe_track(int fd, const std::string &path)
+{
+    struct stat st;
+
+    if (g_stripe_size == 0 || g_hvac_server_count < 2)
+        return false;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < g_stripe_threshold)
+        return false;
+
+    // The fd table entry carries the flag and the path, reads stay lock free
+    hvac_fdtable_set_striped(fd, true);
+
+    L4C_INFO("Striping fd %d (%s) size %ld", fd, path.c_str(), st.st_size);
+    return true;
+}
+
+bool hvac_stripe_is_striped(int fd)
+{
+    return g_stripe_size != 0 && hvac_fdtable_striped(fd);
+}
+
+void hvac_stripe_release(int fd)
+{
+    if (g_stripe_size == 0)
+        return;
+
+    hvac_fdtable_set_striped(fd, false);
+}
+
+struct hvac_stripe_piece {
+    struct hvac_read_op *op;
+    size_t len;
+};
+
+ssize_t hvac_stripe_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    HVAC_TIMING("CLIENT_(hvac_stripe_pread)_total");
+    std::string path;
+    std::vector<struct hvac_stripe_piece> pieces;
+    size_t collected = 0;
+    size_t total = 0;
+    bool contiguous = true;     // every piece so far came back full
+    bool failed = false;
+    char *dst = (char *)buf;
+    off_t end = offset + count;
+
+    if (!hvac_fdtable_striped(fd) || !hvac_fdtable_copy_path(fd, path))
+        return -1;
+
+    /* Results only count up to the first short piece, so collect in order */
+    auto collect = [&](struct hvac_stripe_piece &piece) {
+        ssize_t got = hvac_client_comm_wait_read_rpc(piece.op);
+        if (!contiguous)
+            return;
+        if (got < 0) {
+            failed = (total == 0);
+            contiguous = false;
+            return;
+        }
+        total += got;
+        if ((size_t)got < piece.len)
+            contiguous = false;
+    };
+
+    for (off_t pos = offset; pos < end; ) {
+        uint64_t block = pos / g_stripe_size;
+        off_t block_end = (block + 1) * g_stripe_size;
+        size_t len = (block_end < end ? block_end : end) - pos;
+        uint32_t host = hvac_place_block(path, block);
+        struct hvac_stripe_piece piece;
+
+        // A penalized owner counts as a failed piece, the prefix before it still returns
+        piece.len = len;
+        piece.op = hvac_client_comm_server_available(host) ?
+                   hvac_client_comm_start_stripe_read_rpc(host, path, dst + (pos - offset), len, pos) : NULL;
+        pieces.push_back(piece);
+        pos += len;
+
+        if (pieces.size() - collected >= HVAC_STRIPE_MAX_INFLIGHT)
+            collect(pieces[collected++]);
+    }
+
+    while (collected < pieces.size())
+        collect(pieces[collected++]);
+
+    return failed ? -1 : (ssize_t)total;
+}
@@ -0,0 +1,25 @@
+/* Block striped placement of large files
+ *
+ * By default a whole file lives on hash(path) % servers. With
+ * HVAC_STRIPE_SIZE set, files of at least HVAC_STRIPE_THRESHOLD bytes are
+ * cut into HVAC_STRIPE_SIZE blocks and every (file, block) pair is placed
+ * on its own server. pread() on such a file fans out to the block owners
+ * in parallel, each pushing straight into its slice of the user buffer.
+ * read() and close() still go through the open on the whole-file owner.
+ */
+#ifndef __HVAC_STRIPE_H__
+#define __HVAC_STRIPE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+
+void hvac_stripe_init();
+
+// Called once a file is tracked. Returns true if fd is striped.
+bool hvac_stripe_track(int fd, const std::string &path);
+bool hvac_stripe_is_striped(int fd);
+ssize_t hvac_stripe_pread(int fd, void *buf, size_t count, off_t offset);
+void hvac_stripe_release(int fd);
+
+#endif
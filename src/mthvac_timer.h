@@ -8,11 +8,16 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <deque>
 #include <numeric>    // For std::accumulate
 #include <algorithm>  // For std::sort
 #include <set>        // For std::set to store tags for detailed logging
 #include <unistd.h>   // For getpid()
+#include <sys/syscall.h>
 #include <cstring>    // For strlen
+#include <sstream>
+#include <pthread.h>
+#include <time.h>
 
 namespace hvac {
 
@@ -32,79 +37,546 @@ inline std::set<std::string>& get_detailed_log_tags_set()
     return detailed_tags;
 }
 
+
+
+/*
+    Every HVAC_TIMING call site interns its tag once into a small integer
+    id. Each thread accumulates into its own array of per-tag slots that
+    only it writes, so a scope costs two clock reads and two uncontended
+    stores. The printers take get_mutex() and add up the slots of every
+    live thread plus what exited threads left behind. A reset records the
+    current sums as a baseline instead of touching other threads' slots.
+
+    Every slot also carries a log-linear latency histogram in the HDR
+    style: exact below 16 ns, then 16 linear sub-buckets per power of two,
+    so any recorded value is within 1/16 of its bucket's bound. The layout
+    is fixed, so histograms from threads, processes or servers merge by
+    adding counts. A thread allocates a tag's counts the first time it
+    times that tag, never again.
+*/
+constexpr uint32_t kMaxTimerTags = 1024;
+
+constexpr int kHistSubBits = 4;
+constexpr int kHistSub = 1 << kHistSubBits;
+constexpr int kHistMaxExp = 44;     // ~4.9 hours, longer scopes share the last bucket
+constexpr int kHistBuckets = (kHistMaxExp - kHistSubBits + 2) * kHistSub;
+
+inline uint32_t hist_bucket(uint64_t ns) {
+    if (ns < (uint64_t)kHistSub)
+        return ns;
+    int e = 63 - __builtin_clzll(ns);
+    if (e > kHistMaxExp)
+        return kHistBuckets - 1;
+    return (e - kHistSubBits + 1) * kHistSub + ((ns >> (e - kHistSubBits)) - kHistSub);
+}
+
+// Largest value that lands in bucket idx
+inline uint64_t hist_bucket_high(uint32_t idx) {
+    if (idx < (uint32_t)kHistSub)
+        return idx;
+    int e = idx / kHistSub + kHistSubBits - 1;
+    uint64_t m = kHistSub + idx % kHistSub;
+    return ((m + 1) << (e - kHistSubBits)) - 1;
+}
+
+// Plain snapshot of a histogram, what the printers and RPCs work with
+struct LatencyHistogram {
+    uint64_t counts[kHistBuckets] = {};
+    uint64_t max_ns = 0;
+
+    void record(uint64_t ns) {
+        counts[hist_bucket(ns)]++;
+        if (ns > max_ns)
+            max_ns = ns;
+    }
+
+    void merge(const LatencyHistogram& o) {
+        for (int i = 0; i < kHistBuckets; i++)
+            counts[i] += o.counts[i];
+        if (o.max_ns > max_ns)
+            max_ns = o.max_ns;
+    }
+
+    uint64_t total() const {
+        uint64_t n = 0;
+        for (int i = 0; i < kHistBuckets; i++)
+            n += counts[i];
+        return n;
+    }
+
+    // Upper bound of the bucket holding the q-th quantile, never above max
+    uint64_t percentile(double q) const {
+        uint64_t n = total();
+        if (n == 0)
+            return 0;
+        uint64_t rank = (uint64_t)(q * n + 0.999999);
+        if (rank == 0)
+            rank = 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < kHistBuckets; i++) {
+            seen += counts[i];
+            if (seen >= rank)
+                return std::min(hist_bucket_high(i), max_ns);
+        }
+        return max_ns;
+    }
+};
+
+// Counts of one tag in one thread, written only by that thread
+struct HistCounts {
+    std::atomic<uint64_t> counts[kHistBuckets];
+};
+
+/*
+    Detailed call history. Each thread that runs a detailed tag gets a
+    fixed-size ring of records for it, HVAC_TIMER_HISTORY entries (default
+    16384), which it overwrites once full. A record is guarded by its own
+    sequence number: odd while being written, 2 * (index + 1) once done.
+    The exporter copies records between two reads of it and drops the ones
+    that changed, so draining never makes a writer wait. When a thread
+    exits, what its rings still hold moves into one ring per tag shared by
+    all exited threads, of the same size, so history of short-lived threads
+    is bounded like that of live ones.
+*/
+struct CallRecord {
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> start_ns{0};      // steady clock, comparable across processes
+    std::atomic<uint64_t> duration_ns{0};
+};
+
+struct HistoryRing {
+    std::atomic<uint64_t> head{0};          // records ever written, advanced by the owner
+    uint64_t tail = 0;                      // next record to export, under get_mutex()
+    uint32_t tid;
+    uint32_t capacity;
+    CallRecord* records;
+    uint32_t* tids = nullptr;               // per record, only in a ring of exited threads
+    uint64_t lost = 0;                      // overwritten before they got here, under get_mutex()
+
+    HistoryRing(uint32_t thread_id, uint32_t cap)
+        : tid(thread_id), capacity(cap), records(new CallRecord[cap]) {}
+    ~HistoryRing() { delete[] records; delete[] tids; }
+
+    void push(uint64_t start, uint64_t duration) {
+        uint64_t i = head.load(std::memory_order_relaxed);
+        CallRecord& rec = records[i % capacity];
+        rec.seq.store(2 * i + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        rec.start_ns.store(start, std::memory_order_relaxed);
+        rec.duration_ns.store(duration, std::memory_order_relaxed);
+        rec.seq.store(2 * i + 2, std::memory_order_release);
+        head.store(i + 1, std::memory_order_release);
+    }
+};
+
+/*
+    Tracing. With HVAC_TRACE=<prefix> set, every HVAC_TIMING scope is also
+    appended to a per-thread event buffer as a complete span (start and
+    duration, the tag). Scopes nest by construction, so the viewer rebuilds
+    the call stack of a thread from the spans alone. A buffer grows in
+    chunks up to HVAC_TRACE_EVENTS events (default 1M), later scopes are
+    counted as dropped. Only the owning thread appends and it publishes the
+    count after the event, so a dump can run while threads keep timing.
+    When a thread exits its spans are copied out at their exact size, and
+    exited threads together keep at most HVAC_TRACE_EVENTS of them: past
+    that the oldest exited threads' spans are counted as dropped.
+    At exit the process writes <prefix>.<pid>.json in the Chrome trace
+    event format, which Perfetto and chrome://tracing open directly;
+    script/merge_traces.py puts the files of a job on one timeline.
+*/
+constexpr uint32_t kTraceChunk = 65536;
+
+struct TraceEvent {
+    uint64_t start_ns;      // steady clock
+    uint64_t duration_ns;
+    uint32_t tag;
+};
+
+struct TraceBuffer {
+    std::atomic<uint64_t> count{0};         // events written, advanced by the owner
+    std::atomic<uint64_t> dropped{0};
+    uint32_t tid;
+    uint32_t nchunks;
+    std::atomic<TraceEvent*>* chunks;
+
+    TraceBuffer(uint32_t thread_id, uint64_t capacity)
+        : tid(thread_id), nchunks((capacity + kTraceChunk - 1) / kTraceChunk),
+          chunks(new std::atomic<TraceEvent*>[nchunks]()) {}
+    ~TraceBuffer() {
+        for (uint32_t i = 0; i < nchunks; i++)
+            delete[] chunks[i].load(std::memory_order_relaxed);
+        delete[] chunks;
+    }
+
+    void push(uint64_t start, uint64_t duration, uint32_t tag) {
+        uint64_t i = count.load(std::memory_order_relaxed);
+        uint64_t c = i / kTraceChunk;
+        if (c >= nchunks) {
+            dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        TraceEvent* chunk = chunks[c].load(std::memory_order_relaxed);
+        if (__builtin_expect(chunk == nullptr, 0)) {
+            chunk = new TraceEvent[kTraceChunk];
+            chunks[c].store(chunk, std::memory_order_release);
+        }
+        chunk[i % kTraceChunk] = {start, duration, tag};
+        count.store(i + 1, std::memory_order_release);
+    }
+};
+
+struct RetiredTrace {
+    uint32_t tid;
+    std::vector<TraceEvent> events;
+};
+
+struct TagSlot {
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> max_ns{0};
+    std::atomic<HistCounts*> hist{nullptr};
+    std::atomic<HistoryRing*> history{nullptr};
+};
+
+// Add a slot's histogram into a snapshot
+inline void hist_add_slot(LatencyHistogram& h, const TagSlot& s) {
+    HistCounts* c = s.hist.load(std::memory_order_acquire);
+    if (c == nullptr)
+        return;
+    for (int i = 0; i < kHistBuckets; i++)
+        h.counts[i] += c->counts[i].load(std::memory_order_relaxed);
+    uint64_t m = s.max_ns.load(std::memory_order_relaxed);
+    if (m > h.max_ns)
+        h.max_ns = m;
+}
+
+struct ThreadSlots {
+    TagSlot slots[kMaxTimerTags];
+    uint32_t tid;
+    std::atomic<TraceBuffer*> trace{nullptr};
+};
+
+inline void dump_trace_at_exit();
+inline void trace_atfork_prepare();
+inline void trace_atfork_parent();
+inline void trace_atfork_child();
+
+struct TimerRegistry {
+    std::vector<std::string> names;                     // indexed by tag id
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<ThreadSlots *> threads;                 // live threads
+    ThreadSlots retired;                                // totals of exited threads
+    uint64_t base_ns[kMaxTimerTags] = {};               // sums at the last reset
+    uint64_t base_calls[kMaxTimerTags] = {};
+    LatencyHistogram* base_hist[kMaxTimerTags] = {};
+    std::atomic<bool> detailed[kMaxTimerTags] = {};
+    HistoryRing* retired_history[kMaxTimerTags] = {};   // newest records of exited threads
+    uint32_t history_capacity = 16384;
+    bool tracing = false;
+    std::string trace_prefix;
+    uint64_t trace_capacity = 1 << 20;
+    std::deque<RetiredTrace> retired_traces;            // spans of exited threads, oldest first
+    uint64_t retired_trace_events = 0;
+    uint64_t retired_trace_dropped = 0;
+
+    // Tag ids past kMaxTimerTags all land here
+    TimerRegistry() {
+        names.push_back("(other tags)");
+        ids[names[0]] = 0;
+        const char* env = getenv("HVAC_TIMER_HISTORY");
+        if (env != nullptr && atoi(env) > 0)
+            history_capacity = atoi(env);
+        env = getenv("HVAC_TRACE");
+        if (env != nullptr && env[0] != '\0') {
+            tracing = true;
+            trace_prefix = env;
+            env = getenv("HVAC_TRACE_EVENTS");
+            if (env != nullptr && strtoull(env, nullptr, 10) > 0)
+                trace_capacity = strtoull(env, nullptr, 10);
+            atexit(dump_trace_at_exit);
+            pthread_atfork(trace_atfork_prepare, trace_atfork_parent, trace_atfork_child);
+        }
+    }
+};
+
+// Never destroyed: timers may still fire from other destructors at exit
+inline TimerRegistry& get_registry() {
+    static TimerRegistry *registry = new TimerRegistry();
+    return *registry;
+}
+
+inline uint32_t intern_tag(const char* tag) {
+    std::lock_guard<std::mutex> lk(get_mutex());
+    auto& r = get_registry();
+    auto it = r.ids.find(tag);
+    if (it != r.ids.end())
+        return it->second;
+    if (r.names.size() >= kMaxTimerTags)
+        return 0;
+    uint32_t id = r.names.size();
+    r.names.push_back(tag);
+    r.ids[r.names.back()] = id;
+    r.detailed[id].store(get_detailed_log_tags_set().count(r.names.back()) != 0, std::memory_order_relaxed);
+    return id;
+}
+
+// Move the records an exited thread's ring has not exported yet into the
+// tag's retired ring and free it. Caller holds get_mutex().
+inline void retire_history(TimerRegistry& r, uint32_t tag, HistoryRing* ring) {
+    HistoryRing*& into = r.retired_history[tag];
+    if (into == nullptr) {
+        into = new HistoryRing(0, r.history_capacity);
+        into->tids = new uint32_t[r.history_capacity]();
+    }
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t from = ring->tail;
+    if (head - from > ring->capacity) {
+        into->lost += head - ring->capacity - from;
+        from = head - ring->capacity;
+    }
+    // The owner is gone, every record is complete
+    for (uint64_t i = from; i < head; i++) {
+        CallRecord& rec = ring->records[i % ring->capacity];
+        into->tids[into->head.load(std::memory_order_relaxed) % into->capacity] = ring->tid;
+        into->push(rec.start_ns.load(std::memory_order_relaxed), rec.duration_ns.load(std::memory_order_relaxed));
+    }
+    delete ring;
+}
+
+// Copy an exited thread's spans out of its chunks and free them, then trim
+// the oldest exited threads to stay within the cap. Caller holds get_mutex().
+inline void retire_trace(TimerRegistry& r, TraceBuffer* trace) {
+    uint64_t n = trace->count.load(std::memory_order_acquire);
+    r.retired_trace_dropped += trace->dropped.load(std::memory_order_relaxed);
+    if (n > 0) {
+        r.retired_traces.emplace_back();
+        RetiredTrace& rt = r.retired_traces.back();
+        rt.tid = trace->tid;
+        rt.events.reserve(n);
+        for (uint64_t i = 0; i < n; i++)
+            rt.events.push_back(trace->chunks[i / kTraceChunk].load(std::memory_order_relaxed)[i % kTraceChunk]);
+        r.retired_trace_events += n;
+        while (r.retired_trace_events > r.trace_capacity && r.retired_traces.size() > 1) {
+            uint64_t old = r.retired_traces.front().events.size();
+            r.retired_trace_events -= old;
+            r.retired_trace_dropped += old;
+            r.retired_traces.pop_front();
+        }
+    }
+    delete trace;
+}
+
+// Once a thread's slots are folded into the retired totals, slots points
+// at r.retired: scopes that end later, in other thread_local or atexit
+// destructors, are charged there under get_mutex().
+struct ThreadSlotsHolder {
+    ThreadSlots* slots = nullptr;
+
+    ~ThreadSlotsHolder() {
+        if (slots == nullptr)
+            return;
+        std::lock_guard<std::mutex> lk(get_mutex());
+        auto& r = get_registry();
+        if (slots == &r.retired)
+            return;
+        for (uint32_t i = 0; i < kMaxTimerTags; i++) {
+            TagSlot& to = r.retired.slots[i];
+            to.total_ns.store(to.total_ns.load(std::memory_order_relaxed) +
+                              slots->slots[i].total_ns.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            to.calls.store(to.calls.load(std::memory_order_relaxed) +
+                           slots->slots[i].calls.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            HistoryRing* ring = slots->slots[i].history.load(std::memory_order_relaxed);
+            if (ring != nullptr)
+                retire_history(r, i, ring);
+            HistCounts* from = slots->slots[i].hist.load(std::memory_order_relaxed);
+            if (from == nullptr)
+                continue;
+            HistCounts* into = to.hist.load(std::memory_order_relaxed);
+            if (into == nullptr) {
+                into = new HistCounts();
+                to.hist.store(into, std::memory_order_release);
+            }
+            for (int b = 0; b < kHistBuckets; b++)
+                into->counts[b].store(into->counts[b].load(std::memory_order_relaxed) +
+                                      from->counts[b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            if (slots->slots[i].max_ns.load(std::memory_order_relaxed) > to.max_ns.load(std::memory_order_relaxed))
+                to.max_ns.store(slots->slots[i].max_ns.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            delete from;
+        }
+        TraceBuffer* trace = slots->trace.load(std::memory_order_relaxed);
+        if (trace != nullptr)
+            retire_trace(r, trace);
+        r.threads.erase(std::find(r.threads.begin(), r.threads.end(), slots));
+        delete slots;
+        slots = &r.retired;
+    }
+};
+
+inline ThreadSlots* get_thread_slots() {
+    static thread_local ThreadSlotsHolder holder;
+    if (__builtin_expect(holder.slots == nullptr, 0)) {
+        holder.slots = new ThreadSlots();
+        holder.slots->tid = syscall(SYS_gettid);
+        std::lock_guard<std::mutex> lk(get_mutex());
+        get_registry().threads.push_back(holder.slots);
+    }
+    return holder.slots;
+}
+
 inline void enable_detailed_call_logging_for_tag(const std::string& tag) {
     std::lock_guard<std::mutex> lk(get_mutex());
     get_detailed_log_tags_set().insert(tag);
-    // std::cout << "[HVAC Timer] Detailed call logging enabled for tag: " << tag << std::endl;
+    auto& r = get_registry();
+    auto it = r.ids.find(tag);
+    if (it != r.ids.end() && it->second != 0)
+        r.detailed[it->second].store(true, std::memory_order_relaxed);
 }
 
 inline void disable_detailed_call_logging_for_tag(const std::string& tag)
 {
     std::lock_guard<std::mutex> lk(get_mutex());
     get_detailed_log_tags_set().erase(tag);
-    // std::cout << "[HVAC Timer] Detailed call logging disabled for tag: " << tag << std::endl;
+    auto& r = get_registry();
+    auto it = r.ids.find(tag);
+    if (it != r.ids.end())
+        r.detailed[it->second].store(false, std::memory_order_relaxed);
 }
 
-inline std::unordered_map<std::string, std::vector<uint64_t>>& get_call_history_table()
-{
-    static std::unordered_map<std::string, std::vector<uint64_t>> call_history_table;
-    return call_history_table;
+// Add one duration to a tag's totals and histogram in this thread's slot.
+// Only this thread writes its slots, no read-modify-write needed.
+inline TagSlot& record_duration(ThreadSlots* ts, uint32_t tag, uint64_t ns) {
+    TagSlot& s = ts->slots[tag];
+    s.total_ns.store(s.total_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    s.calls.store(s.calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (ns > s.max_ns.load(std::memory_order_relaxed))
+        s.max_ns.store(ns, std::memory_order_relaxed);
+    HistCounts* h = s.hist.load(std::memory_order_relaxed);
+    if (__builtin_expect(h == nullptr, 0)) {
+        h = new HistCounts();
+        s.hist.store(h, std::memory_order_release);
+    }
+    std::atomic<uint64_t>& c = h->counts[hist_bucket(ns)];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    return s;
 }
 
-
-struct Stat {
-    std::atomic<double> total_us{0.0};
-    std::atomic<uint64_t> calls{0};
-
-    // Default constructor for unordered_map when key is not found
-    Stat() = default;
-};
-
-inline std::unordered_map<std::string, Stat>& get_table() {
-    static std::unordered_map<std::string, Stat> tbl;
-    return tbl;
+// For durations measured elsewhere (e.g. reported by a server): they
+// show up in the summaries and histograms, but not in history or traces.
+inline void record_duration(uint32_t tag, uint64_t ns) {
+    ThreadSlots* ts = get_thread_slots();
+    if (__builtin_expect(ts == &get_registry().retired, 0)) {
+        std::lock_guard<std::mutex> lk(get_mutex());
+        record_duration(ts, tag, ns);
+        return;
+    }
+    record_duration(ts, tag, ns);
 }
 
 class TimerGuard {
     public:
+        explicit TimerGuard(uint32_t tag)
+            : tag_(tag), start_(std::chrono::steady_clock::now()) {}
+
+        // For tags built at run time, interns on every call
         explicit TimerGuard(const char* tag)
-            : tag_name_str_(tag), start_(std::chrono::steady_clock::now()) { // Store tag as std::string
-              // This constructor is a good place to check if the tag exists in get_detailed_log_tags_set()
-              // if many tags are dynamically created, to avoid growing the set unnecessarily.
-              // However, for simplicity, we check in the destructor.
-          }
-    
+            : TimerGuard(intern_tag(tag)) {}
+
         ~TimerGuard() {
-            uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+            uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
                 std::chrono::steady_clock::now() - start_).count();
-    
-            std::lock_guard<std::mutex> lk(get_mutex()); // Acquire lock once for all modifications
-    
-            // 1. Update cumulative statistics
-            auto& cumulative_tbl = get_table();
-            auto& s_cumulative = cumulative_tbl[tag_name_str_]; // Use std::string key
-    
-            double current_total = s_cumulative.total_us.load(std::memory_order_relaxed);
-            double new_total;
-            do {
-                new_total = current_total + static_cast<double>(us);
-            } while (!s_cumulative.total_us.compare_exchange_weak(current_total, new_total,
-                                                                  std::memory_order_release,
-                                                                  std::memory_order_relaxed));
-            s_cumulative.calls.fetch_add(1, std::memory_order_relaxed);
-    
-            // 2. Conditionally log individual call duration for detailed analysis
-            const auto& detailed_tags_to_log = get_detailed_log_tags_set();
-            if (detailed_tags_to_log.count(tag_name_str_)) {
-                auto& call_history_tbl = get_call_history_table();
-                call_history_tbl[tag_name_str_].push_back(us);
+
+            ThreadSlots* ts = get_thread_slots();
+            auto& r = get_registry();
+            if (__builtin_expect(ts == &r.retired, 0)) {
+                // Thread on its way out: totals only, its ring and trace are gone
+                std::lock_guard<std::mutex> lk(get_mutex());
+                record_duration(ts, tag_, ns);
+                return;
+            }
+            TagSlot& s = record_duration(ts, tag_, ns);
+
+            // Conditionally log individual call duration for detailed analysis
+            if (r.detailed[tag_].load(std::memory_order_relaxed)) {
+                HistoryRing* ring = s.history.load(std::memory_order_relaxed);
+                if (__builtin_expect(ring == nullptr, 0)) {
+                    ring = new HistoryRing(ts->tid, r.history_capacity);
+                    s.history.store(ring, std::memory_order_release);
+                }
+                ring->push(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               start_.time_since_epoch()).count(), ns);
+            }
+
+            if (__builtin_expect(r.tracing, 0)) {
+                TraceBuffer* trace = ts->trace.load(std::memory_order_relaxed);
+                if (trace == nullptr) {
+                    trace = new TraceBuffer(ts->tid, r.trace_capacity);
+                    ts->trace.store(trace, std::memory_order_release);
+                }
+                trace->push(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                start_.time_since_epoch()).count(), ns, tag_);
             }
         }
     private:
-        std::string tag_name_str_; // Store tag as std::string to ensure its lifetime and for map key
+        uint32_t tag_;
         std::chrono::steady_clock::time_point start_;
 };
 
+struct TagTotals {
+    std::string name;
+    uint64_t total_ns;
+    uint64_t calls;
+    LatencyHistogram hist;
+};
+
+// Sum of every thread's slots since the last reset, for tags that ever ran.
+// Caller holds get_mutex().
+inline std::vector<TagTotals> collect_stats_locked(bool since_reset = true) {
+    auto& r = get_registry();
+    std::vector<TagTotals> out;
+    for (uint32_t id = 0; id < r.names.size(); id++) {
+        out.emplace_back();
+        TagTotals& t = out.back();
+        t.total_ns = r.retired.slots[id].total_ns.load(std::memory_order_relaxed);
+        t.calls = r.retired.slots[id].calls.load(std::memory_order_relaxed);
+        hist_add_slot(t.hist, r.retired.slots[id]);
+        for (ThreadSlots* th : r.threads) {
+            t.total_ns += th->slots[id].total_ns.load(std::memory_order_relaxed);
+            t.calls += th->slots[id].calls.load(std::memory_order_relaxed);
+            hist_add_slot(t.hist, th->slots[id]);
+        }
+        if (t.calls == 0) {
+            out.pop_back();
+            continue;
+        }
+        t.name = r.names[id];
+        if (since_reset) {
+            t.total_ns -= r.base_ns[id];
+            t.calls -= r.base_calls[id];
+            if (r.base_hist[id] != nullptr) {
+                // The all time max may predate the reset, cap it by the top bucket
+                int top = -1;
+                for (int i = 0; i < kHistBuckets; i++) {
+                    t.hist.counts[i] -= r.base_hist[id]->counts[i];
+                    if (t.hist.counts[i])
+                        top = i;
+                }
+                t.hist.max_ns = top < 0 ? 0 : std::min(t.hist.max_ns, hist_bucket_high(top));
+            }
+        }
+    }
+    return out;
+}
+
+
+constexpr int kPercentileColumns = 5;
+constexpr const char* kPercentileNames[kPercentileColumns] = {"p50(us)", "p90(us)", "p99(us)", "p999(us)", "Max(us)"};
+
+inline double percentile_column_us(const LatencyHistogram& h, int column) {
+    static const double q[kPercentileColumns - 1] = {0.50, 0.90, 0.99, 0.999};
+    if (column == kPercentileColumns - 1)
+        return h.max_ns / 1000.0;
+    return h.percentile(q[column]) / 1000.0;
+}
 
 inline void print_all_stats(int epoch_num = -1) { // Default to -1 if no epoch num is provided
     std::stringstream ss;
@@ -120,25 +592,33 @@ inline void print_all_stats(int epoch_num = -1) { // Default to -1 if no epoch n
     const int calls_col_width = 12;
     const int total_us_col_width = 18; // Made wider to accommodate larger numbers and precision
     const int avg_us_col_width = 15;
-    const int total_line_width = section_col_width + calls_col_width + total_us_col_width + avg_us_col_width;
+    const int pct_col_width = 12;
+    const int total_line_width = section_col_width + calls_col_width + total_us_col_width + avg_us_col_width +
+                                 kPercentileColumns * pct_col_width;
 
 
     ss << std::left << std::setw(section_col_width) << "Section"
        << std::right << std::setw(calls_col_width) << "Calls"
        << std::right << std::setw(total_us_col_width) << "Total(us)" // Align right
-       << std::right << std::setw(avg_us_col_width) << "Avg(us)"   // Align right
-       << "\n" << std::string(total_line_width, '-') << "\n"; // Use calculated total width
+       << std::right << std::setw(avg_us_col_width) << "Avg(us)";   // Align right
+    for (int i = 0; i < kPercentileColumns; i++)
+        ss << std::right << std::setw(pct_col_width) << kPercentileNames[i];
+    ss << "\n" << std::string(total_line_width, '-') << "\n"; // Use calculated total width
 
     {
         std::lock_guard<std::mutex> lk(get_mutex());
-        for (auto const& [k, v] : get_table()) {
-            double tot = v.total_us.load(std::memory_order_acquire);
-            uint64_t c = v.calls.load(std::memory_order_acquire);
+        for (auto const& t : collect_stats_locked()) {
+            const std::string& k = t.name;
+            double tot = t.total_ns / 1000.0;
+            uint64_t c = t.calls;
             ss << std::left  << std::setw(section_col_width) << k
                << std::right << std::setw(calls_col_width) << c
                << std::right << std::setw(total_us_col_width) << std::fixed << std::setprecision(2) << tot
-               << std::right << std::setw(avg_us_col_width) << std::fixed << std::setprecision(2) << (c ? tot / static_cast<double>(c) : 0.0)
-               << "\n";
+               << std::right << std::setw(avg_us_col_width) << std::fixed << std::setprecision(2) << (c ? tot / static_cast<double>(c) : 0.0);
+            for (int i = 0; i < kPercentileColumns; i++)
+                ss << std::right << std::setw(pct_col_width) << std::fixed << std::setprecision(2)
+                   << percentile_column_us(t.hist, i);
+            ss << "\n";
         }
     }
     ss << std::string(total_line_width, '=') << "\n";
@@ -147,19 +627,28 @@ inline void print_all_stats(int epoch_num = -1) { // Default to -1 if no epoch n
 
 inline void reset_all_stats() {
     std::lock_guard<std::mutex> lk(get_mutex());
-    auto& tbl = get_table();
-    for (auto& pair_in_map : tbl) {
-        pair_in_map.second.total_us.store(0.0, std::memory_order_relaxed);
-        pair_in_map.second.calls.store(0, std::memory_order_relaxed);
-    }
-
-    // Reset detailed call history table for enabled tags
-    auto& call_history_tbl = get_call_history_table();
-    const auto& detailed_tags_to_reset = get_detailed_log_tags_set(); // Read the set of tags
-    for (const std::string& tag : detailed_tags_to_reset) {
-        if (call_history_tbl.count(tag)) {
-            call_history_tbl[tag].clear();
-           
+    auto& r = get_registry();
+    for (auto const& t : collect_stats_locked(false)) {
+        uint32_t id = r.ids[t.name];
+        r.base_ns[id] = t.total_ns;
+        r.base_calls[id] = t.calls;
+        if (r.base_hist[id] == nullptr)
+            r.base_hist[id] = new LatencyHistogram();
+        *r.base_hist[id] = t.hist;
+    }
+
+    // Skip every detailed record written so far
+    for (ThreadSlots* th : r.threads) {
+        for (uint32_t id = 0; id < r.names.size(); id++) {
+            HistoryRing* ring = th->slots[id].history.load(std::memory_order_acquire);
+            if (ring != nullptr)
+                ring->tail = ring->head.load(std::memory_order_acquire);
+        }
+    }
+    for (HistoryRing* ring : r.retired_history) {
+        if (ring != nullptr) {
+            ring->tail = ring->head.load(std::memory_order_relaxed);
+            ring->lost = 0;
         }
     }
 
@@ -188,29 +677,73 @@ inline void export_tag_call_history_to_file(const std::string& tag_to_export, co
         outfile << ", For Client Epoch: " << epoch_num; // client's epoch context
     }
     outfile << ") ===\n";
-    outfile << "Call_Index,Duration_us\n"; // CSV Header
-
-    size_t calls_exported = 0;
+    outfile << "Call_Index,Start_ns,Thread,Duration_us\n"; // CSV Header
+
+    struct Exported {
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        uint32_t tid;
+    };
+    std::vector<Exported> calls;
+    uint64_t dropped = 0;
+    bool known = false;
     {
-        std::lock_guard<std::mutex> lk(get_mutex()); // Protect access to call_history_tbl
-        auto& call_history_tbl = get_call_history_table();
-        auto it = call_history_tbl.find(tag_to_export);
-        // outfile << "tag print" << it->first << std::endl;
-        if (it != call_history_tbl.end()) 
-        {
-            const auto& durations = it->second;
-            for (size_t i = 0; i < durations.size(); ++i) {
-                outfile << (i + 1) << "," << durations[i] << "\n";
-                calls_exported++;
-            }
-            if (durations.empty()) {
-                outfile << "(No calls recorded for this tag in this period/since last reset)\n";
+        // Only exporters take the mutex here, writers keep going
+        std::lock_guard<std::mutex> lk(get_mutex());
+        auto& r = get_registry();
+        auto it = r.ids.find(tag_to_export);
+        if (it != r.ids.end()) {
+            known = true;
+            uint32_t id = it->second;
+            auto drain = [&](HistoryRing* ring) {
+                uint64_t head = ring->head.load(std::memory_order_acquire);
+                uint64_t from = ring->tail;
+                dropped += ring->lost;
+                ring->lost = 0;
+                if (head - from > ring->capacity) {
+                    dropped += head - ring->capacity - from;
+                    from = head - ring->capacity;
+                }
+                for (uint64_t i = from; i < head; i++) {
+                    CallRecord& rec = ring->records[i % ring->capacity];
+                    uint64_t seq = rec.seq.load(std::memory_order_acquire);
+                    Exported e = {rec.start_ns.load(std::memory_order_relaxed),
+                                  rec.duration_ns.load(std::memory_order_relaxed),
+                                  ring->tids ? ring->tids[i % ring->capacity] : ring->tid};
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (seq != 2 * i + 2 || rec.seq.load(std::memory_order_relaxed) != seq) {
+                        dropped++;      // overwritten while we looked
+                        continue;
+                    }
+                    calls.push_back(e);
+                }
+                ring->tail = head;
+            };
+            for (ThreadSlots* th : r.threads) {
+                HistoryRing* ring = th->slots[id].history.load(std::memory_order_acquire);
+                if (ring != nullptr)
+                    drain(ring);
             }
-        } else 
-        {
-            outfile << "(Tag \"" << tag_to_export << "\" not found in detailed history or not enabled for detailed logging)\n";
+            if (r.retired_history[id] != nullptr)
+                drain(r.retired_history[id]);
         }
     }
+    std::sort(calls.begin(), calls.end(),
+              [](const Exported& a, const Exported& b) { return a.start_ns < b.start_ns; });
+
+    size_t calls_exported = 0;
+    if (!known) {
+        outfile << "(Tag \"" << tag_to_export << "\" not found in detailed history or not enabled for detailed logging)\n";
+    } else if (calls.empty()) {
+        outfile << "(No calls recorded for this tag in this period/since last reset)\n";
+    }
+    for (const Exported& e : calls) {
+        outfile << (calls_exported + 1) << "," << e.start_ns << "," << e.tid << ","
+                << std::fixed << std::setprecision(3) << e.duration_ns / 1000.0 << "\n";
+        calls_exported++;
+    }
+    if (dropped)
+        outfile << "(" << dropped << " older calls were overwritten before this export, raise HVAC_TIMER_HISTORY to keep them)\n";
     outfile << "--- End of detailed history for tag: \"" << tag_to_export << "\" (Exported " << calls_exported << " calls) ---\n";
     outfile << "==============================================================================\n";
     outfile.close();
@@ -236,19 +769,24 @@ inline void export_all_stats_to_file(const char* filename, int epoch_num = -1) {
     outfile << std::left << std::setw(75) << "Section" // Increased width for potentially longer tags
             << std::right << std::setw(12) << "Calls"
             << std::setw(18) << "Total(us)"
-            << std::setw(15) << "Avg(us)"
-            << "\n-----------------------------------------------------------------------------------\n"; // Adjusted line
+            << std::setw(15) << "Avg(us)";
+    for (int i = 0; i < kPercentileColumns; i++)
+        outfile << std::setw(12) << kPercentileNames[i];
+    outfile << "\n-----------------------------------------------------------------------------------\n"; // Adjusted line
 
     {
         std::lock_guard<std::mutex> lk(get_mutex());
-        for (auto const& [k, v] : get_table()) {
-            double tot = v.total_us.load(std::memory_order_acquire);
-            uint64_t c = v.calls.load(std::memory_order_acquire);
+        for (auto const& t : collect_stats_locked()) {
+            const std::string& k = t.name;
+            double tot = t.total_ns / 1000.0;
+            uint64_t c = t.calls;
             outfile << std::left << std::setw(45) << k
                     << std::right << std::setw(12) << c
                     << std::setw(15) << std::fixed << std::setprecision(2) << tot
-                    << std::setw(15) << (c ? tot / static_cast<double>(c) : 0.0)
-                    << "\n";
+                    << std::setw(15) << (c ? tot / static_cast<double>(c) : 0.0);
+            for (int i = 0; i < kPercentileColumns; i++)
+                outfile << std::setw(12) << percentile_column_us(t.hist, i);
+            outfile << "\n";
         }
     }
     outfile << "===================================================================================\n";
@@ -257,6 +795,174 @@ inline void export_all_stats_to_file(const char* filename, int epoch_num = -1) {
     std::cout << "[HVAC Server Timing summary exported to " << filename << std::endl;
 }
 
+/*
+    Raw bucket counts of every tag as CSV, one row per non-empty bucket.
+    Files from several processes merge by adding counts of equal
+    (Section, Bucket) pairs; Bucket_high_ns is that bucket's upper bound.
+*/
+inline void export_histograms_to_file(const char* filename) {
+    std::ofstream outfile(filename);
+    if (!outfile.is_open()) {
+        std::cerr << "Error: Could not open file '" << filename << "' for writing histograms." << std::endl;
+        return;
+    }
+    outfile << "Section,Bucket,Bucket_high_ns,Count\n";
+    std::lock_guard<std::mutex> lk(get_mutex());
+    for (auto const& t : collect_stats_locked()) {
+        for (int i = 0; i < kHistBuckets; i++) {
+            if (t.hist.counts[i])
+                outfile << t.name << "," << i << "," << hist_bucket_high(i) << "," << t.hist.counts[i] << "\n";
+        }
+    }
+}
+
+inline void trace_json_string(std::string& out, const std::string& in) {
+    out += '"';
+    for (char c : in) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// First line of a /proc comm file, empty if it can't be read
+inline std::string trace_comm(const std::string& path) {
+    std::ifstream in(path);
+    std::string name;
+    std::getline(in, name);
+    return name;
+}
+
+/*
+    Write every traced span of this process as Chrome trace event JSON.
+    Timestamps are steady clock microseconds; realtime_offset_ns in
+    otherData maps them to wall time for merging files across nodes.
+*/
+inline bool dump_trace_to_file(const char* filename) {
+    std::ofstream outfile(filename);
+    if (!outfile.is_open()) {
+        std::cerr << "Error: Could not open file '" << filename << "' for writing the trace." << std::endl;
+        return false;
+    }
+
+    struct timespec rt, mono;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    int64_t offset_ns = ((int64_t)rt.tv_sec - mono.tv_sec) * 1000000000LL + (rt.tv_nsec - mono.tv_nsec);
+    unsigned long pid = getpid();
+
+    std::string out = "{\"traceEvents\":[\n";
+    char line[160];
+    snprintf(line, sizeof(line), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":0,\"args\":{\"name\":", pid);
+    out += line;
+    trace_json_string(out, trace_comm("/proc/self/comm") + " " + std::to_string(pid));
+    out += "}}";
+
+    uint64_t events = 0, dropped = 0;
+    std::lock_guard<std::mutex> lk(get_mutex());
+    auto& r = get_registry();
+    // Tag names as JSON strings, once
+    std::vector<std::string> names(r.names.size());
+    for (size_t i = 0; i < names.size(); i++)
+        trace_json_string(names[i], r.names[i]);
+
+    auto write_event = [&](const TraceEvent& e, uint32_t tid) {
+        out += ",\n{\"name\":";
+        out += names[e.tag];
+        snprintf(line, sizeof(line), ",\"cat\":\"hvac\",\"ph\":\"X\",\"ts\":%lu.%03lu,\"dur\":%lu.%03lu,\"pid\":%lu,\"tid\":%u}",
+                 (unsigned long)(e.start_ns / 1000), (unsigned long)(e.start_ns % 1000),
+                 (unsigned long)(e.duration_ns / 1000), (unsigned long)(e.duration_ns % 1000), pid, tid);
+        out += line;
+        if (out.size() > (1 << 20)) {
+            outfile << out;
+            out.clear();
+        }
+    };
+    for (ThreadSlots* th : r.threads) {
+        TraceBuffer* trace = th->trace.load(std::memory_order_acquire);
+        if (trace == nullptr)
+            continue;
+        std::string comm = trace_comm("/proc/self/task/" + std::to_string(trace->tid) + "/comm");
+        if (!comm.empty()) {
+            snprintf(line, sizeof(line), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%u,\"args\":{\"name\":",
+                     pid, trace->tid);
+            out += line;
+            trace_json_string(out, comm);
+            out += "}}";
+        }
+        uint64_t n = trace->count.load(std::memory_order_acquire);
+        for (uint64_t i = 0; i < n; i++)
+            write_event(trace->chunks[i / kTraceChunk].load(std::memory_order_acquire)[i % kTraceChunk], trace->tid);
+        events += n;
+        dropped += trace->dropped.load(std::memory_order_relaxed);
+    }
+    for (const RetiredTrace& rt : r.retired_traces) {
+        for (const TraceEvent& e : rt.events)
+            write_event(e, rt.tid);
+        events += rt.events.size();
+    }
+    dropped += r.retired_trace_dropped;
+
+    snprintf(line, sizeof(line), "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"realtime_offset_ns\":%lld,\"dropped_events\":%lu}}\n",
+             (long long)offset_ns, (unsigned long)dropped);
+    out += line;
+    outfile << out;
+    outfile.close();
+    std::cout << "[HVAC trace: " << events << " spans written to " << filename;
+    if (dropped)
+        std::cout << ", " << dropped << " dropped, raise HVAC_TRACE_EVENTS to keep them";
+    std::cout << "]" << std::endl;
+    return true;
+}
+
+// HVAC_TRACE prefix plus the pid, empty when tracing is off
+inline std::string trace_file_name() {
+    auto& r = get_registry();
+    if (!r.tracing)
+        return std::string();
+    return r.trace_prefix + "." + std::to_string(getpid()) + ".json";
+}
+
+inline void dump_trace_at_exit() {
+    std::string name = trace_file_name();
+    if (!name.empty())
+        dump_trace_to_file(name.c_str());
+}
+
+// A forked child writes its own file; spans recorded before the fork belong to the parent's
+inline void trace_atfork_prepare() {
+    get_mutex().lock();
+}
+
+inline void trace_atfork_parent() {
+    get_mutex().unlock();
+}
+
+inline void trace_atfork_child() {
+    auto& r = get_registry();
+    // Only the forking thread survives, nobody else can be appending
+    for (ThreadSlots* th : r.threads)
+        delete th->trace.exchange(nullptr);
+    r.retired_traces.clear();
+    r.retired_trace_events = 0;
+    r.retired_trace_dropped = 0;
+    get_mutex().unlock();
+    get_thread_slots()->tid = syscall(SYS_gettid);
+}
+
 } // namespace hvac
 
-#define HVAC_TIMING(name) hvac::TimerGuard __hvac_tg__(name)
\ No newline at end of file
+#define HVAC_TIMER_CAT2(a, b) a##b
+#define HVAC_TIMER_CAT(a, b) HVAC_TIMER_CAT2(a, b)
+// The tag is interned once per call site, the first time it runs
+#define HVAC_TIMING(name) \
+    static const uint32_t HVAC_TIMER_CAT(__hvac_tag_, __LINE__) = hvac::intern_tag(name); \
+    hvac::TimerGuard HVAC_TIMER_CAT(__hvac_tg_, __LINE__)(HVAC_TIMER_CAT(__hvac_tag_, __LINE__))
@@ -16,12 +16,21 @@
  * This file is part of the HVAC project.
  ****************************************************************************/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* statx, stat64 */
+#endif
 #include <dlfcn.h>
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <limits.h>
 
 #include "mthvac_internal.h"
+#include "mthvac_meta.h"
+#include "mthvac_stdio.h"
+#include "mthvac_mmap.h"
 #include "hvac_logging.h"
 #include "execinfo.h"
 
@@ -51,167 +60,328 @@ struct Stats pread_stats = {0, 0.0};
 bool verbose = 0;
 // ! Global variables for tracking time
 
-/* fopen wrapper */
-// FILE *WRAP_DECL(fopen)(const char *path, const char *mode)
-// {
+/* Everything after a successful real open: start tracking the fd and
+ * account the time. Shared by the whole open family. */
+static void hvac_wrap_opened(const char *pathname, int flags, int fd, const struct timespec *start)
+{
+	struct timespec end;
 
-// 	MAP_OR_FAIL(fopen);
-// 	if (g_disable_redirect || tl_disable_redirect) return __real_fopen( path, mode);
+	// C++ code determines whether to track
+	if (hvac_track_file(pathname, flags, fd))
+	{
+		// ! Begin Open delta time 
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double delta;
+		if(end.tv_nsec > start->tv_nsec) {
+			delta = (end.tv_sec - start->tv_sec)  + (end.tv_nsec - start->tv_nsec) / 1e9;
+		}
+		else{
+			delta = (end.tv_sec - start->tv_sec) - 1  + ((end.tv_nsec - start->tv_nsec) + 1000000000) / 1e9;
+		}
+		open_stats.count++;
+		open_stats.total_time += delta;
 
-// 	FILE *ptr = __real_fopen(path,mode);
+		// ! End Open delta time
 
-// 	if (ptr != NULL)
-// 	{
-// 		if (hvac_track_file(path, O_RDONLY, fileno(ptr)))
-// 		{
-// 			L4C_INFO("FOpen: Tracking File %s",path);
-// 		}
-// 	}	
-	
-// 	return ptr;
-// }
+		L4C_INFO("Open: Tracking File %s",pathname);
+	}else
+	{
+		// ! Begin Open delta time
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double delta;
+		if(end.tv_nsec > start->tv_nsec) {
+			delta = (end.tv_sec - start->tv_sec)  + (end.tv_nsec - start->tv_nsec) / 1e9;
+		}
+		else{
+			delta = (end.tv_sec - start->tv_sec) - 1  + ((end.tv_nsec - start->tv_nsec) + 1000000000) / 1e9;
+		}
+		if(verbose)
+			printf("DEBUG_HU: HVAC: Tracked Open fd %d from pathname %s, delta: %.8f\n", fd, pathname, delta);
+		fflush(stdout);
+
+		if (strstr(pathname, "/lustre/orion/gen008/proj-shared/ghu4/data/cosmoUniverse")) {
+			open_data_stats.count++;
+			open_data_stats.total_time += delta;
+		} else {
+			open_system_stats.count++;
+			open_system_stats.total_time += delta;
+		}
+		// ! End Open delta time
+	}
+}
 
+/* openat() names a file relative to a directory fd. Tracking wants a
+ * path, so rebuild one through /proc for the dirfd relative case. */
+static const char *hvac_at_path(int dirfd, const char *pathname, char *buf, size_t len)
+{
+	char link[64];
+	ssize_t n;
+
+	if (pathname[0] == '/' || dirfd == AT_FDCWD)
+		return pathname;
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+	n = readlink(link, buf, len - 1);
+	if (n <= 0 || (size_t)n + 1 + strlen(pathname) >= len)
+		return NULL;
+	buf[n] = '/';
+	strcpy(buf + n + 1, pathname);
+	return buf;
+}
 
-/* fopen wrapper */
-// FILE *WRAP_DECL(fopen64)(const char *path, const char *mode)
-// {
+static void hvac_wrap_opened_at(int dirfd, const char *pathname, int flags, int fd, const struct timespec *start)
+{
+	char buf[PATH_MAX];
+	const char *path = hvac_at_path(dirfd, pathname, buf, sizeof(buf));
 
-// 	MAP_OR_FAIL(fopen64);
-// 	if (g_disable_redirect || tl_disable_redirect) return __real_fopen64( path, mode);
+	if (path)
+		hvac_wrap_opened(path, flags, fd, start);
+}
 
-// 	FILE *ptr = __real_fopen64(path,mode);
+/* An open that may create, truncate or write a file makes the metadata
+ * snapshot of its directory stale, see mthvac_meta.h */
+static void hvac_wrap_opening(int dirfd, const char *pathname, int flags)
+{
+	char buf[PATH_MAX];
+	const char *path;
 
-// 	if (ptr != NULL)
-// 	{
-// 		if (hvac_track_file(path, O_RDONLY, fileno(ptr)))
-// 		{
-// 			L4C_INFO("FOpen64: Tracking File %s",path);
-// 		}
-// 	}	
-	
-// 	return ptr;
-// }
+	if ((flags & O_ACCMODE) == O_RDONLY && !(flags & (O_CREAT | O_TRUNC)))
+		return;
+	path = hvac_at_path(dirfd, pathname, buf, sizeof(buf));
+	if (path)
+		hvac_meta_invalidate(path);
+}
+
+/* O_CREAT and O_TMPFILE carry a mode. O_TMPFILE includes O_DIRECTORY, so
+ * it has to be matched whole or every O_DIRECTORY open would read one */
+#define HVAC_OPEN_MODE(flags, mode) \
+	do { \
+		if (((flags) & O_CREAT) || ((flags) & O_TMPFILE) == O_TMPFILE) { \
+			va_list ap; \
+			va_start(ap, flags); \
+			mode = va_arg(ap, int); \
+			va_end(ap); \
+		} \
+	} while (0)
 
 int WRAP_DECL(open)(const char *pathname, int flags, ...)
 {
 	// ! Begin Open delta time
-	struct timespec start, end;
+	struct timespec start;
     clock_gettime(CLOCK_MONOTONIC, &start);
 	// ! End Open delta time
 	int ret = 0;
-	va_list ap;
 	int mode = 0;
 
-
-	if (flags & O_CREAT)
-	{
-		va_start(ap, flags);
-		mode = va_arg(ap, int);
-		va_end(ap);
-	}
+	HVAC_OPEN_MODE(flags, mode);
 
 	MAP_OR_FAIL(open);
 	if (g_disable_redirect || tl_disable_redirect) return __real_open(pathname, flags, mode);
 
+	hvac_wrap_opening(AT_FDCWD, pathname, flags);
+
 	/* For now pass the open to GPFS  - I think the open is cheap
 	 * possibly asychronous.
 	 * If this impedes performance we can investigate a cheap way of generating
 	 * an FD
 	 */
 	ret = __real_open(pathname, flags, mode);
-
-	// C++ code determines whether to track
-	if (ret != -1){
-		if (hvac_track_file(pathname, flags, ret))
-		{
-			// ! Begin Open delta time 
-			clock_gettime(CLOCK_MONOTONIC, &end);
-			double delta;
-			if(end.tv_nsec > start.tv_nsec) {
-				delta = (end.tv_sec - start.tv_sec)  + (end.tv_nsec - start.tv_nsec) / 1e9;
-			}
-			else{
-				delta = (end.tv_sec - start.tv_sec) - 1  + ((end.tv_nsec - start.tv_nsec) + 1000000000) / 1e9;
-			}
-			open_stats.count++;
-    		open_stats.total_time += delta;
-
-			// ! End Open delta time
-
-			L4C_INFO("Open: Tracking File %s",pathname);
-		}else
-		{
-			// ret = __real_open(pathname, flags, mode);
-			// ! Begin Open delta time
-			clock_gettime(CLOCK_MONOTONIC, &end);
-			double delta;
-			if(end.tv_nsec > start.tv_nsec) {
-				delta = (end.tv_sec - start.tv_sec)  + (end.tv_nsec - start.tv_nsec) / 1e9;
-			}
-			else{
-				delta = (end.tv_sec - start.tv_sec) - 1  + ((end.tv_nsec - start.tv_nsec) + 1000000000) / 1e9;
-			}
-			if(verbose)
-				printf("DEBUG_HU: HVAC: Tracked Open fd %d from pathname %s, delta: %.8f\n", ret, pathname, delta);
-			fflush(stdout);
-
-			if (strstr(pathname, "/lustre/orion/gen008/proj-shared/ghu4/data/cosmoUniverse")) {
-				open_data_stats.count++;
-				open_data_stats.total_time += delta;
-			} else {
-				open_system_stats.count++;
-				open_system_stats.total_time += delta;
-        	}
-			// ! End Open delta time
-		}
-	}
+	if (ret != -1)
+		hvac_wrap_opened(pathname, flags, ret, &start);
 	
 	return ret;
 }
 
-// int WRAP_DECL(open64)(const char *pathname, int flags, ...)
-// {
-// 	int ret = 0;
-// 	va_list ap;
-// 	int mode = 0;
+int WRAP_DECL(open64)(const char *pathname, int flags, ...)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int ret = 0;
+	int mode = 0;
 
+	HVAC_OPEN_MODE(flags, mode);
 
-// 	if (flags & O_CREAT)
-// 	{
-// 		va_start(ap, flags);
-// 		mode = va_arg(ap, int);
-// 		va_end(ap);
-// 	}
+	MAP_OR_FAIL(open64);
+	if (g_disable_redirect || tl_disable_redirect) return __real_open64(pathname, flags, mode);
+
+	hvac_wrap_opening(AT_FDCWD, pathname, flags);
 
+	ret = __real_open64(pathname, flags, mode);
+	if (ret != -1)
+		hvac_wrap_opened(pathname, flags, ret, &start);
+	return ret;
+}
 
-// 	MAP_OR_FAIL(open64);
-// 	if (g_disable_redirect || tl_disable_redirect) return __real_open64(pathname, flags, mode);	
+int WRAP_DECL(openat)(int dirfd, const char *pathname, int flags, ...)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int ret = 0;
+	int mode = 0;
 
+	HVAC_OPEN_MODE(flags, mode);
 
-// 	if (mode)
-// 	{
-// 		ret = __real_open64(pathname, flags, mode);
-// 	}
-// 	else
-// 	{
-// 		ret = __real_open64(pathname, flags);
-// 	}
+	MAP_OR_FAIL(openat);
+	if (g_disable_redirect || tl_disable_redirect) return __real_openat(dirfd, pathname, flags, mode);
 
+	hvac_wrap_opening(dirfd, pathname, flags);
 
-// 	if (ret != -1)
-// 	{
-// 		if (hvac_track_file(pathname, flags, ret))
-// 		{
-// 			L4C_INFO("Open64: Tracking file %s",pathname);
-// 		}
-// 	}
+	ret = __real_openat(dirfd, pathname, flags, mode);
+	if (ret != -1)
+		hvac_wrap_opened_at(dirfd, pathname, flags, ret, &start);
+	return ret;
+}
 
-	
-// 	return ret;
+int WRAP_DECL(openat64)(int dirfd, const char *pathname, int flags, ...)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int ret = 0;
+	int mode = 0;
 
-// }
+	HVAC_OPEN_MODE(flags, mode);
 
+	MAP_OR_FAIL(openat64);
+	if (g_disable_redirect || tl_disable_redirect) return __real_openat64(dirfd, pathname, flags, mode);
 
+	hvac_wrap_opening(dirfd, pathname, flags);
+
+	ret = __real_openat64(dirfd, pathname, flags, mode);
+	if (ret != -1)
+		hvac_wrap_opened_at(dirfd, pathname, flags, ret, &start);
+	return ret;
+}
+
+/* _FORTIFY_SOURCE builds call these when the flags need no mode */
+int WRAP_DECL(__open_2)(const char *pathname, int flags)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int ret;
+
+	MAP_OR_FAIL(__open_2);
+	if (g_disable_redirect || tl_disable_redirect) return __real___open_2(pathname, flags);
+
+	hvac_wrap_opening(AT_FDCWD, pathname, flags);
+
+	ret = __real___open_2(pathname, flags);
+	if (ret != -1)
+		hvac_wrap_opened(pathname, flags, ret, &start);
+	return ret;
+}
+
+int WRAP_DECL(__open64_2)(const char *pathname, int flags)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int ret;
+
+	MAP_OR_FAIL(__open64_2);
+	if (g_disable_redirect || tl_disable_redirect) return __real___open64_2(pathname, flags);
+
+	hvac_wrap_opening(AT_FDCWD, pathname, flags);
+
+	ret = __real___open64_2(pathname, flags);
+	if (ret != -1)
+		hvac_wrap_opened(pathname, flags, ret, &start);
+	return ret;
+}
+
+int WRAP_DECL(__openat_2)(int dirfd, const char *pathname, int flags)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int ret;
+
+	MAP_OR_FAIL(__openat_2);
+	if (g_disable_redirect || tl_disable_redirect) return __real___openat_2(dirfd, pathname, flags);
+
+	hvac_wrap_opening(dirfd, pathname, flags);
+
+	ret = __real___openat_2(dirfd, pathname, flags);
+	if (ret != -1)
+		hvac_wrap_opened_at(dirfd, pathname, flags, ret, &start);
+	return ret;
+}
+
+int WRAP_DECL(__openat64_2)(int dirfd, const char *pathname, int flags)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int ret;
+
+	MAP_OR_FAIL(__openat64_2);
+	if (g_disable_redirect || tl_disable_redirect) return __real___openat64_2(dirfd, pathname, flags);
+
+	hvac_wrap_opening(dirfd, pathname, flags);
+
+	ret = __real___openat64_2(dirfd, pathname, flags);
+	if (ret != -1)
+		hvac_wrap_opened_at(dirfd, pathname, flags, ret, &start);
+	return ret;
+}
+
+/* fopen wrapper - read only streams on cached files become HVAC streams,
+ * see mthvac_stdio.h */
+FILE *WRAP_DECL(fopen)(const char *path, const char *mode)
+{
+	FILE *fp;
+	int handled;
+
+	MAP_OR_FAIL(fopen);
+	if (g_disable_redirect || tl_disable_redirect) return __real_fopen(path, mode);
+
+	if (mode[0] != 'r' || strchr(mode, '+'))
+		hvac_meta_invalidate(path);
+
+	fp = hvac_stdio_fopen(path, mode, &handled);
+	return handled ? fp : __real_fopen(path, mode);
+}
+
+FILE *WRAP_DECL(fopen64)(const char *path, const char *mode)
+{
+	FILE *fp;
+	int handled;
+
+	MAP_OR_FAIL(fopen64);
+	if (g_disable_redirect || tl_disable_redirect) return __real_fopen64(path, mode);
+
+	if (mode[0] != 'r' || strchr(mode, '+'))
+		hvac_meta_invalidate(path);
+
+	fp = hvac_stdio_fopen(path, mode, &handled);
+	return handled ? fp : __real_fopen64(path, mode);
+}
+
+int WRAP_DECL(fclose)(FILE *fp)
+{
+	int ret;
+	void *buffer;
+
+	MAP_OR_FAIL(fclose);
+	// Not behind the redirect check, our streams stay ours to clean up
+	buffer = hvac_stdio_forget(fp);
+	ret = __real_fclose(fp);
+	free(buffer);
+	return ret;
+}
+
+int WRAP_DECL(fileno)(FILE *fp)
+{
+	int fd;
+
+	MAP_OR_FAIL(fileno);
+	fd = hvac_stdio_fileno(fp);
+	return fd >= 0 ? fd : __real_fileno(fp);
+}
+
+int WRAP_DECL(fileno_unlocked)(FILE *fp)
+{
+	int fd;
+
+	MAP_OR_FAIL(fileno_unlocked);
+	fd = hvac_stdio_fileno(fp);
+	return fd >= 0 ? fd : __real_fileno_unlocked(fp);
+}
 
 int WRAP_DECL(close)(int fd)
 {
@@ -225,10 +395,12 @@ int WRAP_DECL(close)(int fd)
 	MAP_OR_FAIL(close);
 	if (g_disable_redirect || tl_disable_redirect) return __real_close(fd);
 
-	const char *path = hvac_get_path(fd);
-	if (path)
+	// Untracked fds, the common case, don't pay for a copy of the path
+	if (hvac_file_tracked(fd))
 	{
-		L4C_INFO("Close to file %s",path);
+		const char *path = hvac_get_path(fd);
+		if (path)
+			L4C_INFO("Close to file %s",path);
 		hvac_remove_fd(fd);
 	}
 
@@ -270,8 +442,9 @@ ssize_t WRAP_DECL(read)(int fd, void *buf, size_t count)
 	
 	//remove me
     MAP_OR_FAIL(read);	
-	
-    const char *path = hvac_get_path(fd);
+	// Same gate as lseek, the two must agree on whose position to use
+	if (g_disable_redirect || tl_disable_redirect) return __real_read(fd, buf, count);
+
 /*	
 	if (fd == 0 || fd == 1 || fd == 2)
 	{
@@ -279,16 +452,25 @@ ssize_t WRAP_DECL(read)(int fd, void *buf, size_t count)
 		return ret;
 	}
 */	
-	ret = hvac_remote_read(fd,buf,count);
-
-	if (path)
+	if (!hvac_file_tracked(fd))
 	{
-		L4C_INFO("Read to file %s of size %ld returning %ld bytes",path,count,ret);
+		ret = __real_read(fd,buf,count);
 	}
-	
-	if (ret == -1)
+	else if ((ret = hvac_remote_read(fd,buf,count)) != -1)
+	{
+		const char *path = hvac_get_path(fd);
+		if (path)
+			L4C_INFO("Read to file %s of size %ld returning %ld bytes",path,count,ret);
+	}
+	else
 	{
-		ret = __real_read(fd,buf,count);	
+		/* The local fd's own position is never moved, read the PFS at
+		 * the client side position instead */
+		MAP_OR_FAIL(pread);
+		off_t pos = hvac_file_offset(fd);
+		ret = __real_pread(fd,buf,count,pos);
+		if (ret > 0)
+			hvac_file_set_offset(fd, pos + ret);
 	}
 	
 	// ! Begin Read delta time
@@ -326,12 +508,11 @@ ssize_t WRAP_DECL(pread)(int fd, void *buf, size_t count, off_t offset)
 		return ret;
 	}
 	*/
-	const char *path = hvac_get_path(fd);
-	
 	//ret = hvac_remote_pread(fd, buf, count, offset);
 	
-	if (path)
+	if (hvac_file_tracked(fd))
 	{                
+		const char *path = hvac_get_path(fd);
 		L4C_INFO("pread to tracked file %s",path);
 		ret = hvac_remote_pread(fd, buf, count, offset);
 		if (ret == -1)
@@ -355,15 +536,15 @@ ssize_t WRAP_DECL(pread)(int fd, void *buf, size_t count, off_t offset)
 		pread_stats.count++;
     	pread_stats.total_time += delta;
 		// ! End pread delta time
+
+		if (ret == -1)
+			fprintf(stderr, "Pread Error for path %s and FD %d\n", path, fd);
 	}
 	else
 	{
 		ret = __real_pread(fd,buf,count,offset);
-	}
-	
-	if (ret == -1)
-	{
-		fprintf(stderr, "Pread Error for path %s and FD %d\n", path, fd);
+		if (ret == -1)
+			fprintf(stderr, "Pread Error for FD %d\n", fd);
 	}
 	return ret;
 }
@@ -400,54 +581,581 @@ ssize_t WRAP_DECL(pread)(int fd, void *buf, size_t count, off_t offset)
 // 	return __real_write(fd, buf, count);
 // }
 
-// off_t WRAP_DECL(lseek)(int fd, off_t offset, int whence)
-// {
-// 	MAP_OR_FAIL(lseek);
-// 	if (g_disable_redirect || tl_disable_redirect) return __real_lseek(fd,offset,whence);
+/* Tracked fds keep their position on the client, see hvac_tracked_lseek.
+ * With redirection off read() uses the kernel position, so lseek must too */
+off_t WRAP_DECL(lseek)(int fd, off_t offset, int whence)
+{
+	MAP_OR_FAIL(lseek);
+	if (!g_disable_redirect && !tl_disable_redirect && hvac_file_tracked(fd))
+		return hvac_tracked_lseek(fd, offset, whence);
+	return __real_lseek(fd, offset, whence);
+}
 
-// 	if (hvac_file_tracked(fd)){
-// 		L4C_INFO("Got an LSEEK on a tracked file %d %ld\n", fd, offset);	
-// 		return hvac_remote_lseek(fd,offset,whence);
-// 	}
-// 	return __real_lseek(fd, offset, whence);
-// }
+off64_t WRAP_DECL(lseek64)(int fd, off64_t offset, int whence)
+{
+	MAP_OR_FAIL(lseek64);
+	if (!g_disable_redirect && !tl_disable_redirect && hvac_file_tracked(fd)) {
+		MAP_OR_FAIL(lseek);
+		return hvac_tracked_lseek(fd, offset, whence);
+	}
+	return __real_lseek64(fd, offset, whence);
+}
 
-// off64_t WRAP_DECL(lseek64)(int fd, off64_t offset, int whence)
-// {
-// 	MAP_OR_FAIL(lseek64);
-// 	if (g_disable_redirect || tl_disable_redirect) return __real_lseek64(fd,offset,whence);
-// 	if (hvac_file_tracked(fd)){
-// 		L4C_INFO("Got an LSEEK64 on a tracked file %d %ld\n", fd, offset);	
-// 		return hvac_remote_lseek(fd,offset,whence);
-// 	}
-// 	return __real_lseek64(fd, offset, whence);
-// }
+/* Reads on a tracked fd never move its kernel position. Bring it up to
+ * date before the open file description is shared with code that reads
+ * through the kernel: a dup() copy, which isn't tracked, or a forked
+ * child. Same gate as lseek, which decides whose position counts. */
+void hvac_sync_kernel_offset(int fd)
+{
+	MAP_OR_FAIL(lseek);
+	if (!g_disable_redirect && !tl_disable_redirect && hvac_file_tracked(fd))
+		__real_lseek(fd, hvac_file_offset(fd), SEEK_SET);
+}
 
-// ssize_t WRAP_DECL(readv)(int fd, const struct iovec *iov, int iovcnt)
-// {
-// 	MAP_OR_FAIL(readv);
-// 	const char *path = hvac_get_path(fd);
-// 	if (path)
-// 	{
-// 		L4C_INFO("Readv to tracked file %s",path);
-// 	}
+/* dup2 / dup3 onto a tracked fd close it first, untrack it like close().
+ * Its position goes to the kernel too, should the dup fail and leave it
+ * open as a plain PFS fd. */
+static void hvac_dup_over(int oldfd, int newfd)
+{
+	hvac_sync_kernel_offset(oldfd);
+	if (newfd != oldfd && !g_disable_redirect && !tl_disable_redirect && hvac_file_tracked(newfd)) {
+		hvac_sync_kernel_offset(newfd);
+		hvac_remove_fd(newfd);
+	}
+}
+
+int WRAP_DECL(dup)(int oldfd)
+{
+	MAP_OR_FAIL(dup);
+	hvac_sync_kernel_offset(oldfd);
+	return __real_dup(oldfd);
+}
 
-// 	return __real_readv(fd, iov, iovcnt);
+int WRAP_DECL(dup2)(int oldfd, int newfd)
+{
+	MAP_OR_FAIL(dup2);
+	hvac_dup_over(oldfd, newfd);
+	return __real_dup2(oldfd, newfd);
+}
 
-// }
-/*
-   void* WRAP_DECL(mmap)(void *addr, ssize_t length, int prot, int flags, int fd, off_t offset)
-   {
-   MAP_OR_FAIL(mmap);
-   if (path)
-   {
-   L4C_INFO("MMAP to tracked file %s Length %ld Offset %ld",path, length, offset);
-   }
+int WRAP_DECL(dup3)(int oldfd, int newfd, int flags)
+{
+	MAP_OR_FAIL(dup3);
+	hvac_dup_over(oldfd, newfd);
+	return __real_dup3(oldfd, newfd, flags);
+}
+
+/* Every fcntl() argument is an int or a pointer, passed on as a word */
+int WRAP_DECL(fcntl)(int fd, int cmd, ...)
+{
+	va_list ap;
+	void *arg;
+
+	MAP_OR_FAIL(fcntl);
+	va_start(ap, cmd);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+	if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)
+		hvac_sync_kernel_offset(fd);
+	return __real_fcntl(fd, cmd, arg);
+}
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 28)
+// What fcntl() resolves to in code built with _FILE_OFFSET_BITS=64
+int WRAP_DECL(fcntl64)(int fd, int cmd, ...)
+{
+	va_list ap;
+	void *arg;
+
+	MAP_OR_FAIL(fcntl64);
+	va_start(ap, cmd);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+	if (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC)
+		hvac_sync_kernel_offset(fd);
+	return __real_fcntl64(fd, cmd, arg);
+}
+#endif
 
-   return __real_mmap(addr,length, prot, flags, fd, offset);
+/* Fallback for readv / preadv2 at the file position of a tracked fd */
+static ssize_t hvac_fallback_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	MAP_OR_FAIL(preadv);
+	off_t pos = hvac_file_offset(fd);
+	ssize_t ret = __real_preadv(fd, iov, iovcnt, pos);
+	if (ret > 0)
+		hvac_file_set_offset(fd, pos + ret);
+	return ret;
+}
 
-   }
-   */
+/* Vectored reads on tracked fds go out as a single RPC */
+ssize_t WRAP_DECL(readv)(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t ret = -1;
+	MAP_OR_FAIL(readv);
+	if (g_disable_redirect || tl_disable_redirect) return __real_readv(fd, iov, iovcnt);
+
+	const char *path = hvac_get_path(fd);
+	if (path)
+	{
+		L4C_INFO("Readv to tracked file %s",path);
+		ret = hvac_remote_preadv(fd, iov, iovcnt, -1);
+	}
+	if (ret == -1 && path)
+	{
+		ret = hvac_fallback_readv(fd, iov, iovcnt);
+	}
+	else if (ret == -1)
+	{
+		ret = __real_readv(fd, iov, iovcnt);
+	}
+	return ret;
+}
+
+ssize_t WRAP_DECL(preadv)(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t ret = -1;
+	MAP_OR_FAIL(preadv);
+	if (g_disable_redirect || tl_disable_redirect) return __real_preadv(fd, iov, iovcnt, offset);
+
+	const char *path = hvac_get_path(fd);
+	if (path && offset >= 0)
+	{
+		L4C_INFO("Preadv to tracked file %s",path);
+		ret = hvac_remote_preadv(fd, iov, iovcnt, offset);
+	}
+	if (ret == -1)
+	{
+		ret = __real_preadv(fd, iov, iovcnt, offset);
+	}
+	return ret;
+}
+
+/* offset -1 means the file position. Flags (RWF_NOWAIT, RWF_HIPRI, ...)
+ * change how the read may behave, which an RPC can't honour, so reads
+ * with flags go to the real call at the position the client keeps. */
+ssize_t WRAP_DECL(preadv2)(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags)
+{
+	ssize_t ret = -1;
+	MAP_OR_FAIL(preadv2);
+	if (g_disable_redirect || tl_disable_redirect) return __real_preadv2(fd, iov, iovcnt, offset, flags);
+
+	const char *path = hvac_get_path(fd);
+	if (path && flags != 0)
+	{
+		off_t pos = (offset == -1) ? hvac_file_offset(fd) : offset;
+		ret = __real_preadv2(fd, iov, iovcnt, pos, flags);
+		if (offset == -1 && ret > 0)
+			hvac_file_set_offset(fd, pos + ret);
+		return ret;
+	}
+	if (path && offset >= -1)
+	{
+		L4C_INFO("Preadv2 to tracked file %s",path);
+		ret = hvac_remote_preadv(fd, iov, iovcnt, offset);
+	}
+	if (ret == -1 && path && offset == -1)
+	{
+		ret = hvac_fallback_readv(fd, iov, iovcnt);
+	}
+	else if (ret == -1)
+	{
+		ret = __real_preadv2(fd, iov, iovcnt, offset, flags);
+	}
+	return ret;
+}
+
+/* Metadata wrappers. Lookups in the data dir are answered from the
+ * directory snapshots in mthvac_meta.cpp, anything the cache can't answer
+ * (other paths, dirfd relative lookups, symlinks) goes to the real call. */
+#ifdef __GLIBC__
+_Static_assert(sizeof(struct stat) == sizeof(struct stat64), "stat64 differs from stat");
+#endif
+
+static int hvac_stat_at(int dirfd, const char *path, struct stat *buf, int flags)
+{
+	if (g_disable_redirect || tl_disable_redirect || path == NULL)
+		return HVAC_META_MISS;
+	if ((flags & AT_EMPTY_PATH) && path[0] == '\0')
+		return hvac_meta_fstat(dirfd, buf);
+	if (path[0] != '/' && dirfd != AT_FDCWD)
+		return HVAC_META_MISS;
+	return hvac_meta_stat(path, buf, !(flags & AT_SYMLINK_NOFOLLOW));
+}
+
+static int hvac_stat_fd(int fd, struct stat *buf)
+{
+	if (g_disable_redirect || tl_disable_redirect)
+		return HVAC_META_MISS;
+	return hvac_meta_fstat(fd, buf);
+}
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 33)
+
+int WRAP_DECL(__xstat)(int ver, const char *path, struct stat *buf)
+{
+	MAP_OR_FAIL(__xstat);
+	int ret = hvac_stat_at(AT_FDCWD, path, buf, 0);
+	return ret != HVAC_META_MISS ? ret : __real___xstat(ver, path, buf);
+}
+
+int WRAP_DECL(__lxstat)(int ver, const char *path, struct stat *buf)
+{
+	MAP_OR_FAIL(__lxstat);
+	int ret = hvac_stat_at(AT_FDCWD, path, buf, AT_SYMLINK_NOFOLLOW);
+	return ret != HVAC_META_MISS ? ret : __real___lxstat(ver, path, buf);
+}
+
+int WRAP_DECL(__fxstat)(int ver, int fd, struct stat *buf)
+{
+	MAP_OR_FAIL(__fxstat);
+	int ret = hvac_stat_fd(fd, buf);
+	return ret != HVAC_META_MISS ? ret : __real___fxstat(ver, fd, buf);
+}
+
+int WRAP_DECL(__fxstatat)(int ver, int dirfd, const char *path, struct stat *buf, int flags)
+{
+	MAP_OR_FAIL(__fxstatat);
+	int ret = hvac_stat_at(dirfd, path, buf, flags);
+	return ret != HVAC_META_MISS ? ret : __real___fxstatat(ver, dirfd, path, buf, flags);
+}
+
+int WRAP_DECL(__xstat64)(int ver, const char *path, struct stat64 *buf)
+{
+	MAP_OR_FAIL(__xstat64);
+	int ret = hvac_stat_at(AT_FDCWD, path, (struct stat *)buf, 0);
+	return ret != HVAC_META_MISS ? ret : __real___xstat64(ver, path, buf);
+}
+
+int WRAP_DECL(__lxstat64)(int ver, const char *path, struct stat64 *buf)
+{
+	MAP_OR_FAIL(__lxstat64);
+	int ret = hvac_stat_at(AT_FDCWD, path, (struct stat *)buf, AT_SYMLINK_NOFOLLOW);
+	return ret != HVAC_META_MISS ? ret : __real___lxstat64(ver, path, buf);
+}
+
+int WRAP_DECL(__fxstat64)(int ver, int fd, struct stat64 *buf)
+{
+	MAP_OR_FAIL(__fxstat64);
+	int ret = hvac_stat_fd(fd, (struct stat *)buf);
+	return ret != HVAC_META_MISS ? ret : __real___fxstat64(ver, fd, buf);
+}
+
+int WRAP_DECL(__fxstatat64)(int ver, int dirfd, const char *path, struct stat64 *buf, int flags)
+{
+	MAP_OR_FAIL(__fxstatat64);
+	int ret = hvac_stat_at(dirfd, path, (struct stat *)buf, flags);
+	return ret != HVAC_META_MISS ? ret : __real___fxstatat64(ver, dirfd, path, buf, flags);
+}
+
+#else
+
+int WRAP_DECL(stat)(const char *path, struct stat *buf)
+{
+	MAP_OR_FAIL(stat);
+	int ret = hvac_stat_at(AT_FDCWD, path, buf, 0);
+	return ret != HVAC_META_MISS ? ret : __real_stat(path, buf);
+}
+
+int WRAP_DECL(lstat)(const char *path, struct stat *buf)
+{
+	MAP_OR_FAIL(lstat);
+	int ret = hvac_stat_at(AT_FDCWD, path, buf, AT_SYMLINK_NOFOLLOW);
+	return ret != HVAC_META_MISS ? ret : __real_lstat(path, buf);
+}
+
+int WRAP_DECL(fstat)(int fd, struct stat *buf)
+{
+	MAP_OR_FAIL(fstat);
+	int ret = hvac_stat_fd(fd, buf);
+	return ret != HVAC_META_MISS ? ret : __real_fstat(fd, buf);
+}
+
+int WRAP_DECL(fstatat)(int dirfd, const char *path, struct stat *buf, int flags)
+{
+	MAP_OR_FAIL(fstatat);
+	int ret = hvac_stat_at(dirfd, path, buf, flags);
+	return ret != HVAC_META_MISS ? ret : __real_fstatat(dirfd, path, buf, flags);
+}
+
+int WRAP_DECL(stat64)(const char *path, struct stat64 *buf)
+{
+	MAP_OR_FAIL(stat64);
+	int ret = hvac_stat_at(AT_FDCWD, path, (struct stat *)buf, 0);
+	return ret != HVAC_META_MISS ? ret : __real_stat64(path, buf);
+}
+
+int WRAP_DECL(lstat64)(const char *path, struct stat64 *buf)
+{
+	MAP_OR_FAIL(lstat64);
+	int ret = hvac_stat_at(AT_FDCWD, path, (struct stat *)buf, AT_SYMLINK_NOFOLLOW);
+	return ret != HVAC_META_MISS ? ret : __real_lstat64(path, buf);
+}
+
+int WRAP_DECL(fstat64)(int fd, struct stat64 *buf)
+{
+	MAP_OR_FAIL(fstat64);
+	int ret = hvac_stat_fd(fd, (struct stat *)buf);
+	return ret != HVAC_META_MISS ? ret : __real_fstat64(fd, buf);
+}
+
+int WRAP_DECL(fstatat64)(int dirfd, const char *path, struct stat64 *buf, int flags)
+{
+	MAP_OR_FAIL(fstatat64);
+	int ret = hvac_stat_at(dirfd, path, (struct stat *)buf, flags);
+	return ret != HVAC_META_MISS ? ret : __real_fstatat64(dirfd, path, buf, flags);
+}
+
+#endif
+
+/* statx may return less than the mask asked for, so the basic stats from
+ * the snapshot are a complete answer */
+int WRAP_DECL(statx)(int dirfd, const char *path, int flags, unsigned int mask, struct statx *buf)
+{
+	struct stat st;
+	MAP_OR_FAIL(statx);
+	int ret = hvac_stat_at(dirfd, path, &st, flags);
+	if (ret == HVAC_META_MISS)
+		return __real_statx(dirfd, path, flags, mask, buf);
+	if (ret != 0)
+		return ret;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->stx_mask = STATX_BASIC_STATS;
+	buf->stx_blksize = st.st_blksize;
+	buf->stx_nlink = st.st_nlink;
+	buf->stx_uid = st.st_uid;
+	buf->stx_gid = st.st_gid;
+	buf->stx_mode = st.st_mode;
+	buf->stx_ino = st.st_ino;
+	buf->stx_size = st.st_size;
+	buf->stx_blocks = st.st_blocks;
+	buf->stx_atime.tv_sec = st.st_atim.tv_sec;
+	buf->stx_atime.tv_nsec = st.st_atim.tv_nsec;
+	buf->stx_mtime.tv_sec = st.st_mtim.tv_sec;
+	buf->stx_mtime.tv_nsec = st.st_mtim.tv_nsec;
+	buf->stx_ctime.tv_sec = st.st_ctim.tv_sec;
+	buf->stx_ctime.tv_nsec = st.st_ctim.tv_nsec;
+	buf->stx_rdev_major = major(st.st_rdev);
+	buf->stx_rdev_minor = minor(st.st_rdev);
+	buf->stx_dev_major = major(st.st_dev);
+	buf->stx_dev_minor = minor(st.st_dev);
+	return 0;
+}
+
+int WRAP_DECL(access)(const char *path, int mode)
+{
+	int ret = HVAC_META_MISS;
+	MAP_OR_FAIL(access);
+	if (!g_disable_redirect && !tl_disable_redirect && path)
+		ret = hvac_meta_access(path, mode);
+	return ret != HVAC_META_MISS ? ret : __real_access(path, mode);
+}
+
+/* AT_EACCESS wants the effective ids, the cache only checks the real ones */
+int WRAP_DECL(faccessat)(int dirfd, const char *path, int mode, int flags)
+{
+	int ret = HVAC_META_MISS;
+	MAP_OR_FAIL(faccessat);
+	if (!g_disable_redirect && !tl_disable_redirect && path && flags == 0 &&
+	    (path[0] == '/' || dirfd == AT_FDCWD))
+		ret = hvac_meta_access(path, mode);
+	return ret != HVAC_META_MISS ? ret : __real_faccessat(dirfd, path, mode, flags);
+}
+
+/* Namespace changes only drop the snapshots they touch, the change itself
+ * always goes to the PFS */
+int WRAP_DECL(unlink)(const char *path)
+{
+	MAP_OR_FAIL(unlink);
+	if (!g_disable_redirect && !tl_disable_redirect)
+		hvac_meta_invalidate(path);
+	return __real_unlink(path);
+}
+
+int WRAP_DECL(unlinkat)(int dirfd, const char *path, int flags)
+{
+	char buf[PATH_MAX];
+	const char *full;
+
+	MAP_OR_FAIL(unlinkat);
+	if (!g_disable_redirect && !tl_disable_redirect &&
+	    (full = hvac_at_path(dirfd, path, buf, sizeof(buf))) != NULL)
+		hvac_meta_invalidate(full);
+	return __real_unlinkat(dirfd, path, flags);
+}
+
+int WRAP_DECL(rmdir)(const char *path)
+{
+	MAP_OR_FAIL(rmdir);
+	if (!g_disable_redirect && !tl_disable_redirect)
+		hvac_meta_invalidate(path);
+	return __real_rmdir(path);
+}
+
+int WRAP_DECL(mkdir)(const char *path, mode_t mode)
+{
+	MAP_OR_FAIL(mkdir);
+	if (!g_disable_redirect && !tl_disable_redirect)
+		hvac_meta_invalidate(path);
+	return __real_mkdir(path, mode);
+}
+
+int WRAP_DECL(rename)(const char *oldpath, const char *newpath)
+{
+	MAP_OR_FAIL(rename);
+	if (!g_disable_redirect && !tl_disable_redirect) {
+		hvac_meta_invalidate(oldpath);
+		hvac_meta_invalidate(newpath);
+	}
+	return __real_rename(oldpath, newpath);
+}
+
+int WRAP_DECL(renameat)(int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+	char buf[PATH_MAX];
+	const char *full;
+
+	MAP_OR_FAIL(renameat);
+	if (!g_disable_redirect && !tl_disable_redirect) {
+		if ((full = hvac_at_path(olddirfd, oldpath, buf, sizeof(buf))) != NULL)
+			hvac_meta_invalidate(full);
+		if ((full = hvac_at_path(newdirfd, newpath, buf, sizeof(buf))) != NULL)
+			hvac_meta_invalidate(full);
+	}
+	return __real_renameat(olddirfd, oldpath, newdirfd, newpath);
+}
+
+/* Directory wrappers. opendir() on a cached directory returns a stream
+ * over the server's snapshot; every other call checks whether it got one
+ * of those before going to libc. The check doesn't depend on redirection
+ * being on - a stream opened before shutdown is still ours to close. */
+DIR *WRAP_DECL(opendir)(const char *name)
+{
+	DIR *dirp = NULL;
+	MAP_OR_FAIL(opendir);
+	if (!g_disable_redirect && !tl_disable_redirect)
+		dirp = hvac_meta_opendir(name);
+	return dirp ? dirp : __real_opendir(name);
+}
+
+struct dirent *WRAP_DECL(readdir)(DIR *dirp)
+{
+	MAP_OR_FAIL(readdir);
+	if (hvac_meta_owns_dir(dirp))
+		return hvac_meta_readdir(dirp);
+	return __real_readdir(dirp);
+}
+
+struct dirent64 *WRAP_DECL(readdir64)(DIR *dirp)
+{
+	MAP_OR_FAIL(readdir64);
+	if (hvac_meta_owns_dir(dirp))
+		return hvac_meta_readdir64(dirp);
+	return __real_readdir64(dirp);
+}
+
+int WRAP_DECL(readdir_r)(DIR *dirp, struct dirent *entry, struct dirent **result)
+{
+	MAP_OR_FAIL(readdir_r);
+	if (hvac_meta_owns_dir(dirp)) {
+		struct dirent *ent = hvac_meta_readdir(dirp);
+		if (ent)
+			memcpy(entry, ent, sizeof(*entry));
+		*result = ent ? entry : NULL;
+		return 0;
+	}
+	return __real_readdir_r(dirp, entry, result);
+}
+
+int WRAP_DECL(readdir64_r)(DIR *dirp, struct dirent64 *entry, struct dirent64 **result)
+{
+	MAP_OR_FAIL(readdir64_r);
+	if (hvac_meta_owns_dir(dirp)) {
+		struct dirent64 *ent = hvac_meta_readdir64(dirp);
+		if (ent)
+			memcpy(entry, ent, sizeof(*entry));
+		*result = ent ? entry : NULL;
+		return 0;
+	}
+	return __real_readdir64_r(dirp, entry, result);
+}
+
+int WRAP_DECL(closedir)(DIR *dirp)
+{
+	MAP_OR_FAIL(closedir);
+	if (hvac_meta_owns_dir(dirp))
+		return hvac_meta_closedir(dirp);
+	return __real_closedir(dirp);
+}
+
+int WRAP_DECL(dirfd)(DIR *dirp)
+{
+	MAP_OR_FAIL(dirfd);
+	if (hvac_meta_owns_dir(dirp))
+		return hvac_meta_dirfd(dirp);
+	return __real_dirfd(dirp);
+}
+
+void WRAP_DECL(rewinddir)(DIR *dirp)
+{
+	MAP_OR_FAIL(rewinddir);
+	if (hvac_meta_owns_dir(dirp))
+		hvac_meta_rewinddir(dirp);
+	else
+		__real_rewinddir(dirp);
+}
+
+long WRAP_DECL(telldir)(DIR *dirp)
+{
+	MAP_OR_FAIL(telldir);
+	if (hvac_meta_owns_dir(dirp))
+		return hvac_meta_telldir(dirp);
+	return __real_telldir(dirp);
+}
+
+void WRAP_DECL(seekdir)(DIR *dirp, long loc)
+{
+	MAP_OR_FAIL(seekdir);
+	if (hvac_meta_owns_dir(dirp))
+		hvac_meta_seekdir(dirp, loc);
+	else
+		__real_seekdir(dirp, loc);
+}
+
+/* mmap of tracked files is backed by HVAC, see mthvac_mmap.h */
+void *WRAP_DECL(mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	void *p;
+	int handled;
+
+	MAP_OR_FAIL(mmap);
+	if (g_disable_redirect || tl_disable_redirect || fd < 0)
+		return __real_mmap(addr, length, prot, flags, fd, offset);
+
+	p = hvac_mmap(addr, length, prot, flags, fd, offset, &handled);
+	return handled ? p : __real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+void *WRAP_DECL(mmap64)(void *addr, size_t length, int prot, int flags, int fd, off64_t offset)
+{
+	void *p;
+	int handled;
+
+	MAP_OR_FAIL(mmap64);
+	if (g_disable_redirect || tl_disable_redirect || fd < 0)
+		return __real_mmap64(addr, length, prot, flags, fd, offset);
+
+	p = hvac_mmap(addr, length, prot, flags, fd, offset, &handled);
+	return handled ? p : __real_mmap64(addr, length, prot, flags, fd, offset);
+}
+
+int WRAP_DECL(munmap)(void *addr, size_t length)
+{
+	MAP_OR_FAIL(munmap);
+	hvac_munmap_notify(addr, length);
+	return __real_munmap(addr, length);
+}
 
 	void export_stats_to_file(const char *filename) {
         FILE *file = fopen(filename, "w");
@@ -496,38 +1204,6 @@ int WRAP_DECL(fdatasync)(int fd)
 	return __real_fdatasync(fd);
 }
 
-off_t WRAP_DECL(lseek)(int fd, off_t offset, int whence)
-{
-	MAP_OR_FAIL(lseek);
-	if (g_disable_redirect || tl_disable_redirect) return __real_lseek(fd,offset,whence);
-	L4C_INFO("Got a LSEEK --- Damnit\n");
-	return __real_lseek(fd, offset, whence);
-}
-
-off64_t WRAP_DECL(lseek64)(int fd, off64_t offset, int whence)
-{
-	MAP_OR_FAIL(lseek64);
-	if (g_disable_redirect || tl_disable_redirect) return __real_lseek64(fd,offset,whence);
-	if (hvac_file_tracked(fd))
-		L4C_INFO("Got an LSEEK64 on a tracked file %d %ld\n", fd, offset);
-	return __real_lseek64(fd, offset, whence);
-}
-
-/* fopen wrapper */
-FILE *WRAP_DECL(fopen)(const char *path, const char *mode)
-{
-
-	MAP_OR_FAIL(fopen);
-	if (g_disable_redirect || tl_disable_redirect) return __real_fopen( path, mode);
-
-
-	L4C_INFO("Intercepted Fopen %s",path);
-
-	return __real_fopen(path, mode);
-}
-
-
-
 bool check_open_mode(const int flags, bool ignore_check)
 {
 	//Always back out of RDONLY
@@ -541,26 +1217,6 @@ bool check_open_mode(const int flags, bool ignore_check)
 	return true;
 }
 
-/* Wrappers */
-int WRAP_DECL(fclose)(FILE *fp)
-{
-	int ret = 0;
-
-	/* RTLD Next fclose call */
-	MAP_OR_FAIL(fclose);
-
-	if (g_disable_redirect || tl_disable_redirect) return __real_fclose(fp);
-
-	if ((ret = __real_fclose(fp)) != 0)
-	{
-		L4C_PERROR("Error from fclose");
-		return ret;
-	}
-
-	return ret;
-}
-
-
 ssize_t WRAP_DECL(pwrite)(int fd, const void *buf, size_t count, off_t offset)
 {
 	MAP_OR_FAIL(pwrite);
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <semaphore.h>
+#include <atomic>
+
+#include "mthvac_completion.h"
+
+/* Round trip cost of the per-RPC completion handoff, old and new.
+ * A completer thread stands in for the Mercury progress thread: the
+ * caller builds a sync object, posts it, and waits for the completer to
+ * signal it - the part of every open / read / seek round trip that does
+ * not depend on the network. End to end numbers come from latency_bench
+ * against a running server.
+ *
+ * usage: completion_bench [iterations]
+ */
+
+struct cond_sync {
+    int done;
+    ssize_t result;
+    pthread_cond_t cond;
+    pthread_mutex_t mutex;
+};
+
+// The completer sleeps on a semaphore like the progress thread sleeps
+// in HG_Progress, so both schemes pay the same cost to post the request
+static std::atomic<void *> mailbox{nullptr};
+static sem_t posted;
+static std::atomic<bool> use_futex{false};
+static std::atomic<bool> stop{false};
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *completer(void *)
+{
+    while (!stop.load(std::memory_order_relaxed)) {
+        sem_wait(&posted);
+        void *p = mailbox.exchange(nullptr, std::memory_order_acquire);
+        if (p == nullptr)
+            continue;
+        if (use_futex.load(std::memory_order_relaxed)) {
+            hvac_completion_complete((struct hvac_completion *)p, 1);
+        } else {
+            struct cond_sync *s = (struct cond_sync *)p;
+            pthread_mutex_lock(&s->mutex);
+            s->done = 1;
+            s->result = 1;
+            pthread_cond_broadcast(&s->cond);
+            pthread_mutex_unlock(&s->mutex);
+        }
+    }
+    return NULL;
+}
+
+// Previous scheme: init / signal / wait / destroy a mutex + cond per op
+static double run_cond(long iters)
+{
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        struct cond_sync s;
+        s.done = 0;
+        pthread_cond_init(&s.cond, NULL);
+        pthread_mutex_init(&s.mutex, NULL);
+        mailbox.store(&s, std::memory_order_release);
+        sem_post(&posted);
+        pthread_mutex_lock(&s.mutex);
+        while (!s.done)
+            pthread_cond_wait(&s.cond, &s.mutex);
+        pthread_mutex_unlock(&s.mutex);
+        pthread_cond_destroy(&s.cond);
+        pthread_mutex_destroy(&s.mutex);
+    }
+    return (now_sec() - start) / iters;
+}
+
+static double run_futex(long iters)
+{
+    double start = now_sec();
+    for (long i = 0; i < iters; i++) {
+        struct hvac_completion *c = hvac_completion_get();
+        mailbox.store(c, std::memory_order_release);
+        sem_post(&posted);
+        hvac_completion_wait(c, 0);
+        hvac_completion_put(c);
+    }
+    return (now_sec() - start) / iters;
+}
+
+int main(int argc, char **argv)
+{
+    long iters = argc > 1 ? atol(argv[1]) : 200000;
+    pthread_t tid;
+
+    if (iters <= 0)
+        iters = 200000;
+    sem_init(&posted, 0, 0);
+    pthread_create(&tid, NULL, completer, NULL);
+
+    use_futex = false;
+    double cond_ns = run_cond(iters) * 1e9;
+    use_futex = true;
+    double futex_ns = run_futex(iters) * 1e9;
+
+    stop = true;
+    sem_post(&posted);
+    pthread_join(tid, NULL);
+
+    printf("iterations: %ld\n", iters);
+    printf("mutex/cond per op: %8.1f ns per round trip\n", cond_ns);
+    printf("futex completion:  %8.1f ns per round trip\n", futex_ns);
+    return 0;
+}
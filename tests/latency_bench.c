@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+
+/* Round trip latency of small preads on one tracked file.
+ *
+ * Run under the client library with a server on the same node, once per
+ * transport, e.g.
+ *   HVAC_NODE_LOCAL_SM=0 LD_PRELOAD=libhvac_client.so ./latency_bench $HVAC_DATA_DIR/file
+ *   HVAC_NODE_LOCAL_SM=1 LD_PRELOAD=libhvac_client.so ./latency_bench $HVAC_DATA_DIR/file
+ */
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <file> [iterations] [size]\n", argv[0]);
+        return 1;
+    }
+
+    int iterations = argc > 2 ? atoi(argv[2]) : 10000;
+    size_t size = argc > 3 ? strtoul(argv[3], NULL, 10) : 4096;
+    char *buffer = malloc(size);
+    uint64_t *samples = malloc(sizeof(uint64_t) * iterations);
+    uint64_t total = 0;
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Cannot open input file"); return 1;
+    }
+
+    /* Warm up - the first read also waits for the remote open */
+    for (int lcv = 0; lcv < 100; lcv++)
+        pread(fd, buffer, size, 0);
+
+    for (int lcv = 0; lcv < iterations; lcv++)
+    {
+        uint64_t start = now_ns();
+        if (pread(fd, buffer, size, 0) < 0)
+        {
+            perror("pread"); return 1;
+        }
+        samples[lcv] = now_ns() - start;
+        total += samples[lcv];
+    }
+    close(fd);
+
+    qsort(samples, iterations, sizeof(uint64_t), cmp_u64);
+    printf("%d x %zu byte pread: avg %.2f us  p50 %.2f us  p99 %.2f us  max %.2f us\n",
+           iterations, size, total / 1000.0 / iterations,
+           samples[iterations / 2] / 1000.0,
+           samples[(int)(iterations * 0.99)] / 1000.0,
+           samples[iterations - 1] / 1000.0);
+
+    free(samples);
+    free(buffer);
+    return 0;
+}
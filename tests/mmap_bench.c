@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Cost of reading a file through mmap: the mmap() call itself, a
+ * sequential pass over every page, and random page touches on a fresh
+ * mapping. Run it once straight against the PFS and once per HVAC mmap
+ * mode, e.g.
+ *   ./mmap_bench $HVAC_DATA_DIR/file
+ *   HVAC_MMAP=copy  LD_PRELOAD=libhvac_client.so ./mmap_bench $HVAC_DATA_DIR/file
+ *   HVAC_MMAP=fault LD_PRELOAD=libhvac_client.so ./mmap_bench $HVAC_DATA_DIR/file
+ * Drop the page cache (or use a file larger than memory) between runs
+ * for the direct numbers to mean anything.
+ */
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static char *map_file(const char *path, size_t size, uint64_t *map_ns)
+{
+    uint64_t start = now_ns();
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Cannot open input file"); exit(1);
+    }
+    char *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        perror("mmap"); exit(1);
+    }
+    close(fd);
+    *map_ns = now_ns() - start;
+    return p;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <file> [random touches]\n", argv[0]);
+        return 1;
+    }
+
+    int touches = argc > 2 ? atoi(argv[2]) : 10000;
+    long page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    uint64_t map_ns, start, seq_ns, rand_ns;
+    volatile uint64_t sum = 0;
+
+    if (stat(argv[1], &st) != 0 || st.st_size == 0)
+    {
+        perror("stat"); return 1;
+    }
+    size_t size = st.st_size;
+    size_t pages = (size + page - 1) / page;
+
+    char *p = map_file(argv[1], size, &map_ns);
+    start = now_ns();
+    for (size_t i = 0; i < pages; i++)
+        sum += p[i * page];
+    seq_ns = now_ns() - start;
+    munmap(p, size);
+    printf("sequential: mmap %.2f ms  touch %zu pages %.2f ms  %.1f MB/s\n",
+           map_ns / 1e6, pages, seq_ns / 1e6,
+           (map_ns + seq_ns) ? size / 1e6 / ((map_ns + seq_ns) / 1e9) : 0.0);
+
+    p = map_file(argv[1], size, &map_ns);
+    srand(42);
+    start = now_ns();
+    for (int i = 0; i < touches; i++)
+        sum += p[(size_t)(rand() % pages) * page];
+    rand_ns = now_ns() - start;
+    munmap(p, size);
+    printf("random:     mmap %.2f ms  %d touches %.2f ms  avg %.2f us\n",
+           map_ns / 1e6, touches, rand_ns / 1e6, rand_ns / 1e3 / touches);
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "mthvac_placement.h"
+
+/* Shows how many files change server when the server count changes.
+ * Jump hashing should move ~1/(n+1) of the keys going n -> n+1 and only
+ * ever move them onto the new server; modulo is printed for comparison.
+ */
+
+#define KEY_COUNT 200000
+
+static std::vector<uint64_t> make_keys()
+{
+    std::vector<uint64_t> keys;
+    char path[256];
+
+    for (int i = 0; i < KEY_COUNT; i++) {
+        snprintf(path, sizeof(path), "/lustre/data/cosmoUniverse/train/sample_%07d.tfrecord", i);
+        keys.push_back(hvac_hash64(path, strlen(path)));
+    }
+    return keys;
+}
+
+static int check_resize(const std::vector<uint64_t> &keys, uint32_t from, uint32_t to)
+{
+    size_t moved = 0, moved_mod = 0, bad = 0;
+    uint32_t bigger = from > to ? from : to;
+
+    for (uint64_t k : keys) {
+        uint32_t a = hvac_jump_hash(k, from);
+        uint32_t b = hvac_jump_hash(k, to);
+        if (a != b) {
+            moved++;
+            // A key may only move to (or off of) the server being added / removed
+            if (a != bigger - 1 && b != bigger - 1)
+                bad++;
+        }
+        if (k % from != k % to)
+            moved_mod++;
+    }
+
+    double frac = (double)moved / keys.size();
+    double ideal = 1.0 / bigger;
+    printf("%4u -> %-4u  jump moved %6.2f%% (ideal %6.2f%%)  modulo moved %6.2f%%\n",
+           from, to, 100.0 * frac, 100.0 * ideal, 100.0 * moved_mod / keys.size());
+
+    if (bad || frac > 1.5 * ideal) {
+        fprintf(stderr, "FAIL: %zu keys moved between surviving servers, moved fraction %.4f\n", bad, frac);
+        return 1;
+    }
+    return 0;
+}
+
+static int check_weights(const std::vector<uint64_t> &keys)
+{
+    std::vector<double> weights = hvac_parse_weights("1,1,2,4", 4);
+    std::vector<size_t> counts(4, 0);
+    int rc = 0;
+
+    if (weights.size() != 4) {
+        fprintf(stderr, "FAIL: could not parse weights\n");
+        return 1;
+    }
+    for (uint64_t k : keys)
+        counts[hvac_rendezvous_hash(k, weights)]++;
+
+    printf("weights 1,1,2,4 ->");
+    for (int i = 0; i < 4; i++) {
+        double share = (double)counts[i] / keys.size();
+        double expect = weights[i] / 8.0;
+        printf(" %5.2f%%", 100.0 * share);
+        if (share < 0.9 * expect || share > 1.1 * expect)
+            rc = 1;
+    }
+    printf("\n");
+
+    /* Dropping the last server should only move its own keys */
+    std::vector<double> fewer(weights.begin(), weights.end() - 1);
+    size_t moved = 0, bad = 0;
+    for (uint64_t k : keys) {
+        uint32_t a = hvac_rendezvous_hash(k, weights);
+        uint32_t b = hvac_rendezvous_hash(k, fewer);
+        if (a != b) {
+            moved++;
+            if (a != 3)
+                bad++;
+        }
+    }
+    printf("weighted 4 -> 3  moved %6.2f%%\n", 100.0 * moved / keys.size());
+    if (bad)
+        rc = 1;
+
+    if (rc)
+        fprintf(stderr, "FAIL: weighted placement off\n");
+    return rc;
+}
+
+/* The hash and the placement must never change between builds: clients
+ * and servers built apart have to agree on where a file lives. These are
+ * the values every build must produce - if one of them changes, so did
+ * the placement of every file. */
+static int check_known_answers()
+{
+    static const struct {
+        const char *data;
+        uint64_t seed;
+        uint64_t hash;
+    } hashes[] = {
+        {"", 0, 0x0000000000000000ULL},
+        {"", 1, 0xb456bcfc34c2cb2cULL},
+        {"hvac", 0, 0x773a4e12a2d58527ULL},
+        {"hvac", 1, 0x77730d0c54780757ULL},
+        {"/lustre/data/cosmoUniverse/train/sample_0000000.tfrecord", 0, 0xe472d82d9cd3a3f8ULL},
+    };
+    // Server of the file and of blocks 0, 1 and 7 out of 16 servers
+    static const struct {
+        const char *path;
+        uint32_t server;
+        uint32_t blocks[3];
+    } places[] = {
+        {"/lustre/data/imagenet/train/n01440764/n01440764_10026.JPEG", 11, {4, 6, 10}},
+        {"/lustre/data/cosmoUniverse/train/sample_0000000.tfrecord", 1, {3, 6, 9}},
+        {"/gpfs/alpine/proj/dataset/shard-00042.h5", 5, {1, 7, 11}},
+    };
+    int rc = 0;
+
+    for (auto &h : hashes) {
+        uint64_t got = hvac_hash64(h.data, strlen(h.data), h.seed);
+        if (got != h.hash) {
+            fprintf(stderr, "FAIL: hash64(\"%s\", seed %lu) = %016lx, expected %016lx\n", h.data,
+                    (unsigned long)h.seed, (unsigned long)got, (unsigned long)h.hash);
+            rc = 1;
+        }
+    }
+    if (hvac_jump_hash(0xdeadbeefcafef00dULL, 16) != 1 || hvac_jump_hash(123456789, 1000) != 294) {
+        fprintf(stderr, "FAIL: jump hash changed\n");
+        rc = 1;
+    }
+    if (hvac_rendezvous_hash(0xdeadbeefcafef00dULL, hvac_parse_weights("1,1,2,4", 4)) != 2) {
+        fprintf(stderr, "FAIL: rendezvous hash changed\n");
+        rc = 1;
+    }
+
+    unsetenv("HVAC_SERVER_WEIGHTS");
+    hvac_placement_init(16);
+    for (auto &p : places) {
+        uint32_t got = hvac_place_path(p.path);
+        uint32_t blocks[3] = {hvac_place_block(p.path, 0), hvac_place_block(p.path, 1), hvac_place_block(p.path, 7)};
+        if (got != p.server || memcmp(blocks, p.blocks, sizeof(blocks)) != 0) {
+            fprintf(stderr, "FAIL: %s placed on %u, blocks on %u %u %u\n", p.path, got, blocks[0], blocks[1],
+                    blocks[2]);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+int main()
+{
+    std::vector<uint64_t> keys = make_keys();
+    int rc = 0;
+
+    rc |= check_known_answers();
+
+    uint32_t sizes[] = {4, 8, 16, 32, 64};
+    for (uint32_t n : sizes) {
+        rc |= check_resize(keys, n, n + 1);
+        rc |= check_resize(keys, n, n - 1);
+    }
+    rc |= check_weights(keys);
+
+    printf(rc ? "placement_test FAILED\n" : "placement_test passed\n");
+    return rc;
+}
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include "mthvac_srvstats.h"
+
+/* Checks the latency histogram layout every process and server shares,
+ * and that server stats snapshots survive the trip through text.
+ */
+
+static int check_buckets()
+{
+    int rc = 0;
+
+    for (uint64_t ns = 0; ns < (uint64_t)hvac::kHistSub; ns++) {
+        if (hvac::hist_bucket(ns) != ns) {
+            fprintf(stderr, "FAIL: %lu ns should have a bucket of its own\n", ns);
+            rc = 1;
+        }
+    }
+
+    // Every bucket's upper bound lands in it and the next value in the next one
+    for (uint32_t i = 0; i < (uint32_t)hvac::kHistBuckets; i++) {
+        uint64_t high = hvac::hist_bucket_high(i);
+        if (hvac::hist_bucket(high) != i ||
+            (i + 1 < (uint32_t)hvac::kHistBuckets && hvac::hist_bucket(high + 1) != i + 1)) {
+            fprintf(stderr, "FAIL: bucket %u ends at %lu, which maps to %u and %u\n", i, high,
+                    hvac::hist_bucket(high), hvac::hist_bucket(high + 1));
+            rc = 1;
+        }
+    }
+
+    // Within 1/16 of the bound everywhere below the last bucket
+    for (uint64_t ns = 1; ns < (1ULL << hvac::kHistMaxExp); ns = ns * 3 / 2 + 1) {
+        uint64_t high = hvac::hist_bucket_high(hvac::hist_bucket(ns));
+        if (high < ns || high - ns > ns / hvac::kHistSub) {
+            fprintf(stderr, "FAIL: %lu ns lands in a bucket ending at %lu\n", ns, high);
+            rc = 1;
+        }
+    }
+
+    if (hvac::hist_bucket(UINT64_MAX) != (uint32_t)hvac::kHistBuckets - 1) {
+        fprintf(stderr, "FAIL: the longest durations should share the last bucket\n");
+        rc = 1;
+    }
+    return rc;
+}
+
+static int check_percentiles()
+{
+    hvac::LatencyHistogram h;
+    int rc = 0;
+
+    if (h.percentile(0.5) != 0) {
+        fprintf(stderr, "FAIL: empty histogram has a median\n");
+        rc = 1;
+    }
+
+    for (uint64_t ns = 1; ns <= 1000; ns++)
+        h.record(ns * 1000);
+
+    struct {
+        double q;
+        uint64_t exact;
+    } cases[] = {{0.0, 1000}, {0.5, 500000}, {0.9, 900000}, {0.99, 990000}, {1.0, 1000000}};
+    for (auto &c : cases) {
+        uint64_t p = h.percentile(c.q);
+        if (p < c.exact || p - c.exact > c.exact / hvac::kHistSub) {
+            fprintf(stderr, "FAIL: p%g is %lu, expected %lu within a bucket\n", c.q * 100, p, c.exact);
+            rc = 1;
+        }
+    }
+    if (h.percentile(1.0) != h.max_ns) {
+        fprintf(stderr, "FAIL: p100 %lu is not the max %lu\n", h.percentile(1.0), h.max_ns);
+        rc = 1;
+    }
+
+    // One sample: every quantile is that sample, not its bucket's bound
+    hvac::LatencyHistogram one;
+    one.record(1234567);
+    if (one.percentile(0.5) != 1234567 || one.percentile(0.999) != 1234567) {
+        fprintf(stderr, "FAIL: single sample percentiles %lu %lu\n", one.percentile(0.5), one.percentile(0.999));
+        rc = 1;
+    }
+    return rc;
+}
+
+static int check_round_trip()
+{
+    struct hvac_srv_stats in, out;
+    int rc = 0;
+
+    in.node = "nid001234";
+    in.counters["opens"] = 42;
+    in.counters["bytes_cached"] = 1ULL << 40;
+    in.counters["open_fds"] = 0;
+    in.tags.emplace_back();
+    in.tags.back().name = "HvacComm_(request)_service";
+    in.tags.emplace_back();
+    in.tags.back().name = "tag with spaces";
+    for (uint64_t ns = 1; ns < (1ULL << 40); ns *= 7) {
+        in.tags[0].hist.record(ns);
+        in.tags[0].calls++;
+        in.tags[0].total_ns += ns;
+    }
+    in.tags[1].hist.record(UINT64_MAX / 2);
+    in.tags[1].calls = 1;
+    in.tags[1].total_ns = UINT64_MAX / 2;
+
+    std::string packed = hvac_srv_stats_pack(in);
+    if (!hvac_srv_stats_unpack(packed.data(), packed.size(), &out)) {
+        fprintf(stderr, "FAIL: could not unpack\n%s", packed.c_str());
+        return 1;
+    }
+    if (out.node != in.node || out.counters != in.counters || out.tags.size() != in.tags.size()) {
+        fprintf(stderr, "FAIL: node, counters or tag count changed\n");
+        return 1;
+    }
+    for (size_t i = 0; i < in.tags.size(); i++) {
+        const hvac::TagTotals &a = in.tags[i], &b = out.tags[i];
+        if (b.calls != a.calls || b.total_ns != a.total_ns || b.hist.max_ns != a.hist.max_ns ||
+            memcmp(b.hist.counts, a.hist.counts, sizeof(a.hist.counts)) != 0) {
+            fprintf(stderr, "FAIL: tag %s changed on the way\n", a.name.c_str());
+            rc = 1;
+        }
+    }
+    if (out.tags[1].name != "tag_with_spaces") {
+        fprintf(stderr, "FAIL: tag name came back as \"%s\"\n", out.tags[1].name.c_str());
+        rc = 1;
+    }
+    if (out.get("opens") != 42 || out.get("no_such_counter") != 0) {
+        fprintf(stderr, "FAIL: counter lookup\n");
+        rc = 1;
+    }
+
+    // Newer servers may send counters we don't know, older ones lack some
+    std::string extra = packed + "future_counter 7\n";
+    if (!hvac_srv_stats_unpack(extra.data(), extra.size(), &out) || out.get("future_counter") != 7) {
+        fprintf(stderr, "FAIL: unknown counter not kept\n");
+        rc = 1;
+    }
+    const char *newer = "version 2\nnode x\nopens 3\n";
+    if (!hvac_srv_stats_unpack(newer, strlen(newer), &out) || out.get("opens") != 3) {
+        fprintf(stderr, "FAIL: snapshot of a newer version rejected\n");
+        rc = 1;
+    }
+
+    const char *bad[] = {
+        "node x\nopens 1\n",                                        // no version
+        "version 0\nnode x\n",                                      // before versioning
+        "version 1\nhist t 1 10 10 99999:1\n",                      // bucket out of range
+        "version 1\nhist t 1 10 10 5\n",                            // bucket without count
+    };
+    for (const char *b : bad) {
+        if (hvac_srv_stats_unpack(b, strlen(b), &out)) {
+            fprintf(stderr, "FAIL: accepted \"%s\"\n", b);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+int main()
+{
+    int rc = 0;
+
+    rc |= check_buckets();
+    rc |= check_percentiles();
+    rc |= check_round_trip();
+
+    printf(rc ? "srvstats_test FAILED\n" : "srvstats_test passed\n");
+    return rc;
+}
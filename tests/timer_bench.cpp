@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "mthvac_timer.h"
+
+/* Per-scope cost of HVAC_TIMING, old and new, with 1..N threads timing
+ * scopes back to back. The old guard is the previous implementation: a
+ * std::string tag per scope and one global mutex around an
+ * unordered_map update.
+ *
+ * usage: timer_bench [iterations per thread] [max threads]
+ */
+
+struct legacy_stat {
+    double total_us = 0;
+    uint64_t calls = 0;
+};
+
+static std::mutex legacy_mutex;
+static std::unordered_map<std::string, legacy_stat> legacy_table;
+
+class LegacyGuard {
+    public:
+        explicit LegacyGuard(const char* tag)
+            : tag_(tag), start_(std::chrono::steady_clock::now()) {}
+        ~LegacyGuard() {
+            uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start_).count();
+            std::lock_guard<std::mutex> lk(legacy_mutex);
+            auto& s = legacy_table[tag_];
+            s.total_us += us;
+            s.calls++;
+        }
+    private:
+        std::string tag_;
+        std::chrono::steady_clock::time_point start_;
+};
+
+static long iterations = 2000000;
+static std::atomic<int> ready{0};
+static std::atomic<bool> go{false};
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *run_new(void *)
+{
+    ready++;
+    while (!go.load())
+        ;
+    for (long i = 0; i < iterations; i++) {
+        HVAC_TIMING("CLIENT_(timer_bench)_scope");
+        asm volatile("" ::: "memory");
+    }
+    return NULL;
+}
+
+static void *run_old(void *)
+{
+    ready++;
+    while (!go.load())
+        ;
+    for (long i = 0; i < iterations; i++) {
+        LegacyGuard g("CLIENT_(timer_bench)_scope");
+        asm volatile("" ::: "memory");
+    }
+    return NULL;
+}
+
+static void *run_empty(void *)
+{
+    ready++;
+    while (!go.load())
+        ;
+    for (long i = 0; i < iterations; i++)
+        asm volatile("" ::: "memory");
+    return NULL;
+}
+
+// Wall time per scope, as each thread sees it
+static double measure(void *(*fn)(void *), int nthreads)
+{
+    pthread_t threads[nthreads];
+
+    ready = 0;
+    go = false;
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, fn, NULL);
+    while (ready.load() < nthreads)
+        ;
+    double start = now_sec();
+    go = true;
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    return (now_sec() - start) * 1e9 / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = 8;
+
+    if (argc > 1)
+        iterations = atol(argv[1]);
+    if (argc > 2)
+        max_threads = atoi(argv[2]);
+
+    printf("%8s %14s %14s %14s\n", "threads", "empty(ns)", "old(ns)", "new(ns)");
+    for (int t = 1; t <= max_threads; t *= 2) {
+        double empty = measure(run_empty, t);
+        double old_ns = measure(run_old, t);
+        double new_ns = measure(run_new, t);
+        printf("%8d %14.1f %14.1f %14.1f\n", t, empty, old_ns, new_ns);
+    }
+
+    // The merged totals must account for every scope
+    hvac::print_all_stats();
+    return 0;
+}